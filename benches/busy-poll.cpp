@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <utils/busypoll.h>
+#include <utils/clock.h>
+
+using std::cout;
+
+/*! \page busy-poll-bench Busy Poll Benchmark
+ *
+ * This benchmark measures the time from an eventfd write on another thread to the wake of the
+ * waiter, with a blocking poll and with the busy poller, and prints the latencies. It only
+ * reports, the delivery of the events is checked by the \ref busy-poll-test.
+ *
+ * A spinning waiter needs a CPU of its own to catch events, on a single CPU the writer only
+ * runs once the spin gave up and the busy poller cannot be faster.
+ */
+
+/*! \brief Measures the wake latencies of a poller, in nanoseconds.
+ *
+ * \param max_ns - Longest spin of the poller, 0 for a blocking poll.
+ * \param count - Number of events.
+ * \param latencies - Latency of every received event.
+ * \return Number of events caught while spinning.
+ */
+static uint64_t measure_latency(uint64_t max_ns, uint32_t count, std::vector<uint64_t>& latencies)
+{
+    int fd = eventfd(0, EFD_NONBLOCK);
+    struct pollfd pfd = {.fd = fd, .events = POLLIN, .revents = 0};
+    struct BusyPoll poller;
+    std::atomic<bool> acked(true);
+
+    busy_poll_init(&poller, max_ns);
+
+    /* The writer waits for the previous event to be read, so every event wakes the waiter. */
+    std::thread writer([&]() {
+        for (uint32_t i = 0; i < count; ++i) {
+            while (!acked.load(std::memory_order_acquire))
+                std::this_thread::yield();
+
+            uint64_t sent;
+
+            acked.store(false, std::memory_order_relaxed);
+            std::this_thread::sleep_for(std::chrono::microseconds(50 + (i * 37) % 150));
+            sent = clock_now_ns();
+
+            if (write(fd, &sent, sizeof(sent)) != sizeof(sent))
+                cout << "\tcannot signal the eventfd\n";
+        }
+    });
+
+    for (uint32_t i = 0; i < count; ++i) {
+        uint64_t sent = 0;
+
+        if (busy_poll(&poller, &pfd, 1, 1000) != 1 || read(fd, &sent, sizeof(sent)) != sizeof(sent))
+            break;
+
+        latencies.push_back(clock_now_ns() - sent);
+        acked.store(true, std::memory_order_release);
+    }
+
+    /* A lost event leaves the writer waiting, it is released so it can finish. */
+    acked.store(true, std::memory_order_release);
+    writer.join();
+    close(fd);
+
+    return poller.spin_hits;
+}
+
+/*! \brief Prints the average and percentiles of latencies, sorting them. */
+static void print_latency(const char* name, std::vector<uint64_t>& latencies)
+{
+    if (latencies.empty())
+        return;
+
+    uint64_t total = 0;
+
+    std::sort(latencies.begin(), latencies.end());
+
+    for (uint64_t latency : latencies)
+        total += latency;
+
+    cout << "\t" << name << ": " << latencies.size() << " wakes, "
+         << total / latencies.size() / 1000 << " us average, "
+         << latencies[latencies.size() / 2] / 1000 << " us p50, "
+         << latencies[latencies.size() * 99 / 100] / 1000 << " us p99\n";
+}
+
+int main()
+{
+    const uint32_t NUM_EVENTS = 2000;
+    std::vector<uint64_t> blocking, spinning;
+    cpu_set_t cpus;
+
+    measure_latency(0, NUM_EVENTS, blocking);
+    uint64_t spin_hits = measure_latency(500000, NUM_EVENTS, spinning);
+
+    cout << "Wake latency\n";
+    print_latency("blocking poll", blocking);
+    print_latency("busy poll", spinning);
+    cout << "\t" << spin_hits << " events caught spinning\n";
+
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) != 0 || CPU_COUNT(&cpus) < 2)
+        cout << "\tsingle CPU, the writer only runs once the spin gave up\n";
+}
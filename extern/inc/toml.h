@@ -104,8 +104,15 @@ TOML_EXTERN toml_array_t *toml_array_at(const toml_array_t *arr, int idx);
 TOML_EXTERN toml_table_t *toml_table_at(const toml_array_t *arr, int idx);
 
 /* on tables: */
+/* A raw value, must be processed by toml_rto* before using. */
+typedef const char *toml_raw_t;
 /* ... retrieve the key in table at keyidx. Return 0 if out of range. */
 TOML_EXTERN const char *toml_key_in(const toml_table_t *tab, int keyidx);
+/* ... retrieve the raw value or the table of the key at keyidx, as numbered
+   by toml_key_in. Return 0 if the key is not a key-value or a table. */
+TOML_EXTERN toml_raw_t toml_raw_key_at(const toml_table_t *tab, int keyidx);
+TOML_EXTERN toml_table_t *toml_table_key_at(const toml_table_t *tab,
+                                            int keyidx);
 /* ... returns 1 if key exists in tab, 0 otherwise */
 TOML_EXTERN int toml_key_exists(const toml_table_t *tab, const char *key);
 /* ... retrieve values using key. */
@@ -162,7 +169,6 @@ TOML_EXTERN void toml_set_memutil(void *(*xxmalloc)(size_t),
  *  deprecated
  */
 /* A raw value, must be processed by toml_rto* before using. */
-typedef const char *toml_raw_t;
 TOML_EXTERN toml_raw_t toml_raw_in(const toml_table_t *tab, const char *key);
 TOML_EXTERN toml_raw_t toml_raw_at(const toml_array_t *arr, int idx);
 TOML_EXTERN int toml_rtos(toml_raw_t s, char **ret);
@@ -1872,6 +1872,21 @@ const char *toml_key_in(const toml_table_t *tab, int keyidx) {
   return 0;
 }
 
+toml_raw_t toml_raw_key_at(const toml_table_t *tab, int keyidx) {
+  if (keyidx < 0 || keyidx >= tab->nkval)
+    return 0;
+
+  return tab->kval[keyidx]->val;
+}
+
+toml_table_t *toml_table_key_at(const toml_table_t *tab, int keyidx) {
+  keyidx -= tab->nkval + tab->narr;
+  if (keyidx < 0 || keyidx >= tab->ntab)
+    return 0;
+
+  return tab->tab[keyidx];
+}
+
 int toml_key_exists(const toml_table_t *tab, const char *key) {
   int i;
   for (i = 0; i < tab->nkval; i++) {
@@ -52,9 +52,27 @@ int nv_open(
  */
 int nv_open_dev(uint16_t minor);
 
+/*! \brief Function opening the traditional NVIDIA devices.
+ *
+ * \param minor - Minor of the device, 255 for /dev/nvidiactl.
+ * \return File descriptor for the device, -1 on failure.
+ */
+typedef int (*NvOpenDev)(uint16_t minor);
+
+/*! \brief Replaces the function opening the traditional NVIDIA devices.
+ *
+ * Allows the devices to be simulated together with the RM Core, see rm_set_ioctl.
+ *
+ * \sideeffect State Side Effect: Every nv_open_dev of every thread goes through the hook.
+ *
+ * \param hook - Function to open the devices with, NULL to restore the device files.
+ */
+void nv_set_open_dev(NvOpenDev hook);
+
 /*! \brief Opens a Mediated NVIDIA device.
  *
- * Opens a Mediated NVIDIA device given a minor number.
+ * Opens a Mediated NVIDIA device given a minor number. The major of the vGPU driver is
+ * looked up once, on the first open that finds it.
  *
  * \param minor - Minor to use to open the device.
  * \return File descriptor for the Mediated NVIDIA component.
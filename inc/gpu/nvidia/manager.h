@@ -23,12 +23,21 @@
 
 #include <gpu/nvidia/resources.h>
 
+#include <utils/configs.h>
+
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+//! Only probes the GPUs, they are attached when a request first targets them.
+#define NV_MGR_LAZY 0x00000001
+
+//! Gives every GPU its own RM client on its own /dev/nvidiactl file descriptor.
+#define NV_MGR_SHARDED 0x00000002
+
 /*! \brief Creates a NVIDIA manager object.
  *
  * This function initalizes the manager object for the NVIDIA GPU.
@@ -46,6 +55,82 @@ extern "C" {
  */
 struct NvMdev create_nv_mgr();
 
+/*! \brief Creates a NVIDIA manager object with flags.
+ *
+ * This function initalizes the manager object for the NVIDIA GPU. With NV_MGR_LAZY the
+ * GPUs are only probed, their vendor and device ids are read from sysfs and they are
+ * attached once a request selects them. With NV_MGR_SHARDED every attached GPU allocates
+ * its objects under its own RM client and /dev/nvidiactl file descriptor, so controls for
+ * different GPUs do not contend on the locks of a single client.
+ *
+ * \sideeffect File System Side Effect: Can potentially create a few /dev files.
+ * \sideeffect File System Side Effect: Opens /dev/nvidiactl.
+ * \sideeffect File System Side Effect: Reads the PCI ids of the GPUs from sysfs.
+ * \sideeffect RM Side Effect: Creates a RM Client.
+ * \sideeffect RM Side Effect: Attaches the GPUs unless NV_MGR_LAZY is set.
+ * \sideeffect RM Side Effect: Creates a RM Client per GPU if NV_MGR_SHARDED is set.
+ *
+ * \param flags - Flags for the manager.
+ * \return A manager for the NVIDIA system.
+ */
+struct NvMdev create_nv_mgr_flags(uint32_t flags);
+
+/*! \brief Attaches a probed GPU.
+ *
+ * Attaches the GPU and allocates its device, sub device and mdev configurator, does nothing
+ * if the GPU is already attached.
+ *
+ * \sideeffect File System Side Effect: Opens /dev/nvidia%d for the GPU.
+ * \sideeffect RM Side Effect: Attaches a GPU to /dev/nvidia%d.
+ * \sideeffect RM Side Effect: Creates a RM Device Id.
+ * \sideeffect RM Side Effect: Creates a RM Sub Device Id.
+ * \sideeffect RM Side Effect: Creates a mdev configurator id.
+ *
+ * \param mgr - Manager the GPU belongs to.
+ * \param mgpu - GPU to attach.
+ * \return If the GPU is attached with a mdev configurator.
+ */
+uint8_t attach_nv_mgr_gpu(struct NvMdev *mgr, struct NvMdevGpu *mgpu);
+
+/*! \brief Attaches a list of probed GPUs.
+ *
+ * Every GPU which is not attached yet is attached with a single batched control call
+ * before its objects are allocated.
+ *
+ * \sideeffect File System Side Effect: Opens /dev/nvidia%d for the GPUs.
+ * \sideeffect RM Side Effect: Attaches the GPUs in one batch.
+ * \sideeffect RM Side Effect: Creates a device, sub device and mdev configurator per GPU.
+ *
+ * \param mgr - Manager the GPUs belong to.
+ * \param mgpus - GPUs to attach.
+ * \param size - Number of GPUs.
+ * \return Number of GPUs attached with a mdev configurator.
+ */
+size_t attach_nv_mgr_gpus(struct NvMdev *mgr, struct NvMdevGpu **mgpus, size_t size);
+
+/*! \brief Publishes a snapshot of the GPUs of a manager.
+ *
+ * Copies the GPUs of the manager into a new NvGpuView and makes it visible to nv_mgr_view,
+ * the previous snapshot is reclaimed after every reader left it.
+ *
+ * \sideeffect State Side Effect: Retires the previous snapshot.
+ *
+ * \param mgr - Manager whose GPUs are published.
+ */
+void nv_mgr_publish(struct NvMdev *mgr);
+
+/*! \brief Reads the published snapshot of the GPUs of a manager.
+ *
+ * Never blocks, the snapshot is immutable and stays valid until the epoch critical section is
+ * left.
+ *
+ * \restriction Must be called inside an epoch critical section.
+ *
+ * \param mgr - Manager to read.
+ * \return The snapshot, NULL if none was published.
+ */
+const struct NvGpuView* nv_mgr_view(const struct NvMdev *mgr);
+
 /*! \brief Deletes a NVIDIA manager object.
  *
  * This function destroys the manager object for the NVIDIA GPU.
@@ -55,6 +140,7 @@ struct NvMdev create_nv_mgr();
  * \sideeffect RM Side Effect: Deletes a RM Device Id.
  * \sideeffect RM Side Effect: Deletes a RM Sub Device Id.
  * \sideeffect RM Side Effect: Deletes a mdev configurator id.
+ * \sideeffect State Side Effect: Waits for the readers of the resource tree to leave.
  *
  * \param mgr - Pointer to the manager structure to free.
  */
@@ -80,6 +166,36 @@ void create_nv_mgr_mdevs(
     size_t mdev_size
 );
 
+/*! \brief Creates mediated devices from a configuration catalog.
+ *
+ * Every gpu is programmed with the single configuration config_catalog_lookup finds for it,
+ * the gpus without one are left untouched.
+ *
+ * \sideeffect RM Side Effect: Creates mdevs on the matching GPUs.
+ *
+ * \param mgr - Pointer to the manager for the NVIDIA driver.
+ * \param catalog - Catalog of configurations.
+ */
+void create_nv_mgr_catalog_mdevs(struct NvMdev *mgr, const struct ConfigCatalog* catalog);
+
+/*! \brief Creates mediated devices from a configuration catalog on some GPUs.
+ *
+ * As create_nv_mgr_catalog_mdevs, but the other GPUs of the manager are left untouched.
+ *
+ * \sideeffect RM Side Effect: Creates mdevs on the matching GPUs.
+ *
+ * \param mgr - Pointer to the manager for the NVIDIA driver.
+ * \param catalog - Catalog of configurations.
+ * \param gpus - GPUs of the manager to program.
+ * \param size - Number of GPUs.
+ */
+void create_nv_gpus_catalog_mdevs(
+    struct NvMdev *mgr,
+    const struct ConfigCatalog* catalog,
+    struct NvMdevGpu** gpus,
+    size_t size
+);
+
 /*! \brief Registers mdevs on the OS.
  *
  * This command actually registers the MDevs in the Operating System.
@@ -90,6 +206,46 @@ void create_nv_mgr_mdevs(
  */
 void register_nv_mgr_mdevs(struct NvMdev *mgr);
 
+/*! \brief Registers the mdevs of some GPUs on the OS.
+ *
+ * \sideeffect RM Side Effect: Creates mdevs in the OS.
+ *
+ * \param gpus - GPUs to register the MDevs for.
+ * \param size - Number of GPUs.
+ */
+void register_nv_gpus_mdevs(struct NvMdevGpu** gpus, size_t size);
+
+/*! \brief Synchronizes the GPUs of a manager with the GPUs probed by the RM.
+ *
+ * GPUs which are no longer probed are torn down and removed, newly probed GPUs are appended
+ * to the registry and attached unless the manager is lazy. GPUs present before and after are
+ * left untouched.
+ *
+ * \sideeffect RM Side Effect: Frees the objects and detaches the removed GPUs.
+ * \sideeffect RM Side Effect: Attaches the added GPUs if NV_MGR_LAZY is not set.
+ * \sideeffect State Side Effect: Publishes a new snapshot of the GPUs.
+ *
+ * \param mgr - Manager to synchronize.
+ * \return Position of the first added GPU in the registry, the GPUs from it to the end of the
+ *         registry were added.
+ */
+uint32_t sync_nv_mgr_gpus(struct NvMdev *mgr);
+
+/*! \brief Handles the pending uevents of a uevent socket.
+ *
+ * When a GPU was bound to the nvidia driver, or a GPU of the manager was unbound or removed,
+ * the GPUs are synchronized with sync_nv_mgr_gpus and the added GPUs are programmed from the
+ * catalog and registered.
+ *
+ * \sideeffect RM Side Effect: Creates and registers the mdevs of the added GPUs.
+ *
+ * \param mgr - Manager to update.
+ * \param fd - Socket from uevent_open, or any socket delivering uevent messages.
+ * \param catalog - Configurations of the added GPUs, NULL to only attach them.
+ * \return Number of GPUs added or removed.
+ */
+size_t handle_nv_mgr_uevents(struct NvMdev *mgr, int fd, const struct ConfigCatalog* catalog);
+
 #ifdef __cplusplus
 };
 #endif
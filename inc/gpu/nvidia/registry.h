@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef GPU_NVIDIA_REGISTRY_H
+#define GPU_NVIDIA_REGISTRY_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct NvMdevGpu;
+
+//! Composes the key of a PCI address for nv_registry_find_bdf.
+#define NV_GPU_BDF(domain, bus, slot, function)                             \
+    (((uint64_t) (domain) << 16) | (((bus) & 0xFF) << 8) | (((slot) & 0x1F) << 3) | ((function) & 0x7))
+
+/*! \brief Open addressing index of the GPUs of a registry. */
+struct NvGpuHash {
+    uint64_t* keys;             //!< Keys of the slots.
+    uint32_t* values;           //!< Index of the GPU plus one, 0 for an empty slot.
+    uint32_t capacity;          //!< Number of slots, a power of two.
+};
+
+/*! \brief Growable registry of the GPUs of a manager.
+ *
+ * The GPUs are stored densely in the order they were added, with the fields used for lookups
+ * kept in separate arrays. Iterating from 0 to size visits every GPU in a stable order, the
+ * hash indexes find a GPU by RM id, PCI address or device minor in constant time.
+ */
+struct NvGpuRegistry {
+    uint32_t size;              //!< Number of GPUs.
+    uint32_t capacity;          //!< Number of GPUs the arrays can hold.
+    uint32_t* ids;              //!< RM GPU ids.
+    uint64_t* bdfs;             //!< PCI addresses, composed with NV_GPU_BDF.
+    uint16_t* minors;           //!< Minors of the /dev/nvidia%d devices.
+    struct NvMdevGpu** entries; //!< GPUs.
+    struct NvGpuHash by_id;     //!< Index by RM GPU id.
+    struct NvGpuHash by_bdf;    //!< Index by PCI address.
+    struct NvGpuHash by_minor;  //!< Index by device minor.
+};
+
+/*! \brief Adds a GPU to a registry.
+ *
+ * \sideeffect State Side Effect: Grows the registry and its indexes when full.
+ *
+ * \param registry - Registry to add to.
+ * \param gpu - GPU to add, the registry does not take ownership of it.
+ * \return If the GPU was added, fails if its RM id is already registered.
+ */
+uint8_t nv_registry_add(struct NvGpuRegistry* registry, struct NvMdevGpu* gpu);
+
+/*! \brief Removes a GPU from a registry.
+ *
+ * The GPUs after it keep their relative order.
+ *
+ * \param registry - Registry to remove from.
+ * \param id - RM GPU id.
+ * \return The removed GPU, or NULL if it is not registered.
+ */
+struct NvMdevGpu* nv_registry_remove(struct NvGpuRegistry* registry, uint32_t id);
+
+/*! \brief Finds a GPU by RM GPU id.
+ *
+ * \param registry - Registry to search.
+ * \param id - RM GPU id.
+ * \return The GPU, or NULL if it is not registered.
+ */
+struct NvMdevGpu* nv_registry_find_id(const struct NvGpuRegistry* registry, uint32_t id);
+
+/*! \brief Finds a GPU by PCI address.
+ *
+ * \param registry - Registry to search.
+ * \param bdf - PCI address composed with NV_GPU_BDF.
+ * \return The GPU, or NULL if it is not registered.
+ */
+struct NvMdevGpu* nv_registry_find_bdf(const struct NvGpuRegistry* registry, uint64_t bdf);
+
+/*! \brief Finds a GPU by the minor of its /dev/nvidia%d device.
+ *
+ * \param registry - Registry to search.
+ * \param minor - Device minor.
+ * \return The GPU, or NULL if it is not registered.
+ */
+struct NvMdevGpu* nv_registry_find_minor(const struct NvGpuRegistry* registry, uint16_t minor);
+
+/*! \brief Frees the arrays of a registry.
+ *
+ * The GPUs themselves are owned by the caller and are not freed.
+ *
+ * \param registry - Registry to free, left empty.
+ */
+void nv_registry_free(struct NvGpuRegistry* registry);
+
+/*! \brief Gets the GPU at a position of the registry.
+ *
+ * \param registry - Registry to read.
+ * \param index - Position, below the size of the registry.
+ * \return The GPU.
+ */
+static inline struct NvMdevGpu* nv_registry_at(const struct NvGpuRegistry* registry, uint32_t index)
+{
+    return registry->entries[index];
+}
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
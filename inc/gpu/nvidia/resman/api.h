@@ -22,12 +22,66 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include <gpu/nvidia/resman/types.h>
 #include <gpu/nvidia/resources.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/*! \brief Function issuing the ioctls of the RM API.
+ *
+ * \param fd - File descriptor the ioctl is issued on.
+ * \param request - Ioctl request.
+ * \param data - Ioctl argument.
+ * \return -1 on failure, as ioctl.
+ */
+typedef int (*RmIoctl)(int fd, unsigned long request, void* data);
+
+/*! \brief Replaces the function issuing the ioctls of the RM API.
+ *
+ * Allows the RM Core to be simulated, e.g. for tests and benchmarks without a GPU.
+ *
+ * \sideeffect State Side Effect: Every RM call of every thread goes through the hook.
+ *
+ * \param hook - Function to issue the ioctls with, NULL to restore ioctl.
+ */
+void rm_set_ioctl(RmIoctl hook);
+
+//! Command selecting the retry policy of every call without a policy of its own.
+#define RM_RETRY_ALL 0xFFFFFFFF
+
+/*! \brief Retry policy of a RM call.
+ *
+ * Calls failing with NV_ERR_BUSY_RETRY, NV_ERR_TIMEOUT_RETRY, or an ioctl interrupted with
+ * EINTR or EAGAIN, are issued again after a backoff which doubles on every attempt.
+ */
+struct RmRetryPolicy {
+    uint32_t attempts;          //!< Maximum number of attempts, 1 or less to never retry.
+    uint32_t backoff_us;        //!< Microseconds to wait before the first retry.
+    uint32_t max_backoff_us;    //!< Maximum microseconds to wait between two attempts.
+};
+
+/*! \brief Sets the retry policy of a control command.
+ *
+ * Allocations use the policy of RM_RETRY_ALL. By default calls are attempted 3 times, with
+ * a backoff from 500us up to 8ms.
+ *
+ * \sideeffect State Side Effect: Applies to the calls of every thread.
+ *
+ * \param command - Control command, or RM_RETRY_ALL for every call without a policy.
+ * \param policy - Retry policy, NULL to restore the policy of RM_RETRY_ALL, or the default
+ *                 for RM_RETRY_ALL.
+ */
+void rm_set_retry_policy(uint32_t command, const struct RmRetryPolicy* policy);
+
+/*! \brief Gets the retry policy of a control command.
+ *
+ * \param command - Control command, or RM_RETRY_ALL.
+ * \return The policy used for the command.
+ */
+struct RmRetryPolicy rm_get_retry_policy(uint32_t command);
+
 /*! \brief Version check for the RM API.
  *
  * RM API version check must be performed before running code.
@@ -48,7 +102,8 @@ uint8_t rm_version_check(int ctl_fd, uint8_t ignore_version, const char* version
  * \sideeffect RM Side Effect: Allocates an object with a specific class in the RM Core, for safety purposes
  *                             we should call a free res for all resources available on the system. However it is
  *                             not strictly necessary as there is a garbage collector inside the RM Core.
- * \sideeffect State Side Effect: Parent node is modified, to have a new child.
+ * \sideeffect State Side Effect: Parent node is modified, to have a new child. The appends share the
+ *                               tree lock, so several threads may allocate under the same parent.
  *
  * \param fd - File for allocating the device on.
  * \param parent - Parent node to allocate the device on.
@@ -65,6 +120,34 @@ struct NvResource* rm_alloc_res(
     void* data
 );
 
+/*! \brief Allocates a resource without a node.
+ *
+ * Same as rm_alloc_res, but only returns the handle, the caller tracks the object.
+ *
+ * \sideeffect RM Side Effect: Allocates an object with a specific class in the RM Core.
+ *
+ * \param fd - File for allocating the object on.
+ * \param client - Client of the object, 0 to allocate a client.
+ * \param parent - Parent of the object, 0 to allocate a client.
+ * \param object - Object id, 0 to let the RM Core pick one.
+ * \param rm_class - Class of the new object.
+ * \param data - Pointer for allocation data.
+ * \return Handle of the new object, or 0 in a case of a failure.
+ */
+uint32_t rm_alloc_obj(int fd, uint32_t client, uint32_t parent, uint32_t object, uint32_t rm_class, void* data);
+
+/*! \brief Frees a resource without a node.
+ *
+ * \sideeffect RM Side Effect: Deallocates an object with a specific id in the RM Core.
+ *
+ * \param fd - File for deallocating the object on.
+ * \param client - Client of the object.
+ * \param parent - Parent of the object, the client itself for a client.
+ * \param object - Object to deallocate.
+ * \return Boolean value if we could free or not free the object in question.
+ */
+uint8_t rm_free_obj(int fd, uint32_t client, uint32_t parent, uint32_t object);
+
 /*! \brief Frees a Node for a Resource.
  *
  * The RM Core uses an object oriented paradigm which forces us to free nodes when we are finished. This specifically
@@ -80,15 +163,86 @@ uint8_t rm_free_res(int fd, struct NvResource* object);
 
 /*! \brief Frees a resource tree for the system.
  *
- * This is a mechanism by which we can free an entire tree.
+ * This is a mechanism by which we can free an entire tree. The nodes are retired through the
+ * epoch reclaimer, so threads still traversing the tree inside a critical section never see
+ * released memory.
  *
  * \sideeffect RM Side Effect: Deallocates an object with a specific root in the RM Core.
+ * \sideeffect RM Side Effect: Detaches the GPUs of device resources in one batch per client.
+ * \sideeffect State Side Effect: The nodes are released once no reader can reference them.
+ *
+ * \restriction The root must no longer be reachable by new readers and no thread may allocate
+ *              under the tree while it is being freed.
  *
  * \param fd - File for deallocating the device on.
  * \param root - Root we are deallocating from.
  */
 void rm_free_tree(int fd, struct NvResource* root);
 
+/*! \brief Frees a resource and its children and unlinks it from its parent.
+ *
+ * The siblings of the resource are kept. The nodes are retired through the epoch reclaimer as
+ * in rm_free_tree.
+ *
+ * \sideeffect RM Side Effect: Deallocates the resource and its children in the RM Core.
+ * \sideeffect RM Side Effect: Detaches the GPUs of device resources.
+ * \sideeffect State Side Effect: Takes the tree lock exclusively while the resource is unlinked,
+ *                               the allocations wait for it.
+ *
+ * \param fd - File for deallocating the resources on.
+ * \param parent - Parent of the resource.
+ * \param node - Resource to free.
+ * \return If the resource was a child of the parent and was freed.
+ */
+uint8_t rm_free_subtree(int fd, struct NvResource* parent, struct NvResource* node);
+
+/*! \brief Finds a resource in a tree.
+ *
+ * \restriction Must be called between epoch_enter and epoch_exit, the result is only valid
+ *              until the critical section is left.
+ *
+ * \param root - Root of the tree to search.
+ * \param object - Object id to find.
+ * \return The resource, or NULL if the object is not in the tree.
+ */
+struct NvResource* rm_find_res(struct NvResource* root, uint32_t object);
+
+/*! \brief Attaches a list of GPUs.
+ *
+ * The GPUs are attached with one control call per 32 GPUs. If a batch fails, the GPUs the
+ * batch did not attach are retried one at a time, skipping the GPU reported as failed.
+ *
+ * \sideeffect RM Side Effect: Attaches the GPUs to the driver.
+ *
+ * \param fd - File for controlling the client on.
+ * \param client - Client to attach the GPUs with.
+ * \param gpu_ids - GPU ids to attach.
+ * \param size - Number of GPU ids.
+ * \param attached - Returns if each GPU was attached.
+ * \return Number of attached GPUs.
+ */
+uint32_t rm_attach_gpus(
+    int fd,
+    struct NvResource* client,
+    const uint32_t* gpu_ids,
+    uint32_t size,
+    uint8_t* attached
+);
+
+/*! \brief Detaches a list of GPUs.
+ *
+ * The GPUs are detached with one control call per 32 GPUs, falling back to one call per GPU
+ * if a batch fails.
+ *
+ * \sideeffect RM Side Effect: Detaches the GPUs from the driver.
+ *
+ * \param fd - File for controlling the client on.
+ * \param client - Client the GPUs were attached with.
+ * \param gpu_ids - GPU ids to detach.
+ * \param size - Number of GPU ids.
+ */
+void rm_detach_gpus(int fd, uint32_t client, const uint32_t* gpu_ids, uint32_t size);
+
 /*! \brief Allocates an Operating System Event.
  *
  * This is how we can create an operating system event.
@@ -100,6 +254,17 @@ void rm_free_tree(int fd, struct NvResource* root);
  */
 uint8_t rm_alloc_os_event(int fd, uint32_t client_id, uint32_t device_id);
 
+/*! \brief Dequeues the data of an Operating System Event.
+ *
+ * \sideeffect RM Side Effect: Removes the oldest event queued on the file.
+ *
+ * \param fd - File descriptor the operating system event was allocated on.
+ * \param event - Returns the data of the event.
+ * \param more - Returns if more events are queued.
+ * \return If an event was dequeued.
+ */
+uint8_t rm_get_event_data(int fd, struct RmEventData* event, uint8_t* more);
+
 /*! \brief Control resource command.
  *
  * The RM Core uses an object oriented paradigm which forces us to use this generic function to apply methods onto
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef GPU_NVIDIA_RESMAN_ASYNC_H
+#define GPU_NVIDIA_RESMAN_ASYNC_H
+
+#include <stdint.h>
+
+#include <gpu/nvidia/resources.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \brief State of an asynchronous RM operation. */
+enum RmAsyncState {
+    RM_ASYNC_PENDING,           //!< Queued or being issued.
+    RM_ASYNC_DONE,              //!< The RM call succeeded.
+    RM_ASYNC_FAILED,            //!< The RM call failed.
+    RM_ASYNC_CANCELLED,         //!< Cancelled before it was issued.
+    RM_ASYNC_EXPIRED            //!< The deadline passed before it was issued.
+};
+
+struct RmAsync;
+struct RmAsyncOp;
+
+/*! \brief Completion callback of an asynchronous RM operation.
+ *
+ * Called once per operation, from a worker thread, or from the thread cancelling it.
+ *
+ * \param op - Completed operation.
+ * \param user - User data of the completion.
+ */
+typedef void (*RmAsyncCallback)(struct RmAsyncOp* op, void* user);
+
+/*! \brief How the completion of an asynchronous RM operation is reported.
+ *
+ * Besides the callback and the eventfd, every operation can be waited on as a future.
+ */
+struct RmAsyncCompletion {
+    RmAsyncCallback callback;   //!< Callback to call, or NULL.
+    void* user;                 //!< User data passed to the callback.
+    int event_fd;               //!< Eventfd incremented on completion, or -1.
+    uint32_t deadline_ms;       //!< Milliseconds the operation may wait before it is
+                                //!< issued, 0 for no deadline.
+};
+
+/*! \brief Creates an executor for asynchronous RM operations.
+ *
+ * The executor owns a fixed number of worker queues. Operations are queued by GPU id, so the
+ * operations of a GPU are issued in order while different GPUs progress in parallel.
+ *
+ * \sideeffect State Side Effect: Starts one thread per worker queue.
+ *
+ * \param workers - Number of worker queues, 0 for one per online CPU.
+ * \return The executor, or NULL in a case of a failure.
+ */
+struct RmAsync* rm_async_create(uint32_t workers);
+
+/*! \brief Destroys an executor.
+ *
+ * Operations that were not issued yet are cancelled, operations being issued are finished.
+ *
+ * \param async - Executor to destroy.
+ */
+void rm_async_destroy(struct RmAsync* async);
+
+/*! \brief Controls a resource asynchronously.
+ *
+ * Asynchronous version of rm_ctrl_res, data must stay valid until the operation completed.
+ *
+ * \param async - Executor to queue the operation on.
+ * \param gpu_id - GPU the operation is queued for.
+ * \param fd - File for controlling object on.
+ * \param client - Client id to use.
+ * \param device - Object id to use.
+ * \param command - Command to use on the object.
+ * \param data - Command data.
+ * \param size - Size of the data.
+ * \param completion - How the completion is reported, NULL to only wait on the operation.
+ * \return The operation, which must be released, or NULL in a case of a failure.
+ */
+struct RmAsyncOp* rm_ctrl_res_async(
+    struct RmAsync* async,
+    uint32_t gpu_id,
+    int fd,
+    uint32_t client,
+    uint32_t device,
+    uint32_t command,
+    void* data,
+    uint32_t size,
+    const struct RmAsyncCompletion* completion
+);
+
+/*! \brief Allocates a resource asynchronously.
+ *
+ * Asynchronous version of rm_alloc_res, data must stay valid until the operation completed.
+ *
+ * \param async - Executor to queue the operation on.
+ * \param gpu_id - GPU the operation is queued for.
+ * \param fd - File for allocating the device on.
+ * \param parent - Parent node to allocate the device on.
+ * \param object - Object id.
+ * \param rm_class - Class of the new object.
+ * \param data - Pointer for allocation data.
+ * \param completion - How the completion is reported, NULL to only wait on the operation.
+ * \return The operation, which must be released, or NULL in a case of a failure.
+ */
+struct RmAsyncOp* rm_alloc_res_async(
+    struct RmAsync* async,
+    uint32_t gpu_id,
+    int fd,
+    struct NvResource* parent,
+    uint32_t object,
+    uint32_t rm_class,
+    void* data,
+    const struct RmAsyncCompletion* completion
+);
+
+/*! \brief Waits for an operation to complete.
+ *
+ * \param op - Operation to wait on.
+ * \param timeout_ms - Milliseconds to wait, -1 to wait forever.
+ * \return State of the operation, RM_ASYNC_PENDING if the wait timed out.
+ */
+enum RmAsyncState rm_async_wait(struct RmAsyncOp* op, int timeout_ms);
+
+/*! \brief Gets the state of an operation without waiting. */
+enum RmAsyncState rm_async_state(struct RmAsyncOp* op);
+
+/*! \brief Gets the result of a completed operation.
+ *
+ * \param op - Completed operation.
+ * \return The control data or allocated resource, NULL unless the operation is done.
+ */
+void* rm_async_result(struct RmAsyncOp* op);
+
+/*! \brief Cancels an operation.
+ *
+ * Only operations which were not issued yet can be cancelled, the completion is reported
+ * from the calling thread.
+ *
+ * \param op - Operation to cancel.
+ * \return If the operation was cancelled.
+ */
+uint8_t rm_async_cancel(struct RmAsyncOp* op);
+
+/*! \brief Releases an operation returned by a submission.
+ *
+ * \param op - Operation to release, NULL is ignored.
+ */
+void rm_async_release(struct RmAsyncOp* op);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -25,6 +25,9 @@
 extern "C" {
 #endif
 
+//! Command enabling the notifications of an event of the client.
+#define NV0000_SET_NOTIFICATION 0x00000501
+
 //! Command for rm control res to get a list of all probed ids.
 #define NV0000_GET_PROBED_IDS 0x00000214
 
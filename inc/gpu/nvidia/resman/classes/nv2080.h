@@ -28,6 +28,9 @@ extern "C" {
 //! Command to allocate a Nv2080 device
 #define NV2080_CLASS 0x00002080
 
+//! Command enabling the notifications of an event of the subdevice.
+#define NV2080_SET_NOTIFICATION 0x20800301
+
 //! Command to get the BUS PCI info.
 #define NV2080_GET_BUS_PCI_INFO 0x20801801
 
@@ -43,7 +43,7 @@ struct RmMdevConfig {
     uint64_t discard;
     uint32_t mdev_type;
     char name[32];
-    char class[32];
+    char gpu_class[32];
     char sign[128];
     char pact[132];
     uint32_t max_instances;
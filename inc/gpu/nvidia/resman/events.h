@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef GPU_NVIDIA_RESMAN_EVENTS_H
+#define GPU_NVIDIA_RESMAN_EVENTS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <gpu/nvidia/resman/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! Notification flag delivering an event from the non-stalling interrupt of the RM Core.
+#define RM_EVENT_NONSTALL 0x10000000
+
+/*! \brief Hub of RM events.
+ *
+ * Every RM event of the hub notifies the same operating system event file, whatever client,
+ * GPU or VM it belongs to. A single fd is polled and the queued event data tells the events
+ * apart, so the fds and wakeups do not grow with the events.
+ */
+struct RmEventHub;
+
+/*! \brief Creates a hub on its own control file.
+ *
+ * \param ctl_fd - Control file the events are allocated on.
+ * \return The hub, or NULL in a case of a failure.
+ */
+struct RmEventHub* rm_event_hub_create(int ctl_fd);
+
+/*! \brief Creates a hub on an opened file, taking ownership of it.
+ *
+ * \param ctl_fd - Control file the events are allocated on.
+ * \param event_fd - File the events are queued on, closed with the hub.
+ * \return The hub, or NULL in a case of a failure, the file is closed.
+ */
+struct RmEventHub* rm_event_hub_create_fd(int ctl_fd, int event_fd);
+
+/*! \brief Frees a hub and its events.
+ *
+ * \sideeffect RM Side Effect: Frees the event objects.
+ *
+ * \param hub - Hub to free, may be NULL.
+ */
+void rm_event_hub_free(struct RmEventHub* hub);
+
+/*! \brief Gets the file to poll for the events of a hub.
+ *
+ * \param hub - Hub, may be NULL.
+ * \return File descriptor readable when events are queued, -1 without a hub.
+ */
+int rm_event_hub_fd(const struct RmEventHub* hub);
+
+/*! \brief Registers an event in a hub.
+ *
+ * The operating system event is bound to the client the first time the client registers an
+ * event, later events of the client reuse it.
+ *
+ * \sideeffect RM Side Effect: Allocates an event object under the parent.
+ *
+ * \param hub - Hub of the event.
+ * \param client - Client of the parent.
+ * \param parent - Object notifying the event.
+ * \param notify_cmd - Command of the parent enabling repeated notifications, 0 for none.
+ * \param notify - Notification index.
+ * \param flags - Notification flags of the event object, e.g. RM_EVENT_NONSTALL.
+ * \return Handle of the event object, reported in RmEventData.object, 0 on failure.
+ */
+uint32_t rm_event_hub_add(
+    struct RmEventHub* hub,
+    uint32_t client,
+    uint32_t parent,
+    uint32_t notify_cmd,
+    uint32_t notify,
+    uint32_t flags
+);
+
+/*! \brief Unregisters an event of a hub.
+ *
+ * \sideeffect RM Side Effect: Frees the event object.
+ *
+ * \param hub - Hub of the event.
+ * \param handle - Handle returned by rm_event_hub_add.
+ * \return If the event was registered.
+ */
+uint8_t rm_event_hub_remove(struct RmEventHub* hub, uint32_t handle);
+
+/*! \brief Reads the events queued on a hub.
+ *
+ * Called when the file is readable, then again as long as the events fill the buffer. Events
+ * of unknown objects are dropped, only the events whose data was dequeued are reported.
+ *
+ * \sideeffect RM Side Effect: Dequeues up to count events.
+ *
+ * \restriction Not thread safe, a hub is read and modified from one thread.
+ *
+ * \param hub - Hub to read.
+ * \param events - Returns the events.
+ * \param count - Size of events.
+ * \return Number of events read, more events may remain queued when it is count.
+ */
+size_t rm_event_hub_read(struct RmEventHub* hub, struct RmEventData* events, size_t count);
+
+/*! \brief Gets the number of events registered in a hub. */
+size_t rm_event_hub_size(const struct RmEventHub* hub);
+
+/*! \brief Gets the number of clients the operating system event of a hub is bound to. */
+size_t rm_event_hub_clients(const struct RmEventHub* hub);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
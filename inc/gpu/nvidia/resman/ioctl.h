@@ -42,6 +42,9 @@ extern "C" {
 //!< IOCTL command to control a resource.
 #define NV_CONTROL_RES _IOWR('F', 0x2A, struct RmControlRes)
 
+//!< IOCTL command to dequeue the data of an operating system event.
+#define NV_GET_EVENT_DATA _IOWR('F', 0x52, struct RmGetEventData)
+
 #ifdef __cplusplus
 };
 #endif
@@ -0,0 +1,442 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef GPU_NVIDIA_RESMAN_OBJECTS_HPP
+#define GPU_NVIDIA_RESMAN_OBJECTS_HPP
+
+#if __cplusplus < 201703L
+#error "gpu/nvidia/resman/objects.hpp requires C++17"
+#endif
+
+#include <cstdint>
+#include <utility>
+
+#include <unistd.h>
+
+#include <gpu/nvidia/device.h>
+#include <gpu/nvidia/resman/api.h>
+#include <gpu/nvidia/resman/classes.h>
+#include <gpu/nvidia/resman/types.h>
+
+/*! \brief C++ object model of the RM API.
+ *
+ * Every type owns its RM handle and file descriptors and releases them in its destructor.
+ * Children are stored inline in their parents and declared after the parent handle, so the
+ * members are destroyed children first, move assignments release in the same order. None of
+ * the types allocate memory, they are move-only and moving one only copies a few integers, so
+ * they can be handed to other threads. A failed creation returns an object which converts to
+ * false.
+ *
+ * \restriction A RmClient must outlive the objects allocated under it.
+ */
+namespace gvm::nvidia {
+
+/*! \brief Owned file descriptor. */
+class Fd {
+public:
+    Fd() = default;
+    explicit Fd(int fd) : fd_(fd) {}
+    Fd(Fd&& other) noexcept : fd_(std::exchange(other.fd_, -1)) {}
+
+    Fd& operator=(Fd&& other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            fd_ = std::exchange(other.fd_, -1);
+        }
+
+        return *this;
+    }
+
+    ~Fd() { reset(); }
+
+    /*! \brief Closes the file descriptor. */
+    void reset()
+    {
+        if (fd_ != -1)
+            close(fd_);
+        fd_ = -1;
+    }
+
+    int get() const { return fd_; }
+    explicit operator bool() const { return fd_ != -1; }
+
+private:
+    int fd_ = -1;                       //!< File descriptor, -1 if none.
+};
+
+/*! \brief Owned RM object handle. */
+class RmObject {
+public:
+    RmObject() = default;
+
+    RmObject(RmObject&& other) noexcept
+        : fd_(std::exchange(other.fd_, -1)),
+          client_(std::exchange(other.client_, 0)),
+          parent_(std::exchange(other.parent_, 0)),
+          object_(std::exchange(other.object_, 0))
+    {}
+
+    RmObject& operator=(RmObject&& other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            fd_ = std::exchange(other.fd_, -1);
+            client_ = std::exchange(other.client_, 0);
+            parent_ = std::exchange(other.parent_, 0);
+            object_ = std::exchange(other.object_, 0);
+        }
+
+        return *this;
+    }
+
+    ~RmObject() { reset(); }
+
+    /*! \brief Allocates the object under a parent.
+     *
+     * \param fd - File for allocating the object on.
+     * \param parent - Parent object.
+     * \param object - Object id, 0 to let the RM Core pick one.
+     * \param rm_class - Class of the new object.
+     * \param data - Pointer for allocation data.
+     * \return If the object was allocated.
+     */
+    bool alloc(int fd, const RmObject& parent, uint32_t object, uint32_t rm_class, void* data)
+    {
+        reset();
+
+        object_ = rm_alloc_obj(fd, parent.client_, parent.object_, object, rm_class, data);
+
+        if (object_ != 0) {
+            fd_ = fd;
+            client_ = parent.client_;
+            parent_ = parent.object_;
+        }
+
+        return object_ != 0;
+    }
+
+    /*! \brief Allocates the object as a client.
+     *
+     * \param fd - Control file for allocating the client on.
+     * \return If the client was allocated.
+     */
+    bool alloc_client(int fd)
+    {
+        reset();
+
+        object_ = rm_alloc_obj(fd, 0, 0, 0, 0, nullptr);
+
+        if (object_ != 0) {
+            fd_ = fd;
+            client_ = object_;
+            parent_ = object_;
+        }
+
+        return object_ != 0;
+    }
+
+    /*! \brief Frees the object. */
+    void reset()
+    {
+        if (object_ != 0)
+            rm_free_obj(fd_, client_, parent_, object_);
+
+        fd_ = -1;
+        client_ = parent_ = object_ = 0;
+    }
+
+    /*! \brief Controls the object on the file it was allocated on. */
+    template <typename T>
+    T* ctrl(uint32_t command, T& data) const
+    {
+        return ctrl(fd_, command, data);
+    }
+
+    /*! \brief Controls the object on another file. */
+    template <typename T>
+    T* ctrl(int fd, uint32_t command, T& data) const
+    {
+        return static_cast<T*>(rm_ctrl_res(fd, client_, object_, command, &data, sizeof(data)));
+    }
+
+    int fd() const { return fd_; }
+    uint32_t client() const { return client_; }
+    uint32_t parent() const { return parent_; }
+    uint32_t object() const { return object_; }
+    explicit operator bool() const { return object_ != 0; }
+
+private:
+    int fd_ = -1;                       //!< File the object was allocated on.
+    uint32_t client_ = 0;               //!< Client of the object.
+    uint32_t parent_ = 0;               //!< Parent of the object.
+    uint32_t object_ = 0;               //!< Object handle, 0 if none.
+};
+
+/*! \brief RM Client on its own /dev/nvidiactl file descriptor. */
+class RmClient {
+public:
+    RmClient() = default;
+    RmClient(RmClient&&) noexcept = default;
+
+    RmClient& operator=(RmClient&& other) noexcept
+    {
+        object_ = std::move(other.object_);
+        ctl_ = std::move(other.ctl_);
+
+        return *this;
+    }
+
+    /*! \brief Opens /dev/nvidiactl and allocates a client on it. */
+    static RmClient open() { return open(Fd(nv_open_dev(255))); }
+
+    /*! \brief Allocates a client on an opened control file, taking ownership of it. */
+    static RmClient open(Fd ctl)
+    {
+        RmClient ret;
+
+        ret.ctl_ = std::move(ctl);
+
+        if (!ret.object_.alloc_client(ret.ctl_.get()))
+            ret.ctl_.reset();
+
+        return ret;
+    }
+
+    int fd() const { return ctl_.get(); }
+    const RmObject& object() const { return object_; }
+    explicit operator bool() const { return static_cast<bool>(object_); }
+
+private:
+    Fd ctl_;                            //!< Control file, closed after the client is freed.
+    RmObject object_;                   //!< Client handle.
+};
+
+/*! \brief Mdev configurator of a sub device. */
+class RmMdevConfig {
+public:
+    /*! \brief Allocates the configurator under a sub device. */
+    bool alloc(int fd, const RmObject& subdevice, uint32_t handle)
+    {
+        return object_.alloc(fd, subdevice, handle, NVA081_CLASS, nullptr);
+    }
+
+    const RmObject& object() const { return object_; }
+    explicit operator bool() const { return static_cast<bool>(object_); }
+
+private:
+    RmObject object_;                   //!< Configurator handle.
+};
+
+/*! \brief Sub device of a device, owning its mdev configurator inline. */
+class RmSubdevice {
+public:
+    RmSubdevice() = default;
+    RmSubdevice(RmSubdevice&&) noexcept = default;
+
+    RmSubdevice& operator=(RmSubdevice&& other) noexcept
+    {
+        mdev_config_ = std::move(other.mdev_config_);
+        object_ = std::move(other.object_);
+
+        return *this;
+    }
+
+    /*! \brief Allocates the sub device under a device. */
+    bool alloc(int fd, const RmObject& device, uint32_t handle)
+    {
+        uint32_t sub_dev_alloc = 0;
+
+        return object_.alloc(fd, device, handle, NV2080_CLASS, &sub_dev_alloc);
+    }
+
+    /*! \brief Allocates the mdev configurator of the sub device. */
+    bool alloc_mdev_config(uint32_t handle) { return mdev_config_.alloc(object_.fd(), object_, handle); }
+
+    const RmObject& object() const { return object_; }
+    RmMdevConfig& mdev_config() { return mdev_config_; }
+    const RmMdevConfig& mdev_config() const { return mdev_config_; }
+    explicit operator bool() const { return static_cast<bool>(object_); }
+
+private:
+    RmObject object_;                   //!< Sub device handle.
+    RmMdevConfig mdev_config_;          //!< Configurator, freed before the sub device.
+};
+
+/*! \brief Device of an attached GPU, owning its /dev/nvidia%d file and sub device inline. */
+class RmDevice {
+public:
+    RmDevice() = default;
+    RmDevice(RmDevice&&) noexcept = default;
+
+    RmDevice& operator=(RmDevice&& other) noexcept
+    {
+        subdevice_ = std::move(other.subdevice_);
+        object_ = std::move(other.object_);
+        dev_ = std::move(other.dev_);
+
+        return *this;
+    }
+
+    /*! \brief Opens /dev/nvidia%d and allocates the device of an attached GPU.
+     *
+     * \param client - Client to allocate the device under.
+     * \param minor - Minor of the /dev/nvidia%d file.
+     * \param dev_inst - Device instance of the GPU.
+     * \param handle - Device handle.
+     */
+    static RmDevice create(const RmClient& client, uint16_t minor, uint32_t dev_inst, uint32_t handle)
+    {
+        return create(client, Fd(nv_open_dev(minor)), dev_inst, handle);
+    }
+
+    /*! \brief Allocates the device of an attached GPU, taking ownership of its opened file. */
+    static RmDevice create(const RmClient& client, Fd dev, uint32_t dev_inst, uint32_t handle)
+    {
+        struct Nv0080AllocParams dev_alloc = {};
+        RmDevice ret;
+
+        dev_alloc.deviceId = dev_inst;
+        dev_alloc.hClientShare = client.object().object();
+
+        ret.dev_ = std::move(dev);
+
+        if (!ret.dev_ || !ret.object_.alloc(client.fd(), client.object(), handle, NV0080_CLASS, &dev_alloc))
+            ret.dev_.reset();
+
+        return ret;
+    }
+
+    /*! \brief Allocates the sub device of the device. */
+    bool alloc_subdevice(uint32_t handle) { return subdevice_.alloc(object_.fd(), object_, handle); }
+
+    int fd() const { return dev_.get(); }
+    const RmObject& object() const { return object_; }
+    RmSubdevice& subdevice() { return subdevice_; }
+    const RmSubdevice& subdevice() const { return subdevice_; }
+    explicit operator bool() const { return static_cast<bool>(object_); }
+
+private:
+    Fd dev_;                            //!< Device file, closed after the device is freed.
+    RmObject object_;                   //!< Device handle.
+    RmSubdevice subdevice_;             //!< Sub device, freed before the device.
+};
+
+/*! \brief RM event signalled on its own /dev/nvidiactl file descriptor. */
+class RmEvent {
+public:
+    RmEvent() = default;
+    RmEvent(RmEvent&&) noexcept = default;
+
+    RmEvent& operator=(RmEvent&& other) noexcept
+    {
+        object_ = std::move(other.object_);
+        fd_ = std::move(other.fd_);
+
+        return *this;
+    }
+
+    /*! \brief Opens an event file and binds a notification of a resource to it.
+     *
+     * \param client - Client allocating the event.
+     * \param parent - Resource raising the notification.
+     * \param handle - Event handle.
+     * \param notify - Notification index.
+     * \param flags - Notification flags.
+     */
+    static RmEvent create(const RmClient& client, const RmObject& parent, uint32_t handle, uint32_t notify,
+                          uint32_t flags)
+    {
+        return create(client, parent, Fd(nv_open_dev(255)), handle, notify, flags);
+    }
+
+    /*! \brief Binds a notification to an opened event file, taking ownership of it. */
+    static RmEvent create(const RmClient& client, const RmObject& parent, Fd fd, uint32_t handle,
+                          uint32_t notify, uint32_t flags)
+    {
+        struct RmAllocEvent rm_event = {};
+        struct RmSetNotification set_notify = {};
+        RmEvent ret;
+
+        ret.fd_ = std::move(fd);
+
+        if (!ret.fd_ || !rm_alloc_os_event(ret.fd_.get(), parent.client(), parent.object())) {
+            ret.fd_.reset();
+            return ret;
+        }
+
+        rm_event.parent = parent.client();
+        rm_event.event_class = 0x00000079;
+        rm_event.notify = notify | flags;
+        rm_event.event_data = ret.fd_.get();
+
+        set_notify.event = notify;
+        set_notify.action = 2;
+
+        if (!ret.object_.alloc(client.fd(), parent, handle, 0x00000005, &rm_event) ||
+            parent.ctrl(client.fd(), 0x00000501, set_notify) == nullptr) {
+            ret.object_.reset();
+            ret.fd_.reset();
+        }
+
+        return ret;
+    }
+
+    int fd() const { return fd_.get(); }
+    const RmObject& object() const { return object_; }
+    explicit operator bool() const { return static_cast<bool>(object_); }
+
+private:
+    Fd fd_;                             //!< Event file, closed after the event is freed.
+    RmObject object_;                   //!< Event handle.
+};
+
+/*! \brief Opened /dev/nvidia-vgpu%d file of a running vGPU. */
+class VgpuFd {
+public:
+    VgpuFd() = default;
+    VgpuFd(VgpuFd&&) noexcept = default;
+    VgpuFd& operator=(VgpuFd&&) noexcept = default;
+
+    /*! \brief Opens /dev/nvidia-vgpu%d. */
+    static VgpuFd open(uint16_t minor)
+    {
+        VgpuFd ret;
+
+        ret.fd_ = Fd(nv_open_mdev(minor));
+
+        return ret;
+    }
+
+    /*! \brief Controls the mdev configurator through the vGPU file. */
+    template <typename T>
+    T* ctrl(const RmMdevConfig& config, uint32_t command, T& data) const
+    {
+        return config.object().ctrl(fd_.get(), command, data);
+    }
+
+    int fd() const { return fd_.get(); }
+    explicit operator bool() const { return static_cast<bool>(fd_); }
+
+private:
+    Fd fd_;                             //!< vGPU file.
+};
+
+} // namespace gvm::nvidia
+
+#endif
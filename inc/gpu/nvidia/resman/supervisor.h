@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef GPU_NVIDIA_RESMAN_SUPERVISOR_H
+#define GPU_NVIDIA_RESMAN_SUPERVISOR_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! Maximum number of RM calls tracked at once, further calls are not supervised.
+#define RM_SUPERVISOR_SLOTS 128
+
+/*! \brief RM call in flight. */
+struct RmInFlight {
+    pthread_t thread;           //!< Thread issuing the call.
+    int fd;                     //!< File the call is issued on.
+    unsigned long request;      //!< Ioctl request of the call.
+    uint32_t command;           //!< Control command or allocated class.
+    uint64_t elapsed_ms;        //!< Milliseconds the call has been running for.
+    uint8_t escalated;          //!< If the thread was interrupted.
+};
+
+/*! \brief Reports a RM call that missed its deadline.
+ *
+ * Called from the supervisor thread, once when the deadline passes and once when the call is
+ * escalated.
+ *
+ * \param call - Stuck call.
+ * \param user - User data of the supervisor.
+ */
+typedef void (*RmStuckCallback)(const struct RmInFlight* call, void* user);
+
+/*! \brief Configuration of the RM call supervisor. */
+struct RmSupervisorConfig {
+    uint32_t deadline_ms;       //!< Milliseconds after which a call is reported as stuck.
+    uint32_t escalate_ms;       //!< Milliseconds after which the thread is interrupted,
+                                //!< 0 to never interrupt.
+    uint32_t interval_ms;       //!< Milliseconds between scans of the calls in flight.
+    int signal;                 //!< Signal interrupting a stuck thread, 0 for SIGUSR2.
+    RmStuckCallback report;     //!< Reports stuck calls, NULL to print them.
+    void* user;                 //!< User data passed to report.
+};
+
+/*! \brief Starts supervising the RM calls.
+ *
+ * Every RM call issued while the supervisor runs is tracked with its start time. A call that
+ * runs past the deadline is reported, past the escalation time its thread is interrupted
+ * with a signal so the ioctl returns and the call fails with ETIMEDOUT.
+ *
+ * \sideeffect State Side Effect: Starts the supervisor thread.
+ * \sideeffect State Side Effect: Installs a handler for the escalation signal.
+ *
+ * \restriction Interrupting only helps when the kernel waits interruptibly.
+ *
+ * \param config - Supervisor configuration.
+ * \return If the supervisor was started.
+ */
+uint8_t rm_supervisor_start(const struct RmSupervisorConfig* config);
+
+/*! \brief Stops supervising the RM calls.
+ *
+ * \sideeffect State Side Effect: Restores the handler of the escalation signal.
+ */
+void rm_supervisor_stop(void);
+
+/*! \brief Lists the RM calls in flight.
+ *
+ * \param calls - Returns the calls in flight.
+ * \param size - Maximum number of calls to return.
+ * \return Number of calls returned.
+ */
+uint32_t rm_supervisor_in_flight(struct RmInFlight* calls, uint32_t size);
+
+/*! \brief Tracks the start of a RM call, used by the RM API.
+ *
+ * \param fd - File the call is issued on.
+ * \param request - Ioctl request of the call.
+ * \param command - Control command or allocated class.
+ * \return Slot of the call, -1 if it is not tracked.
+ */
+int rm_supervisor_enter(int fd, unsigned long request, uint32_t command);
+
+/*! \brief Tracks the end of a RM call, used by the RM API.
+ *
+ * \param slot - Slot returned by rm_supervisor_enter.
+ * \return If the call was escalated.
+ */
+uint8_t rm_supervisor_leave(int slot);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
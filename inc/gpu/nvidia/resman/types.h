@@ -25,6 +25,12 @@
 extern "C" {
 #endif
 
+//! RM status of a call that can be retried once the resource is no longer busy.
+#define NV_ERR_BUSY_RETRY 0x00000003
+
+//! RM status of a call that timed out inside the RM Core and can be retried.
+#define NV_ERR_TIMEOUT_RETRY 0x00000066
+
 /*! \brief RM API Version Check.
  *
  * NVIDIA requires a version check to ensure that the binary offsets are correct between the
@@ -82,6 +88,28 @@ struct RmSetNotification {
     uint32_t action;         //!< Action to use for the notification.
 };
 
+/*! \brief Data of a RM Event.
+ *
+ * Queued on the operating system event file for every notification of an event allocated
+ * without NV01_EVENT_WITHOUT_EVENT_DATA.
+ */
+struct RmEventData {
+    uint32_t object;         //!< Event object that fired.
+    uint32_t notify;         //!< Notification index of the event.
+    uint32_t info32;         //!< Notification specific data.
+    uint16_t info16;         //!< Notification specific data.
+};
+
+/*! \brief Operating System Event Data Reader.
+ *
+ * Dequeues the data of one event from an operating system event file.
+ */
+struct RmGetEventData {
+    uint64_t event;          //!< Pointer to the RmEventData to fill.
+    uint32_t more_events;    //!< If more events are queued.
+    uint32_t status;         //!< Status, not 0 when no event is queued.
+};
+
 /*! \brief Resource Deallocator.
  *
  * Structure to free a resource.
@@ -20,6 +20,7 @@
 #define GPU_NVIDIA_RESOURCES_H
 
 #include <gpu/mdev.h>
+#include <gpu/nvidia/registry.h>
 
 #include <stdint.h>
 
@@ -47,6 +48,8 @@ struct NvResource {
     void *class_info;           //!< Class info for the resource.
     struct NvResource* next;    //!< Next child on the level.
     struct NvResource* child;   //!< Child of the resource.
+    struct NvResource* last;    //!< Recently appended child, appends walk
+                                //!< forward from it to the last child.
 };
 
 /*! \brief Control Mechanism for the NVIDIA GPU.
@@ -57,6 +60,9 @@ struct NvMdevGpu {
     int ctl_fd;                 //!< Control Nvidia control file description.
     int dev_fd;                 //!< Device Nvidia file descriptor.
     int mdev_fd;                //!< Mdev file descriptor.
+    uint16_t minor;             //!< Minor of the /dev/nvidia%d device.
+    int32_t numa_node;          //!< NUMA node of the GPU, -1 if unknown.
+    uint8_t attached;           //!< If the GPU is attached and its objects allocated.
     struct Gpu* gpu;            //!< GPU structure corresponding to the GPU.
     uint32_t root;              //!< Initial client.
     uint32_t device;            //!< Device id for controlling the physical gpu.
@@ -65,6 +71,21 @@ struct NvMdevGpu {
     struct NvResource* dev;     //!< Device.
     struct NvResource* sdev;    //!< Subdevice.
     struct NvResource* mdev;    //!< Mdev device.
+    struct NvResource* shard;   //!< RM client owned by the GPU in sharded mode,
+                                //!< allocated on its own ctl_fd.
+};
+
+/*! \brief Immutable snapshot of the GPUs of a manager.
+ *
+ * Holds copies of the GPUs so readers never observe a GPU being updated. A new snapshot is
+ * published by nv_mgr_publish whenever the GPUs change, the previous one is reclaimed once no
+ * reader can hold it anymore.
+ */
+struct NvGpuView {
+    uint64_t generation;        //!< Number of snapshots published before this one.
+    struct NvGpuRegistry gpus;  //!< Index over the copied GPUs.
+    struct NvMdevGpu* copies;   //!< Copies of the GPUs.
+    struct Gpu* infos;          //!< Copies of the GPU descriptions.
 };
 
 /*! \brief Structure for managing the mediated stack.
@@ -73,7 +94,9 @@ struct NvMdevGpu {
  */
 struct NvMdev {
     int fd;                     //!< Control file descriptor.
-    struct NvMdevGpu* gpus[32]; //!< Available GPUs.
+    uint32_t flags;             //!< Flags the manager was created with.
+    struct NvGpuRegistry gpus;  //!< Available GPUs.
+    struct NvGpuView* view;     //!< Published snapshot of the GPUs, read with nv_mgr_view.
     struct NvResource* res;     //!< Resource tree.
 };
 
@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef GPU_PLAN_H
+#define GPU_PLAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <gpu/mdev.h>
+
+#include <utils/configs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! Granularity of the framebuffer of the planned types, in megabytes.
+#define PLAN_FB_ALIGN 64
+//! Smallest BAR1 aperture given to an instance, in megabytes.
+#define PLAN_BAR1_MIN 0x40
+//! Largest BAR1 aperture given to an instance, in megabytes.
+#define PLAN_BAR1_MAX 0x800
+//! Largest BAR1 aperture given to an instance sharing its GPU, in megabytes.
+#define PLAN_BAR1_SHARED_MAX 0x400
+//! Most partitions in a mix.
+#define PLAN_MAX_MIX 32
+
+/*! \brief Memory of a GPU model. */
+struct GpuMemory {
+    uint32_t vendor_id;     //!< Vendor id of the GPU.
+    uint32_t device_id;     //!< Device id of the GPU.
+    uint32_t fb_size;       //!< Framebuffer of the GPU, in megabytes.
+    uint32_t bar1_size;     //!< BAR1 aperture of the GPU, in megabytes.
+};
+
+/*! \brief Parameters of a mdev type splitting a GPU in equal partitions. */
+struct PlanType {
+    uint32_t max_instances; //!< Partitions of the GPU.
+    uint32_t fb_len;        //!< Framebuffer usable by an instance, in megabytes.
+    uint32_t fb_res;        //!< Framebuffer reserved for an instance, in megabytes.
+    uint32_t bar1_len;      //!< BAR1 aperture of an instance, in megabytes.
+    uint32_t fb_unused;     //!< Framebuffer of the GPU left to no instance, in megabytes.
+};
+
+/*! \brief Severity of a configuration issue. */
+enum PlanSeverity {
+    PLAN_WARNING,           //!< The type works but wastes memory.
+    PLAN_ERROR              //!< The type cannot fit the GPU.
+};
+
+/*! \brief Issue found in a mdev type of a configuration. */
+struct PlanIssue {
+    enum PlanSeverity severity; //!< Severity of the issue.
+    uint32_t device_id;         //!< Device id of the GPU the type was checked against.
+    uint32_t num;               //!< Number of the mdev type.
+    char message[128];          //!< Description of the issue.
+};
+
+/*! \brief Issues found in configurations. */
+struct PlanReport {
+    size_t size;                //!< Number of issues.
+    size_t errors;              //!< Number of issues of PLAN_ERROR severity.
+    struct PlanIssue* issues;   //!< Issues, in the order of the checked types.
+};
+
+/*! \brief Parses the memory of a GPU model.
+ *
+ * \param spec - Memory as [VENDOR:]DEVICE=FB_MB:BAR1_MB, the vendor defaulting to NVIDIA.
+ * \param memory - Returns the memory.
+ * \return If the memory was parsed.
+ */
+uint8_t plan_parse_memory(const char* spec, struct GpuMemory* memory);
+
+/*! \brief Parses a partition mix.
+ *
+ * \param list - Comma separated list of the partitions per GPU of every type, e.g. 1,2,4,8.
+ * \param counts - Returns the partitions.
+ * \param size - Capacity of the partition list.
+ * \return Number of partitions, 0 if the list is malformed or too long.
+ */
+size_t plan_parse_mix(const char* list, uint32_t* counts, size_t size);
+
+/*! \brief Computes a type splitting a GPU in equal partitions.
+ *
+ * Every partition gets the largest aligned slice of the framebuffer, of which the driver
+ * reservation is taken, so the usable framebuffer of an instance is as large as possible.
+ * The BAR1 window of an instance is the largest power of two fitting its share of the
+ * aperture, up to PLAN_BAR1_MAX for a whole GPU and PLAN_BAR1_SHARED_MAX for a partition, as
+ * in the shipped profiles.
+ *
+ * \param memory - Memory of the GPU.
+ * \param instances - Partitions of the GPU.
+ * \param type - Returns the type.
+ * \return If the partitions fit the framebuffer and the BAR1 aperture of the GPU.
+ */
+uint8_t plan_type(const struct GpuMemory* memory, uint32_t instances, struct PlanType* type);
+
+/*! \brief Writes a configuration for a partition mix.
+ *
+ * The configuration targets the vendor/device id of the GPU and has one mdev type per
+ * partition count, numbered from first_num.
+ *
+ * \param out - Stream to write the TOML configuration to.
+ * \param memory - Memory of the GPU.
+ * \param counts - Partitions per GPU of every type.
+ * \param size - Number of types.
+ * \param first_num - Number of the first mdev type.
+ * \return If every type fits the GPU, nothing is written otherwise.
+ */
+uint8_t plan_write_config(FILE* out, const struct GpuMemory* memory, const uint32_t* counts, size_t size, uint32_t first_num);
+
+/*! \brief Checks mdev types against the memory of a GPU.
+ *
+ * Types which do not fit the framebuffer or the BAR1 aperture are errors, types leaving
+ * framebuffer unused or reserving less than a planned type are warnings.
+ *
+ * \param memory - Memory of the GPU.
+ * \param requests - Types to check.
+ * \param count - Number of types.
+ * \param report - Report the issues are appended to, zero initialized before the first check.
+ * \return If no type is an error.
+ */
+uint8_t plan_validate(const struct GpuMemory* memory, const struct MDevRequest* requests, size_t count, struct PlanReport* report);
+
+/*! \brief Checks configurations against the memory of GPU models.
+ *
+ * Every configuration is checked against the models its gpu selectors can match.
+ *
+ * \param memories - Memory of the GPU models.
+ * \param memory_count - Number of models.
+ * \param configs - Configurations to check.
+ * \param report - Report the issues are appended to, zero initialized before the first check.
+ * \return If no type is an error.
+ */
+uint8_t plan_validate_configs(const struct GpuMemory* memories, size_t memory_count, const struct GpuConfigs* configs, struct PlanReport* report);
+
+/*! \brief Checks a configuration catalog against the memory of GPU models.
+ *
+ * Every model is checked against the configuration the catalog gives its GPUs, a generic
+ * one only for the models no configuration targets.
+ *
+ * \param memories - Memory of the GPU models.
+ * \param memory_count - Number of models.
+ * \param catalog - Catalog to check.
+ * \param report - Report the issues are appended to, zero initialized before the first check.
+ * \return If no type is an error.
+ */
+uint8_t plan_validate_catalog(const struct GpuMemory* memories, size_t memory_count, const struct ConfigCatalog* catalog, struct PlanReport* report);
+
+/*! \brief Prints the issues of a report.
+ *
+ * \param report - Report to print.
+ * \param out - Stream to print to.
+ */
+void plan_print_report(const struct PlanReport* report, FILE* out);
+
+/*! \brief Frees the issues of a report.
+ *
+ * \param report - Report to free.
+ */
+void plan_free_report(struct PlanReport* report);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
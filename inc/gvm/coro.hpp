@@ -0,0 +1,542 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef GVM_CORO_HPP
+#define GVM_CORO_HPP
+
+#if __cplusplus < 202002L
+#error "gvm/coro.hpp requires C++20"
+#endif
+
+#include <cerrno>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <gpu/nvidia/resman/events.h>
+#include <gpu/nvidia/resman/objects.hpp>
+
+#include <gvm/exits.h>
+#include <gvm/nvidia/manager.h>
+
+/*! \brief Coroutines over the event sources of the VM manager.
+ *
+ * A Scheduler multiplexes any number of coroutines on one thread and one epoll instance, a
+ * coroutine waiting for a file descriptor, a process exit or a timer costs a few hundred bytes
+ * of frame instead of a thread. VM flows are written as straight-line code:
+ *
+ * ```{.cpp}
+ * Task<> lifecycle(Scheduler& s, VmMgr& mgr, NvMdev& mdev, VmStartRequest request)
+ * {
+ *     start_vm_request(&mgr, &mdev, &request);
+ *     co_await s.pid_exit(request.info.qemu_pid);
+ *     vm_end_session(&mgr, &request.info.uuid, request.info.qemu_pid);
+ * }
+ * ```
+ *
+ * Tasks are lazy, they run once awaited or spawned. Awaiting a task resumes it in place and
+ * the awaiting coroutine is resumed in place when it finishes, so chains of tasks do not grow
+ * the stack. The library does not use exceptions, one escaping a coroutine terminates.
+ *
+ * \restriction A scheduler and its coroutines are used from a single thread.
+ * \restriction A file descriptor stays open while a coroutine waits for it.
+ * \restriction GCC 12 can skip the body of a coroutine awaiting inside an if condition, the
+ *              awaited values are stored before being tested.
+ */
+namespace gvm {
+
+class Scheduler;
+
+template <typename T = void>
+class Task;
+
+namespace detail {
+
+/*! \brief State shared by the promises of every task. */
+struct PromiseBase {
+    std::coroutine_handle<> continuation;   //!< Coroutine awaiting the task, none if spawned.
+    Scheduler* scheduler = nullptr;         //!< Scheduler owning the task if spawned.
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    void unhandled_exception() noexcept { std::terminate(); }
+};
+
+/*! \brief Resumes the awaiting coroutine, or releases a spawned task, once a task finished. */
+struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept;
+
+    void await_resume() noexcept {}
+};
+
+/*! \brief Promise of a task returning a value. */
+template <typename T>
+struct Promise : PromiseBase {
+    std::optional<T> value;                 //!< Returned value.
+
+    Task<T> get_return_object() noexcept;
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void return_value(T ret) { value.emplace(std::move(ret)); }
+};
+
+/*! \brief Promise of a task returning nothing. */
+template <>
+struct Promise<void> : PromiseBase {
+    Task<void> get_return_object() noexcept;
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+};
+
+/*! \brief Coroutine waiting for events of a file descriptor. */
+struct FdWaiter {
+    int fd;                                 //!< File descriptor.
+    uint32_t events;                        //!< Epoll events waited for.
+    uint32_t revents;                       //!< Ready epoll events, 0 until woken.
+    std::coroutine_handle<> handle;         //!< Waiting coroutine.
+};
+
+} // namespace detail
+
+/*! \brief Lazily started coroutine.
+ *
+ * Owns its frame until it is spawned, destroying a task that is suspended in a wait is only
+ * allowed once its scheduler is destroyed.
+ */
+template <typename T>
+class Task {
+public:
+    using promise_type = detail::Promise<T>;
+
+    Task() = default;
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+    Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+
+    Task& operator=(Task&& other) noexcept
+    {
+        if (this != &other) {
+            if (handle_)
+                handle_.destroy();
+            handle_ = std::exchange(other.handle_, {});
+        }
+
+        return *this;
+    }
+
+    ~Task()
+    {
+        if (handle_)
+            handle_.destroy();
+    }
+
+    bool await_ready() const noexcept { return !handle_ || handle_.done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        handle_.promise().continuation = awaiting;
+
+        return handle_;
+    }
+
+    T await_resume()
+    {
+        if constexpr (!std::is_void_v<T>)
+            return std::move(*handle_.promise().value);
+    }
+
+    /*! \brief Gives up the ownership of the frame. */
+    std::coroutine_handle<promise_type> release() { return std::exchange(handle_, {}); }
+
+    explicit operator bool() const { return bool(handle_); }
+
+private:
+    std::coroutine_handle<promise_type> handle_;    //!< Frame of the coroutine.
+};
+
+namespace detail {
+
+template <typename T>
+Task<T> Promise<T>::get_return_object() noexcept
+{
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() noexcept
+{
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+} // namespace detail
+
+/*! \brief Awaits events of a file descriptor.
+ *
+ * Resumes with the ready epoll events, 0 if the file descriptor cannot be watched.
+ */
+class FdAwaiter {
+public:
+    FdAwaiter(Scheduler& scheduler, int fd, uint32_t events)
+        : scheduler_(scheduler), waiter_{fd, events, 0, {}}
+    {}
+
+    bool await_ready() const noexcept { return waiter_.fd == -1; }
+    bool await_suspend(std::coroutine_handle<> handle);
+    uint32_t await_resume() const noexcept { return waiter_.revents; }
+
+private:
+    Scheduler& scheduler_;                  //!< Scheduler watching the file descriptor.
+    detail::FdWaiter waiter_;               //!< Registration, linked while suspended.
+};
+
+/*! \brief Single threaded coroutine scheduler on top of epoll. */
+class Scheduler {
+public:
+    Scheduler() : epoll_(epoll_create1(EPOLL_CLOEXEC)) {}
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    /*! \brief Destroys the spawned tasks that did not finish. */
+    ~Scheduler()
+    {
+        watches_.clear();
+        ready_.clear();
+
+        for (void* root : std::exchange(roots_, {}))
+            std::coroutine_handle<>::from_address(root).destroy();
+    }
+
+    explicit operator bool() const { return bool(epoll_); }
+
+    /*! \brief Runs a task to completion on the scheduler, which then owns it.
+     *
+     * \param task - Task to run, it starts on the next run of the scheduler.
+     */
+    void spawn(Task<void> task)
+    {
+        auto handle = task.release();
+
+        if (!handle)
+            return;
+
+        handle.promise().scheduler = this;
+        roots_.insert(handle.address());
+        ready_.push_back(handle);
+    }
+
+    /*! \brief Gets the number of spawned tasks that did not finish. */
+    size_t size() const { return roots_.size(); }
+
+    /*! \brief Resumes a coroutine on the next run of the scheduler. */
+    void schedule(std::coroutine_handle<> handle) { ready_.push_back(handle); }
+
+    /*! \brief Runs the ready coroutines and those whose wait completes within a timeout.
+     *
+     * \param timeout_ms - Milliseconds to wait when no coroutine is ready, -1 to wait forever.
+     * \return Number of coroutines resumed.
+     */
+    size_t run_once(int timeout_ms)
+    {
+        struct epoll_event events[64];
+        size_t ret = run_ready();
+        int count = epoll_wait(epoll_.get(), events, 64, ret != 0 ? 0 : timeout_ms);
+
+        for (int i = 0; i < count; ++i)
+            wake(events[i].data.fd, events[i].events);
+
+        return ret + run_ready();
+    }
+
+    /*! \brief Runs until every spawned task finished or stop was called.
+     *
+     * \return If every spawned task finished, a task waiting for nothing stops the run.
+     */
+    bool run()
+    {
+        stopped_ = false;
+
+        while (!stopped_ && !roots_.empty()) {
+            if (ready_.empty() && watches_.empty())
+                return false;
+            run_once(-1);
+        }
+
+        return roots_.empty();
+    }
+
+    /*! \brief Makes run return after the coroutines being resumed. */
+    void stop() { stopped_ = true; }
+
+    /*! \brief Awaits a file descriptor to be readable. */
+    FdAwaiter readable(int fd) { return FdAwaiter(*this, fd, EPOLLIN); }
+
+    /*! \brief Awaits a file descriptor to be writable. */
+    FdAwaiter writable(int fd) { return FdAwaiter(*this, fd, EPOLLOUT); }
+
+    /*! \brief Awaits a vGPU file descriptor to report an event of its VM. */
+    FdAwaiter vgpu_ready(int fd) { return FdAwaiter(*this, fd, EPOLLIN | EPOLLPRI); }
+
+    /*! \brief Awaits the exit of a process.
+     *
+     * \param pid - Process to wait for, it does not have to be a child.
+     * \return If the process exited, an unknown process already did.
+     */
+    Task<bool> pid_exit(uint32_t pid)
+    {
+        nvidia::Fd fd(syscall(SYS_pidfd_open, pid, 0));
+
+        if (!fd)
+            co_return errno == ESRCH;
+
+        uint32_t events = co_await readable(fd.get());
+
+        co_return events != 0;
+    }
+
+    /*! \brief Awaits a delay.
+     *
+     * \param delay - Delay to wait.
+     * \return If the delay elapsed, it cannot be waited for without a timer.
+     */
+    Task<bool> sleep_for(std::chrono::nanoseconds delay)
+    {
+        nvidia::Fd fd(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK));
+        struct itimerspec spec = {};
+        int64_t ns = delay.count() > 0 ? delay.count() : 1;
+
+        /* A zero expiration disarms the timer, the shortest delay is a nanosecond. */
+        spec.it_value.tv_sec = ns / 1000000000;
+        spec.it_value.tv_nsec = ns % 1000000000;
+
+        if (!fd || timerfd_settime(fd.get(), 0, &spec, nullptr) == -1)
+            co_return false;
+
+        uint32_t events = co_await readable(fd.get());
+
+        co_return events != 0;
+    }
+
+    /*! \brief Links a waiter, called when a coroutine suspends on a file descriptor.
+     *
+     * \return If the file descriptor is watched, the waiter is resumed once it is ready.
+     */
+    bool watch(detail::FdWaiter* waiter)
+    {
+        auto [watch, inserted] = watches_.try_emplace(waiter->fd);
+        struct epoll_event event = {};
+
+        event.events = watch->second.events | waiter->events;
+        event.data.fd = waiter->fd;
+
+        if (event.events != watch->second.events || inserted) {
+            if (epoll_ctl(epoll_.get(), inserted ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, waiter->fd, &event) == -1) {
+                if (inserted)
+                    watches_.erase(watch);
+                return false;
+            }
+        }
+
+        watch->second.events = event.events;
+        watch->second.waiters.push_back(waiter);
+
+        return true;
+    }
+
+private:
+    /*! \brief Coroutines waiting for a file descriptor. */
+    struct Watch {
+        uint32_t events = 0;                        //!< Epoll events registered.
+        std::vector<detail::FdWaiter*> waiters;     //!< Waiters in arrival order.
+    };
+
+    /*! \brief Resumes the ready coroutines, including those they make ready. */
+    size_t run_ready()
+    {
+        size_t ret = 0;
+
+        while (!ready_.empty()) {
+            std::coroutine_handle<> handle = ready_.front();
+
+            ready_.pop_front();
+            handle.resume();
+            ++ret;
+        }
+
+        return ret;
+    }
+
+    /*! \brief Wakes the waiters of a ready file descriptor. */
+    void wake(int fd, uint32_t events)
+    {
+        auto watch = watches_.find(fd);
+
+        if (watch == watches_.end())
+            return;
+
+        std::vector<detail::FdWaiter*>& waiters = watch->second.waiters;
+        uint32_t remaining = 0;
+        size_t kept = 0;
+
+        /* Errors and hangups wake every waiter, they would never see their events. */
+        for (detail::FdWaiter* waiter : waiters) {
+            if (events & (waiter->events | EPOLLERR | EPOLLHUP)) {
+                waiter->revents = events;
+                ready_.push_back(waiter->handle);
+            } else {
+                remaining |= waiter->events;
+                waiters[kept++] = waiter;
+            }
+        }
+
+        waiters.resize(kept);
+
+        if (kept == 0) {
+            epoll_ctl(epoll_.get(), EPOLL_CTL_DEL, fd, nullptr);
+            watches_.erase(watch);
+        } else if (remaining != watch->second.events) {
+            struct epoll_event event = {};
+
+            event.events = remaining;
+            event.data.fd = fd;
+            epoll_ctl(epoll_.get(), EPOLL_CTL_MOD, fd, &event);
+            watch->second.events = remaining;
+        }
+    }
+
+    friend struct detail::FinalAwaiter;
+
+    /*! \brief Releases a spawned task which finished. */
+    void release(std::coroutine_handle<> handle)
+    {
+        roots_.erase(handle.address());
+        handle.destroy();
+    }
+
+    nvidia::Fd epoll_;                              //!< Epoll instance.
+    std::deque<std::coroutine_handle<>> ready_;     //!< Coroutines to resume.
+    std::unordered_map<int, Watch> watches_;        //!< Watched file descriptors.
+    std::unordered_set<void*> roots_;               //!< Frames of the spawned tasks.
+    bool stopped_ = false;                          //!< If stop was called.
+};
+
+inline bool FdAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    waiter_.handle = handle;
+
+    return scheduler_.watch(&waiter_);
+}
+
+namespace detail {
+
+template <typename Promise>
+std::coroutine_handle<> FinalAwaiter::await_suspend(std::coroutine_handle<Promise> handle) noexcept
+{
+    PromiseBase& promise = handle.promise();
+
+    if (promise.continuation)
+        return promise.continuation;
+
+    if (promise.scheduler != nullptr)
+        promise.scheduler->release(handle);
+
+    return std::noop_coroutine();
+}
+
+} // namespace detail
+
+/*! \brief Awaitable events of a VM manager.
+ *
+ * Start requests are read in batches from the event file of the manager and handed out one
+ * at a time, so an accept loop can spawn a lifecycle coroutine per VM.
+ *
+ * \restriction Each event is awaited by one coroutine at a time.
+ */
+class VmEventSource {
+public:
+    VmEventSource(Scheduler& scheduler, struct VmMgr& mgr, struct NvMdev& mdev)
+        : scheduler_(scheduler), mgr_(mgr), mdev_(mdev)
+    {}
+
+    /*! \brief Awaits the next VM start request.
+     *
+     * \return The start request, nothing if the VM events cannot be waited for.
+     */
+    Task<std::optional<struct VmStartRequest>> start_event()
+    {
+        while (pending_.empty()) {
+            uint32_t ready = co_await scheduler_.readable(rm_event_hub_fd(mgr_.events));
+
+            if (ready == 0)
+                co_return std::nullopt;
+
+            binds_ += drain_vm_events(&mgr_, &mdev_, push_start, &pending_).binds;
+        }
+
+        struct VmStartRequest ret = pending_.front();
+
+        pending_.pop_front();
+
+        co_return ret;
+    }
+
+    /*! \brief Awaits the exit of watched QEMU processes and ends their sessions.
+     *
+     * \return Number of ended sessions, nothing if the exits cannot be waited for.
+     */
+    Task<std::optional<size_t>> exit_event()
+    {
+        uint32_t ready = co_await scheduler_.readable(mgr_.exit_fd);
+
+        if (ready == 0)
+            co_return std::nullopt;
+
+        co_return handle_vm_exits(&mgr_, NULL, NULL);
+    }
+
+    /*! \brief Gets the number of bind requests read with the start requests. */
+    uint32_t binds() const { return binds_; }
+
+private:
+    /*! \brief Queues a start request to hand out, as a VmStartFn of drain_vm_events. */
+    static void push_start(const struct VmStartRequest* request, void* user)
+    {
+        static_cast<std::deque<struct VmStartRequest>*>(user)->push_back(*request);
+    }
+
+    Scheduler& scheduler_;                          //!< Scheduler of the waits.
+    struct VmMgr& mgr_;                             //!< VM manager.
+    struct NvMdev& mdev_;                           //!< Manager of the GPUs.
+    std::deque<struct VmStartRequest> pending_;     //!< Start requests read, not handed out.
+    uint32_t binds_ = 0;                            //!< Bind requests read.
+};
+
+} // namespace gvm
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef GVM_EXITS_H
+#define GVM_EXITS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <gvm/sessions.h>
+#include <gvm/vm_mgr.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \brief Starts watching the exits of the QEMU processes of a VM manager.
+ *
+ * The returned fd becomes readable when a watched QEMU process exits, it is meant to be added
+ * to the event loop waiting for the VM events.
+ *
+ * \sideeffect Resource Side Effect: Creates the epoll instance of mgr->exit_fd.
+ *
+ * \param mgr - VM manager whose exits are watched.
+ * \return The exit fd, -1 if exits cannot be watched.
+ */
+int vm_exits_open(struct VmMgr* mgr);
+
+/*! \brief Stops watching the exits of the QEMU processes of a VM manager.
+ *
+ * \param mgr - VM manager whose exits are watched.
+ */
+void vm_exits_close(struct VmMgr* mgr);
+
+/*! \brief Watches the exit of the QEMU process of a session.
+ *
+ * Opens a pidfd for the QEMU process of the session, which then owns it. Must be called before
+ * the session is added, so the pidfd is released with the session.
+ *
+ * \sideeffect Resource Side Effect: Opens a pidfd and adds it to the exit fd.
+ *
+ * \param mgr - VM manager whose exits are watched.
+ * \param session - Session about to be added, its pid_fd is set.
+ * \return If the exit of the process is watched.
+ */
+uint8_t vm_watch_exit(struct VmMgr* mgr, struct VmSession* session);
+
+/*! \brief Receives a session ended by handle_vm_exits.
+ *
+ * \param session - Ended session, its fds are already released. Only valid during the call.
+ * \param user - User data given to handle_vm_exits.
+ */
+typedef void (*VmExitFn)(const struct VmSession* session, void* user);
+
+/*! \brief Ends the sessions of the exited QEMU processes.
+ *
+ * Never blocks, meant to be called when the exit fd is readable.
+ *
+ * \sideeffect Resource Side Effect: Releases the fds of the ended sessions.
+ *
+ * \param mgr - VM manager whose exits are watched.
+ * \param exited - Called for every ended session, may be NULL.
+ * \param user - User data given to exited.
+ * \return Number of ended sessions.
+ */
+size_t handle_vm_exits(struct VmMgr* mgr, VmExitFn exited, void* user);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
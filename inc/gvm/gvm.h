@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef GVM_GVM_H
+#define GVM_GVM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \brief Marks a function exported by libgvm.
+ *
+ * The library is built with hidden visibility, only the functions of this header are part of
+ * its ABI. Structures passed through the ABI start with their size, new members are only
+ * appended so older callers keep working.
+ */
+#define GVM_EXPORT __attribute__((visibility("default")))
+
+//! Version of the embedding API, incremented when functions are added.
+#define GVM_API_VERSION 1
+
+//! Only attaches the GPUs targeted by a provisioned configuration.
+#define GVM_OPEN_LAZY 0x00000001
+
+//! Uses a separate RM client for every GPU.
+#define GVM_OPEN_SHARDED 0x00000002
+
+/*! \brief Status returned by the embedding API. */
+enum GvmStatus {
+    GVM_OK = 0,                         //!< Success.
+    GVM_ERR_INVALID = -1,               //!< Invalid argument.
+    GVM_ERR_NOT_FOUND = -2,             //!< No such GPU or configuration.
+    GVM_ERR_RM = -3,                    //!< The RM Core refused the request.
+    GVM_ERR_STATE = -4,                 //!< Not allowed in the current state of the context.
+    GVM_ERR_MEMORY = -5                 //!< Memory could not be allocated.
+};
+
+/*! \brief Type of an event reported to subscribers. */
+enum GvmEventType {
+    GVM_EVENT_VM_START = 1,             //!< A VM started using a vGPU.
+    GVM_EVENT_VM_BIND = 2,              //!< A vGPU was bound.
+    GVM_EVENT_VM_EXIT = 3               //!< The QEMU process of a VM exited, its vGPU was
+                                        //!< released.
+};
+
+/*! \brief Information about a GPU of the context. */
+struct GvmGpuInfo {
+    uint32_t size;                      //!< Size of the structure, set by the caller.
+    uint32_t id;                        //!< RM GPU id.
+    uint32_t domain;                    //!< PCI domain.
+    uint32_t bus;                       //!< PCI bus.
+    uint8_t slot;                       //!< PCI slot.
+    uint16_t vendor_id;                 //!< PCI vendor id.
+    uint16_t device_id;                 //!< PCI device id.
+    uint16_t sub_vendor_id;             //!< PCI subsystem vendor id.
+    uint16_t sub_device_id;             //!< PCI subsystem device id.
+    uint8_t attached;                   //!< If the GPU is attached.
+    uint8_t mdev;                       //!< If the GPU has a mdev configurator.
+};
+
+//! Size of a UUID in its canonical text form, with the terminator.
+#define GVM_UUID_SIZE 37
+
+/*! \brief Event reported to subscribers.
+ *
+ * The VM members identify the VM of a start or an exit, they are empty for a bind.
+ */
+struct GvmEvent {
+    uint32_t size;                      //!< Size of the structure.
+    uint32_t type;                      //!< Type of the event, a GvmEventType.
+    uint32_t gpu_id;                    //!< RM id of the GPU backing the vGPU, 0 if none.
+    uint32_t qemu_pid;                  //!< PID of the QEMU process of the VM, 0 if none.
+    char mdev[GVM_UUID_SIZE];           //!< UUID of the mediated device, empty if none.
+};
+
+/*! \brief Opaque embedding context, owning the manager of the GPUs. */
+struct GvmContext;
+
+/*! \brief Receives events of a context.
+ *
+ * Called from gvm_dispatch on the dispatching thread.
+ *
+ * \param event - Event, only valid during the call.
+ * \param user - User data of the subscription.
+ */
+typedef void (*GvmEventCallback)(const struct GvmEvent* event, void* user);
+
+/*! \brief Gets the version of the embedding API implemented by the library.
+ *
+ * \return GVM_API_VERSION of the library.
+ */
+GVM_EXPORT uint32_t gvm_api_version(void);
+
+/*! \brief Opens a context.
+ *
+ * Probes the GPUs once, they stay probed for the lifetime of the context.
+ *
+ * \sideeffect File System Side Effect: Opens /dev/nvidiactl.
+ * \sideeffect RM Side Effect: Creates a RM Client and attaches the GPUs unless GVM_OPEN_LAZY
+ *                             is set.
+ *
+ * \param flags - GVM_OPEN_* flags.
+ * \return The context, or NULL if the NVIDIA driver is not available.
+ */
+GVM_EXPORT struct GvmContext* gvm_open(uint32_t flags);
+
+/*! \brief Closes a context.
+ *
+ * \sideeffect RM Side Effect: Frees every object of the context and detaches its GPUs.
+ *
+ * \param ctx - Context to close, NULL is ignored.
+ */
+GVM_EXPORT void gvm_close(struct GvmContext* ctx);
+
+/*! \brief Gets the number of GPUs of a context.
+ *
+ * \param ctx - Context to query.
+ * \return Number of probed GPUs.
+ */
+GVM_EXPORT uint32_t gvm_gpu_count(const struct GvmContext* ctx);
+
+/*! \brief Gets information about a GPU.
+ *
+ * \param ctx - Context to query.
+ * \param index - Index of the GPU, below gvm_gpu_count.
+ * \param info - Returns the information, its size member must be set.
+ * \return GVM_OK, or GVM_ERR_INVALID / GVM_ERR_NOT_FOUND.
+ */
+GVM_EXPORT int gvm_gpu_info(const struct GvmContext* ctx, uint32_t index, struct GvmGpuInfo* info);
+
+/*! \brief Provisions the mdev types of a configuration.
+ *
+ * \sideeffect RM Side Effect: Creates the mdev types requested for the selected GPUs.
+ *
+ * \param ctx - Context to provision.
+ * \param path - Configuration file, or directory of configuration files.
+ * \return GVM_OK, GVM_ERR_INVALID if a configuration cannot be loaded, or GVM_ERR_NOT_FOUND /
+ *         GVM_ERR_STATE.
+ */
+GVM_EXPORT int gvm_provision(struct GvmContext* ctx, const char* path);
+
+/*! \brief Registers the provisioned mdev types with the kernel.
+ *
+ * \sideeffect RM Side Effect: Makes the mdev types available to the mdev core.
+ *
+ * \param ctx - Context to register.
+ * \return GVM_OK, or GVM_ERR_INVALID / GVM_ERR_STATE.
+ */
+GVM_EXPORT int gvm_register(struct GvmContext* ctx);
+
+/*! \brief Keeps instances of a mdev type ready on a GPU.
+ *
+ * The instances are created with their vGPU device open, ahead of the VMs started on them, and
+ * replaced in the background once taken. The first instances are created before returning.
+ *
+ * \sideeffect File System Side Effect: Creates mdev instances, removed when the context is
+ *                                      closed unless they were taken.
+ *
+ * \param ctx - Registered context.
+ * \param index - Index of the GPU, below gvm_gpu_count.
+ * \param type - Mdev type, e.g. nvidia-63.
+ * \param count - Instances kept ready, 0 stops creating them.
+ * \return GVM_OK, or GVM_ERR_INVALID / GVM_ERR_NOT_FOUND / GVM_ERR_STATE / GVM_ERR_MEMORY.
+ */
+GVM_EXPORT int gvm_pool_set(struct GvmContext* ctx, uint32_t index, const char* type, uint32_t count);
+
+/*! \brief Takes a ready instance of a mdev type on a GPU.
+ *
+ * The instance is reserved for the caller, who starts QEMU on the mdev with the returned UUID.
+ * The start of the VM then gets the already open vGPU device.
+ *
+ * \param ctx - Context whose pool is taken from.
+ * \param index - Index of the GPU, below gvm_gpu_count.
+ * \param type - Mdev type, e.g. nvidia-63.
+ * \param uuid - Returns the UUID of the mdev in its canonical text form.
+ * \return GVM_OK, GVM_ERR_NOT_FOUND if no instance is ready, or GVM_ERR_INVALID.
+ */
+GVM_EXPORT int gvm_pool_take(struct GvmContext* ctx, uint32_t index, const char* type, char uuid[GVM_UUID_SIZE]);
+
+/*! \brief Subscribes to the VM events of a context.
+ *
+ * The first subscription sets up the RM events, later ones replace the callback.
+ *
+ * \sideeffect RM Side Effect: Disables persistence mode and allocates the VM events.
+ *
+ * \param ctx - Context to subscribe to.
+ * \param callback - Callback receiving the events.
+ * \param user - User data passed to the callback.
+ * \return GVM_OK, or GVM_ERR_INVALID / GVM_ERR_RM.
+ */
+GVM_EXPORT int gvm_subscribe(struct GvmContext* ctx, GvmEventCallback callback, void* user);
+
+/*! \brief Waits for VM events and handles them.
+ *
+ * VM starts are handled before the subscriber is called, as are the exits of QEMU processes,
+ * whose vGPUs are released. Both events name the mediated device, GPU and QEMU process.
+ *
+ * \param ctx - Subscribed context.
+ * \param timeout_ms - Milliseconds to wait, -1 to wait forever, 0 to only poll.
+ * \return Number of handled events, GVM_ERR_INVALID / GVM_ERR_STATE, or -errno if waiting failed.
+ */
+GVM_EXPORT int gvm_dispatch(struct GvmContext* ctx, int timeout_ms);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
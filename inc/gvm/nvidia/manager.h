@@ -19,7 +19,10 @@
 #ifndef GVM_NVIDIA_MANAGER_H
 #define GVM_NVIDIA_MANAGER_H
 
+#include <stddef.h>
+
 #include <gpu/nvidia/resources.h>
+#include <gvm/nvidia/init.h>
 #include <gvm/vm_mgr.h>
 
 #ifdef __cplusplus
@@ -31,16 +34,44 @@ extern "C" {
  * This code initializes a NVIDIA VM manager object that will
  * help us in providing a VM manager command.
  *
- * \sideeffect RM Side Effect: Creates a start and a bind operation to the VM object.
+ * \sideeffect RM Side Effect: Creates a start and a bind event notifying a single file.
  *
  * \param mdevs - Root for all mdevs.
  * \return A VM manager object.
  */
 struct VmMgr init_nv_vm_mgr(struct NvMdev* mdevs);
 
-/*! \brief Handles a start request.
+/*! \brief Frees the RM events of a NVIDIA VM manager.
+ *
+ * \sideeffect RM Side Effect: Frees the start and bind events.
+ *
+ * \param mgr - Manager for the VM management system.
+ */
+void free_nv_vm_events(struct VmMgr* mgr);
+
+/*! \brief Number of each VM event read at once. */
+struct VmEvents {
+    uint32_t starts;            //!< Start requests.
+    uint32_t binds;             //!< Bind requests.
+};
+
+/*! \brief Reads the queued VM events.
+ *
+ * Called once the events fd, rm_event_hub_fd(mgr->events), is readable. Every start request
+ * must then be read with read_vm_start.
+ *
+ * \sideeffect RM Side Effect: Dequeues the events.
+ *
+ * \param mgr - Manager for the VM management system.
+ * \param events - Returns the number of each event.
+ * \return Number of events read.
+ */
+size_t read_vm_events(struct VmMgr* mgr, struct VmEvents* events);
+
+/*! \brief Handles the start requests.
  *
- * Handles a VM start request.
+ * Waits for the VM events and handles the start requests. Returns without handling a request
+ * if the wait is interrupted by a signal.
  *
  * \sideeffect VM Side Effect: Starts a VM.
  *
@@ -58,9 +89,69 @@ void handle_vm_start(struct VmMgr* mgr, struct NvMdev* mdev_mgr);
  *
  * \param mgr - Manager for the VM management system.
  * \param mdev_mgr - Manager for the mediated devices.
+ * \return If a start request was read.
+ */
+uint8_t start_vm(struct VmMgr* mgr, struct NvMdev* mdev_mgr);
+
+/*! \brief VM start request read from the RM. */
+struct VmStartRequest {
+    struct RmVmStartInfo info;  //!< Start request of the RM.
+    uint64_t requested_ns;      //!< CLOCK_MONOTONIC time the request was read.
+};
+
+/*! \brief Reads a pending VM start request.
+ *
+ * First half of start_vm, kept on the thread waiting for the start event so the request can
+ * be handed to the reactor of its GPU.
+ *
+ * \sideeffect RM Side Effect: Consumes the start request.
+ *
+ * \param mdev_mgr - Manager for the mediated devices.
+ * \param request - Returns the start request.
+ * \return If a start request was read.
+ */
+uint8_t read_vm_start(struct NvMdev* mdev_mgr, struct VmStartRequest* request);
+
+/*! \brief Starts the VM of a start request.
+ *
+ * Second half of start_vm. Safe to run concurrently for different VMs. The VM is identified
+ * by the UUID QEMU was started with, or a random one, and its session is added to the
+ * manager. A VM started on an instance of the warm pool of the manager gets its already open
+ * vGPU device.
+ *
+ * \sideeffect VM Side Effect: Starts a VM.
+ * \sideeffect State Side Effect: Adds the session of the VM, replacing a previous session of
+ *                                the same mediated device.
+ *
+ * \param mgr - Manager for the VM management system.
+ * \param mdev_mgr - Manager for the mediated devices.
+ * \param request - Start request read by read_vm_start.
  * \return Only performed for the side effects.
  */
-void start_vm(struct VmMgr* mgr, struct NvMdev* mdev_mgr);
+void start_vm_request(struct VmMgr* mgr, struct NvMdev* mdev_mgr, const struct VmStartRequest* request);
+
+/*! \brief Handles a start request read by drain_vm_events.
+ *
+ * \param request - Start request, only valid during the call.
+ * \param user - User data given to drain_vm_events.
+ */
+typedef void (*VmStartFn)(const struct VmStartRequest* request, void* user);
+
+/*! \brief Reads the queued VM events and the start requests they announce.
+ *
+ * Called once the events fd, rm_event_hub_fd(mgr->events), is readable. Every start request
+ * is read with read_vm_start and handed to start in the order of the events, a start event
+ * without a pending request is dropped.
+ *
+ * \sideeffect RM Side Effect: Dequeues the events and consumes the start requests.
+ *
+ * \param mgr - Manager for the VM management system.
+ * \param mdev_mgr - Manager for the mediated devices.
+ * \param start - Called for every start request read.
+ * \param user - User data given to start.
+ * \return Number of each event, starts only counts the requests handed to start.
+ */
+struct VmEvents drain_vm_events(struct VmMgr* mgr, struct NvMdev* mdev_mgr, VmStartFn start, void* user);
 
 #ifdef __cplusplus
 };
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef GVM_NVIDIA_REACTORS_H
+#define GVM_NVIDIA_REACTORS_H
+
+#include <gpu/nvidia/resources.h>
+
+#include <utils/reactor.h>
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! One reactor per NUMA node, shared by the GPUs of the node.
+#define NV_REACTORS_PER_NODE 0
+
+//! One reactor per GPU, pinned to the CPUs local to the GPU.
+#define NV_REACTORS_PER_GPU 1
+
+/*! \brief Reactors serving the GPUs of a manager.
+ *
+ * Work for a GPU is posted to the reactor of the GPU, whose thread runs on CPUs of the node
+ * the GPU is attached to. Only the work is placed: the state of the GPUs, their event file
+ * descriptors and their session tables are allocated by the manager on the main thread, and
+ * allocating them from the node of the GPU is out of scope.
+ */
+struct NvReactors {
+    uint8_t mode;               //!< NV_REACTORS_PER_NODE or NV_REACTORS_PER_GPU.
+    uint32_t size;              //!< Number of reactors.
+    int64_t* keys;              //!< NUMA node or RM GPU id served by every reactor.
+    struct Reactor** reactors;  //!< Reactors.
+};
+
+/*! \brief Creates the reactors for the GPUs of a manager.
+ *
+ * Reactors are pinned to the CPUs local to their GPUs, falling back to the CPUs of the NUMA
+ * node, and are left unpinned when the topology is unknown.
+ *
+ * \sideeffect Thread Side Effect: Spawns a thread per reactor.
+ *
+ * \param mgr - Manager of the GPUs.
+ * \param mode - NV_REACTORS_PER_NODE or NV_REACTORS_PER_GPU.
+ * \return The reactors, empty if none could be created.
+ */
+struct NvReactors create_nv_reactors(struct NvMdev* mgr, uint8_t mode);
+
+/*! \brief Finds the reactor of a GPU.
+ *
+ * GPUs without a reactor, such as GPUs added by hotplug, use a reactor of their NUMA node,
+ * or the first reactor.
+ *
+ * \param reactors - Reactors to search.
+ * \param mgr - Manager of the GPUs.
+ * \param gpu_id - RM id of the GPU.
+ * \return The reactor, NULL if there are no reactors.
+ */
+struct Reactor* nv_reactor_for_gpu(const struct NvReactors* reactors, const struct NvMdev* mgr, uint32_t gpu_id);
+
+/*! \brief Destroys the reactors.
+ *
+ * \sideeffect Thread Side Effect: Runs the pending work and joins the threads.
+ *
+ * \param reactors - Reactors to destroy.
+ */
+void free_nv_reactors(struct NvReactors* reactors);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef GVM_PLACEMENT_H
+#define GVM_PLACEMENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <gpu/mdev.h>
+
+#include <gvm/sessions.h>
+
+#include <utils/topology.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \brief Policies choosing the GPU of a new instance. */
+enum PlacementPolicy {
+    PLACEMENT_PACK,         //!< GPU with the least free framebuffer the instance fits in.
+    PLACEMENT_SPREAD,       //!< GPU with the most free framebuffer.
+    PLACEMENT_NUMA_FIRST    //!< Packs on the GPUs local to the CPUs of the VM, then anywhere.
+};
+
+/*! \brief Mdev type registered on a GPU. */
+struct PlacementType {
+    uint32_t num;           //!< Number of the mdev type.
+    uint32_t max_instances; //!< Most instances of the type on a GPU.
+    uint64_t fb_len;        //!< Framebuffer of an instance, in bytes.
+    uint64_t fb_res;        //!< Framebuffer reserved for an instance, in bytes.
+};
+
+/*! \brief Request for a new instance. */
+struct PlacementRequest {
+    uint32_t type;                  //!< Number of the mdev type.
+    enum PlacementPolicy policy;    //!< Policy choosing the GPU.
+    const struct CpuSet* cpus;      //!< CPUs the VM runs on, NULL if unknown.
+};
+
+/*! \brief Occupancy of a GPU. */
+struct PlacementGpuStats {
+    uint32_t gpu_id;        //!< RM id of the GPU.
+    int32_t numa_node;      //!< NUMA node of the GPU, -1 if unknown.
+    uint64_t fb_total;      //!< Framebuffer available to the instances, in bytes.
+    uint64_t fb_used;       //!< Framebuffer used by the instances, in bytes.
+    uint32_t instances;     //!< Instances on the GPU.
+};
+
+/*! \brief Placement engine for new vGPU instances.
+ *
+ * Chooses the GPU of a new instance from the types registered on the GPUs, their occupancy
+ * and their NUMA locality. The GPUs with room for a type are indexed by their free
+ * framebuffer, per type and per NUMA node, and the indexes are updated as instances are
+ * placed and released, so a placement is O(log GPUs). Safe to use from any thread.
+ */
+struct Placement;
+
+/*! \brief Creates a placement engine.
+ *
+ * \return The engine, NULL if it could not be allocated.
+ */
+struct Placement* placement_create(void);
+
+/*! \brief Frees a placement engine.
+ *
+ * \param engine - Engine to free, NULL is ignored.
+ */
+void placement_free(struct Placement* engine);
+
+/*! \brief Adds a GPU.
+ *
+ * \sideeffect File System Side Effect: Reads the CPUs of a NUMA node seen for the first time.
+ *
+ * \param engine - Engine to add to.
+ * \param gpu_id - RM id of the GPU.
+ * \param numa_node - NUMA node of the GPU, -1 if unknown.
+ * \param fb_total - Framebuffer available to the instances, in bytes.
+ * \return If the GPU was added, a GPU is only added once.
+ */
+uint8_t placement_add_gpu(struct Placement* engine, uint32_t gpu_id, int32_t numa_node, uint64_t fb_total);
+
+/*! \brief Registers a mdev type on a GPU.
+ *
+ * \param engine - Engine of the GPU.
+ * \param gpu_id - RM id of the GPU.
+ * \param type - Type, registering it again updates it.
+ * \return If the type was registered.
+ */
+uint8_t placement_add_type(struct Placement* engine, uint32_t gpu_id, const struct PlacementType* type);
+
+/*! \brief Registers the mdev types of a configuration on a GPU.
+ *
+ * \param engine - Engine of the GPU.
+ * \param gpu_id - RM id of the GPU.
+ * \param requests - Types of the configuration, their sizes in megabytes.
+ * \param count - Number of types.
+ * \return Number of types registered.
+ */
+size_t placement_add_requests(struct Placement* engine, uint32_t gpu_id, const struct MDevRequest* requests, size_t count);
+
+/*! \brief Sets the number of instances of a type on a GPU.
+ *
+ * \param engine - Engine of the GPU.
+ * \param gpu_id - RM id of the GPU.
+ * \param type - Number of the mdev type.
+ * \param instances - Instances of the type on the GPU.
+ * \return If the type is registered on the GPU and the instances fit.
+ */
+uint8_t placement_set_instances(struct Placement* engine, uint32_t gpu_id, uint32_t type, uint32_t instances);
+
+/*! \brief Sets the occupancy of the GPUs from the sessions of a VM manager.
+ *
+ * Each session counts one instance of its mdev type, sessions of an unknown type count for the
+ * type of a single type GPU. Instances placed since the last sync whose VM did not start yet are
+ * kept until released, each new session of the type is the start of one of them.
+ *
+ * \param engine - Engine of the GPUs.
+ * \param view - Sessions of the started VMs.
+ * \return Number of GPUs updated.
+ */
+uint32_t placement_sync_sessions(struct Placement* engine, const struct VmSessionView* view);
+
+/*! \brief Chooses the GPU of a new instance and reserves its framebuffer.
+ *
+ * \param engine - Engine to place with.
+ * \param request - Instance to place.
+ * \param gpu_id - Returns the RM id of the chosen GPU.
+ * \return If a GPU has room for the instance.
+ */
+uint8_t placement_place(struct Placement* engine, const struct PlacementRequest* request, uint32_t* gpu_id);
+
+/*! \brief Releases an instance.
+ *
+ * \param engine - Engine of the GPU.
+ * \param gpu_id - RM id of the GPU of the instance.
+ * \param type - Number of the mdev type of the instance.
+ * \return If the GPU had an instance of the type.
+ */
+uint8_t placement_release(struct Placement* engine, uint32_t gpu_id, uint32_t type);
+
+/*! \brief Gets the occupancy of a GPU.
+ *
+ * \param engine - Engine of the GPU.
+ * \param gpu_id - RM id of the GPU.
+ * \param stats - Returns the occupancy.
+ * \return If the GPU was added.
+ */
+uint8_t placement_gpu_stats(struct Placement* engine, uint32_t gpu_id, struct PlacementGpuStats* stats);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef GVM_POOL_H
+#define GVM_POOL_H
+
+#include <stdint.h>
+
+#include <utils/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! Longest mdev type name, e.g. nvidia-63.
+#define VGPU_POOL_TYPE 32
+
+//! Longest PCI address, e.g. 0000:01:00.0.
+#define VGPU_POOL_BDF 16
+
+/*! \brief Opens the vGPU device of an instance.
+ *
+ * \param minor - Minor of the /dev/nvidia-vgpu%d device.
+ * \return The open device, -1 on failure.
+ */
+typedef int (*VgpuOpenFn)(uint16_t minor);
+
+/*! \brief Instance kept by a warm pool. */
+struct VgpuInstance {
+    struct UUID uuid;               //!< UUID of the mdev, the one QEMU is started with.
+    char bdf[VGPU_POOL_BDF];        //!< PCI address of the GPU.
+    char type[VGPU_POOL_TYPE];      //!< Mdev type.
+    int32_t minor;                  //!< Minor of the vGPU device, -1 if not known yet.
+};
+
+/*! \brief Metrics of a warm pool. */
+struct VgpuPoolStats {
+    uint32_t ready;                 //!< Instances waiting to be handed out.
+    uint32_t opened;                //!< Waiting instances whose vGPU device is open.
+    uint32_t taken;                 //!< Instances handed out whose VM did not start yet.
+    uint64_t created;               //!< Instances created.
+    uint64_t claimed;               //!< VMs started on a pooled instance.
+    uint64_t warm_starts;           //!< VMs started on a pooled instance with an open device.
+    uint64_t failures;              //!< Instances that could not be created.
+};
+
+/*! \brief Warm pool of vGPU instances.
+ *
+ * Keeps a number of mdev instances of a type created on a GPU, through the
+ * mdev_supported_types/TYPE/create attribute of the GPU in sysfs, with their vGPU device open.
+ * A VM started on a pooled instance gets the open device instead of setting it up on its
+ * start, and the pool creates a replacement in the background. Safe to use from any thread.
+ *
+ * The vGPU minor of an instance is read from the nvidia/vgpu_minor attribute of the mdev.
+ * Instances whose minor is not known can still be started on, their device is opened on the
+ * start of their VM as without a pool.
+ */
+struct VgpuPool;
+
+/*! \brief Creates a warm pool.
+ *
+ * \param open - Opens the vGPU devices, NULL for nv_open_mdev.
+ * \return The pool, NULL if it could not be allocated.
+ */
+struct VgpuPool* vgpu_pool_create(VgpuOpenFn open);
+
+/*! \brief Frees a warm pool.
+ *
+ * Stops the refill thread and removes the instances that were never handed out.
+ *
+ * \sideeffect File System Side Effect: Removes the waiting mdev instances.
+ * \sideeffect Resource Side Effect: Closes the vGPU devices of the pool.
+ *
+ * \param pool - Pool to free, NULL is ignored.
+ */
+void vgpu_pool_free(struct VgpuPool* pool);
+
+/*! \brief Sets the number of instances kept ready for a type on a GPU.
+ *
+ * \param pool - Pool to configure.
+ * \param bdf - PCI address of the GPU, e.g. 0000:01:00.0.
+ * \param type - Mdev type, e.g. nvidia-63.
+ * \param target - Instances kept ready, 0 stops creating them.
+ * \return If the target was set.
+ */
+uint8_t vgpu_pool_add(struct VgpuPool* pool, const char* bdf, const char* type, uint32_t target);
+
+/*! \brief Sets a target written as TYPE@BDF=COUNT.
+ *
+ * \param pool - Pool to configure.
+ * \param spec - Target to parse, e.g. nvidia-63@0000:01:00.0=4.
+ * \return If the target is well formed and was set.
+ */
+uint8_t vgpu_pool_parse(struct VgpuPool* pool, const char* spec);
+
+/*! \brief Creates the missing instances and opens the devices not open yet.
+ *
+ * Types without available instances on their GPU are skipped.
+ *
+ * \sideeffect File System Side Effect: Creates mdev instances.
+ * \sideeffect Resource Side Effect: Opens vGPU devices.
+ *
+ * \param pool - Pool to fill.
+ * \return Number of instances created.
+ */
+uint32_t vgpu_pool_fill(struct VgpuPool* pool);
+
+/*! \brief Starts refilling the pool in the background.
+ *
+ * The refill thread fills the pool whenever an instance is taken or claimed, and every second
+ * for the devices that appeared late and the instances that could not be created.
+ *
+ * \sideeffect Thread Side Effect: Starts the refill thread.
+ *
+ * \param pool - Pool to refill.
+ * \return If the thread was started.
+ */
+uint8_t vgpu_pool_start(struct VgpuPool* pool);
+
+/*! \brief Hands out an instance to start a VM on.
+ *
+ * The instance is reserved for the caller, who starts QEMU with its UUID. The pool keeps the
+ * device of the instance open until the VM starts, then hands it to the session with
+ * vgpu_pool_claim.
+ *
+ * \param pool - Pool to take from.
+ * \param bdf - PCI address of the GPU.
+ * \param type - Mdev type.
+ * \param instance - Returns the instance.
+ * \return If an instance was ready.
+ */
+uint8_t vgpu_pool_take(struct VgpuPool* pool, const char* bdf, const char* type, struct VgpuInstance* instance);
+
+/*! \brief Claims the open device of the instance a VM started on.
+ *
+ * The instance leaves the pool whether it was handed out or not, a VM can be started on any
+ * pooled mdev by its UUID like on any other existing mdev.
+ *
+ * \param pool - Pool of the instance, NULL is allowed.
+ * \param uuid - UUID of the mdev of the VM.
+ * \param minor - Minor of the vGPU device of the VM.
+ * \return The open device, now owned by the caller, -1 if the instance is not pooled or its
+ *         device is not open.
+ */
+int vgpu_pool_claim(struct VgpuPool* pool, const struct UUID* uuid, uint16_t minor);
+
+/*! \brief Gets the metrics of a pool.
+ *
+ * \param pool - Pool to read.
+ * \param stats - Returns the metrics.
+ */
+void vgpu_pool_stats(struct VgpuPool* pool, struct VgpuPoolStats* stats);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
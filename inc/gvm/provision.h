@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef GVM_PROVISION_H
+#define GVM_PROVISION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <utils/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! Longest mdev type name, e.g. nvidia-63.
+#define PROVISION_TYPE 32
+
+//! Longest PCI address, e.g. 0000:01:00.0.
+#define PROVISION_BDF 16
+
+//! Most creates written at once.
+#define PROVISION_MAX_PARALLEL 64
+
+/*! \brief Instances wanted of a mdev type. */
+struct ProvisionRequest {
+    char type[PROVISION_TYPE];  //!< Mdev type, e.g. nvidia-63.
+    uint32_t count;             //!< Instances of the type wanted on the selected GPUs, existing
+                                //!< ones included.
+    const char* gpus;           //!< Comma separated PCI addresses of the GPUs, NULL or "all"
+                                //!< for every GPU supporting mediated devices.
+};
+
+/*! \brief Outcome of a create. */
+struct ProvisionResult {
+    char bdf[PROVISION_BDF];    //!< PCI address of the GPU.
+    char type[PROVISION_TYPE];  //!< Mdev type.
+    struct UUID uuid;           //!< UUID of the instance.
+    int error;                  //!< 0 if the instance was created, the errno otherwise.
+    uint64_t ns;                //!< Time the create took.
+};
+
+/*! \brief Instances of a type on a GPU. */
+struct ProvisionParent {
+    char bdf[PROVISION_BDF];    //!< PCI address of the GPU.
+    char type[PROVISION_TYPE];  //!< Mdev type.
+    uint32_t existing;          //!< Instances found before provisioning.
+    uint32_t available;         //!< Instances the GPU could still create before provisioning.
+    uint32_t created;           //!< Instances created.
+    uint32_t failed;            //!< Creates that failed.
+};
+
+/*! \brief Report of a provisioning. */
+struct ProvisionReport {
+    uint32_t parent_count;              //!< Number of GPU and type pairs.
+    struct ProvisionParent* parents;    //!< GPU and type pairs provisioned.
+    uint32_t result_count;              //!< Number of creates.
+    struct ProvisionResult* results;    //!< Creates, in the order they were planned.
+    uint32_t existing;                  //!< Instances found before provisioning.
+    uint32_t created;                   //!< Instances created.
+    uint32_t failed;                    //!< Creates that failed.
+    uint32_t shortfall;                 //!< Instances wanted the GPUs had no room for.
+    uint32_t max_in_flight;             //!< Most creates running at once.
+    uint64_t elapsed_ns;                //!< Time the creates took.
+    uint64_t slowest_ns;                //!< Time the slowest create took.
+};
+
+/*! \brief Parses a request written as TYPE=COUNT or TYPE=COUNT@GPUS.
+ *
+ * \param spec - Request to parse, e.g. nvidia-63=8@0000:01:00.0,0000:02:00.0, it must outlive
+ *               the request.
+ * \param request - Returns the request.
+ * \return If the request is well formed.
+ */
+uint8_t provision_parse(const char* spec, struct ProvisionRequest* request);
+
+/*! \brief Creates the missing mdev instances of a batch of requests.
+ *
+ * Only the instances missing from the count of a request are created, so provisioning twice
+ * creates nothing the second time. They are spread over the selected GPUs, the GPUs with the
+ * fewest instances of the type first, within the instances each GPU still has available.
+ *
+ * The directory of every type is opened once, the creates are then written relative to it
+ * by up to max_parallel threads at once, so a batch takes about as long as its slowest
+ * create.
+ *
+ * \sideeffect File System Side Effect: Creates mdev instances through sysfs.
+ * \sideeffect Thread Side Effect: Runs the creates on temporary threads.
+ *
+ * \param requests - Requests to provision.
+ * \param count - Number of requests.
+ * \param max_parallel - Most creates at once, 0 for PROVISION_MAX_PARALLEL.
+ * \param report - Returns the report, freed with provision_free_report.
+ * \return If every request could be planned, the report then tells which creates failed.
+ */
+uint8_t provision_mdevs(
+    const struct ProvisionRequest* requests,
+    size_t count,
+    uint32_t max_parallel,
+    struct ProvisionReport* report
+);
+
+/*! \brief Prints a provisioning report.
+ *
+ * \param report - Report to print.
+ * \param out - Stream to print to.
+ */
+void provision_print_report(const struct ProvisionReport* report, FILE* out);
+
+/*! \brief Frees a provisioning report.
+ *
+ * \param report - Report to free.
+ */
+void provision_free_report(struct ProvisionReport* report);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
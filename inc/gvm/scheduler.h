@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef GVM_SCHEDULER_H
+#define GVM_SCHEDULER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! Number of priority classes, class 0 is started first.
+#define VM_SCHED_CLASSES 4
+
+/*! \brief Starts a scheduled request.
+ *
+ * Called outside of the scheduler lock, vm_sched_done must be called once the start finished.
+ *
+ * \param gpu_id - RM id of the GPU of the request.
+ * \param data - Data of the request.
+ * \param user - Pointer given to vm_sched_pump.
+ */
+typedef void (*VmSchedDispatch)(uint32_t gpu_id, void* data, void* user);
+
+/*! \brief Metrics of a scheduler. */
+struct VmSchedStats {
+    uint32_t queued;                            //!< Requests waiting.
+    uint32_t queued_by_class[VM_SCHED_CLASSES]; //!< Requests waiting per priority class.
+    uint32_t max_queued;                        //!< Most requests ever waiting at once.
+    uint32_t in_flight;                         //!< Requests dispatched and not done.
+    uint32_t gpus;                              //!< GPUs with requests seen.
+    uint64_t submitted;                         //!< Requests submitted.
+    uint64_t dispatched;                        //!< Requests dispatched.
+    uint64_t completed;                         //!< Requests done.
+    uint64_t wait_ns_total;                     //!< Time the dispatched requests waited.
+    uint64_t wait_ns_max;                       //!< Longest time a request waited.
+};
+
+/*! \brief Scheduler of VM start requests.
+ *
+ * Requests are dispatched by priority class, round robin across the GPUs within a class, and
+ * never more than a fixed number at once per GPU. Safe to use from any thread.
+ */
+struct VmScheduler;
+
+/*! \brief Creates a scheduler.
+ *
+ * \param gpu_cap - Most requests dispatched at once per GPU, at least 1.
+ * \param default_class - Class of the requests no rule matches.
+ * \return The scheduler, NULL if it could not be allocated.
+ */
+struct VmScheduler* vm_sched_create(uint32_t gpu_cap, uint8_t default_class);
+
+/*! \brief Frees a scheduler.
+ *
+ * \param sched - Scheduler to free, NULL is ignored.
+ * \param discard - Called with the data of every request still waiting, may be NULL.
+ */
+void vm_sched_free(struct VmScheduler* sched, void (*discard)(void* data));
+
+/*! \brief Adds a priority rule.
+ *
+ * Rules are matched in the order they are added, the first one whose pattern appears in the
+ * VM configuration string gives the class.
+ *
+ * \param sched - Scheduler to configure.
+ * \param pattern - Text to find in the configuration string, e.g. "tier=gold".
+ * \param priority_class - Class of the matching requests.
+ * \return If the rule was added.
+ */
+uint8_t vm_sched_add_rule(struct VmScheduler* sched, const char* pattern, uint8_t priority_class);
+
+/*! \brief Adds a priority rule written as PATTERN=CLASS.
+ *
+ * The class follows the last '=', so patterns may contain '=' themselves.
+ *
+ * \param sched - Scheduler to configure.
+ * \param rule - Rule to parse, e.g. "tier=gold=0".
+ * \return If the rule is well formed and was added.
+ */
+uint8_t vm_sched_parse_rule(struct VmScheduler* sched, const char* rule);
+
+/*! \brief Classifies a VM configuration string.
+ *
+ * \param sched - Scheduler holding the rules.
+ * \param config - Configuration string of the start request.
+ * \return The priority class of the request.
+ */
+uint8_t vm_sched_class(struct VmScheduler* sched, const char* config);
+
+/*! \brief Queues a request.
+ *
+ * \param sched - Scheduler to queue on.
+ * \param gpu_id - RM id of the GPU of the request.
+ * \param priority_class - Priority class of the request.
+ * \param data - Data of the request, owned by the scheduler until dispatched.
+ * \return If the request was queued.
+ */
+uint8_t vm_sched_submit(struct VmScheduler* sched, uint32_t gpu_id, uint8_t priority_class, void* data);
+
+/*! \brief Takes the next request allowed to run.
+ *
+ * \param sched - Scheduler to take from.
+ * \param gpu_id - Returns the RM id of the GPU of the request.
+ * \param data - Returns the data of the request.
+ * \return If a request may run, the request then counts as in flight.
+ */
+uint8_t vm_sched_next(struct VmScheduler* sched, uint32_t* gpu_id, void** data);
+
+/*! \brief Marks a dispatched request as done.
+ *
+ * \param sched - Scheduler of the request.
+ * \param gpu_id - RM id of the GPU of the request.
+ */
+void vm_sched_done(struct VmScheduler* sched, uint32_t gpu_id);
+
+/*! \brief Dispatches every request allowed to run.
+ *
+ * \param sched - Scheduler to dispatch from.
+ * \param dispatch - Function starting a request.
+ * \param user - Pointer given to the function.
+ * \return Number of dispatched requests.
+ */
+size_t vm_sched_pump(struct VmScheduler* sched, VmSchedDispatch dispatch, void* user);
+
+/*! \brief Reads the metrics of a scheduler.
+ *
+ * \param sched - Scheduler to read.
+ * \param stats - Returns the metrics.
+ */
+void vm_sched_stats(struct VmScheduler* sched, struct VmSchedStats* stats);
+
+/*! \brief Counts the requests waiting for a GPU.
+ *
+ * \param sched - Scheduler to read.
+ * \param gpu_id - RM id of the GPU.
+ * \return Number of requests waiting for the GPU.
+ */
+uint32_t vm_sched_gpu_depth(struct VmScheduler* sched, uint32_t gpu_id);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
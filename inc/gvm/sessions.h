@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef GVM_SESSIONS_H
+#define GVM_SESSIONS_H
+
+#include <stdint.h>
+
+#include <gvm/vm_mgr.h>
+
+#include <utils/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \brief Session of a started VM.
+ *
+ * A session owns the vgpu file descriptor and the pidfd of its VM, they are released when the
+ * session is removed or replaced.
+ */
+struct VmSession {
+    struct UUID mdev;           //!< UUID of the mediated device of the VM.
+    struct UUID vm;             //!< UUID of the VM.
+    uint32_t gpu_id;            //!< RM id of the GPU backing the mediated device.
+    uint32_t qemu_pid;          //!< PID of the QEMU process running the VM.
+    uint16_t mdev_id;           //!< Minor of the /dev/nvidia-vgpu%d device.
+    uint32_t mdev_type;         //!< Number of the mdev type of the vGPU, 0 if unknown.
+    int mdev_fd;                //!< Open /dev/nvidia-vgpu%d device, -1 if none. Only the
+                                //!< writer releasing the session may use it.
+    int pid_fd;                 //!< Pidfd of the QEMU process, -1 if its exit is not watched.
+    uint64_t requested_ns;      //!< CLOCK_MONOTONIC time the start request was read.
+    uint64_t started_ns;        //!< CLOCK_MONOTONIC time the VM was started.
+    int64_t started_unix;       //!< Wall clock time the VM was started, in seconds.
+};
+
+/*! \brief Number of sessions of a GPU. */
+struct VmGpuLoad {
+    uint32_t gpu_id;            //!< RM id of the GPU.
+    uint32_t sessions;          //!< Number of sessions on the GPU.
+};
+
+/*! \brief Immutable snapshot of the sessions of a VM manager.
+ *
+ * Updates publish a new snapshot, the previous one is reclaimed once no reader can hold it
+ * anymore. Sessions are indexed by the UUID of their mediated device, and the watched ones by
+ * their pidfd, in open addressing tables.
+ */
+struct VmSessionView {
+    uint64_t generation;        //!< Number of snapshots published before this one.
+    uint32_t size;              //!< Number of sessions.
+    struct VmSession* sessions; //!< Sessions of the started VMs.
+    uint32_t capacity;          //!< Slots of the index, a power of two.
+    uint32_t* index;            //!< Session index + 1 per slot, 0 for an empty slot.
+    uint32_t* pid_index;        //!< Session index + 1 per slot by pidfd, 0 for an empty slot.
+    uint32_t gpu_count;         //!< Number of GPUs running sessions.
+    struct VmGpuLoad* loads;    //!< Sessions per GPU, sorted by GPU id.
+};
+
+/*! \brief Adds the session of a started VM.
+ *
+ * Replaces the session of the same mediated device if there is one, releasing it. The
+ * session owns its vgpu fd and pidfd once added.
+ *
+ * \sideeffect State Side Effect: Publishes a new snapshot and retires the previous one.
+ *
+ * \param mgr - VM manager owning the sessions.
+ * \param session - Session to add.
+ * \return If the session was added.
+ */
+uint8_t vm_add_session(struct VmMgr* mgr, const struct VmSession* session);
+
+/*! \brief Removes the session of a mediated device.
+ *
+ * \sideeffect State Side Effect: Publishes a new snapshot and retires the previous one.
+ * \sideeffect Resource Side Effect: Closes the fds of the session.
+ *
+ * \param mgr - VM manager owning the sessions.
+ * \param mdev - UUID of the mediated device.
+ * \return If a session was removed.
+ */
+uint8_t vm_remove_session(struct VmMgr* mgr, const struct UUID* mdev);
+
+/*! \brief Ends the session of a VM whose QEMU process exited.
+ *
+ * Leaves the session alone if the mediated device was started again by another process.
+ *
+ * \sideeffect State Side Effect: Publishes a new snapshot and retires the previous one.
+ * \sideeffect Resource Side Effect: Closes the fds of the session.
+ *
+ * \param mgr - VM manager owning the sessions.
+ * \param mdev - UUID of the mediated device.
+ * \param qemu_pid - PID of the exited QEMU process.
+ * \return If a session was ended.
+ */
+uint8_t vm_end_session(struct VmMgr* mgr, const struct UUID* mdev, uint32_t qemu_pid);
+
+/*! \brief Reads the published sessions of a VM manager.
+ *
+ * Never blocks, the snapshot is immutable and stays valid until the epoch critical section is
+ * left.
+ *
+ * \restriction Must be called inside an epoch critical section.
+ *
+ * \param mgr - VM manager to read.
+ * \return The snapshot, NULL if no session was ever added.
+ */
+const struct VmSessionView* vm_sessions(const struct VmMgr* mgr);
+
+/*! \brief Finds the session of a mediated device in a snapshot.
+ *
+ * Runs in constant time through the index of the snapshot.
+ *
+ * \param view - Snapshot to search, may be NULL.
+ * \param mdev - UUID of the mediated device.
+ * \return The session, NULL if the mediated device has none.
+ */
+const struct VmSession* vm_find_session(const struct VmSessionView* view, const struct UUID* mdev);
+
+/*! \brief Finds the session whose QEMU exit is watched by a pidfd in a snapshot.
+ *
+ * Runs in constant time through the pidfd index of the snapshot.
+ *
+ * \param view - Snapshot to search, may be NULL.
+ * \param pid_fd - Pidfd of the QEMU process.
+ * \return The session, NULL if no session is watched by the pidfd.
+ */
+const struct VmSession* vm_find_watched(const struct VmSessionView* view, int pid_fd);
+
+/*! \brief Counts the sessions running on a GPU.
+ *
+ * \param view - Snapshot to search, may be NULL.
+ * \param gpu_id - RM id of the GPU.
+ * \return Number of sessions on the GPU.
+ */
+uint32_t vm_gpu_sessions(const struct VmSessionView* view, uint32_t gpu_id);
+
+/*! \brief Finds the UUID QEMU was started with.
+ *
+ * \sideeffect File System Side Effect: Reads /proc/<pid>/cmdline.
+ *
+ * \param pid - PID of the QEMU process.
+ * \param uuid - Returns the value of its -uuid option.
+ * \return If QEMU was started with a UUID.
+ */
+uint8_t vm_qemu_uuid(uint32_t pid, struct UUID* uuid);
+
+/*! \brief Finds the mdev type of a mediated device.
+ *
+ * \sideeffect File System Side Effect: Reads the mdev_type link of the device in sysfs.
+ *
+ * \param mdev - UUID of the mediated device.
+ * \param type - Returns the number of its nvidia-<num> type.
+ * \return If the device has an NVIDIA mdev type.
+ */
+uint8_t vm_mdev_type(const struct UUID* mdev, uint32_t* type);
+
+/*! \brief Releases the sessions of a VM manager.
+ *
+ * \sideeffect State Side Effect: Retires the published snapshot.
+ * \sideeffect Resource Side Effect: Closes the fds of the sessions.
+ *
+ * \param mgr - VM manager owning the sessions.
+ */
+void vm_free_sessions(struct VmMgr* mgr);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
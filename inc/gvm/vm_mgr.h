@@ -25,16 +25,25 @@
 extern "C" {
 #endif
 
+struct RmEventHub;
+struct VgpuPool;
+struct VmSessionView;
+
 /*! \brief Structure for VM management.
  *
  * This structure is used as an intermediate object
  * for getting information from a VM when opened.
  */
 struct VmMgr {
-    int event_start;            //!< Event start fd.
-    int event_bind;             //!< Event bind fd.
+    struct RmEventHub* events;  //!< RM events of the VMs, NULL if they could not be set up.
+    uint32_t start_event;       //!< Handle of the start event in events.
+    uint32_t bind_event;        //!< Handle of the bind event in events.
     uint32_t root;              //!< Root of the VM manager.
-    int mdev_fd;                //!< MDEV file descriptor.
+    int exit_fd;                //!< Epoll instance watching the QEMU processes, -1 if none.
+    struct VmSessionView* sessions; //!< Published sessions of the started VMs, read
+                                    //!< with vm_sessions.
+    struct VgpuPool* pool;      //!< Warm pool handing open vGPU devices to the starts, NULL
+                                //!< if none. Owned by the caller.
 };
 
 #ifdef __cplusplus
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef UTILS_ARENA_H
+#define UTILS_ARENA_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \brief Single block of arena memory.
+ *
+ * Arena blocks are chained together, every allocation out of the arena is
+ * carved from the tail of the newest block.
+ */
+struct ArenaBlock {
+    struct ArenaBlock* prev;    //!< Previously filled block.
+    size_t used;                //!< Bytes used in this block.
+    size_t size;                //!< Bytes available in this block.
+    char data[];                //!< Memory handed out by the arena.
+};
+
+/*! \brief Bump allocator owning a group of objects.
+ *
+ * Objects allocated from an arena are never freed individually, the arena
+ * releases all of them in one call.
+ */
+struct Arena {
+    struct ArenaBlock* head;    //!< Block currently being filled.
+    size_t block_size;          //!< Default size of a new block.
+};
+
+/*! \brief Creates an arena.
+ *
+ * Allocates a new arena which hands out memory in blocks of at least the
+ * requested size.
+ *
+ * \param block_size - Default size of a block, 0 to use the default size.
+ * \return A new arena, or NULL in a case of a failure.
+ */
+struct Arena* arena_create(size_t block_size);
+
+/*! \brief Allocates memory out of the arena.
+ *
+ * Allocates zeroed memory out of the arena, aligned for any type.
+ *
+ * \param arena - Arena to allocate from.
+ * \param size - Size of the memory to allocate.
+ * \return Pointer to the memory, or NULL in a case of a failure.
+ */
+void* arena_alloc(struct Arena* arena, size_t size);
+
+/*! \brief Duplicates a string into the arena.
+ *
+ * \param arena - Arena to allocate from.
+ * \param str - String to copy.
+ * \return Copy of the string owned by the arena, or NULL in a case of a failure.
+ */
+char* arena_strdup(struct Arena* arena, const char* str);
+
+/*! \brief Frees an arena.
+ *
+ * Releases every object allocated from the arena and the arena itself.
+ *
+ * \param arena - Arena to free, NULL is ignored.
+ */
+void arena_free(struct Arena* arena);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
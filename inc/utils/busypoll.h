@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef UTILS_BUSYPOLL_H
+#define UTILS_BUSYPOLL_H
+
+#include <poll.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! Shortest spin an adaptive poller keeps, so it can notice events getting frequent again.
+#define BUSY_POLL_MIN_NS 1000
+
+/*! \brief Adaptive busy poller.
+ *
+ * Spins on non-blocking polls with an exponential backoff before blocking in the kernel. The
+ * spin budget doubles when an event is caught while spinning or right after blocking, and
+ * halves when the spin expires idle, so idle loops converge to blocking immediately.
+ */
+struct BusyPoll {
+    uint64_t max_ns;            //!< Longest spin, 0 to always block.
+    uint64_t budget_ns;         //!< Current spin, between BUSY_POLL_MIN_NS and max_ns.
+    uint64_t spin_hits;         //!< Waits served while spinning.
+    uint64_t blocks;            //!< Waits that blocked in the kernel.
+};
+
+/*! \brief Initializes an adaptive busy poller.
+ *
+ * \param poller - Poller to initialize.
+ * \param max_ns - Longest spin, 0 to always block.
+ */
+void busy_poll_init(struct BusyPoll* poller, uint64_t max_ns);
+
+/*! \brief Waits for events like poll, spinning first.
+ *
+ * \param poller - Poller adapting the spin.
+ * \param fds - File descriptors to wait on, negative fds are ignored.
+ * \param count - Number of file descriptors.
+ * \param timeout_ms - Milliseconds to wait, spin included, -1 to wait forever.
+ * \return As poll, the number of ready file descriptors, 0 on timeout or -1 on error.
+ */
+int busy_poll(struct BusyPoll* poller, struct pollfd* fds, nfds_t count, int timeout_ms);
+
+/*! \brief Runs the calling thread with the SCHED_FIFO policy.
+ *
+ * \sideeffect Thread Side Effect: Changes the scheduling policy of the calling thread.
+ *
+ * \restriction A real time thread that spins without bound starves the other threads of its
+ *              CPU, so the busy poller must keep a finite spin.
+ *
+ * \param priority - Real time priority, 1 to 99.
+ * \return If the policy was changed, which requires CAP_SYS_NICE.
+ */
+uint8_t thread_set_fifo(int priority);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef UTILS_CLOCK_H
+#define UTILS_CLOCK_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \brief Gets the monotonic time in nanoseconds.
+ *
+ * The time is only meaningful relative to another reading, it is used for latencies and
+ * deadlines.
+ */
+uint64_t clock_now_ns(void);
+
+/*! \brief Gets the monotonic time in milliseconds. */
+uint64_t clock_now_ms(void);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
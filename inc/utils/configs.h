@@ -21,6 +21,9 @@
 
 #include <gpu/mdev.h>
 
+#include <utils/arena.h>
+
+#include <stdint.h>
 #include <stdlib.h>
 
 #ifdef __cplusplus
@@ -41,10 +44,40 @@ struct GpuConfig {
 /*! \brief Structure to provide a list of GPU configurations.
  *
  * This provides the GPU Configurations as well as a size of GPU configs.
+ * Every configuration, gpu, request, display and string is owned by the arena.
  */
 struct GpuConfigs {
     struct GpuConfig* configs;     //!< List of configurations.
     size_t config_size;            //!< Size of the configuration list.
+    struct Arena* arena;           //!< Arena owning the configurations.
+};
+
+/*! \brief Configurations targeting a single vendor/device pair.
+ *
+ * Entry of a configuration catalog.
+ */
+struct ConfigCatalogEntry {
+    uint32_t vendor_id;            //!< Vendor id of the targeted gpus.
+    uint32_t device_id;            //!< Device id of the targeted gpus.
+    struct GpuConfig** configs;    //!< Configurations targeting the gpus, in load order.
+    size_t size;                   //!< Number of configurations.
+};
+
+/*! \brief Catalog of configurations loaded from a config directory.
+ *
+ * Every configuration of every file is indexed by the vendor/device ids of its gpu selectors,
+ * a selector naming no vendor id targets an NVIDIA device. Configurations with a selector that
+ * does not name a device id are generic, and are only used by gpus which no configuration
+ * targeting their device id matches.
+ */
+struct ConfigCatalog {
+    struct GpuConfigs* files;            //!< Parsed files, in name order.
+    size_t file_size;                    //!< Number of parsed files.
+    struct ConfigCatalogEntry* entries;  //!< Entries, sorted by vendor/device id.
+    size_t entry_size;                   //!< Number of entries.
+    struct GpuConfig** generic;          //!< Generic configurations, in load order.
+    size_t generic_size;                 //!< Number of generic configurations.
+    struct Arena* arena;                 //!< Arena owning the catalog index.
 };
 
 /*! \brief Parses a config file.
@@ -52,10 +85,52 @@ struct GpuConfigs {
  * This code parses a config file and produces a GpuConfig object.
  *
  * \param name - Name of the config file.
- * \return A gpu config file, which tells us what mdevs to create.
+ * \return A gpu config file, which tells us what mdevs to create. Its arena is NULL if the
+ *         file could not be read, is not valid TOML or misses a required key.
  */
 struct GpuConfigs get_configs(const char* name);
 
+/*! \brief Frees a parsed config.
+ *
+ * Releases every object owned by the configuration in a single call.
+ *
+ * \param configs - Configurations to free.
+ */
+void free_configs(struct GpuConfigs* configs);
+
+/*! \brief Loads a configuration catalog.
+ *
+ * Parses every *.toml file of a config directory concurrently, or a single config file, and
+ * indexes the configurations by vendor/device id.
+ *
+ * \sideeffect Thread Side Effect: Spawns threads to parse the files of a directory.
+ *
+ * \param path - Path of a config directory or a config file.
+ * \return A catalog of configurations. It is empty and its arena is NULL if the path could
+ *         not be opened or one of its files could not be loaded.
+ */
+struct ConfigCatalog get_config_catalog(const char* path);
+
+/*! \brief Finds the configuration of a gpu.
+ *
+ * A gpu gets a single configuration, the one whose matching selector sets the most fields,
+ * the first loaded one on a tie. Configurations targeting the vendor/device id of the gpu are
+ * searched first, the generic configurations only when none of them matches.
+ *
+ * \param catalog - Catalog to search.
+ * \param gpu - Gpu to find the configuration for.
+ * \return The configuration, NULL if no configuration matches the gpu.
+ */
+const struct GpuConfig* config_catalog_lookup(const struct ConfigCatalog* catalog, const struct Gpu* gpu);
+
+/*! \brief Frees a configuration catalog.
+ *
+ * Releases every parsed file and the catalog index.
+ *
+ * \param catalog - Catalog to free.
+ */
+void free_config_catalog(struct ConfigCatalog* catalog);
+
 #ifdef __cplusplus
 };
 #endif
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef UTILS_EPOCH_H
+#define UTILS_EPOCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \brief Enters an epoch critical section.
+ *
+ * Memory retired while a thread is inside a critical section is not reclaimed until the
+ * thread leaves it, so shared nodes read inside the section stay valid. Critical sections
+ * nest.
+ *
+ * \sideeffect State Side Effect: Registers the calling thread on its first call.
+ */
+void epoch_enter(void);
+
+/*! \brief Leaves an epoch critical section.
+ *
+ * \restriction Must be paired with a previous call to epoch_enter on the same thread.
+ */
+void epoch_exit(void);
+
+/*! \brief Retires memory which is no longer reachable from shared structures.
+ *
+ * The destructor is called once no thread can still be inside a critical section that
+ * started before the memory was retired.
+ *
+ * \sideeffect State Side Effect: May reclaim previously retired memory.
+ *
+ * \param ptr - Unlinked memory, NULL is ignored.
+ * \param destructor - Function releasing the memory.
+ */
+void epoch_retire(void* ptr, void (*destructor)(void*));
+
+/*! \brief Reclaims the retired memory that is safe to release.
+ *
+ * Never blocks, memory still protected by a critical section is kept for a later call.
+ */
+void epoch_reclaim(void);
+
+/*! \brief Waits until all retired memory has been reclaimed.
+ *
+ * \restriction Must not be called from inside a critical section.
+ */
+void epoch_barrier(void);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef UTILS_REACTOR_H
+#define UTILS_REACTOR_H
+
+#include <stdint.h>
+
+#include <utils/topology.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \brief Task run on a reactor thread.
+ *
+ * \param user - Pointer given with the task.
+ */
+typedef void (*ReactorFn)(void* user);
+
+/*! \brief Handler of a file descriptor watched by a reactor.
+ *
+ * \param fd - Ready file descriptor.
+ * \param events - Ready epoll events.
+ * \param user - Pointer given with the file descriptor.
+ */
+typedef void (*ReactorHandler)(int fd, uint32_t events, void* user);
+
+/*! \brief Event loop running on its own thread. */
+struct Reactor;
+
+/*! \brief Creates a reactor.
+ *
+ * The thread of the reactor pins itself to the CPUs before it creates its epoll instance and
+ * runs any task. Only the thread is placed, the memory given to its tasks and handlers is
+ * allocated by their callers and stays wherever it was first touched.
+ *
+ * \sideeffect Thread Side Effect: Spawns the thread of the reactor.
+ *
+ * \param node - NUMA node the reactor serves, -1 if unknown.
+ * \param cpus - CPUs to pin the thread to, NULL to leave it unpinned.
+ * \return The reactor, or NULL if it could not be created.
+ */
+struct Reactor* reactor_create(int32_t node, const struct CpuSet* cpus);
+
+/*! \brief Destroys a reactor.
+ *
+ * Tasks posted before the call are run, then the thread is joined. Watched file descriptors
+ * are not closed.
+ *
+ * \restriction Must not be called from the thread of the reactor.
+ *
+ * \param reactor - Reactor to destroy, NULL is ignored.
+ */
+void reactor_destroy(struct Reactor* reactor);
+
+/*! \brief Runs a task on the thread of a reactor.
+ *
+ * Tasks run in the order they are posted.
+ *
+ * \restriction Tasks posted once reactor_destroy returned never run.
+ *
+ * \param reactor - Reactor to run the task on.
+ * \param fn - Task.
+ * \param user - Pointer given to the task.
+ * \return If the task was queued.
+ */
+uint8_t reactor_post(struct Reactor* reactor, ReactorFn fn, void* user);
+
+/*! \brief Runs a task on the thread of a reactor and waits for it.
+ *
+ * Runs the task immediately when called from the thread of the reactor.
+ *
+ * \restriction The reactor must not be destroyed while waiting.
+ *
+ * \param reactor - Reactor to run the task on.
+ * \param fn - Task.
+ * \param user - Pointer given to the task.
+ * \return If the task ran.
+ */
+uint8_t reactor_call(struct Reactor* reactor, ReactorFn fn, void* user);
+
+/*! \brief Watches a file descriptor.
+ *
+ * \param reactor - Reactor calling the handler.
+ * \param fd - File descriptor to watch.
+ * \param events - Epoll events to wait for.
+ * \param handler - Handler called on the thread of the reactor when the fd is ready.
+ * \param user - Pointer given to the handler.
+ * \return If the file descriptor is watched.
+ */
+uint8_t reactor_add_fd(struct Reactor* reactor, int fd, uint32_t events, ReactorHandler handler, void* user);
+
+/*! \brief Stops watching a file descriptor.
+ *
+ * The handler is not called anymore once this returns, it may remove its own file descriptor.
+ *
+ * \param reactor - Reactor watching the fd.
+ * \param fd - File descriptor to stop watching.
+ */
+void reactor_remove_fd(struct Reactor* reactor, int fd);
+
+/*! \brief Gets the NUMA node a reactor serves.
+ *
+ * \param reactor - Reactor to check.
+ * \return The NUMA node, -1 if unknown.
+ */
+int32_t reactor_node(const struct Reactor* reactor);
+
+/*! \brief Checks if the thread of a reactor is pinned.
+ *
+ * \param reactor - Reactor to check.
+ * \return If the thread runs on the CPUs it was created with.
+ */
+uint8_t reactor_pinned(const struct Reactor* reactor);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef UTILS_SYSFS_H
+#define UTILS_SYSFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \brief Gets the sysfs root.
+ *
+ * All sysfs paths used by the suite are relative to this root, which defaults to /sys.
+ *
+ * \return The sysfs root.
+ */
+const char* get_sysfs_root(void);
+
+/*! \brief Sets the sysfs root.
+ *
+ * Allows the sysfs tree to be replaced with a fixture directory.
+ *
+ * \restriction This function is not thread safe, it should be called before any threads
+ *              read from sysfs.
+ *
+ * \param root - New sysfs root, NULL restores /sys.
+ */
+void set_sysfs_root(const char* root);
+
+/*! \brief Builds a path inside sysfs.
+ *
+ * \param buffer - Buffer for the path.
+ * \param size - Size of the buffer.
+ * \param fmt - Format of the path relative to the sysfs root, without a leading /.
+ * \return The number of characters written, or -1 if the path does not fit.
+ */
+int sysfs_path(char* buffer, size_t size, const char* fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/*! \brief Reads an integer from a sysfs attribute.
+ *
+ * Decimal, octal and hexadecimal (0x prefixed) values are accepted.
+ *
+ * \sideeffect File System Side Effect: Reads a sysfs attribute.
+ *
+ * \param value - Returns the value of the attribute.
+ * \param fmt - Format of the attribute path relative to the sysfs root.
+ * \return 1 if the attribute was read, 0 otherwise.
+ */
+uint8_t sysfs_read_u32(uint32_t* value, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/*! \brief Reads the first line of a sysfs attribute.
+ *
+ * The trailing newline is removed.
+ *
+ * \sideeffect File System Side Effect: Reads a sysfs attribute.
+ *
+ * \param value - Buffer for the line.
+ * \param size - Size of the buffer.
+ * \param fmt - Format of the attribute path relative to the sysfs root.
+ * \return 1 if the attribute was read, 0 otherwise.
+ */
+uint8_t sysfs_read_str(char* value, size_t size, const char* fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/*! \brief Reads the name of the file a sysfs link points to.
+ *
+ * Only the last component of the target is returned, e.g. nvidia-63 for the mdev_type link
+ * of a mediated device.
+ *
+ * \sideeffect File System Side Effect: Reads a sysfs link.
+ *
+ * \param value - Buffer for the name.
+ * \param size - Size of the buffer.
+ * \param fmt - Format of the link path relative to the sysfs root.
+ * \return 1 if the link was read and its name fits the buffer, 0 otherwise.
+ */
+uint8_t sysfs_read_link(char* value, size_t size, const char* fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/*! \brief Writes a value to a sysfs attribute.
+ *
+ * The attribute is opened for appending, sysfs attributes ignore the offset and a fixture
+ * file keeps every value written to it.
+ *
+ * \sideeffect File System Side Effect: Writes a sysfs attribute, e.g. creating a device.
+ *
+ * \param value - Value to write.
+ * \param fmt - Format of the attribute path relative to the sysfs root.
+ * \return 1 if the whole value was written, 0 otherwise.
+ */
+uint8_t sysfs_write_str(const char* value, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef UTILS_TOPOLOGY_H
+#define UTILS_TOPOLOGY_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! Number of CPUs a CpuSet can hold.
+#define CPU_SET_MAX 1024
+
+/*! \brief Set of CPUs.
+ *
+ * Kept independent of cpu_set_t so headers do not depend on _GNU_SOURCE.
+ */
+struct CpuSet {
+    uint64_t bits[CPU_SET_MAX / 64];  //!< One bit per CPU.
+};
+
+/*! \brief Parses a CPU list.
+ *
+ * Lists are the ones of sysfs, comma separated CPUs and inclusive ranges, e.g. 0-3,8,10-11.
+ *
+ * \param list - List to parse, a trailing newline is accepted.
+ * \param set - Returns the CPUs of the list.
+ * \return If the list is well formed and every CPU fits the set.
+ */
+uint8_t cpulist_parse(const char* list, struct CpuSet* set);
+
+/*! \brief Counts the CPUs of a set.
+ *
+ * \param set - Set to count.
+ * \return Number of CPUs in the set.
+ */
+uint32_t cpuset_count(const struct CpuSet* set);
+
+/*! \brief Checks if a CPU is in a set.
+ *
+ * \param set - Set to check.
+ * \param cpu - CPU to find.
+ * \return If the CPU is in the set.
+ */
+static inline uint8_t cpuset_test(const struct CpuSet* set, uint32_t cpu)
+{
+    return cpu < CPU_SET_MAX && (set->bits[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+/*! \brief Pins the calling thread to a set of CPUs.
+ *
+ * \sideeffect Thread Side Effect: Changes the affinity of the calling thread.
+ *
+ * \param set - CPUs the thread may run on.
+ * \return If the affinity was changed.
+ */
+uint8_t cpuset_pin_thread(const struct CpuSet* set);
+
+/*! \brief Gets the NUMA node of a PCI device.
+ *
+ * \sideeffect File System Side Effect: Reads bus/pci/devices/.../numa_node from sysfs.
+ *
+ * \param domain - PCI domain.
+ * \param bus - PCI bus.
+ * \param slot - PCI slot.
+ * \param function - PCI function.
+ * \return The NUMA node, or -1 if the device is not attached to a node.
+ */
+int32_t pci_numa_node(uint32_t domain, uint32_t bus, uint32_t slot, uint32_t function);
+
+/*! \brief Gets the CPUs local to a PCI device.
+ *
+ * \sideeffect File System Side Effect: Reads bus/pci/devices/.../local_cpulist from sysfs.
+ *
+ * \param domain - PCI domain.
+ * \param bus - PCI bus.
+ * \param slot - PCI slot.
+ * \param function - PCI function.
+ * \param set - Returns the local CPUs.
+ * \return If the local CPUs were read and at least one CPU is local.
+ */
+uint8_t pci_local_cpus(uint32_t domain, uint32_t bus, uint32_t slot, uint32_t function, struct CpuSet* set);
+
+/*! \brief Gets the CPUs of a NUMA node.
+ *
+ * \sideeffect File System Side Effect: Reads devices/system/node/node%d/cpulist from sysfs.
+ *
+ * \param node - NUMA node.
+ * \param set - Returns the CPUs of the node.
+ * \return If the CPUs were read and the node has at least one CPU.
+ */
+uint8_t numa_node_cpus(int32_t node, struct CpuSet* set);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
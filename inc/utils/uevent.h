@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef UTILS_UEVENT_H
+#define UTILS_UEVENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \brief Kernel object event.
+ *
+ * Fields of a uevent broadcast by the kernel when a device is added, removed, bound to a
+ * driver or unbound from it. Missing fields are empty.
+ */
+struct Uevent {
+    char action[16];            //!< Action, e.g. add, remove, bind or unbind.
+    char subsystem[32];         //!< Subsystem of the device, e.g. pci.
+    char driver[32];            //!< Driver bound to the device.
+    char devpath[256];          //!< Path of the device relative to /sys.
+    uint64_t seqnum;            //!< Sequence number of the event.
+    uint8_t has_slot;           //!< If the PCI address below was given.
+    uint32_t domain;            //!< PCI domain of the device.
+    uint32_t bus;               //!< PCI bus of the device.
+    uint32_t slot;              //!< PCI slot of the device.
+    uint32_t function;          //!< PCI function of the device.
+};
+
+/*! \brief Opens a socket receiving the uevents of the kernel.
+ *
+ * \sideeffect File System Side Effect: Opens a non blocking netlink socket.
+ *
+ * \return The socket, or -1 if it could not be opened.
+ */
+int uevent_open(void);
+
+/*! \brief Parses a uevent message.
+ *
+ * Messages are the ones broadcast by the kernel, a header of the form action\@devpath followed
+ * by NUL separated KEY=VALUE pairs. Messages rebroadcast by udev are rejected.
+ *
+ * \param buf - Message to parse.
+ * \param size - Size of the message.
+ * \param event - Returns the parsed event.
+ * \return If the message is a kernel uevent.
+ */
+uint8_t uevent_parse(const char* buf, size_t size, struct Uevent* event);
+
+/*! \brief Receives a uevent.
+ *
+ * Works on the socket of uevent_open or on any datagram socket delivering uevent messages,
+ * e.g. a socket pair in tests. Netlink messages which do not come from the kernel and
+ * malformed messages are skipped.
+ *
+ * \param fd - Socket to receive from.
+ * \param event - Returns the received event.
+ * \return 1 if an event was received, 0 if no event is pending, -1 on failure.
+ */
+int uevent_recv(int fd, struct Uevent* event);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef UTILS_UUID_H
+#define UTILS_UUID_H
+
+#include <stdint.h>
+
+#include <utils/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! Length of a UUID in its canonical text form, without the terminator.
+#define UUID_STR_LEN 36
+
+/*! \brief Parses a UUID in its canonical text form.
+ *
+ * \param str - Text of the UUID, e.g. 1ef6679d-e5ee-1aea-cafd-56470fbb851e.
+ * \param uuid - Returns the UUID.
+ * \return If the text is a well formed UUID, trailing characters are ignored.
+ */
+uint8_t uuid_parse(const char* str, struct UUID* uuid);
+
+/*! \brief Formats a UUID in its canonical lower case text form.
+ *
+ * \param uuid - UUID to format.
+ * \param str - Buffer of at least UUID_STR_LEN + 1 characters for the text.
+ */
+void uuid_format(const struct UUID* uuid, char* str);
+
+/*! \brief Generates a random (version 4) UUID.
+ *
+ * \sideeffect Entropy Side Effect: Reads from the kernel random number generator.
+ *
+ * \param uuid - Returns the UUID.
+ * \return If enough entropy could be read.
+ */
+uint8_t uuid_generate(struct UUID* uuid);
+
+/*! \brief Compares two UUIDs.
+ *
+ * \param first - First UUID.
+ * \param second - Second UUID.
+ * \return If the UUIDs are equal.
+ */
+uint8_t uuid_equal(const struct UUID* first, const struct UUID* second);
+
+/*! \brief Hashes a UUID.
+ *
+ * \param uuid - UUID to hash.
+ * \return Hash mixing every bit of the UUID.
+ */
+uint64_t uuid_hash(const struct UUID* uuid);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -17,12 +17,17 @@
  *
  */
 #include <iostream>
+#include <vector>
 
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <cargs.h>
 
 #include <gpu/nvidia/manager.h>
+#include <gpu/plan.h>
+
+#include <gvm/provision.h>
 
 #include <utils/configs.h>
 
@@ -40,6 +45,13 @@ using std::cout;
  * now we only allow the creation of NVIDIA mediated devices, future plans
  * are in the works to provide us the ability to create mediated devices
  * on multiple GPU vendors.
+ *
+ * Once the mediated device types are registered, instances of them can be provisioned in
+ * bulk. Only the instances missing from the requested count are created, concurrently across
+ * the GPUs, and a report lists every created UUID.
+ *
+ * When the memory of the GPU models is given, the configuration is checked against it first,
+ * and no mediated device type is added if a type does not fit its GPU. See \ref gvm-plan.
  */
 
 static struct cag_option options[] = {
@@ -48,7 +60,42 @@ static struct cag_option options[] = {
 .access_letters = "c",
 .access_name = "config",
 .value_name = "CONFIG",
-.description = "Configuration file to use."
+.description = "Configuration file or directory to use."
+},
+{
+.identifier = 'l',
+.access_letters = "l",
+.access_name = "lazy",
+.value_name = NULL,
+.description = "Only attach the GPUs targeted by the configuration."
+},
+{
+.identifier = 's',
+.access_letters = "s",
+.access_name = "shard",
+.value_name = NULL,
+.description = "Use a separate RM client for every GPU."
+},
+{
+.identifier = 'g',
+.access_letters = "g",
+.access_name = "gpu-memory",
+.value_name = "[VENDOR:]DEVICE=FB:BAR1",
+.description = "Framebuffer and BAR1 sizes in MB of a GPU model to check the configuration against before adding its types. Repeatable."
+},
+{
+.identifier = 'P',
+.access_letters = "P",
+.access_name = "provision",
+.value_name = "TYPE=COUNT[@GPUS]",
+.description = "Creates instances of the mdev type TYPE until COUNT exist on the GPUs, a comma separated list of PCI addresses or all GPUs by default. Repeatable."
+},
+{
+.identifier = 'j',
+.access_letters = "j",
+.access_name = "jobs",
+.value_name = "N",
+.description = "Creates at most N instances at once (default 64)."
 },
 {
 .identifier = 'h',
@@ -66,10 +113,79 @@ static struct cag_option options[] = {
 }
 };
 
+/*! \brief Creates and registers the mediated device types of a configuration.
+ *
+ * \return If the configuration fits the GPU models and its types were added.
+ */
+static bool register_config(const char* config, uint32_t flags, const std::vector<struct GpuMemory>& memories)
+{
+    struct stat sb;
+    struct PlanReport report = {};
+    bool directory = stat(config, &sb) == 0 && S_ISDIR(sb.st_mode);
+    struct ConfigCatalog catalog = {};
+    struct GpuConfigs configs = {};
+
+    if (directory) {
+        catalog = get_config_catalog(config);
+        plan_validate_catalog(memories.data(), memories.size(), &catalog, &report);
+    } else {
+        configs = get_configs(config);
+        plan_validate_configs(memories.data(), memories.size(), &configs, &report);
+    }
+
+    if ((directory ? catalog.arena : configs.arena) == NULL) {
+        printf("The configuration %s cannot be loaded, no MDev was added.\n", config);
+        return false;
+    }
+
+    plan_print_report(&report, stdout);
+
+    bool valid = report.errors == 0;
+
+    plan_free_report(&report);
+
+    if (!valid) {
+        printf("The configuration does not fit the GPUs, no MDev was added.\n");
+
+        if (directory)
+            free_config_catalog(&catalog);
+        else
+            free_configs(&configs);
+
+        return false;
+    }
+
+    struct NvMdev mgr = create_nv_mgr_flags(flags);
+
+    if (directory) {
+        create_nv_mgr_catalog_mdevs(&mgr, &catalog);
+        free_config_catalog(&catalog);
+    } else {
+        for (size_t i = 0; i < configs.config_size; ++i) {
+            struct GpuConfig config = configs.configs[i];
+            create_nv_mgr_mdevs(&mgr, config.gpus, config.gpu_size, config.requests, config.mdev_size);
+        }
+
+        free_configs(&configs);
+    }
+
+    register_nv_mgr_mdevs(&mgr);
+
+    printf("Registered MDevs on the system.\n");
+
+    free_nv_mgr(&mgr);
+
+    return true;
+}
+
 int main(int argc, char *argv[])
 {
     char identifier;
     const char *config = NULL;
+    uint32_t flags = 0;
+    std::vector<const char*> provisions;
+    std::vector<struct GpuMemory> memories;
+    uint32_t jobs = 0;
     cag_option_context context;
 
     cag_option_prepare(&context, options, CAG_ARRAY_SIZE(options), argc, argv);
@@ -79,6 +195,30 @@ int main(int argc, char *argv[])
             case 'c':
                 config = cag_option_get_value(&context);
                 break;
+            case 'l':
+                flags |= NV_MGR_LAZY;
+                break;
+            case 's':
+                flags |= NV_MGR_SHARDED;
+                break;
+            case 'g': {
+                const char* value = cag_option_get_value(&context);
+                struct GpuMemory memory;
+
+                if (value == NULL || !plan_parse_memory(value, &memory)) {
+                    printf("Invalid GPU memory, use DEVICE=FB:BAR1 in MB, e.g. 0x20B0=40960:65536.\n");
+                    return 1;
+                }
+
+                memories.push_back(memory);
+                break;
+            }
+            case 'P':
+                provisions.push_back(cag_option_get_value(&context));
+                break;
+            case 'j':
+                jobs = strtoul(cag_option_get_value(&context), NULL, 0);
+                break;
             case 'a':
                 printf("HELP THE FALCONS ARE CHASING ME...\n");
                 return 0;
@@ -91,22 +231,38 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (config == NULL) {
+    std::vector<struct ProvisionRequest> requests(provisions.size());
+
+    for (size_t i = 0; i < provisions.size(); ++i) {
+        if (provisions[i] == NULL || !provision_parse(provisions[i], &requests[i])) {
+            printf("Invalid provisioning, use TYPE=COUNT or TYPE=COUNT@GPUS, e.g. nvidia-63=8@0000:01:00.0.\n");
+            return 1;
+        }
+    }
+
+    if (config == NULL && requests.empty()) {
         printf("Why must the Tensor Cores crush the little cpu man?\n");
         return 0;
     }
 
-    struct GpuConfigs configs = get_configs(config);
-    struct NvMdev mgr = create_nv_mgr();
+    if (config != NULL && !register_config(config, flags, memories))
+        return 1;
 
-    for (size_t i = 0; i < configs.config_size; ++i) {
-        struct GpuConfig config = configs.configs[i];
-        create_nv_mgr_mdevs(&mgr, config.gpus, config.gpu_size, config.requests, config.mdev_size);
+    if (requests.empty())
+        return 0;
+
+    struct ProvisionReport report;
+
+    if (!provision_mdevs(requests.data(), requests.size(), jobs, &report)) {
+        printf("Invalid GPU list, or the provisioning could not be planned.\n");
+        return 1;
     }
 
-    register_nv_mgr_mdevs(&mgr);
+    provision_print_report(&report, stdout);
 
-    printf("Registered MDevs on the system.\n");
+    int ret = report.failed != 0 || report.shortfall != 0;
 
-    free_nv_mgr(&mgr);
+    provision_free_report(&report);
+
+    return ret;
 }
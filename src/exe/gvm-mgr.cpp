@@ -16,16 +16,32 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  *
  */
+#include <cerrno>
+#include <cstring>
 #include <iostream>
+#include <vector>
 
+#include <poll.h>
+#include <signal.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 
 #include <cargs.h>
 
 #include <gpu/nvidia/manager.h>
+#include <gpu/nvidia/resman/events.h>
+#include <gpu/nvidia/resman/supervisor.h>
+#include <gvm/exits.h>
 #include <gvm/nvidia/manager.h>
+#include <gvm/nvidia/reactors.h>
+#include <gvm/pool.h>
+#include <gvm/scheduler.h>
+#include <gvm/sessions.h>
 
+#include <utils/busypoll.h>
 #include <utils/configs.h>
+#include <utils/topology.h>
+#include <utils/uevent.h>
 
 using std::cout;
 
@@ -38,6 +54,25 @@ using std::cout;
  *
  * This code creates and attaches mediated devices to the VMs running on
  * the host device.
+ *
+ * GPUs bound to the nvidia driver while the manager runs are probed and programmed from the
+ * configuration, GPUs unbound from it are torn down.
+ *
+ * The exit of the QEMU process of every started VM is watched through a pidfd, its session is
+ * released as soon as the process exits.
+ *
+ * VM starts are read on the main thread and run on the reactor of their GPU, a thread pinned
+ * to CPUs of the NUMA node of the GPU, so starts on different GPUs do not wait on each other.
+ *
+ * Start requests go through a scheduler first. VMs whose configuration matches a priority rule
+ * of a lower class start first, the GPUs take turns within a class and every GPU runs a
+ * bounded number of starts at once.
+ *
+ * For the lowest start latency, the event loop can spin on its events for a while before it
+ * sleeps, run pinned to dedicated CPUs and run with a real time priority.
+ *
+ * A warm pool keeps mdev instances of chosen types created with their vGPU device open, VMs
+ * started on them skip the setup of the instance and the pool refills in the background.
  */
 
 static struct cag_option options[] = {
@@ -46,7 +81,77 @@ static struct cag_option options[] = {
 .access_letters = "c",
 .access_name = "config",
 .value_name = "CONFIG",
-.description = "Configuration file to use."
+.description = "Configuration file or directory to use."
+},
+{
+.identifier = 'l',
+.access_letters = "l",
+.access_name = "lazy",
+.value_name = NULL,
+.description = "Only attach the GPUs targeted by the configuration."
+},
+{
+.identifier = 's',
+.access_letters = "s",
+.access_name = "shard",
+.value_name = NULL,
+.description = "Use a separate RM client for every GPU."
+},
+{
+.identifier = 't',
+.access_letters = "t",
+.access_name = "rm-timeout",
+.value_name = "MS",
+.description = "Interrupts RM calls running longer than MS milliseconds (default 30000, 0 disables)."
+},
+{
+.identifier = 'r',
+.access_letters = "r",
+.access_name = "reactors",
+.value_name = "MODE",
+.description = "Runs VM starts on reactor threads, one per NUMA node (numa, default), one per GPU (gpu) or none (none)."
+},
+{
+.identifier = 'p',
+.access_letters = "p",
+.access_name = "priority",
+.value_name = "PATTERN=CLASS",
+.description = "Starts VMs whose configuration contains PATTERN in CLASS, 0 first to 3 last (unmatched VMs are 2). Repeatable, the first match wins."
+},
+{
+.identifier = 'n',
+.access_letters = "n",
+.access_name = "gpu-starts",
+.value_name = "N",
+.description = "Runs at most N VM starts at once per GPU (default 1)."
+},
+{
+.identifier = 'b',
+.access_letters = "b",
+.access_name = "busy-poll",
+.value_name = "US",
+.description = "Spins up to US microseconds on the VM events before sleeping, the spin adapts to the event rate (default 0, disabled)."
+},
+{
+.identifier = 'C',
+.access_letters = "C",
+.access_name = "event-cpu",
+.value_name = "CPULIST",
+.description = "Pins the event loop to the CPUs of CPULIST, e.g. 2,4-5."
+},
+{
+.identifier = 'f',
+.access_letters = "f",
+.access_name = "fifo",
+.value_name = "PRIO",
+.description = "Runs the event loop with the SCHED_FIFO real time priority PRIO, 1 to 99."
+},
+{
+.identifier = 'w',
+.access_letters = "w",
+.access_name = "warm-pool",
+.value_name = "TYPE@BDF=COUNT",
+.description = "Keeps COUNT instances of the mdev type TYPE created on the GPU at BDF, e.g. nvidia-63@0000:01:00.0=4. Repeatable."
 },
 {
 .identifier = 'h',
@@ -64,10 +169,130 @@ static struct cag_option options[] = {
 }
 };
 
+//! Set once a termination signal was received.
+static volatile sig_atomic_t stop_requested = 0;
+
+/*! \brief Requests the manager loop to stop. */
+static void request_stop(int signal)
+{
+    (void) signal;
+    stop_requested = 1;
+}
+
+//! Class of the VMs no priority rule matches.
+static const uint8_t DEFAULT_CLASS = 2;
+
+/*! \brief Context of the VM starts. */
+struct VmStarter {
+    struct VmMgr* vm_mgr;           //!< VM manager.
+    struct NvMdev* mgr;             //!< Manager of the GPUs.
+    struct NvReactors* reactors;    //!< Reactors running the starts.
+    struct VmScheduler* sched;      //!< Scheduler of the starts.
+    int done_fd;                    //!< Eventfd waking the main loop when a start finished.
+};
+
+/*! \brief VM start handed to the reactor of its GPU. */
+struct VmStartTask {
+    struct VmStarter* starter;      //!< Context of the starts.
+    struct VmStartRequest request;  //!< Start request.
+    uint8_t scheduled;              //!< If the scheduler dispatched the start, it is then
+                                    //!< marked done with vm_sched_done.
+};
+
+/*! \brief Starts a VM and lets the scheduler run the next start of its GPU if it was scheduled. */
+static void run_vm_start(void* user)
+{
+    struct VmStartTask* task = (struct VmStartTask*) user;
+    struct VmStarter* starter = task->starter;
+    uint64_t value = 1;
+    ssize_t written;
+
+    start_vm_request(starter->vm_mgr, starter->mgr, &task->request);
+    if (task->scheduled)
+        vm_sched_done(starter->sched, task->request.info.pci_id);
+    delete task;
+
+    /* Only the main loop dispatches, so reactors never post to each other. */
+    do {
+        written = write(starter->done_fd, &value, sizeof(value));
+    } while (written == -1 && errno == EINTR);
+}
+
+/*! \brief Hands a scheduled start to the reactor of its GPU. */
+static void dispatch_vm_start(uint32_t gpu_id, void* data, void* user)
+{
+    struct VmStartTask* task = (struct VmStartTask*) data;
+    struct VmStarter* starter = (struct VmStarter*) user;
+    struct Reactor* reactor = nv_reactor_for_gpu(starter->reactors, starter->mgr, gpu_id);
+
+    if (reactor == NULL || !reactor_post(reactor, run_vm_start, task))
+        run_vm_start(task);
+}
+
+/*! \brief Queues a start request on the scheduler, as a VmStartFn of drain_vm_events. */
+static void submit_vm_start(const struct VmStartRequest* request, void* user)
+{
+    struct VmStarter* starter = (struct VmStarter*) user;
+    struct VmStartTask* task = new VmStartTask{starter, *request, 1};
+    uint32_t gpu_id = request->info.pci_id;
+    uint8_t priority_class = vm_sched_class(starter->sched, request->info.config);
+
+    printf("Got a start request from the NVIDIA kernel module\n");
+
+    /* A start the scheduler could not queue runs at once, outside of its accounting. */
+    if (!vm_sched_submit(starter->sched, gpu_id, priority_class, task)) {
+        task->scheduled = 0;
+        dispatch_vm_start(gpu_id, task, starter);
+    } else {
+        printf(
+            "Queued start in class %u, %u waiting for GPU 0x%.8X\n",
+            priority_class, vm_sched_gpu_depth(starter->sched, gpu_id), gpu_id
+        );
+    }
+}
+
+/*! \brief Drops a start that was never dispatched. */
+static void discard_vm_start(void* data)
+{
+    delete (struct VmStartTask*) data;
+}
+
+/*! \brief Prints the metrics of the scheduler. */
+static void print_sched_stats(struct VmScheduler* sched)
+{
+    struct VmSchedStats stats;
+
+    vm_sched_stats(sched, &stats);
+
+    printf(
+        "Start scheduler:\n"
+        "\tsubmitted: %lu\n"
+        "\tcompleted: %lu\n"
+        "\tqueued: %u (max %u)\n"
+        "\tin flight: %u\n"
+        "\twait: %lu ms average, %lu ms max\n",
+        (unsigned long) stats.submitted,
+        (unsigned long) stats.completed,
+        stats.queued, stats.max_queued,
+        stats.in_flight,
+        (unsigned long) (stats.dispatched != 0 ? stats.wait_ns_total / stats.dispatched / 1000000 : 0),
+        (unsigned long) (stats.wait_ns_max / 1000000)
+    );
+}
+
 int main(int argc, char *argv[])
 {
     char identifier;
     const char *config = NULL;
+    uint32_t flags = 0;
+    uint32_t rm_timeout = 30000;
+    int reactor_mode = NV_REACTORS_PER_NODE;
+    uint32_t gpu_starts = 1;
+    std::vector<const char*> priorities;
+    uint64_t busy_poll_us = 0;
+    const char* event_cpus = NULL;
+    int fifo_priority = 0;
+    std::vector<const char*> warm_pools;
     cag_option_context context;
 
     cag_option_prepare(&context, options, CAG_ARRAY_SIZE(options), argc, argv);
@@ -77,6 +302,46 @@ int main(int argc, char *argv[])
             case 'c':
                 config = cag_option_get_value(&context);
                 break;
+            case 'l':
+                flags |= NV_MGR_LAZY;
+                break;
+            case 's':
+                flags |= NV_MGR_SHARDED;
+                break;
+            case 't':
+                rm_timeout = strtoul(cag_option_get_value(&context), NULL, 0);
+                break;
+            case 'r': {
+                const char* mode = cag_option_get_value(&context);
+
+                if (mode != NULL && strcmp(mode, "gpu") == 0) {
+                    reactor_mode = NV_REACTORS_PER_GPU;
+                } else if (mode != NULL && strcmp(mode, "none") == 0) {
+                    reactor_mode = -1;
+                } else if (mode == NULL || strcmp(mode, "numa") != 0) {
+                    printf("Unknown reactor mode, use numa, gpu or none.\n");
+                    return 1;
+                }
+                break;
+            }
+            case 'p':
+                priorities.push_back(cag_option_get_value(&context));
+                break;
+            case 'n':
+                gpu_starts = strtoul(cag_option_get_value(&context), NULL, 0);
+                break;
+            case 'b':
+                busy_poll_us = strtoull(cag_option_get_value(&context), NULL, 0);
+                break;
+            case 'C':
+                event_cpus = cag_option_get_value(&context);
+                break;
+            case 'f':
+                fifo_priority = strtol(cag_option_get_value(&context), NULL, 0);
+                break;
+            case 'w':
+                warm_pools.push_back(cag_option_get_value(&context));
+                break;
             case 'a':
                 printf("THE FALCONS WILL NEVER TAKE ME ALIVE\n");
                 return 0;
@@ -94,23 +359,193 @@ int main(int argc, char *argv[])
         return 0;
     }
 
-    struct GpuConfigs configs = get_configs(config);
-    struct NvMdev mgr = create_nv_mgr();
+    struct CpuSet event_set = {};
+
+    if (event_cpus != NULL && (!cpulist_parse(event_cpus, &event_set) || cpuset_count(&event_set) == 0)) {
+        printf("Invalid event loop CPU list.\n");
+        return 1;
+    }
+
+    if (fifo_priority < 0 || fifo_priority > 99) {
+        printf("Invalid real time priority, use 1 to 99.\n");
+        return 1;
+    }
+
+    struct VmScheduler* sched = vm_sched_create(gpu_starts, DEFAULT_CLASS);
+
+    if (sched == NULL)
+        return 1;
+
+    for (const char* rule : priorities) {
+        if (rule == NULL || !vm_sched_parse_rule(sched, rule)) {
+            printf("Invalid priority rule, use PATTERN=CLASS with a class from 0 to 3.\n");
+            vm_sched_free(sched, NULL);
+            return 1;
+        }
+    }
+
+    struct VgpuPool* pool = NULL;
 
-    for (size_t i = 0; i < configs.config_size; ++i) {
-        struct GpuConfig config = configs.configs[i];
-        create_nv_mgr_mdevs(&mgr, config.gpus, config.gpu_size, config.requests, config.mdev_size);
+    if (!warm_pools.empty() && (pool = vgpu_pool_create(NULL)) == NULL) {
+        vm_sched_free(sched, NULL);
+        return 1;
     }
 
+    for (const char* spec : warm_pools) {
+        if (spec == NULL || !vgpu_pool_parse(pool, spec)) {
+            printf("Invalid warm pool, use TYPE@BDF=COUNT, e.g. nvidia-63@0000:01:00.0=4.\n");
+            vgpu_pool_free(pool);
+            vm_sched_free(sched, NULL);
+            return 1;
+        }
+    }
+
+    /* The catalog also programs the GPUs that appear later, the same way as the first ones. */
+    struct ConfigCatalog catalog = get_config_catalog(config);
+
+    if (catalog.arena == NULL) {
+        printf("The configuration %s cannot be loaded.\n", config);
+        vgpu_pool_free(pool);
+        vm_sched_free(sched, NULL);
+        return 1;
+    }
+
+    /* Stuck calls are reported halfway to the timeout. */
+    struct RmSupervisorConfig supervisor = {};
+
+    supervisor.deadline_ms = rm_timeout / 2;
+    supervisor.escalate_ms = rm_timeout;
+
+    if (rm_timeout != 0)
+        rm_supervisor_start(&supervisor);
+
+    struct NvMdev mgr = create_nv_mgr_flags(flags);
+
+    create_nv_mgr_catalog_mdevs(&mgr, &catalog);
+
     register_nv_mgr_mdevs(&mgr);
 
     printf("Registered MDevs on the system.\n");
 
     struct VmMgr vm_mgr = init_nv_vm_mgr(&mgr);
 
-    while (true) {
-        handle_vm_start(&vm_mgr, &mgr);
+    /* The mdev types only exist once the GPUs are registered. */
+    if (pool != NULL) {
+        vm_mgr.pool = pool;
+        printf("Created %u warm vGPU instances.\n", vgpu_pool_fill(pool));
+
+        if (!vgpu_pool_start(pool))
+            printf("The warm pool cannot refill in the background.\n");
+    }
+    struct NvReactors reactors = {};
+
+    if (reactor_mode != -1) {
+        reactors = create_nv_reactors(&mgr, reactor_mode);
+        printf("Started %u reactors.\n", reactors.size);
+    }
+
+    /* Threads inherit the affinity and policy, so the event loop only tunes itself once they run. */
+    if (event_cpus != NULL && !cpuset_pin_thread(&event_set))
+        printf("Cannot pin the event loop to CPUs %s.\n", event_cpus);
+
+    if (fifo_priority != 0 && !thread_set_fifo(fifo_priority))
+        printf("Cannot run the event loop with SCHED_FIFO, it requires CAP_SYS_NICE.\n");
+
+    struct BusyPoll poller;
+
+    busy_poll_init(&poller, busy_poll_us * 1000);
+
+    /* Without SA_RESTART the signals interrupt the wait for VM events. */
+    struct sigaction action = {};
+
+    action.sa_handler = request_stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    int hotplug = uevent_open();
+
+    if (hotplug == -1)
+        printf("GPU hotplug is unavailable, uevents cannot be received.\n");
+
+    struct VmStarter starter = {&vm_mgr, &mgr, &reactors, sched, eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)};
+
+    if (starter.done_fd == -1)
+        printf("Finished starts cannot wake the manager, queued starts wait for the next event.\n");
+
+    /* Negative fds, for unavailable VM events, hotplug or exit watches, are ignored by poll. */
+    struct pollfd fds[] = {
+        {.fd = rm_event_hub_fd(vm_mgr.events), .events = POLLIN, .revents = 0},
+        {.fd = hotplug, .events = POLLIN, .revents = 0},
+        {.fd = vm_mgr.exit_fd, .events = POLLIN, .revents = 0},
+        {.fd = starter.done_fd, .events = POLLIN, .revents = 0}
+    };
+
+    while (!stop_requested) {
+        if (busy_poll(&poller, fds, 4, -1) <= 0)
+            continue;
+
+        struct VmEvents events = {};
+
+        if (fds[0].revents & POLLIN)
+            events = drain_vm_events(&vm_mgr, &mgr, submit_vm_start, &starter);
+
+        if (events.binds != 0)
+            printf("Got a bind request from the NVIDIA kernel module\n");
+
+        if (fds[1].revents & POLLIN)
+            handle_nv_mgr_uevents(&mgr, hotplug, &catalog);
+
+        if (fds[2].revents & POLLIN) {
+            size_t exited = handle_vm_exits(&vm_mgr, NULL, NULL);
+
+            if (exited > 0)
+                printf("Released %zu VMs whose QEMU process exited\n", exited);
+        }
+
+        uint64_t done;
+
+        /* The eventfd only wakes the loop, the number of finished starts does not matter. */
+        if ((fds[3].revents & POLLIN) && read(starter.done_fd, &done, sizeof(done)) != sizeof(done))
+            done = 0;
+
+        vm_sched_pump(sched, dispatch_vm_start, &starter);
+    }
+
+    if (hotplug != -1)
+        close(hotplug);
+
+    /* Pending starts finish before the sessions and GPUs go away. */
+    free_nv_reactors(&reactors);
+
+    print_sched_stats(sched);
+
+    if (busy_poll_us != 0)
+        printf("Event loop: %lu events caught spinning, %lu waits slept\n", (unsigned long) poller.spin_hits, (unsigned long) poller.blocks);
+
+    vm_sched_free(sched, discard_vm_start);
+
+    if (pool != NULL) {
+        struct VgpuPoolStats stats;
+
+        vgpu_pool_stats(pool, &stats);
+        printf(
+            "Warm pool: %lu VMs started on pooled instances, %lu with an open device, %lu instances created\n",
+            (unsigned long) stats.claimed, (unsigned long) stats.warm_starts, (unsigned long) stats.created
+        );
+
+        vm_mgr.pool = NULL;
+        vgpu_pool_free(pool);
     }
 
+    if (starter.done_fd != -1)
+        close(starter.done_fd);
+
+    free_nv_vm_events(&vm_mgr);
+
+    vm_free_sessions(&vm_mgr);
+    vm_exits_close(&vm_mgr);
     free_nv_mgr(&mgr);
+    free_config_catalog(&catalog);
+    rm_supervisor_stop();
 }
@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <cstdio>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include <cargs.h>
+
+#include <gpu/plan.h>
+
+#include <utils/configs.h>
+
+/*! \page gvm-plan GVM Plan
+ * \brief Plans the framebuffer and BAR1 of mediated device types.
+ *
+ * \tableofcontents
+ *
+ * \section Introduction
+ *
+ * The mdev types of a configuration share the framebuffer and the BAR1 aperture of their GPU.
+ * Given the memory of a GPU model and a mix of partition counts, this program computes one
+ * type per count whose instances fill the GPU with as much usable framebuffer as possible,
+ * and writes a configuration which can be given to gvm-cli.
+ *
+ * Existing configurations can be checked against the same memory sizes, reporting the types
+ * which do not fit their GPU as errors and the types wasting memory as warnings.
+ */
+
+static struct cag_option options[] = {
+{
+.identifier = 'g',
+.access_letters = "g",
+.access_name = "gpu",
+.value_name = "[VENDOR:]DEVICE=FB:BAR1",
+.description = "Framebuffer and BAR1 sizes in MB of a GPU model, e.g. 0x20B0=40960:65536. Repeatable."
+},
+{
+.identifier = 'm',
+.access_letters = "m",
+.access_name = "mix",
+.value_name = "N[,N]...",
+.description = "Instances per GPU of every planned type (default 1,2,4,8)."
+},
+{
+.identifier = 'n',
+.access_letters = "n",
+.access_name = "num",
+.value_name = "NUM",
+.description = "Number of the first planned type (default 1)."
+},
+{
+.identifier = 'o',
+.access_letters = "o",
+.access_name = "output",
+.value_name = "FILE",
+.description = "Writes the planned configuration to FILE instead of the standard output."
+},
+{
+.identifier = 'V',
+.access_letters = "V",
+.access_name = "validate",
+.value_name = "CONFIG",
+.description = "Checks a configuration file or directory against the GPU models instead."
+},
+{
+.identifier = 'h',
+.access_letters = "h",
+.access_name = "help",
+.value_name = NULL,
+.description = "Shows the command help"
+}
+};
+
+/*! \brief Checks a configuration file or directory against GPU models. */
+static int validate(const char* config, const std::vector<struct GpuMemory>& memories)
+{
+    struct stat sb;
+    struct PlanReport report = {};
+
+    bool loaded;
+
+    if (stat(config, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+        struct ConfigCatalog catalog = get_config_catalog(config);
+
+        loaded = catalog.arena != NULL;
+        plan_validate_catalog(memories.data(), memories.size(), &catalog, &report);
+        free_config_catalog(&catalog);
+    } else {
+        struct GpuConfigs configs = get_configs(config);
+
+        loaded = configs.arena != NULL;
+        plan_validate_configs(memories.data(), memories.size(), &configs, &report);
+        free_configs(&configs);
+    }
+
+    if (!loaded) {
+        printf("The configuration %s cannot be loaded.\n", config);
+        return 1;
+    }
+
+    plan_print_report(&report, stdout);
+    printf("%zu errors, %zu warnings\n", report.errors, report.size - report.errors);
+
+    int ret = report.errors != 0;
+
+    plan_free_report(&report);
+
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    char identifier;
+    std::vector<struct GpuMemory> memories;
+    const char* mix = "1,2,4,8";
+    const char* output = NULL;
+    const char* config = NULL;
+    uint32_t first_num = 1;
+    cag_option_context context;
+
+    cag_option_prepare(&context, options, CAG_ARRAY_SIZE(options), argc, argv);
+    while (cag_option_fetch(&context)) {
+        identifier = cag_option_get(&context);
+        switch (identifier) {
+            case 'g': {
+                const char* value = cag_option_get_value(&context);
+                struct GpuMemory memory;
+
+                if (value == NULL || !plan_parse_memory(value, &memory)) {
+                    printf("Invalid GPU memory, use DEVICE=FB:BAR1 in MB, e.g. 0x20B0=40960:65536.\n");
+                    return 1;
+                }
+
+                memories.push_back(memory);
+                break;
+            }
+            case 'm':
+                mix = cag_option_get_value(&context);
+                break;
+            case 'n':
+                first_num = strtoul(cag_option_get_value(&context), NULL, 0);
+                break;
+            case 'o':
+                output = cag_option_get_value(&context);
+                break;
+            case 'V':
+                config = cag_option_get_value(&context);
+                break;
+            case 'h':
+                printf("Usage: gvm-plan [OPTION]...\n");
+                printf("Plans the framebuffer and BAR1 of mediated device types\n\n");
+                cag_option_print(options, CAG_ARRAY_SIZE(options), stdout);
+                return 0;
+        }
+    }
+
+    if (memories.empty()) {
+        printf("No GPU model given, use -g DEVICE=FB:BAR1.\n");
+        return 1;
+    }
+
+    if (config != NULL)
+        return validate(config, memories);
+
+    uint32_t counts[PLAN_MAX_MIX];
+    size_t count = mix != NULL ? plan_parse_mix(mix, counts, PLAN_MAX_MIX) : 0;
+
+    if (count == 0) {
+        printf("Invalid mix, use a comma separated list of instance counts, e.g. 1,2,4,8.\n");
+        return 1;
+    }
+
+    FILE* out = output != NULL ? fopen(output, "w") : stdout;
+
+    if (out == NULL) {
+        perror(output);
+        return 1;
+    }
+
+    int ret = 0;
+
+    for (const struct GpuMemory& memory : memories) {
+        if (!plan_write_config(out, &memory, counts, count, first_num)) {
+            fprintf(stderr, "The mix does not fit 0x%.4X, a partition would not fit its framebuffer or BAR1.\n", memory.device_id);
+            ret = 1;
+            continue;
+        }
+
+        for (size_t i = 0; output != NULL && i < count; ++i) {
+            struct PlanType type;
+
+            plan_type(&memory, counts[i], &type);
+            printf(
+                "0x%.4X type %zu: %u x %u MB usable, %u MB reserved, 0x%X MB BAR1, %u MB unused\n",
+                memory.device_id, first_num + i, type.max_instances, type.fb_len, type.fb_res,
+                type.bar1_len, type.fb_unused
+            );
+        }
+    }
+
+    if (out != stdout)
+        fclose(out);
+
+    return ret;
+}
@@ -60,9 +60,8 @@ int nv_open(
     return fd;
 }
 
-/*! \failure Not Created - Normally this is the case if the NVIDIA driver is not loaded.
- */
-int nv_open_dev(uint16_t minor)
+/*! \brief Opens a traditional NVIDIA device file. */
+static int nv_sys_open_dev(uint16_t minor)
 {
     const char *params = "/proc/driver/nvidia/params";
 
@@ -77,15 +76,39 @@ int nv_open_dev(uint16_t minor)
     return nv_open(major, minor, path, params);
 }
 
+//! Function every traditional NVIDIA device is opened through.
+static NvOpenDev NV_OPEN_DEV = nv_sys_open_dev;
+
+/*! \failure Not Created - Normally this is the case if the NVIDIA driver is not loaded.
+ */
+int nv_open_dev(uint16_t minor)
+{
+    return __atomic_load_n(&NV_OPEN_DEV, __ATOMIC_ACQUIRE)(minor);
+}
+
+void nv_set_open_dev(NvOpenDev hook)
+{
+    __atomic_store_n(&NV_OPEN_DEV, hook != NULL ? hook : nv_sys_open_dev, __ATOMIC_RELEASE);
+}
+
+//! Major of the vGPU devices, -1 until found.
+static int32_t VGPU_MAJOR = -1;
+
 /*! \failure Not Created - Normally this is the case if the NVIDIA driver is not loaded.
  */
 int nv_open_mdev(uint16_t minor)
 {
     const char *params = "/proc/driver/nvidia/params";
 
-    int32_t major = get_major("nvidia-vgpu-vfio");
+    /* Every VM start opens a vGPU, /proc/devices is only parsed until the driver is found. */
+    int32_t major = __atomic_load_n(&VGPU_MAJOR, __ATOMIC_RELAXED);
     char path[1024] = "";
 
+    if (major == -1) {
+        major = get_major("nvidia-vgpu-vfio");
+        __atomic_store_n(&VGPU_MAJOR, major, __ATOMIC_RELAXED);
+    }
+
     sprintf(path, "/dev/nvidia-vgpu%d", minor);
 
     return nv_open(major, minor, path, params);
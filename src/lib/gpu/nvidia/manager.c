@@ -22,6 +22,13 @@
 
 #include <gpu/nvidia/resman/classes.h>
 
+#include <utils/device.h>
+#include <utils/epoch.h>
+#include <utils/sysfs.h>
+#include <utils/topology.h>
+#include <utils/uevent.h>
+
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -38,147 +45,509 @@ static const char SIGN[128] = {
 0x96, 0x5c, 0x5c, 0xe4, 0x7c, 0xad, 0x87, 0x24, 0x20, 0x70, 0xad, 0x63, 0x84, 0x96, 0x92, 0x3f
 };
 
+//! Lock serializing the publication of GPU snapshots.
+static pthread_mutex_t VIEW_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
 /*! \brief Inline function to create device ids. */
 static inline uint32_t compose_manager_id(uint32_t client, uint32_t gpu_id, uint32_t handle)
 {
     return ((client + gpu_id) << 8) | (handle & ((1 << 8) - 1));
 }
 
-/*! \todo Use proper logging.
+/*! \brief Creates the manager structure for a probed gpu.
+ *
+ * Only the PCI information of the gpu is gathered. The vendor and device ids are read from
+ * sysfs, which avoids attaching the gpu before it is known to be used.
+ *
+ * \param mgr - Manager the gpu belongs to.
+ * \param gpu_id - Probed RM gpu id.
+ * \param minor - Minor of the /dev/nvidia%d device for the gpu.
+ * \return The probed gpu, or NULL if its PCI information could not be read.
  */
-struct NvMdev create_nv_mgr()
+static struct NvMdevGpu* nv_probe_gpu(struct NvMdev* mgr, uint32_t gpu_id, uint16_t minor)
 {
-    struct NvMdev ret = {};
-    struct Nv0000CtrlGpuGetProbedIdsParams probed_ids = {};
+    struct NvMdevGpu *mgpu = calloc(1, sizeof(struct NvMdevGpu));
+    struct Nv0000CtrlGpuGetPciInfoParams pci_info = {
+       .gpu_id = gpu_id
+    };
 
-    ret.fd = nv_open_dev(255);
+    if (mgpu == NULL)
+        return NULL;
 
-    ret.res = rm_alloc_res(ret.fd, NULL, 0, 0, NULL);
+    mgpu->gpu = calloc(1, sizeof(struct Gpu));
 
-    if (ret.res == NULL)
-        goto failure;
+    if (mgpu->gpu == NULL || RM_CTRL(mgr->fd, mgr->res, NV0000_GET_PCI_INFO, pci_info) == NULL) {
+        free(mgpu->gpu);
+        free(mgpu);
+        return NULL;
+    }
 
-    if (RM_CTRL(ret.fd, ret.res, NV0000_GET_PROBED_IDS, probed_ids) == NULL)
-        goto free_failure;
+    mgpu->ctl_fd = mgr->fd;
+    mgpu->dev_fd = -1;
+    mgpu->minor = minor;
+    mgpu->root = mgr->res->object;
+    mgpu->device = compose_manager_id(mgr->res->object, gpu_id, 1);
+    mgpu->sub_device = compose_manager_id(mgr->res->object, gpu_id, 2);
+    mgpu->mdev_config = compose_manager_id(mgr->res->object, gpu_id, 3);
+
+    mgpu->gpu->identifier = gpu_id;
+    mgpu->gpu->domain = pci_info.domain;
+    mgpu->gpu->bus = pci_info.bus;
+    mgpu->gpu->slot = pci_info.slot;
+    mgpu->gpu->vendor_id = 0x10DE;
+    mgpu->gpu->sub_vendor_id = 0x10DE;
+
+    sysfs_read_u32(
+        &mgpu->gpu->device_id,
+        "bus/pci/devices/%.4x:%.2x:%.2x.%x/device",
+        pci_info.domain, pci_info.bus, pci_info.slot, 0
+    );
+    sysfs_read_u32(
+        &mgpu->gpu->sub_device_id,
+        "bus/pci/devices/%.4x:%.2x:%.2x.%x/subsystem_device",
+        pci_info.domain, pci_info.bus, pci_info.slot, 0
+    );
+
+    mgpu->numa_node = pci_numa_node(pci_info.domain, pci_info.bus, pci_info.slot, 0);
+
+    /* The driver reports the real minor, the probe order is only a fallback. */
+    char information[128];
+
+    snprintf(
+        information, sizeof(information), "/proc/driver/nvidia/gpus/%.4x:%.2x:%.2x.%x/information",
+        pci_info.domain, pci_info.bus, pci_info.slot, 0
+    );
+
+    int32_t proc_minor = get_param(information, "Device Minor");
+
+    if (proc_minor >= 0 && proc_minor < 255)
+        mgpu->minor = proc_minor;
+
+    return mgpu;
+}
 
-    for (int i = 0; i < 32 && probed_ids.gpu_ids[i] != 0xFFFFFFFF; ++i) {
-        struct NvMdevGpu *mgpu = calloc(1, sizeof(struct NvMdevGpu));
+/*! \brief Allocates the objects of an attached GPU.
+ *
+ * \param mgr - Manager the GPU belongs to.
+ * \param mgpu - Attached GPU.
+ * \return If the GPU has a mdev configurator.
+ */
+static uint8_t nv_init_gpu(struct NvMdev *mgr, struct NvMdevGpu *mgpu)
+{
+    struct NvResource* client = mgr->res;
 
-        mgpu->ctl_fd = ret.fd;
-        mgpu->gpu = calloc(1, sizeof(struct Gpu));
-        mgpu->root = ret.res->object;
-        mgpu->device = compose_manager_id(ret.res->object, probed_ids.gpu_ids[i], 1);
-        mgpu->sub_device = compose_manager_id(ret.res->object, probed_ids.gpu_ids[i], 2);
-        mgpu->mdev_config = compose_manager_id(ret.res->object, probed_ids.gpu_ids[i], 3);
+    if (mgr->flags & NV_MGR_SHARDED) {
+        int fd = nv_open_dev(255);
 
-        struct Nv0000CtrlGpuGetPciInfoParams pci_info = {
-           .gpu_id = probed_ids.gpu_ids[i]
-        };
-        struct Nv0000CtrlGpuAttachIdsParams attach_ids = {};
+        mgpu->shard = rm_alloc_res(fd, NULL, 0, 0, NULL);
 
-        attach_ids.gpu_ids[0] = probed_ids.gpu_ids[i];
-        attach_ids.gpu_ids[1] = 0xFFFFFFFF;
+        if (mgpu->shard == NULL) {
+            if (fd != -1)
+                close(fd);
+            rm_detach_gpus(mgr->fd, mgr->res->client, &mgpu->gpu->identifier, 1);
+            return 0;
+        }
 
-        RM_CTRL(ret.fd, ret.res, NV0000_GET_PCI_INFO, pci_info);
-        RM_CTRL(ret.fd, ret.res, NV0000_ATTACH_IDS, attach_ids);
+        client = mgpu->shard;
+        mgpu->ctl_fd = fd;
+        mgpu->root = client->object;
+    }
 
-        mgpu->dev_fd = nv_open_dev(i);
+    mgpu->dev_fd = nv_open_dev(mgpu->minor);
 
-        struct Nv0000CtrlGpuGetIdInfoParams gpu_info = {};
-        struct Nv0080AllocParams dev_alloc = {};
-        uint32_t sub_dev_alloc = 0;
+    struct Nv0000CtrlGpuGetIdInfoParams gpu_info = {};
+    struct Nv0080AllocParams dev_alloc = {};
+    uint32_t sub_dev_alloc = 0;
 
-        gpu_info.gpu_id = probed_ids.gpu_ids[i];
+    gpu_info.gpu_id = mgpu->gpu->identifier;
 
-        RM_CTRL(ret.fd, ret.res, NV0000_GET_GPU_INFO, gpu_info);
+    RM_CTRL(mgr->fd, mgr->res, NV0000_GET_GPU_INFO, gpu_info);
 
-        dev_alloc.deviceId = gpu_info.dev_inst;
-        dev_alloc.hClientShare = ret.res->object;
+    dev_alloc.deviceId = gpu_info.dev_inst;
+    dev_alloc.hClientShare = client->object;
 
-        mgpu->dev = rm_alloc_res(mgpu->ctl_fd, ret.res, mgpu->device, NV0080_CLASS, &dev_alloc);
-        mgpu->sdev = rm_alloc_res(mgpu->ctl_fd, mgpu->dev, mgpu->sub_device, NV2080_CLASS, &sub_dev_alloc);
+    mgpu->dev = rm_alloc_res(mgpu->ctl_fd, client, mgpu->device, NV0080_CLASS, &dev_alloc);
 
-        struct BusGetPciInfo bus_info = {};
+    if (mgpu->dev == NULL) {
+        if (mgpu->dev_fd != -1)
+            close(mgpu->dev_fd);
+        mgpu->dev_fd = -1;
 
-        RM_CTRL(ret.fd, mgpu->sdev, NV2080_GET_BUS_PCI_INFO, bus_info);
+        if (mgpu->shard != NULL) {
+            rm_free_tree(mgpu->ctl_fd, mgpu->shard);
+            close(mgpu->ctl_fd);
+            mgpu->shard = NULL;
+            mgpu->ctl_fd = mgr->fd;
+            mgpu->root = mgr->res->object;
+        }
 
-        mgpu->mdev = rm_alloc_res(mgpu->ctl_fd, mgpu->sdev, mgpu->mdev_config, NVA081_CLASS, NULL);
+        rm_detach_gpus(mgr->fd, mgr->res->client, &mgpu->gpu->identifier, 1);
+        return 0;
+    }
+
+    mgpu->dev->fd = mgpu->dev_fd;
+    mgpu->dev->class_info = mgpu->gpu;
+    mgpu->attached = 1;
+
+    mgpu->sdev = rm_alloc_res(mgpu->ctl_fd, mgpu->dev, mgpu->sub_device, NV2080_CLASS, &sub_dev_alloc);
 
-        mgpu->dev->class_info = mgpu->gpu;
+    struct BusGetPciInfo bus_info = {};
 
-        mgpu->gpu->identifier = probed_ids.gpu_ids[i];
-        mgpu->gpu->domain = pci_info.domain;
-        mgpu->gpu->bus = pci_info.bus;
-        mgpu->gpu->slot = pci_info.slot;
-        mgpu->gpu->vendor_id = 0x10DE;
+    if (mgpu->sdev != NULL && RM_CTRL(mgpu->ctl_fd, mgpu->sdev, NV2080_GET_BUS_PCI_INFO, bus_info) != NULL) {
         mgpu->gpu->device_id = bus_info.dev_id >> 16;
-        mgpu->gpu->sub_vendor_id = 0x10DE;
         mgpu->gpu->sub_device_id = bus_info.sub_dev_id >> 16;
+    }
+
+    if (mgpu->sdev != NULL)
+        mgpu->mdev = rm_alloc_res(mgpu->ctl_fd, mgpu->sdev, mgpu->mdev_config, NVA081_CLASS, NULL);
+
+    printf(
+        "Created gpu: 0x%.8X (0x%.4X, 0x%.4X, 0x%.4X, 0x%.4X)\n",
+        mgpu->gpu->identifier,
+        mgpu->gpu->vendor_id,
+        mgpu->gpu->device_id,
+        mgpu->gpu->sub_vendor_id,
+        mgpu->gpu->sub_device_id
+    );
+
+    return mgpu->mdev != NULL;
+}
+
+/*! \todo Use proper logging.
+ */
+size_t attach_nv_mgr_gpus(struct NvMdev *mgr, struct NvMdevGpu **mgpus, size_t size)
+{
+    uint32_t gpu_ids[32];
+    uint8_t attached[32];
+    struct NvMdevGpu* pending[32];
+    uint32_t pending_size = 0;
+    size_t ret = 0;
+
+    for (size_t i = 0; i < size; ++i) {
+        if (mgpus[i]->attached) {
+            ret += mgpus[i]->mdev != NULL;
+            continue;
+        }
+
+        pending[pending_size] = mgpus[i];
+        gpu_ids[pending_size++] = mgpus[i]->gpu->identifier;
+
+        if (pending_size < 32 && i + 1 < size)
+            continue;
+
+        rm_attach_gpus(mgr->fd, mgr->res, gpu_ids, pending_size, attached);
+
+        for (uint32_t j = 0; j < pending_size; ++j)
+            if (attached[j])
+                ret += nv_init_gpu(mgr, pending[j]);
+
+        pending_size = 0;
+    }
+
+    nv_mgr_publish(mgr);
+
+    return ret;
+}
+
+uint8_t attach_nv_mgr_gpu(struct NvMdev *mgr, struct NvMdevGpu *mgpu)
+{
+    return attach_nv_mgr_gpus(mgr, &mgpu, 1) == 1;
+}
+
+struct NvMdev create_nv_mgr()
+{
+    return create_nv_mgr_flags(0);
+}
+
+/*! \todo Use proper logging.
+ */
+struct NvMdev create_nv_mgr_flags(uint32_t flags)
+{
+    struct NvMdev ret = {};
+    struct Nv0000CtrlGpuGetProbedIdsParams probed_ids = {};
+
+    ret.flags = flags;
+    ret.fd = nv_open_dev(255);
+
+    ret.res = rm_alloc_res(ret.fd, NULL, 0, 0, NULL);
+
+    if (ret.res == NULL)
+        goto failure;
+
+    if (RM_CTRL(ret.fd, ret.res, NV0000_GET_PROBED_IDS, probed_ids) == NULL)
+        goto free_failure;
+
+    /* The minor follows the probe order, GPUs which fail to probe are skipped. */
+    for (int i = 0; i < 32 && probed_ids.gpu_ids[i] != 0xFFFFFFFF; ++i) {
+        struct NvMdevGpu* mgpu = nv_probe_gpu(&ret, probed_ids.gpu_ids[i], i);
+
+        if (mgpu != NULL && !nv_registry_add(&ret.gpus, mgpu)) {
+            free(mgpu->gpu);
+            free(mgpu);
+        }
+    }
+
+    if (!(flags & NV_MGR_LAZY)) {
+        attach_nv_mgr_gpus(&ret, ret.gpus.entries, ret.gpus.size);
+        return ret;
+    }
+
+    nv_mgr_publish(&ret);
+
+    for (uint32_t i = 0; i < ret.gpus.size; ++i) {
+        struct NvMdevGpu *mgpu = nv_registry_at(&ret.gpus, i);
 
         printf(
-            "Created gpu: 0x%.8X (0x%.4X, 0x%.4X, 0x%.4X, 0x%.4X)\n",
-            probed_ids.gpu_ids[i],
+            "Probed gpu: 0x%.8X (0x%.4X, 0x%.4X, 0x%.4X, 0x%.4X)\n",
+            mgpu->gpu->identifier,
             mgpu->gpu->vendor_id,
             mgpu->gpu->device_id,
             mgpu->gpu->sub_vendor_id,
             mgpu->gpu->sub_device_id
         );
-
-        ret.gpus[i] = mgpu;
     }
 
     return ret;
 
 free_failure:
-    for (int i = 0; i < 32 && ret.gpus[i] != NULL; ++i) {
-        printf(
-            "Destroyed gpu: 0x%.8X (0x%.4X, 0x%.4X, 0x%.4X, 0x%.4X)\n",
-            ret.gpus[i]->gpu->identifier,
-            ret.gpus[i]->gpu->vendor_id,
-            ret.gpus[i]->gpu->device_id,
-            ret.gpus[i]->gpu->sub_vendor_id,
-            ret.gpus[i]->gpu->sub_device_id
-        );
-        free(ret.gpus[i]);
-        ret.gpus[i] = NULL;
-    }
-
     rm_free_tree(ret.fd, ret.res);
 
     ret.res = NULL;
 
 failure:
-    close(ret.fd);
+    if (ret.fd != -1)
+        close(ret.fd);
     ret.fd = -1;
     return ret;
 }
 
-/*! \todo Use proper logging.
+/*! \brief Frees a GPU snapshot once it is retired.
+ *
+ * \param ptr - Snapshot to free.
+ */
+static void nv_free_view(void* ptr)
+{
+    struct NvGpuView* view = ptr;
+
+    nv_registry_free(&view->gpus);
+    free(view->copies);
+    free(view->infos);
+    free(view);
+}
+
+/*! \failure Out Of Memory - The previous snapshot stays published.
+ */
+void nv_mgr_publish(struct NvMdev *mgr)
+{
+    uint32_t size = mgr->gpus.size;
+    struct NvGpuView* view = calloc(1, sizeof(*view));
+
+    if (view == NULL)
+        return;
+
+    view->copies = calloc(size + 1, sizeof(*view->copies));
+    view->infos = calloc(size + 1, sizeof(*view->infos));
+
+    if (view->copies == NULL || view->infos == NULL) {
+        nv_free_view(view);
+        return;
+    }
+
+    pthread_mutex_lock(&VIEW_LOCK);
+
+    struct NvGpuView* old = mgr->view;
+
+    view->generation = old != NULL ? old->generation + 1 : 0;
+
+    for (uint32_t i = 0; i < size; ++i) {
+        const struct NvMdevGpu* mgpu = nv_registry_at(&mgr->gpus, i);
+
+        view->copies[i] = *mgpu;
+        view->infos[i] = *mgpu->gpu;
+        view->copies[i].gpu = &view->infos[i];
+
+        if (!nv_registry_add(&view->gpus, &view->copies[i])) {
+            pthread_mutex_unlock(&VIEW_LOCK);
+            nv_free_view(view);
+            return;
+        }
+    }
+
+    __atomic_store_n(&mgr->view, view, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&VIEW_LOCK);
+
+    epoch_retire(old, nv_free_view);
+}
+
+const struct NvGpuView* nv_mgr_view(const struct NvMdev *mgr)
+{
+    return __atomic_load_n(&mgr->view, __ATOMIC_ACQUIRE);
+}
+
+/*! \restriction Must not be called from inside an epoch critical section.
+ * \todo Use proper logging.
  */
 void free_nv_mgr(struct NvMdev *mgr)
 {
-    if (mgr->fd == -1)
+    pthread_mutex_lock(&VIEW_LOCK);
+
+    struct NvGpuView* view = mgr->view;
+
+    __atomic_store_n(&mgr->view, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&VIEW_LOCK);
+
+    epoch_retire(view, nv_free_view);
+
+    if (mgr->fd == -1) {
+        nv_registry_free(&mgr->gpus);
         return;
+    }
+
+    uint32_t* shard_ids = calloc(mgr->gpus.size + 1, sizeof(*shard_ids));
+    uint32_t shard_size = 0;
+
+    for (uint32_t i = 0; i < mgr->gpus.size; ++i) {
+        struct NvMdevGpu* gpu = nv_registry_at(&mgr->gpus, i);
 
-    for (int i = 0; i < 32 && mgr->gpus[i] != NULL; ++i) {
         printf(
             "Destroyed gpu: 0x%.8X (0x%.4X, 0x%.4X, 0x%.4X, 0x%.4X)\n",
-            mgr->gpus[i]->gpu->identifier,
-            mgr->gpus[i]->gpu->vendor_id,
-            mgr->gpus[i]->gpu->device_id,
-            mgr->gpus[i]->gpu->sub_vendor_id,
-            mgr->gpus[i]->gpu->sub_device_id
+            gpu->gpu->identifier,
+            gpu->gpu->vendor_id,
+            gpu->gpu->device_id,
+            gpu->gpu->sub_vendor_id,
+            gpu->gpu->sub_device_id
         );
-        free(mgr->gpus[i]);
-        mgr->gpus[i] = NULL;
+
+        if (gpu->shard != NULL) {
+            /* Shards are detached together with the GPUs of the main client. */
+            if (shard_ids != NULL)
+                shard_ids[shard_size++] = gpu->gpu->identifier;
+            else
+                rm_detach_gpus(mgr->fd, mgr->res->client, &gpu->gpu->identifier, 1);
+            gpu->dev->class_info = NULL;
+            rm_free_tree(gpu->ctl_fd, gpu->shard);
+            close(gpu->dev_fd);
+            close(gpu->ctl_fd);
+        }
+
+        if (!gpu->attached || gpu->shard != NULL)
+            free(gpu->gpu);
+        free(gpu);
     }
 
+    nv_registry_free(&mgr->gpus);
+
+    rm_detach_gpus(mgr->fd, mgr->res->client, shard_ids, shard_size);
+    free(shard_ids);
     rm_free_tree(mgr->fd, mgr->res);
 
     mgr->res = NULL;
 
     close(mgr->fd);
     mgr->fd = -1;
+
+    epoch_barrier();
+}
+
+/*! \brief Checks if a gpu is selected by a list of gpu selectors.
+ *
+ * \param ggpu - Gpu to check.
+ * \param limited - Gpu selectors, fields set to 0xFFFFFFFF match any value.
+ * \param gpu_size - Size of the selector list.
+ * \return If the gpu is selected, an empty list selects every gpu.
+ */
+static uint8_t nv_gpu_selected(const struct Gpu* ggpu, const struct Gpu* limited, size_t gpu_size)
+{
+    uint8_t valid = 0;
+
+    if (limited == NULL || gpu_size == 0)
+        return 1;
+
+    for (size_t j = 0; j < gpu_size && !valid; ++j) {
+        struct Gpu req_gpu = limited[j];
+
+        valid =
+            (req_gpu.domain == 0xFFFFFFFF ||
+             req_gpu.domain == ggpu->domain) &&
+            (req_gpu.bus == 0xFFFFFFFF ||
+             req_gpu.bus == ggpu->bus) &&
+            (req_gpu.slot == 0xFFFFFFFF ||
+             req_gpu.slot == ggpu->slot) &&
+            (req_gpu.function == 0xFFFFFFFF ||
+             req_gpu.function == ggpu->function) &&
+            (req_gpu.vendor_id == 0xFFFFFFFF ||
+             req_gpu.vendor_id == ggpu->vendor_id) &&
+            (req_gpu.device_id == 0xFFFFFFFF ||
+             req_gpu.device_id == ggpu->device_id) &&
+            (req_gpu.sub_vendor_id == 0xFFFFFFFF ||
+             req_gpu.sub_vendor_id == ggpu->sub_vendor_id) &&
+            (req_gpu.sub_device_id == 0xFFFFFFFF ||
+             req_gpu.sub_device_id == ggpu->sub_device_id) &&
+            (req_gpu.identifier == 0xFFFFFFFF ||
+             req_gpu.identifier == ggpu->identifier);
+    }
+
+    return valid;
+}
+
+/*! \brief Adds mediated device types to a gpu.
+ *
+ * \sideeffect RM Side Effect: Creates mdevs on the GPU.
+ *
+ * \param gpu - Gpu to add the types to.
+ * \param requested - Requested MDevs to use.
+ * \param mdev_size - Size of the requested list.
+ * \param discard - If the first type discards the types previously added to the gpu.
+ */
+static void nv_gpu_add_mdevs(
+    struct NvMdevGpu* gpu,
+    struct MDevRequest* requested,
+    size_t mdev_size,
+    uint8_t discard
+)
+{
+    struct Gpu *ggpu = gpu->gpu;
+
+    for (size_t j = 0; j < mdev_size; ++j) {
+        struct MDevRequest request = requested[j];
+        struct RmMdevConfig mdev = {};
+
+        mdev.discard = discard && j == 0;
+        mdev.mdev_type = request.num;
+        strcpy(mdev.name, request.name);
+        strcpy(mdev.gpu_class, request.gpu_class);
+        memcpy(mdev.sign, SIGN, 128);
+        strcpy(mdev.pact, "NVIDIA-vComputeServer,9.0;Quadro-Virtual-DWS,5.0");
+        mdev.max_instances = request.max_inst;
+
+        if (request.disp != NULL) {
+            mdev.num_heads = request.disp->num_heads;
+            mdev.max_res_x = request.disp->max_res_x;
+            mdev.max_res_y = request.disp->max_res_y;
+            mdev.max_pixel = request.disp->max_res_x * request.disp->max_res_y;
+            mdev.frl_config = request.disp->frl_config;
+            mdev.frl_enable = request.disp->frl_enable;
+        }
+
+        mdev.cuda = 1;
+        mdev.ecc_support = request.ecc_support;
+        mdev.gpu_instance_size = 0;
+        mdev.multi_mdev = request.multi_mdev;
+        mdev.enc_cap = request.enc_cap;
+        mdev.v_dev_id =
+            request.v_dev_id == 0xFFFFFFFFFFFFFFFF ?
+            (ggpu->device_id << 16 || ggpu->sub_device_id) :
+            request.v_dev_id;
+        mdev.p_dev_id =
+            request.p_dev_id == 0xFFFFFFFFFFFFFFFF ?
+            ggpu->device_id : request.p_dev_id;
+        mdev.fb_len = (uint64_t) request.fb_len * 1024 * 1024;
+        mdev.map_video = request.map_vid_size * 1024 * 1024;
+        mdev.fb_res = (uint64_t) request.fb_res * 1024 * 1024;
+        mdev.bar1_len = request.bar1_len;
+
+        RM_CTRL(gpu->ctl_fd, gpu->mdev, NVA081_ADD_MDEV, mdev);
+    }
 }
 
 void create_nv_mgr_mdevs(
@@ -189,85 +558,79 @@ void create_nv_mgr_mdevs(
     size_t mdev_size
 )
 {
-    for (int i = 0; i < 32 && mgr->gpus[i] != NULL; ++i) {
-        struct NvMdevGpu* gpu = mgr->gpus[i];
-        struct Gpu *ggpu = gpu->gpu;
-        uint8_t valid = 0;
-
-        for (size_t j = 0; j < gpu_size && !valid; ++j) {
-            struct Gpu req_gpu = limited[j];
-
-            valid =
-                (req_gpu.domain == 0xFFFFFFFF ||
-                 req_gpu.domain == ggpu->domain) &&
-                (req_gpu.bus == 0xFFFFFFFF ||
-                 req_gpu.bus == ggpu->bus) &&
-                (req_gpu.slot == 0xFFFFFFFF ||
-                 req_gpu.slot == ggpu->slot) &&
-                (req_gpu.function == 0xFFFFFFFF ||
-                 req_gpu.function == ggpu->function) &&
-                (req_gpu.vendor_id == 0xFFFFFFFF ||
-                 req_gpu.vendor_id == ggpu->vendor_id) &&
-                (req_gpu.device_id == 0xFFFFFFFF ||
-                 req_gpu.device_id == ggpu->device_id) &&
-                (req_gpu.sub_vendor_id == 0xFFFFFFFF ||
-                 req_gpu.sub_vendor_id == ggpu->sub_vendor_id) &&
-                (req_gpu.sub_device_id == 0xFFFFFFFF ||
-                 req_gpu.sub_device_id == ggpu->sub_device_id) &&
-                (req_gpu.identifier == 0xFFFFFFFF ||
-                 req_gpu.identifier == ggpu->identifier);
-        }
+    struct NvMdevGpu** selected = calloc(mgr->gpus.size + 1, sizeof(*selected));
+    size_t selected_size = 0;
+
+    if (selected == NULL)
+        return;
 
-        if (!valid && limited != NULL && gpu_size > 0)
+    for (uint32_t i = 0; i < mgr->gpus.size; ++i)
+        if (nv_gpu_selected(nv_registry_at(&mgr->gpus, i)->gpu, limited, gpu_size))
+            selected[selected_size++] = nv_registry_at(&mgr->gpus, i);
+
+    attach_nv_mgr_gpus(mgr, selected, selected_size);
+
+    for (size_t i = 0; i < selected_size; ++i) {
+        struct NvMdevGpu* gpu = selected[i];
+
+        if (gpu->mdev == NULL)
             continue;
 
-        for (size_t j = 0; j < mdev_size; ++j) {
-            struct MDevRequest request = requested[j];
-            struct RmMdevConfig mdev = {};
-
-            mdev.discard = j == 0;
-            mdev.mdev_type = request.num;
-            strcpy(mdev.name, request.name);
-            strcpy(mdev.class, request.gpu_class);
-            memcpy(mdev.sign, SIGN, 128);
-            strcpy(mdev.pact, "NVIDIA-vComputeServer,9.0;Quadro-Virtual-DWS,5.0");
-            mdev.max_instances = request.max_inst;
-
-            if (request.disp != NULL) {
-                mdev.num_heads = request.disp->num_heads;
-                mdev.max_res_x = request.disp->max_res_x;
-                mdev.max_res_y = request.disp->max_res_y;
-                mdev.max_pixel = request.disp->max_res_x * request.disp->max_res_y;
-                mdev.frl_config = request.disp->frl_config;
-                mdev.frl_enable = request.disp->frl_enable;
-            }
-
-            mdev.cuda = 1;
-            mdev.ecc_support = request.ecc_support;
-            mdev.gpu_instance_size = 0;
-            mdev.multi_mdev = request.multi_mdev;
-            mdev.enc_cap = request.enc_cap;
-            mdev.v_dev_id =
-                request.v_dev_id == 0xFFFFFFFFFFFFFFFF ?
-                (ggpu->device_id << 16 || ggpu->sub_device_id) :
-                request.v_dev_id;
-            mdev.p_dev_id =
-                request.p_dev_id == 0xFFFFFFFFFFFFFFFF ?
-                ggpu->device_id : request.p_dev_id;
-            mdev.fb_len = (uint64_t) request.fb_len * 1024 * 1024;
-            mdev.map_video = request.map_vid_size * 1024 * 1024;
-            mdev.fb_res = (uint64_t) request.fb_res * 1024 * 1024;
-            mdev.bar1_len = request.bar1_len;
-
-            RM_CTRL(gpu->ctl_fd, gpu->mdev, NVA081_ADD_MDEV, mdev);
-        }
+        nv_gpu_add_mdevs(gpu, requested, mdev_size, 1);
     }
+
+    free(selected);
+}
+
+void create_nv_mgr_catalog_mdevs(struct NvMdev *mgr, const struct ConfigCatalog* catalog)
+{
+    create_nv_gpus_catalog_mdevs(mgr, catalog, mgr->gpus.entries, mgr->gpus.size);
+}
+
+void create_nv_gpus_catalog_mdevs(
+    struct NvMdev *mgr,
+    const struct ConfigCatalog* catalog,
+    struct NvMdevGpu** gpus,
+    size_t size
+)
+{
+    struct NvMdevGpu** selected = calloc(size + 1, sizeof(*selected));
+    size_t selected_size = 0;
+
+    if (selected == NULL)
+        return;
+
+    for (size_t i = 0; i < size; ++i)
+        if (config_catalog_lookup(catalog, gpus[i]->gpu) != NULL)
+            selected[selected_size++] = gpus[i];
+
+    attach_nv_mgr_gpus(mgr, selected, selected_size);
+
+    for (size_t i = 0; i < selected_size; ++i) {
+        struct NvMdevGpu* gpu = selected[i];
+        const struct GpuConfig* config = config_catalog_lookup(catalog, gpu->gpu);
+
+        if (gpu->mdev == NULL)
+            continue;
+
+        nv_gpu_add_mdevs(gpu, config->requests, config->mdev_size, 1);
+    }
+
+    free(selected);
 }
 
 void register_nv_mgr_mdevs(struct NvMdev *mgr)
 {
-    for (int i = 0; i < 32 && mgr->gpus[i] != NULL; ++i) {
-        struct NvMdevGpu* gpu = mgr->gpus[i];
+    register_nv_gpus_mdevs(mgr->gpus.entries, mgr->gpus.size);
+}
+
+void register_nv_gpus_mdevs(struct NvMdevGpu** gpus, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        struct NvMdevGpu* gpu = gpus[i];
+
+        if (gpu->mdev == NULL)
+            continue;
 
         rm_ctrl_res(
             gpu->ctl_fd,
@@ -279,3 +642,145 @@ void register_nv_mgr_mdevs(struct NvMdev *mgr)
         );
     }
 }
+
+/*! \brief Tears down a GPU removed from the registry of its manager.
+ *
+ * \param mgr - Manager the GPU belonged to.
+ * \param gpu - GPU to tear down and free.
+ */
+static void nv_remove_gpu(struct NvMdev *mgr, struct NvMdevGpu *gpu)
+{
+    printf(
+        "Removed gpu: 0x%.8X (0x%.4X, 0x%.4X, 0x%.4X, 0x%.4X)\n",
+        gpu->gpu->identifier,
+        gpu->gpu->vendor_id,
+        gpu->gpu->device_id,
+        gpu->gpu->sub_vendor_id,
+        gpu->gpu->sub_device_id
+    );
+
+    if (gpu->shard != NULL) {
+        gpu->dev->class_info = NULL;
+        rm_free_tree(gpu->ctl_fd, gpu->shard);
+        close(gpu->dev_fd);
+        close(gpu->ctl_fd);
+        rm_detach_gpus(mgr->fd, mgr->res->client, &gpu->gpu->identifier, 1);
+        free(gpu->gpu);
+    } else if (gpu->attached) {
+        /* Freeing the device detaches the GPU and releases its description. */
+        rm_free_subtree(mgr->fd, mgr->res, gpu->dev);
+    } else {
+        free(gpu->gpu);
+    }
+
+    free(gpu);
+}
+
+/*! \failure Probe Failure - The GPUs are left unchanged if the probed GPUs cannot be read.
+ * \todo Use proper logging.
+ */
+uint32_t sync_nv_mgr_gpus(struct NvMdev *mgr)
+{
+    struct Nv0000CtrlGpuGetProbedIdsParams probed_ids = {};
+    uint32_t probed_size = 0;
+
+    if (RM_CTRL(mgr->fd, mgr->res, NV0000_GET_PROBED_IDS, probed_ids) == NULL)
+        return mgr->gpus.size;
+
+    while (probed_size < 32 && probed_ids.gpu_ids[probed_size] != 0xFFFFFFFF)
+        ++probed_size;
+
+    /* Removals go first, so the GPUs added below are the last ones of the registry. */
+    for (uint32_t i = mgr->gpus.size; i-- > 0;) {
+        struct NvMdevGpu* gpu = nv_registry_at(&mgr->gpus, i);
+        uint8_t probed = 0;
+
+        for (uint32_t j = 0; j < probed_size && !probed; ++j)
+            probed = probed_ids.gpu_ids[j] == gpu->gpu->identifier;
+
+        if (!probed)
+            nv_remove_gpu(mgr, nv_registry_remove(&mgr->gpus, gpu->gpu->identifier));
+    }
+
+    uint32_t first = mgr->gpus.size;
+
+    for (uint32_t i = 0; i < probed_size; ++i) {
+        if (nv_registry_find_id(&mgr->gpus, probed_ids.gpu_ids[i]) != NULL)
+            continue;
+
+        struct NvMdevGpu* mgpu = nv_probe_gpu(mgr, probed_ids.gpu_ids[i], i);
+
+        if (mgpu == NULL)
+            continue;
+
+        if (!nv_registry_add(&mgr->gpus, mgpu)) {
+            free(mgpu->gpu);
+            free(mgpu);
+            continue;
+        }
+
+        printf(
+            "Added gpu: 0x%.8X (0x%.4X, 0x%.4X, 0x%.4X, 0x%.4X)\n",
+            mgpu->gpu->identifier,
+            mgpu->gpu->vendor_id,
+            mgpu->gpu->device_id,
+            mgpu->gpu->sub_vendor_id,
+            mgpu->gpu->sub_device_id
+        );
+    }
+
+    if (!(mgr->flags & NV_MGR_LAZY) && first < mgr->gpus.size)
+        attach_nv_mgr_gpus(mgr, mgr->gpus.entries + first, mgr->gpus.size - first);
+    else
+        nv_mgr_publish(mgr);
+
+    return first;
+}
+
+/*! \brief Checks if a uevent may change the GPUs of a manager.
+ *
+ * \param mgr - Manager to check.
+ * \param event - Received uevent.
+ * \return If the GPUs have to be synchronized.
+ */
+static uint8_t nv_uevent_changes_gpus(const struct NvMdev *mgr, const struct Uevent* event)
+{
+    if (strcmp(event->subsystem, "pci") != 0)
+        return 0;
+
+    /* The RM only probes a new GPU once the nvidia driver is bound to it. */
+    if (strcmp(event->action, "bind") == 0)
+        return strcmp(event->driver, "nvidia") == 0;
+
+    if (strcmp(event->action, "unbind") != 0 && strcmp(event->action, "remove") != 0)
+        return 0;
+
+    return event->has_slot && nv_registry_find_bdf(
+        &mgr->gpus, NV_GPU_BDF(event->domain, event->bus, event->slot, event->function)
+    ) != NULL;
+}
+
+/*! \failure Receive Failure - Events received before the failure are still handled.
+ */
+size_t handle_nv_mgr_uevents(struct NvMdev *mgr, int fd, const struct ConfigCatalog* catalog)
+{
+    struct Uevent event;
+    uint8_t changed = 0;
+
+    while (uevent_recv(fd, &event) == 1)
+        changed = changed || nv_uevent_changes_gpus(mgr, &event);
+
+    if (!changed)
+        return 0;
+
+    uint32_t size = mgr->gpus.size;
+    uint32_t first = sync_nv_mgr_gpus(mgr);
+    uint32_t added = mgr->gpus.size - first;
+
+    if (catalog != NULL && added > 0) {
+        create_nv_gpus_catalog_mdevs(mgr, catalog, mgr->gpus.entries + first, added);
+        register_nv_gpus_mdevs(mgr->gpus.entries + first, added);
+    }
+
+    return added + (size - first);
+}
@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include <gpu/nvidia/registry.h>
+#include <gpu/nvidia/resources.h>
+
+/*! \brief Mixes a key into a hash slot.
+ *
+ * \param key - Key to mix.
+ * \return Hash of the key.
+ */
+static uint64_t nv_registry_mix(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDULL;
+    key ^= key >> 33;
+    key *= 0xC4CEB9FE1A85EC53ULL;
+    key ^= key >> 33;
+
+    return key;
+}
+
+/*! \brief Finds the value stored for a key.
+ *
+ * \param hash - Index to search.
+ * \param key - Key to find.
+ * \return Index of the GPU plus one, 0 if the key is not in the index.
+ */
+static uint32_t nv_hash_get(const struct NvGpuHash* hash, uint64_t key)
+{
+    if (hash->capacity == 0)
+        return 0;
+
+    uint32_t mask = hash->capacity - 1;
+
+    for (uint32_t slot = nv_registry_mix(key) & mask; hash->values[slot] != 0; slot = (slot + 1) & mask)
+        if (hash->keys[slot] == key)
+            return hash->values[slot];
+
+    return 0;
+}
+
+/*! \brief Stores a value for a key, the key must not be in the index.
+ *
+ * \param hash - Index to store into, with at least one free slot.
+ * \param key - Key to store.
+ * \param value - Index of the GPU plus one.
+ */
+static void nv_hash_put(struct NvGpuHash* hash, uint64_t key, uint32_t value)
+{
+    uint32_t mask = hash->capacity - 1;
+    uint32_t slot = nv_registry_mix(key) & mask;
+
+    while (hash->values[slot] != 0)
+        slot = (slot + 1) & mask;
+
+    hash->keys[slot] = key;
+    hash->values[slot] = value;
+}
+
+/*! \brief Allocates an empty index.
+ *
+ * \param hash - Index to allocate.
+ * \param capacity - Number of slots, a power of two.
+ * \return If the index was allocated.
+ */
+static uint8_t nv_hash_alloc(struct NvGpuHash* hash, uint32_t capacity)
+{
+    uint64_t* keys = calloc(capacity, sizeof(*keys));
+    uint32_t* values = calloc(capacity, sizeof(*values));
+
+    if (keys == NULL || values == NULL) {
+        free(keys);
+        free(values);
+        return 0;
+    }
+
+    free(hash->keys);
+    free(hash->values);
+
+    hash->keys = keys;
+    hash->values = values;
+    hash->capacity = capacity;
+
+    return 1;
+}
+
+/*! \brief Rebuilds the indexes from the arrays of the registry.
+ *
+ * \param registry - Registry whose indexes are rebuilt.
+ */
+static void nv_registry_rehash(struct NvGpuRegistry* registry)
+{
+    struct NvGpuHash* hashes[] = { &registry->by_id, &registry->by_bdf, &registry->by_minor };
+
+    for (uint32_t i = 0; i < 3; ++i)
+        if (hashes[i]->capacity != 0)
+            memset(hashes[i]->values, 0, hashes[i]->capacity * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < registry->size; ++i) {
+        nv_hash_put(&registry->by_id, registry->ids[i], i + 1);
+        nv_hash_put(&registry->by_bdf, registry->bdfs[i], i + 1);
+        nv_hash_put(&registry->by_minor, registry->minors[i], i + 1);
+    }
+}
+
+/*! \brief Grows the arrays and indexes of a registry.
+ *
+ * The indexes keep at least twice as many slots as there are GPUs.
+ *
+ * \param registry - Registry to grow.
+ * \return If the registry was grown.
+ */
+static uint8_t nv_registry_grow(struct NvGpuRegistry* registry)
+{
+    uint32_t capacity = registry->capacity == 0 ? 8 : registry->capacity * 2;
+
+    uint32_t* ids = realloc(registry->ids, capacity * sizeof(*ids));
+    if (ids == NULL)
+        return 0;
+    registry->ids = ids;
+
+    uint64_t* bdfs = realloc(registry->bdfs, capacity * sizeof(*bdfs));
+    if (bdfs == NULL)
+        return 0;
+    registry->bdfs = bdfs;
+
+    uint16_t* minors = realloc(registry->minors, capacity * sizeof(*minors));
+    if (minors == NULL)
+        return 0;
+    registry->minors = minors;
+
+    struct NvMdevGpu** entries = realloc(registry->entries, capacity * sizeof(*entries));
+    if (entries == NULL)
+        return 0;
+    registry->entries = entries;
+
+    if (!nv_hash_alloc(&registry->by_id, capacity * 2) ||
+        !nv_hash_alloc(&registry->by_bdf, capacity * 2) ||
+        !nv_hash_alloc(&registry->by_minor, capacity * 2)) {
+        /* Indexes that were already replaced are empty and must be refilled. */
+        nv_registry_rehash(registry);
+        return 0;
+    }
+
+    registry->capacity = capacity;
+    nv_registry_rehash(registry);
+
+    return 1;
+}
+
+/*! \failure Fails if the RM id is already registered or if the registry could not be grown. */
+uint8_t nv_registry_add(struct NvGpuRegistry* registry, struct NvMdevGpu* gpu)
+{
+    if (nv_hash_get(&registry->by_id, gpu->gpu->identifier) != 0)
+        return 0;
+
+    if (registry->size == registry->capacity && !nv_registry_grow(registry))
+        return 0;
+
+    uint32_t index = registry->size++;
+
+    registry->ids[index] = gpu->gpu->identifier;
+    registry->bdfs[index] = NV_GPU_BDF(gpu->gpu->domain, gpu->gpu->bus, gpu->gpu->slot, gpu->gpu->function);
+    registry->minors[index] = gpu->minor;
+    registry->entries[index] = gpu;
+
+    nv_hash_put(&registry->by_id, registry->ids[index], index + 1);
+    nv_hash_put(&registry->by_bdf, registry->bdfs[index], index + 1);
+    nv_hash_put(&registry->by_minor, registry->minors[index], index + 1);
+
+    return 1;
+}
+
+struct NvMdevGpu* nv_registry_remove(struct NvGpuRegistry* registry, uint32_t id)
+{
+    uint32_t value = nv_hash_get(&registry->by_id, id);
+
+    if (value == 0)
+        return NULL;
+
+    uint32_t index = value - 1;
+    uint32_t tail = registry->size - index - 1;
+    struct NvMdevGpu* ret = registry->entries[index];
+
+    memmove(&registry->ids[index], &registry->ids[index + 1], tail * sizeof(*registry->ids));
+    memmove(&registry->bdfs[index], &registry->bdfs[index + 1], tail * sizeof(*registry->bdfs));
+    memmove(&registry->minors[index], &registry->minors[index + 1], tail * sizeof(*registry->minors));
+    memmove(&registry->entries[index], &registry->entries[index + 1], tail * sizeof(*registry->entries));
+
+    --registry->size;
+
+    /* Every GPU after the removed one moved down, so the indexes are rebuilt. */
+    nv_registry_rehash(registry);
+
+    return ret;
+}
+
+struct NvMdevGpu* nv_registry_find_id(const struct NvGpuRegistry* registry, uint32_t id)
+{
+    uint32_t value = nv_hash_get(&registry->by_id, id);
+
+    return value == 0 ? NULL : registry->entries[value - 1];
+}
+
+struct NvMdevGpu* nv_registry_find_bdf(const struct NvGpuRegistry* registry, uint64_t bdf)
+{
+    uint32_t value = nv_hash_get(&registry->by_bdf, bdf);
+
+    return value == 0 ? NULL : registry->entries[value - 1];
+}
+
+struct NvMdevGpu* nv_registry_find_minor(const struct NvGpuRegistry* registry, uint16_t minor)
+{
+    uint32_t value = nv_hash_get(&registry->by_minor, minor);
+
+    return value == 0 ? NULL : registry->entries[value - 1];
+}
+
+void nv_registry_free(struct NvGpuRegistry* registry)
+{
+    free(registry->ids);
+    free(registry->bdfs);
+    free(registry->minors);
+    free(registry->entries);
+    free(registry->by_id.keys);
+    free(registry->by_id.values);
+    free(registry->by_bdf.keys);
+    free(registry->by_bdf.values);
+    free(registry->by_minor.keys);
+    free(registry->by_minor.values);
+
+    memset(registry, 0, sizeof(*registry));
+}
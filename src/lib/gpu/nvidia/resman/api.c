@@ -19,17 +19,168 @@
 #include <gpu/nvidia/resman/api.h>
 #include <gpu/nvidia/resman/classes.h>
 #include <gpu/nvidia/resman/ioctl.h>
+#include <gpu/nvidia/resman/supervisor.h>
 #include <gpu/nvidia/resman/types.h>
 
 #include <gpu/nvidia/resources.h>
 
 #include <gpu/mdev.h>
 
+#include <utils/epoch.h>
+
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+/*! \brief Lock of the links of the resource trees.
+ *
+ * Appends only race with each other through their exchanges and share the lock, an unlink
+ * stores the links of its siblings and takes it exclusively. Readers only rely on the epochs.
+ */
+static pthread_rwlock_t TREE_LOCK = PTHREAD_RWLOCK_INITIALIZER;
+
+/*! \brief Issues an ioctl on the kernel module. */
+static int rm_sys_ioctl(int fd, unsigned long request, void* data)
+{
+    return ioctl(fd, request, data);
+}
+
+//! Function every RM ioctl is issued through.
+static RmIoctl RM_IOCTL = rm_sys_ioctl;
+
+/*! \brief Issues an ioctl through the installed hook.
+ *
+ * The call is tracked by the supervisor, a call it interrupted fails with ETIMEDOUT.
+ */
+static int rm_ioctl(int fd, unsigned long request, void* data, uint32_t command)
+{
+    int slot = rm_supervisor_enter(fd, request, command);
+    int ret = __atomic_load_n(&RM_IOCTL, __ATOMIC_ACQUIRE)(fd, request, data);
+    int error = errno;
+
+    if (rm_supervisor_leave(slot) && ret == -1)
+        error = ETIMEDOUT;
+
+    errno = error;
+
+    return ret;
+}
+
+void rm_set_ioctl(RmIoctl hook)
+{
+    __atomic_store_n(&RM_IOCTL, hook != NULL ? hook : rm_sys_ioctl, __ATOMIC_RELEASE);
+}
+
+/*! \brief Retry policy of a single command. */
+struct RmRetryEntry {
+    uint32_t command;                   //!< Command the policy applies to.
+    struct RmRetryPolicy policy;        //!< Retry policy.
+};
+
+/*! \brief Immutable table of retry policies, replaced as a whole on updates. */
+struct RmRetryTable {
+    struct RmRetryPolicy fallback;      //!< Policy of the commands without an entry.
+    uint32_t size;                      //!< Number of entries.
+    struct RmRetryEntry entries[];      //!< Policies of single commands.
+};
+
+//! Retry policies, NULL until a policy is set.
+static struct RmRetryTable* RETRY_TABLE = NULL;
+
+//! Lock serializing updates of the retry policies.
+static pthread_mutex_t RETRY_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+//! Retry policy of every command until one is set.
+static const struct RmRetryPolicy RETRY_DEFAULT = {
+    .attempts = 3,
+    .backoff_us = 500,
+    .max_backoff_us = 8000
+};
+
+/*! \failure Out Of Memory - The policies are left unchanged.
+ */
+void rm_set_retry_policy(uint32_t command, const struct RmRetryPolicy* policy)
+{
+    pthread_mutex_lock(&RETRY_LOCK);
+
+    struct RmRetryTable* old = RETRY_TABLE;
+    uint32_t size = old != NULL ? old->size : 0;
+    struct RmRetryTable* table = malloc(sizeof(struct RmRetryTable) + (size + 1) * sizeof(struct RmRetryEntry));
+
+    if (table == NULL) {
+        pthread_mutex_unlock(&RETRY_LOCK);
+        return;
+    }
+
+    table->fallback = old != NULL ? old->fallback : RETRY_DEFAULT;
+    table->size = 0;
+
+    for (uint32_t i = 0; i < size; ++i)
+        if (old->entries[i].command != command)
+            table->entries[table->size++] = old->entries[i];
+
+    if (command == RM_RETRY_ALL)
+        table->fallback = policy != NULL ? *policy : RETRY_DEFAULT;
+    else if (policy != NULL)
+        table->entries[table->size++] = (struct RmRetryEntry) {command, *policy};
+
+    __atomic_store_n(&RETRY_TABLE, table, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&RETRY_LOCK);
+
+    epoch_retire(old, free);
+}
+
+struct RmRetryPolicy rm_get_retry_policy(uint32_t command)
+{
+    struct RmRetryPolicy ret = RETRY_DEFAULT;
+
+    epoch_enter();
+
+    struct RmRetryTable* table = __atomic_load_n(&RETRY_TABLE, __ATOMIC_ACQUIRE);
+
+    if (table != NULL) {
+        ret = table->fallback;
+
+        for (uint32_t i = 0; i < table->size; ++i)
+            if (table->entries[i].command == command)
+                ret = table->entries[i].policy;
+    }
+
+    epoch_exit();
+
+    return ret;
+}
+
+/*! \brief Checks if a failed RM call is retried, waiting for the backoff if it is.
+ *
+ * \param policy - Retry policy of the call.
+ * \param attempt - Attempts made so far, minus one.
+ * \param ret - Return value of the ioctl.
+ * \param status - RM status of the call.
+ * \param backoff - Microseconds to wait, doubled for the next attempt.
+ * \return If the call must be issued again.
+ */
+static uint8_t rm_retry(const struct RmRetryPolicy* policy, uint32_t attempt, int ret, uint32_t status,
+                        uint32_t* backoff)
+{
+    if (attempt + 1 >= policy->attempts)
+        return 0;
+
+    if (ret == -1 && errno != EINTR && errno != EAGAIN)
+        return 0;
+
+    if (ret != -1 && status != NV_ERR_BUSY_RETRY && status != NV_ERR_TIMEOUT_RETRY)
+        return 0;
+
+    usleep(*backoff);
+    *backoff = *backoff * 2 < policy->max_backoff_us ? *backoff * 2 : policy->max_backoff_us;
+
+    return 1;
+}
+
 /*! \failure Invalid File Descriptor - This occurs when ctl_fd is -1.
  * \failure Invalid RM Version - This will occur when there is a mismatch on the driver
  *                               and the user suite.
@@ -50,7 +201,7 @@ uint8_t rm_version_check(int ctl_fd, uint8_t ignore_version, const char* version
     if (version != NULL)
         strncpy(version_check.version, version, sizeof(version_check.version));
 
-    ret = ioctl(ctl_fd, NV_VERSION_CHECK, &version_check) != -1;
+    ret = rm_ioctl(ctl_fd, NV_VERSION_CHECK, &version_check, 0) != -1;
 
     if (ret)
         ret = version_check.reply == 1;
@@ -58,6 +209,40 @@ uint8_t rm_version_check(int ctl_fd, uint8_t ignore_version, const char* version
     return ret;
 }
 
+/*! \failure Invalid File Descriptor - Occurs when fd is -1.
+ * \failure Incorrect File Descriptor - Occurs when fd is an incorrect descriptor.
+ * \failure RM Busy - Retried with backoff according to the retry policy of RM_RETRY_ALL.
+ */
+uint32_t rm_alloc_obj(int fd, uint32_t client, uint32_t parent, uint32_t object, uint32_t rm_class, void* data)
+{
+    struct RmAllocRes alloc_res = {};
+    struct RmRetryPolicy policy = rm_get_retry_policy(RM_RETRY_ALL);
+    uint32_t backoff = policy.backoff_us;
+    int ret;
+
+    if (fd == -1)
+        return 0;
+
+    alloc_res.hRoot = client;
+    alloc_res.hObjectParent = parent;
+    alloc_res.hClass = rm_class;
+    alloc_res.pAllocParams = data;
+
+    for (uint32_t attempt = 0;; ++attempt) {
+        alloc_res.hObjectNew = object;
+        alloc_res.status = 0;
+        ret = rm_ioctl(fd, NV_ALLOC_RES, &alloc_res, rm_class);
+
+        if (!rm_retry(&policy, attempt, ret, alloc_res.status, &backoff))
+            break;
+    }
+
+    if (ret == -1 || alloc_res.status != 0)
+        return 0;
+
+    return alloc_res.hObjectNew;
+}
+
 /*! \failure Invalid File Descriptor - Occurs when fd is -1.
  * \failure Incorrect File Descriptor - Occurs when fd is an incorrect descriptor.
  * \todo Inform user of status error if there is an error.
@@ -70,96 +255,282 @@ struct NvResource* rm_alloc_res(
     void* data
 )
 {
-    struct NvResource* ret = NULL;
-    struct RmAllocRes alloc_res = {};
+    uint32_t client = parent != NULL ? parent->client : 0;
+    uint32_t handle = rm_alloc_obj(fd, client, parent != NULL ? parent->object : 0, object, rm_class, data);
 
-    if (fd == -1)
+    if (handle == 0)
         return NULL;
 
-    alloc_res.hObjectNew = object;
-    alloc_res.hClass = rm_class;
-    alloc_res.pAllocParams = data;
+    struct NvResource* ret = calloc(1, sizeof(struct NvResource));
 
-    if (parent != NULL) {
-        alloc_res.hRoot = parent->client;
-        alloc_res.hObjectParent = parent->object;
+    if (ret == NULL) {
+        rm_free_obj(fd, parent != NULL ? client : handle, parent != NULL ? parent->object : handle, handle);
+        return NULL;
     }
 
-    if (ioctl(fd, NV_ALLOC_RES, &alloc_res) != -1) {
-        if (alloc_res.status == 0x00)
-            ret = calloc(1, sizeof(struct NvResource));
-
-        if (ret != NULL) {
-            ret->fd = fd;
-            ret->object = alloc_res.hObjectNew;
-            ret->rm_class = rm_class;
-            ret->class_info = data;
-
-            if (parent == NULL) {
-                ret->client = alloc_res.hObjectNew;
-                ret->parent = alloc_res.hObjectNew;
-            } else {
-                ret->client = parent->client;
-                ret->parent = parent->object;
-
-                struct NvResource* child = parent->child;
-                while (child != NULL && child->next != NULL)
-                    child = child->next;
-                if (child != NULL)
-                    child->next = ret;
-                else
-                    parent->child = ret;
-            }
-        }
+    ret->fd = fd;
+    ret->object = handle;
+    ret->rm_class = rm_class;
+    ret->class_info = data;
 
+    if (parent == NULL) {
+        ret->client = handle;
+        ret->parent = handle;
         return ret;
     }
 
-    return NULL;
+    ret->client = parent->client;
+    ret->parent = parent->object;
+
+    epoch_enter();
+    pthread_rwlock_rdlock(&TREE_LOCK);
+
+    struct NvResource* last = __atomic_load_n(&parent->last, __ATOMIC_ACQUIRE);
+    struct NvResource** link = last != NULL ? &last->next : &parent->child;
+
+    /* Lock-free append, a failed exchange returns the sibling to continue from. */
+    last = NULL;
+    while (!__atomic_compare_exchange_n(link, &last, ret, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+        link = &last->next;
+        last = NULL;
+    }
+
+    __atomic_store_n(&parent->last, ret, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&TREE_LOCK);
+    epoch_exit();
+
+    return ret;
 }
 
 /*! \failure Invalid File Descriptor - Occurs when fd is -1.
  * \failure Incorrect File Descriptor - Occurs when the fd is an incorrect file descriptor.
  */
-uint8_t rm_free_res(int fd, struct NvResource* object)
+uint8_t rm_free_obj(int fd, uint32_t client, uint32_t parent, uint32_t object)
 {
     struct RmFreeRes free_res = {};
 
-    if (object == NULL || fd == -1)
+    if (fd == -1 || object == 0)
         return 0;
 
-    free_res.hRoot = object->client;
-    free_res.hObjectParent = object->parent;
-    free_res.hObjectOld = object->object;
+    free_res.hRoot = client;
+    free_res.hObjectParent = parent;
+    free_res.hObjectOld = object;
 
-    return (ioctl(fd, NV_FREE_RES, &free_res) != -1 && free_res.status == 0);
+    return (rm_ioctl(fd, NV_FREE_RES, &free_res, 0) != -1 && free_res.status == 0);
 }
 
-void rm_free_tree(int fd, struct NvResource* root)
+/*! \failure Invalid File Descriptor - Occurs when fd is -1.
+ * \failure Incorrect File Descriptor - Occurs when the fd is an incorrect file descriptor.
+ */
+uint8_t rm_free_res(int fd, struct NvResource* object)
 {
-    if (root == NULL)
-        return;
+    if (object == NULL)
+        return 0;
+
+    return rm_free_obj(fd, object->client, object->parent, object->object);
+}
+
+/*! \brief GPU ids waiting to be detached from a client. */
+struct RmDetachBatch {
+    uint32_t client;                     //!< Client the GPUs are detached from.
+    uint32_t size;                       //!< Number of GPU ids.
+    uint32_t gpu_ids[32];                //!< GPU ids to detach.
+};
+
+/*! \brief Detaches every GPU in the batch and empties it. */
+static void rm_flush_detach(int fd, struct RmDetachBatch* batch)
+{
+    if (batch->size > 0)
+        rm_detach_gpus(fd, batch->client, batch->gpu_ids, batch->size);
+
+    batch->size = 0;
+}
+
+static void rm_free_nodes(int fd, struct NvResource* root, struct RmDetachBatch* batch);
+
+/*! \brief Frees a resource and its children.
+ *
+ * GPUs attached for device resources are queued in the batch, which is flushed before the
+ * client owning them is freed.
+ */
+static void rm_free_node(int fd, struct NvResource* root, struct RmDetachBatch* batch)
+{
+    rm_free_nodes(fd, root->child, batch);
 
-    rm_free_tree(fd, root->child);
-    rm_free_tree(fd, root->next);
+    if (root->object == root->client)
+        rm_flush_detach(fd, batch);
 
     rm_free_res(fd, root);
 
-    if (root->rm_class == 0x00000080 && root->class_info != NULL) {
-        struct Nv0000CtrlGpuDeAttachIdsParams deattach_ids = {};
-        deattach_ids.gpu_ids[0] = ((struct Gpu*) root->class_info)->identifier;
-        deattach_ids.gpu_ids[1] = 0xFFFFFFFF;
+    if (root->rm_class == NV0080_CLASS && root->class_info != NULL) {
+        if (batch->size == 32 || (batch->size > 0 && batch->client != root->client))
+            rm_flush_detach(fd, batch);
+
+        batch->client = root->client;
+        batch->gpu_ids[batch->size++] = ((struct Gpu*) root->class_info)->identifier;
+
         close(root->fd);
-        _RM_CTRL(fd, root->client, root->client, NV0000_DEATTACH_IDS, deattach_ids);
-        free(root->class_info);
+        epoch_retire(root->class_info, free);
     }
 
-    free(root);
+    epoch_retire(root, free);
+}
+
+/*! \brief Frees a resource, its children and its next siblings. */
+static void rm_free_nodes(int fd, struct NvResource* root, struct RmDetachBatch* batch)
+{
+    if (root == NULL)
+        return;
+
+    rm_free_nodes(fd, root->next, batch);
+    rm_free_node(fd, root, batch);
+}
+
+void rm_free_tree(int fd, struct NvResource* root)
+{
+    struct RmDetachBatch batch = {};
+
+    rm_free_nodes(fd, root, &batch);
+    rm_flush_detach(fd, &batch);
+    epoch_reclaim();
+}
+
+/*! \failure Not A Child - Nothing is freed if the node is not a child of the parent.
+ */
+uint8_t rm_free_subtree(int fd, struct NvResource* parent, struct NvResource* node)
+{
+    struct RmDetachBatch batch = {};
+    struct NvResource** link = &parent->child;
+    struct NvResource* prev = NULL;
+
+    /* No append is in flight, an append to the node would be lost with it. */
+    pthread_rwlock_wrlock(&TREE_LOCK);
+
+    while (*link != NULL && *link != node) {
+        prev = *link;
+        link = &prev->next;
+    }
+
+    if (*link == NULL) {
+        pthread_rwlock_unlock(&TREE_LOCK);
+        return 0;
+    }
+
+    /* Appends walk forward from the hint, which must not point into the unlinked node. */
+    if (__atomic_load_n(&parent->last, __ATOMIC_ACQUIRE) == node)
+        __atomic_store_n(&parent->last, prev, __ATOMIC_RELEASE);
+
+    /* Readers standing on the node still reach its siblings through its next pointer. */
+    __atomic_store_n(link, __atomic_load_n(&node->next, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&TREE_LOCK);
+
+    rm_free_node(fd, node, &batch);
+    rm_flush_detach(fd, &batch);
+    epoch_reclaim();
+
+    return 1;
+}
+
+/*! \restriction Must be called inside an epoch critical section.
+ */
+struct NvResource* rm_find_res(struct NvResource* root, uint32_t object)
+{
+    if (root == NULL || root->object == object)
+        return root;
+
+    struct NvResource* child = __atomic_load_n(&root->child, __ATOMIC_ACQUIRE);
+
+    for (; child != NULL; child = __atomic_load_n(&child->next, __ATOMIC_ACQUIRE)) {
+        struct NvResource* ret = rm_find_res(child, object);
+
+        if (ret != NULL)
+            return ret;
+    }
+
+    return NULL;
+}
+
+/*! \failure Batch Failure - Falls back to attaching the remaining GPUs one at a time.
+ */
+uint32_t rm_attach_gpus(
+    int fd,
+    struct NvResource* client,
+    const uint32_t* gpu_ids,
+    uint32_t size,
+    uint8_t* attached
+)
+{
+    uint32_t ret = 0;
+
+    for (uint32_t start = 0; start < size; start += 32) {
+        struct Nv0000CtrlGpuAttachIdsParams attach_ids = {};
+        uint32_t batch = size - start < 32 ? size - start : 32;
+        uint32_t retry = 0;
+
+        memset(attach_ids.gpu_ids, 0xFF, sizeof(attach_ids.gpu_ids));
+        memcpy(attach_ids.gpu_ids, gpu_ids + start, batch * sizeof(uint32_t));
+        attach_ids.failed_gpu_id = 0xFFFFFFFF;
+
+        if (RM_CTRL(fd, client, NV0000_ATTACH_IDS, attach_ids) != NULL) {
+            memset(attached + start, 1, batch);
+            ret += batch;
+            continue;
+        }
+
+        /* GPUs before the failed one were attached by the batch. */
+        for (uint32_t i = 0; i < batch; ++i) {
+            if (gpu_ids[start + i] == attach_ids.failed_gpu_id) {
+                memset(attached + start, 1, i);
+                attached[start + i] = 0;
+                ret += i;
+                retry = i + 1;
+                break;
+            }
+        }
+
+        for (uint32_t i = retry; i < batch; ++i) {
+            struct Nv0000CtrlGpuAttachIdsParams attach_id = {};
+
+            memset(attach_id.gpu_ids, 0xFF, sizeof(attach_id.gpu_ids));
+            attach_id.gpu_ids[0] = gpu_ids[start + i];
+
+            attached[start + i] = RM_CTRL(fd, client, NV0000_ATTACH_IDS, attach_id) != NULL;
+            ret += attached[start + i];
+        }
+    }
+
+    return ret;
+}
+
+/*! \failure Batch Failure - Falls back to detaching the GPUs one at a time.
+ */
+void rm_detach_gpus(int fd, uint32_t client, const uint32_t* gpu_ids, uint32_t size)
+{
+    for (uint32_t start = 0; start < size; start += 32) {
+        struct Nv0000CtrlGpuDeAttachIdsParams deattach_ids = {};
+        uint32_t batch = size - start < 32 ? size - start : 32;
+
+        memset(deattach_ids.gpu_ids, 0xFF, sizeof(deattach_ids.gpu_ids));
+        memcpy(deattach_ids.gpu_ids, gpu_ids + start, batch * sizeof(uint32_t));
+
+        if (_RM_CTRL(fd, client, client, NV0000_DEATTACH_IDS, deattach_ids) != NULL)
+            continue;
+
+        for (uint32_t i = 0; i < batch; ++i) {
+            struct Nv0000CtrlGpuDeAttachIdsParams deattach_id = {};
+
+            memset(deattach_id.gpu_ids, 0xFF, sizeof(deattach_id.gpu_ids));
+            deattach_id.gpu_ids[0] = gpu_ids[start + i];
+
+            _RM_CTRL(fd, client, client, NV0000_DEATTACH_IDS, deattach_id);
+        }
+    }
 }
 
 /*! \failure Invalid File Descriptor - Occurs when fd is -1.
  * \failure Incorrect File Descriptor - Occurs when the fd is an incorrect file descriptor.
  * \failure RM Failure - Occurs when incorrect information is placed.
+ * \failure RM Busy - Retried with backoff according to the retry policy of the command.
  */
 void* rm_ctrl_res(int fd, uint32_t client, uint32_t device, uint32_t command, void* data, uint32_t size)
 {
@@ -174,7 +545,19 @@ void* rm_ctrl_res(int fd, uint32_t client, uint32_t device, uint32_t command, vo
     ctrl_res.params = data;
     ctrl_res.param_size = size;
 
-    if (ioctl(fd, NV_CONTROL_RES, &ctrl_res) == -1)
+    struct RmRetryPolicy policy = rm_get_retry_policy(command);
+    uint32_t backoff = policy.backoff_us;
+    int ret;
+
+    for (uint32_t attempt = 0;; ++attempt) {
+        ctrl_res.status = 0;
+        ret = rm_ioctl(fd, NV_CONTROL_RES, &ctrl_res, command);
+
+        if (!rm_retry(&policy, attempt, ret, ctrl_res.status, &backoff))
+            break;
+    }
+
+    if (ret == -1)
         return NULL;
 
     if (ctrl_res.status == 0)
@@ -213,8 +596,27 @@ uint8_t rm_alloc_os_event(int fd, uint32_t client_id, uint32_t device_id)
     event.device = device_id;
     event.fd = fd;
 
-    if (ioctl(fd, NV_CREATE_OS_EVENT, &event) == -1 || event.status != 0)
+    if (rm_ioctl(fd, NV_CREATE_OS_EVENT, &event, 0) == -1 || event.status != 0)
         return 0;
 
     return event.status == 0;
 }
+
+/*! \failure Empty Queue - Returns 0 when no event is queued on the file.
+ */
+uint8_t rm_get_event_data(int fd, struct RmEventData* event, uint8_t* more)
+{
+    struct RmGetEventData get_data = {};
+
+    memset(event, 0, sizeof(struct RmEventData));
+    get_data.event = (uint64_t) (uintptr_t) event;
+
+    *more = 0;
+
+    if (rm_ioctl(fd, NV_GET_EVENT_DATA, &get_data, 0) == -1 || get_data.status != 0)
+        return 0;
+
+    *more = get_data.more_events != 0;
+
+    return 1;
+}
@@ -0,0 +1,392 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <gpu/nvidia/resman/api.h>
+#include <gpu/nvidia/resman/async.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*! \brief Kind of an asynchronous RM operation. */
+enum RmAsyncKind {
+    RM_ASYNC_CTRL,              //!< rm_ctrl_res.
+    RM_ASYNC_ALLOC              //!< rm_alloc_res.
+};
+
+//! Internal state of an operation being issued by a worker.
+#define RM_ASYNC_RUNNING 0xFF
+
+/*! \brief Asynchronous RM operation. */
+struct RmAsyncOp {
+    enum RmAsyncKind kind;              //!< Kind of the operation.
+    int fd;                             //!< File the call is issued on.
+    uint32_t client;                    //!< Client for controls.
+    uint32_t object;                    //!< Object controlled or allocated.
+    uint32_t command;                   //!< Control command or allocated class.
+    uint32_t size;                      //!< Size of the control data.
+    void* data;                         //!< Control or allocation data.
+    struct NvResource* parent;          //!< Parent of an allocation.
+    struct RmAsyncCompletion completion;//!< How the completion is reported.
+    struct timespec deadline;           //!< Deadline to issue the call by.
+    void* result;                       //!< Result of the call.
+    uint32_t state;                     //!< State of the operation.
+    uint32_t refs;                      //!< References of the caller and the worker.
+    pthread_mutex_t lock;               //!< Lock for waiting on completion.
+    pthread_cond_t done;                //!< Signalled on completion.
+    struct RmAsyncOp* next;             //!< Next operation in the worker queue.
+};
+
+/*! \brief Worker issuing the operations of its queue in order. */
+struct RmAsyncWorker {
+    pthread_t thread;                   //!< Worker thread.
+    pthread_mutex_t lock;               //!< Lock protecting the queue.
+    pthread_cond_t wake;                //!< Signalled when the queue changes.
+    struct RmAsyncOp* head;             //!< First queued operation.
+    struct RmAsyncOp* tail;             //!< Last queued operation.
+    uint8_t stop;                       //!< If the worker must exit.
+};
+
+/*! \brief Executor for asynchronous RM operations. */
+struct RmAsync {
+    uint32_t size;                      //!< Number of workers.
+    struct RmAsyncWorker workers[];     //!< Workers.
+};
+
+/*! \brief Drops a reference to an operation. */
+static void rm_async_unref(struct RmAsyncOp* op)
+{
+    if (__atomic_sub_fetch(&op->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    pthread_cond_destroy(&op->done);
+    pthread_mutex_destroy(&op->lock);
+    free(op);
+}
+
+/*! \brief Publishes the final state of an operation and reports it. */
+static void rm_async_complete(struct RmAsyncOp* op, enum RmAsyncState state)
+{
+    pthread_mutex_lock(&op->lock);
+    __atomic_store_n(&op->state, state, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&op->done);
+    pthread_mutex_unlock(&op->lock);
+
+    if (op->completion.event_fd != -1) {
+        uint64_t value = 1;
+        ssize_t written;
+
+        do {
+            written = write(op->completion.event_fd, &value, sizeof(value));
+        } while (written == -1 && errno == EINTR);
+    }
+
+    if (op->completion.callback != NULL)
+        op->completion.callback(op, op->completion.user);
+}
+
+/*! \brief Issues an operation, unless it expired. */
+static void rm_async_run(struct RmAsyncOp* op)
+{
+    uint32_t pending = RM_ASYNC_PENDING;
+    struct timespec now;
+
+    if (!__atomic_compare_exchange_n(&op->state, &pending, RM_ASYNC_RUNNING, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (op->completion.deadline_ms != 0 &&
+        (now.tv_sec > op->deadline.tv_sec ||
+         (now.tv_sec == op->deadline.tv_sec && now.tv_nsec >= op->deadline.tv_nsec))) {
+        rm_async_complete(op, RM_ASYNC_EXPIRED);
+        return;
+    }
+
+    if (op->kind == RM_ASYNC_CTRL)
+        op->result = rm_ctrl_res(op->fd, op->client, op->object, op->command, op->data, op->size);
+    else
+        op->result = rm_alloc_res(op->fd, op->parent, op->object, op->command, op->data);
+
+    rm_async_complete(op, op->result != NULL ? RM_ASYNC_DONE : RM_ASYNC_FAILED);
+}
+
+/*! \brief Main loop of a worker. */
+static void* rm_async_worker(void* arg)
+{
+    struct RmAsyncWorker* worker = arg;
+
+    pthread_mutex_lock(&worker->lock);
+
+    for (;;) {
+        while (worker->head == NULL && !worker->stop)
+            pthread_cond_wait(&worker->wake, &worker->lock);
+
+        struct RmAsyncOp* op = worker->head;
+
+        if (op == NULL)
+            break;
+
+        uint8_t stop = worker->stop;
+
+        worker->head = op->next;
+        if (worker->head == NULL)
+            worker->tail = NULL;
+
+        pthread_mutex_unlock(&worker->lock);
+
+        /* Operations left at destruction are cancelled instead of issued. */
+        if (stop)
+            rm_async_cancel(op);
+        else
+            rm_async_run(op);
+        rm_async_unref(op);
+
+        pthread_mutex_lock(&worker->lock);
+    }
+
+    pthread_mutex_unlock(&worker->lock);
+
+    return NULL;
+}
+
+/*! \failure Thread Failure - Returns NULL when a worker could not be started.
+ */
+struct RmAsync* rm_async_create(uint32_t workers)
+{
+    if (workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        workers = cpus > 0 ? cpus : 1;
+    }
+
+    struct RmAsync* ret = calloc(1, sizeof(struct RmAsync) + workers * sizeof(struct RmAsyncWorker));
+
+    if (ret == NULL)
+        return NULL;
+
+    for (; ret->size < workers; ++ret->size) {
+        struct RmAsyncWorker* worker = &ret->workers[ret->size];
+
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->wake, NULL);
+
+        if (pthread_create(&worker->thread, NULL, rm_async_worker, worker) != 0) {
+            pthread_cond_destroy(&worker->wake);
+            pthread_mutex_destroy(&worker->lock);
+            rm_async_destroy(ret);
+            return NULL;
+        }
+    }
+
+    return ret;
+}
+
+void rm_async_destroy(struct RmAsync* async)
+{
+    if (async == NULL)
+        return;
+
+    for (uint32_t i = 0; i < async->size; ++i) {
+        pthread_mutex_lock(&async->workers[i].lock);
+        async->workers[i].stop = 1;
+        pthread_cond_signal(&async->workers[i].wake);
+        pthread_mutex_unlock(&async->workers[i].lock);
+    }
+
+    for (uint32_t i = 0; i < async->size; ++i) {
+        pthread_join(async->workers[i].thread, NULL);
+        pthread_cond_destroy(&async->workers[i].wake);
+        pthread_mutex_destroy(&async->workers[i].lock);
+    }
+
+    free(async);
+}
+
+/*! \brief Creates an operation holding a reference for the caller and the worker. */
+static struct RmAsyncOp* rm_async_op(const struct RmAsyncCompletion* completion)
+{
+    struct RmAsyncOp* op = calloc(1, sizeof(struct RmAsyncOp));
+    pthread_condattr_t attr;
+
+    if (op == NULL)
+        return NULL;
+
+    op->refs = 2;
+    op->state = RM_ASYNC_PENDING;
+    op->completion.event_fd = -1;
+
+    if (completion != NULL)
+        op->completion = *completion;
+
+    clock_gettime(CLOCK_MONOTONIC, &op->deadline);
+    op->deadline.tv_sec += op->completion.deadline_ms / 1000;
+    op->deadline.tv_nsec += (op->completion.deadline_ms % 1000) * 1000000L;
+    if (op->deadline.tv_nsec >= 1000000000L) {
+        op->deadline.tv_sec += 1;
+        op->deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&op->done, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&op->lock, NULL);
+
+    return op;
+}
+
+/*! \brief Queues an operation on the worker of a GPU. */
+static struct RmAsyncOp* rm_async_submit(struct RmAsync* async, uint32_t gpu_id, struct RmAsyncOp* op)
+{
+    /* Spreads consecutive GPU ids over the workers. */
+    struct RmAsyncWorker* worker = &async->workers[(gpu_id * 0x9E3779B1u) % async->size];
+
+    pthread_mutex_lock(&worker->lock);
+
+    if (worker->tail != NULL)
+        worker->tail->next = op;
+    else
+        worker->head = op;
+    worker->tail = op;
+
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->lock);
+
+    return op;
+}
+
+/*! \failure Out Of Memory - Returns NULL when the operation could not be allocated.
+ */
+struct RmAsyncOp* rm_ctrl_res_async(
+    struct RmAsync* async,
+    uint32_t gpu_id,
+    int fd,
+    uint32_t client,
+    uint32_t device,
+    uint32_t command,
+    void* data,
+    uint32_t size,
+    const struct RmAsyncCompletion* completion
+)
+{
+    struct RmAsyncOp* op = rm_async_op(completion);
+
+    if (op == NULL)
+        return NULL;
+
+    op->kind = RM_ASYNC_CTRL;
+    op->fd = fd;
+    op->client = client;
+    op->object = device;
+    op->command = command;
+    op->data = data;
+    op->size = size;
+
+    return rm_async_submit(async, gpu_id, op);
+}
+
+/*! \failure Out Of Memory - Returns NULL when the operation could not be allocated.
+ */
+struct RmAsyncOp* rm_alloc_res_async(
+    struct RmAsync* async,
+    uint32_t gpu_id,
+    int fd,
+    struct NvResource* parent,
+    uint32_t object,
+    uint32_t rm_class,
+    void* data,
+    const struct RmAsyncCompletion* completion
+)
+{
+    struct RmAsyncOp* op = rm_async_op(completion);
+
+    if (op == NULL)
+        return NULL;
+
+    op->kind = RM_ASYNC_ALLOC;
+    op->fd = fd;
+    op->parent = parent;
+    op->object = object;
+    op->command = rm_class;
+    op->data = data;
+
+    return rm_async_submit(async, gpu_id, op);
+}
+
+enum RmAsyncState rm_async_state(struct RmAsyncOp* op)
+{
+    uint32_t state = __atomic_load_n(&op->state, __ATOMIC_ACQUIRE);
+
+    return state == RM_ASYNC_RUNNING ? RM_ASYNC_PENDING : state;
+}
+
+enum RmAsyncState rm_async_wait(struct RmAsyncOp* op, int timeout_ms)
+{
+    struct timespec until;
+
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    if (timeout_ms > 0) {
+        until.tv_sec += timeout_ms / 1000;
+        until.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec += 1;
+            until.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&op->lock);
+
+    while (rm_async_state(op) == RM_ASYNC_PENDING && timeout_ms != 0) {
+        if (timeout_ms < 0)
+            pthread_cond_wait(&op->done, &op->lock);
+        else if (pthread_cond_timedwait(&op->done, &op->lock, &until) == ETIMEDOUT)
+            break;
+    }
+
+    pthread_mutex_unlock(&op->lock);
+
+    return rm_async_state(op);
+}
+
+void* rm_async_result(struct RmAsyncOp* op)
+{
+    return rm_async_state(op) == RM_ASYNC_DONE ? op->result : NULL;
+}
+
+uint8_t rm_async_cancel(struct RmAsyncOp* op)
+{
+    uint32_t pending = RM_ASYNC_PENDING;
+
+    if (!__atomic_compare_exchange_n(&op->state, &pending, RM_ASYNC_RUNNING, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return 0;
+
+    rm_async_complete(op, RM_ASYNC_CANCELLED);
+
+    return 1;
+}
+
+void rm_async_release(struct RmAsyncOp* op)
+{
+    if (op != NULL)
+        rm_async_unref(op);
+}
@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <gpu/nvidia/device.h>
+#include <gpu/nvidia/resman/api.h>
+#include <gpu/nvidia/resman/events.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+//! Class of the event objects.
+#define RM_EVENT_CLASS 0x00000005
+
+//! Class of the notifications signalling an operating system event.
+#define RM_EVENT_OS_EVENT 0x00000079
+
+//! Action keeping the notifications of an event enabled after it fired.
+#define RM_NOTIFY_REPEAT 2
+
+//! Next handle of an event object, shared by the hubs so their handles never collide.
+static uint32_t RM_EVENT_HANDLE = 0xDAE40000;
+
+/*! \brief Event registered in a hub. */
+struct RmEventReg {
+    uint32_t handle;            //!< Event object.
+    uint32_t client;            //!< Client of the event.
+    uint32_t parent;            //!< Object notifying the event.
+    uint32_t notify;            //!< Notification index.
+};
+
+struct RmEventHub {
+    int ctl_fd;                 //!< Control file the events are allocated on.
+    int fd;                     //!< File the events are queued on.
+    struct RmEventReg* events;  //!< Registered events, sorted by handle.
+    size_t size;                //!< Number of registered events.
+    size_t capacity;            //!< Capacity of events.
+    uint32_t* clients;          //!< Clients the operating system event is bound to.
+    size_t client_size;         //!< Number of clients.
+    size_t client_capacity;     //!< Capacity of clients.
+};
+
+/*! \failure No Device - Returns NULL when the control device cannot be opened.
+ */
+struct RmEventHub* rm_event_hub_create(int ctl_fd)
+{
+    int fd = nv_open_dev(255);
+
+    if (fd == -1)
+        return NULL;
+
+    return rm_event_hub_create_fd(ctl_fd, fd);
+}
+
+/*! \failure Allocation Failure - Closes the file and returns NULL.
+ */
+struct RmEventHub* rm_event_hub_create_fd(int ctl_fd, int event_fd)
+{
+    struct RmEventHub* ret = calloc(1, sizeof(struct RmEventHub));
+
+    if (ret == NULL) {
+        close(event_fd);
+        return NULL;
+    }
+
+    ret->ctl_fd = ctl_fd;
+    ret->fd = event_fd;
+
+    return ret;
+}
+
+void rm_event_hub_free(struct RmEventHub* hub)
+{
+    if (hub == NULL)
+        return;
+
+    for (size_t i = 0; i < hub->size; ++i) {
+        struct RmEventReg* event = &hub->events[i];
+
+        rm_free_obj(hub->ctl_fd, event->client, event->parent, event->handle);
+    }
+
+    /* Closing the file releases the operating system events bound to it. */
+    close(hub->fd);
+    free(hub->events);
+    free(hub->clients);
+    free(hub);
+}
+
+int rm_event_hub_fd(const struct RmEventHub* hub)
+{
+    return hub != NULL ? hub->fd : -1;
+}
+
+/*! \brief Binds the operating system event of a hub to a client.
+ *
+ * \return If the operating system event notifies the events of the client.
+ */
+static uint8_t rm_event_hub_bind(struct RmEventHub* hub, uint32_t client)
+{
+    for (size_t i = 0; i < hub->client_size; ++i)
+        if (hub->clients[i] == client)
+            return 1;
+
+    if (hub->client_size == hub->client_capacity) {
+        size_t capacity = hub->client_capacity != 0 ? hub->client_capacity * 2 : 4;
+        uint32_t* clients = realloc(hub->clients, capacity * sizeof(uint32_t));
+
+        if (clients == NULL)
+            return 0;
+
+        hub->clients = clients;
+        hub->client_capacity = capacity;
+    }
+
+    if (!rm_alloc_os_event(hub->fd, client, client))
+        return 0;
+
+    hub->clients[hub->client_size++] = client;
+
+    return 1;
+}
+
+/*! \brief Finds a registered event by handle.
+ *
+ * \return Index of the event, or the size of the hub when it is not registered.
+ */
+static size_t rm_event_hub_find(const struct RmEventHub* hub, uint32_t handle)
+{
+    size_t low = 0;
+    size_t high = hub->size;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+
+        if (hub->events[mid].handle < handle)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low < hub->size && hub->events[low].handle == handle ? low : hub->size;
+}
+
+/*! \failure OS Event Failure - Returns 0 when the client cannot notify the hub file.
+ * \failure RM Failure - Returns 0 and frees the event when the notifications cannot be enabled.
+ */
+uint32_t rm_event_hub_add(
+    struct RmEventHub* hub,
+    uint32_t client,
+    uint32_t parent,
+    uint32_t notify_cmd,
+    uint32_t notify,
+    uint32_t flags
+)
+{
+    if (hub == NULL || !rm_event_hub_bind(hub, client))
+        return 0;
+
+    if (hub->size == hub->capacity) {
+        size_t capacity = hub->capacity != 0 ? hub->capacity * 2 : 8;
+        struct RmEventReg* events = realloc(hub->events, capacity * sizeof(struct RmEventReg));
+
+        if (events == NULL)
+            return 0;
+
+        hub->events = events;
+        hub->capacity = capacity;
+    }
+
+    uint32_t handle = __atomic_add_fetch(&RM_EVENT_HANDLE, 1, __ATOMIC_RELAXED);
+
+    /* The event data is queued, it tells the events sharing the file apart. */
+    struct RmAllocEvent rm_event = {};
+
+    rm_event.parent = client;
+    rm_event.event_class = RM_EVENT_OS_EVENT;
+    rm_event.notify = notify | flags;
+    rm_event.event_data = hub->fd;
+
+    if (rm_alloc_obj(hub->ctl_fd, client, parent, handle, RM_EVENT_CLASS, &rm_event) == 0)
+        return 0;
+
+    if (notify_cmd != 0) {
+        struct RmSetNotification set_notify = {};
+
+        set_notify.event = notify;
+        set_notify.action = RM_NOTIFY_REPEAT;
+
+        if (_RM_CTRL(hub->ctl_fd, client, parent, notify_cmd, set_notify) == NULL) {
+            rm_free_obj(hub->ctl_fd, client, parent, handle);
+            return 0;
+        }
+    }
+
+    /* Handles grow, so the event is normally appended. */
+    size_t index = hub->size;
+
+    while (index > 0 && hub->events[index - 1].handle > handle) {
+        hub->events[index] = hub->events[index - 1];
+        --index;
+    }
+
+    hub->events[index] = (struct RmEventReg) {handle, client, parent, notify};
+    ++hub->size;
+
+    return handle;
+}
+
+uint8_t rm_event_hub_remove(struct RmEventHub* hub, uint32_t handle)
+{
+    if (hub == NULL)
+        return 0;
+
+    size_t index = rm_event_hub_find(hub, handle);
+
+    if (index == hub->size)
+        return 0;
+
+    struct RmEventReg event = hub->events[index];
+
+    for (size_t i = index + 1; i < hub->size; ++i)
+        hub->events[i - 1] = hub->events[i];
+
+    --hub->size;
+
+    rm_free_obj(hub->ctl_fd, event.client, event.parent, event.handle);
+
+    return 1;
+}
+
+size_t rm_event_hub_read(struct RmEventHub* hub, struct RmEventData* events, size_t count)
+{
+    size_t ret = 0;
+    uint8_t more = 1;
+
+    if (hub == NULL)
+        return 0;
+
+    while (ret < count && more) {
+        if (!rm_get_event_data(hub->fd, &events[ret], &more))
+            break;
+
+        if (rm_event_hub_find(hub, events[ret].object) != hub->size)
+            ++ret;
+    }
+
+    return ret;
+}
+
+size_t rm_event_hub_size(const struct RmEventHub* hub)
+{
+    return hub != NULL ? hub->size : 0;
+}
+
+size_t rm_event_hub_clients(const struct RmEventHub* hub)
+{
+    return hub != NULL ? hub->client_size : 0;
+}
@@ -0,0 +1,324 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <gpu/nvidia/resman/supervisor.h>
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <utils/clock.h>
+
+/*! \brief State of a slot of the in-flight table. */
+enum RmSlotState {
+    RM_SLOT_FREE,               //!< Not used by any call.
+    RM_SLOT_CLAIMED,            //!< Being filled by a call.
+    RM_SLOT_ACTIVE              //!< Tracking a call.
+};
+
+/*! \brief Slot of the in-flight table.
+ *
+ * An active slot only becomes free under its lock, so the supervisor can signal the thread
+ * while holding the lock without racing its exit.
+ */
+struct RmSupervisorSlot {
+    uint32_t state;             //!< State of the slot.
+    uint8_t reported;           //!< If the call was reported as stuck.
+    uint8_t escalated;          //!< If the thread of the call was interrupted.
+    pthread_t thread;           //!< Thread issuing the call.
+    int fd;                     //!< File the call is issued on.
+    unsigned long request;      //!< Ioctl request of the call.
+    uint32_t command;           //!< Control command or allocated class.
+    uint64_t start_ms;          //!< Monotonic start time of the call.
+    pthread_mutex_t lock;       //!< Lock for freeing or signalling the call.
+};
+
+//! In-flight table.
+static struct RmSupervisorSlot SLOTS[RM_SUPERVISOR_SLOTS];
+
+//! Guard for initializing the slot locks.
+static pthread_once_t SLOTS_ONCE = PTHREAD_ONCE_INIT;
+
+//! Slot last used by the thread, so threads do not contend on the same slots.
+static __thread uint32_t SLOT_HINT = 0;
+
+//! If the supervisor is running.
+static uint32_t RUNNING = 0;
+
+//! Configuration of the running supervisor.
+static struct RmSupervisorConfig CONFIG;
+
+//! Supervisor thread.
+static pthread_t THREAD;
+
+//! Lock for waking the supervisor thread.
+static pthread_mutex_t LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+//! Signalled when the supervisor stops.
+static pthread_cond_t WAKE;
+
+//! Handler of the escalation signal before the supervisor started.
+static struct sigaction OLD_ACTION;
+
+/*! \brief Initializes the slot locks. */
+static void rm_init_slots(void)
+{
+    for (uint32_t i = 0; i < RM_SUPERVISOR_SLOTS; ++i)
+        pthread_mutex_init(&SLOTS[i].lock, NULL);
+}
+
+/*! \brief Interrupts the ioctl of the signalled thread. */
+static void rm_escalation_handler(int signal)
+{
+    (void) signal;
+}
+
+/*! \brief Prints a stuck call.
+ *
+ * \todo Update to use proper logging mechanism (WARNING).
+ */
+static void rm_print_stuck(const struct RmInFlight* call, void* user)
+{
+    (void) user;
+
+    printf(
+        "Stuck RM call:\n"
+        "\tfd: %d\n"
+        "\trequest: 0x%.8lX\n"
+        "\tcommand: 0x%.8X\n"
+        "\telapsed: %lu ms\n"
+        "\tescalated: %u\n",
+        call->fd,
+        call->request,
+        call->command,
+        (unsigned long) call->elapsed_ms,
+        call->escalated
+    );
+}
+
+/*! \brief Copies an active slot, must be called with the slot lock held. */
+static void rm_slot_info(struct RmSupervisorSlot* slot, uint64_t now, struct RmInFlight* call)
+{
+    call->thread = slot->thread;
+    call->fd = slot->fd;
+    call->request = slot->request;
+    call->command = slot->command;
+    call->elapsed_ms = now - slot->start_ms;
+    call->escalated = slot->escalated;
+}
+
+/*! \brief Reports and escalates the calls past their deadline. */
+static void rm_supervise(void)
+{
+    uint64_t now = clock_now_ms();
+
+    for (uint32_t i = 0; i < RM_SUPERVISOR_SLOTS; ++i) {
+        struct RmSupervisorSlot* slot = &SLOTS[i];
+        struct RmInFlight call;
+        uint8_t report = 0;
+
+        if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != RM_SLOT_ACTIVE)
+            continue;
+
+        pthread_mutex_lock(&slot->lock);
+
+        if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == RM_SLOT_ACTIVE) {
+            uint64_t elapsed = now - slot->start_ms;
+
+            if (!slot->reported && elapsed >= CONFIG.deadline_ms) {
+                slot->reported = 1;
+                report = 1;
+            }
+
+            if (!slot->escalated && CONFIG.escalate_ms != 0 && elapsed >= CONFIG.escalate_ms) {
+                slot->escalated = 1;
+                pthread_kill(slot->thread, CONFIG.signal);
+                report = 1;
+            }
+
+            rm_slot_info(slot, now, &call);
+        }
+
+        pthread_mutex_unlock(&slot->lock);
+
+        if (report)
+            CONFIG.report(&call, CONFIG.user);
+    }
+}
+
+/*! \brief Main loop of the supervisor thread. */
+static void* rm_supervisor(void* arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&LOCK);
+
+    while (__atomic_load_n(&RUNNING, __ATOMIC_ACQUIRE)) {
+        uint64_t until = clock_now_ms() + CONFIG.interval_ms;
+        struct timespec wake = {
+            .tv_sec = until / 1000,
+            .tv_nsec = (until % 1000) * 1000000
+        };
+
+        pthread_cond_timedwait(&WAKE, &LOCK, &wake);
+
+        pthread_mutex_unlock(&LOCK);
+        rm_supervise();
+        pthread_mutex_lock(&LOCK);
+    }
+
+    pthread_mutex_unlock(&LOCK);
+
+    return NULL;
+}
+
+/*! \failure Already Running - Returns 0 when the supervisor is already running.
+ * \failure Thread Failure - Returns 0 when the supervisor thread could not be started.
+ */
+uint8_t rm_supervisor_start(const struct RmSupervisorConfig* config)
+{
+    struct sigaction action = {};
+    pthread_condattr_t attr;
+
+    pthread_once(&SLOTS_ONCE, rm_init_slots);
+    pthread_mutex_lock(&LOCK);
+
+    if (RUNNING) {
+        pthread_mutex_unlock(&LOCK);
+        return 0;
+    }
+
+    CONFIG = *config;
+    if (CONFIG.signal == 0)
+        CONFIG.signal = SIGUSR2;
+    if (CONFIG.interval_ms == 0)
+        CONFIG.interval_ms = 100;
+    if (CONFIG.report == NULL)
+        CONFIG.report = rm_print_stuck;
+
+    /* Without SA_RESTART the interrupted ioctl returns EINTR. */
+    action.sa_handler = rm_escalation_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(CONFIG.signal, &action, &OLD_ACTION);
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&WAKE, &attr);
+    pthread_condattr_destroy(&attr);
+
+    __atomic_store_n(&RUNNING, 1, __ATOMIC_RELEASE);
+
+    if (pthread_create(&THREAD, NULL, rm_supervisor, NULL) != 0) {
+        __atomic_store_n(&RUNNING, 0, __ATOMIC_RELEASE);
+        pthread_cond_destroy(&WAKE);
+        sigaction(CONFIG.signal, &OLD_ACTION, NULL);
+        pthread_mutex_unlock(&LOCK);
+        return 0;
+    }
+
+    pthread_mutex_unlock(&LOCK);
+
+    return 1;
+}
+
+void rm_supervisor_stop(void)
+{
+    pthread_mutex_lock(&LOCK);
+
+    if (!RUNNING) {
+        pthread_mutex_unlock(&LOCK);
+        return;
+    }
+
+    __atomic_store_n(&RUNNING, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&WAKE);
+    pthread_mutex_unlock(&LOCK);
+
+    pthread_join(THREAD, NULL);
+    pthread_cond_destroy(&WAKE);
+    sigaction(CONFIG.signal, &OLD_ACTION, NULL);
+}
+
+uint32_t rm_supervisor_in_flight(struct RmInFlight* calls, uint32_t size)
+{
+    uint64_t now = clock_now_ms();
+    uint32_t ret = 0;
+
+    pthread_once(&SLOTS_ONCE, rm_init_slots);
+
+    for (uint32_t i = 0; i < RM_SUPERVISOR_SLOTS && ret < size; ++i) {
+        struct RmSupervisorSlot* slot = &SLOTS[i];
+
+        if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != RM_SLOT_ACTIVE)
+            continue;
+
+        pthread_mutex_lock(&slot->lock);
+        if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == RM_SLOT_ACTIVE)
+            rm_slot_info(slot, now, &calls[ret++]);
+        pthread_mutex_unlock(&slot->lock);
+    }
+
+    return ret;
+}
+
+int rm_supervisor_enter(int fd, unsigned long request, uint32_t command)
+{
+    if (!__atomic_load_n(&RUNNING, __ATOMIC_ACQUIRE))
+        return -1;
+
+    for (uint32_t i = 0; i < RM_SUPERVISOR_SLOTS; ++i) {
+        uint32_t index = (SLOT_HINT + i) % RM_SUPERVISOR_SLOTS;
+        struct RmSupervisorSlot* slot = &SLOTS[index];
+        uint32_t state = RM_SLOT_FREE;
+
+        if (!__atomic_compare_exchange_n(&slot->state, &state, RM_SLOT_CLAIMED, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            continue;
+
+        slot->reported = 0;
+        slot->escalated = 0;
+        slot->thread = pthread_self();
+        slot->fd = fd;
+        slot->request = request;
+        slot->command = command;
+        slot->start_ms = clock_now_ms();
+
+        __atomic_store_n(&slot->state, RM_SLOT_ACTIVE, __ATOMIC_RELEASE);
+        SLOT_HINT = index;
+
+        return index;
+    }
+
+    return -1;
+}
+
+uint8_t rm_supervisor_leave(int slot)
+{
+    if (slot < 0)
+        return 0;
+
+    struct RmSupervisorSlot* entry = &SLOTS[slot];
+
+    pthread_mutex_lock(&entry->lock);
+    uint8_t ret = entry->escalated;
+    __atomic_store_n(&entry->state, RM_SLOT_FREE, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&entry->lock);
+
+    return ret;
+}
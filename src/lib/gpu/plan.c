@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <gpu/plan.h>
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+//! Vendor id of the GPUs whose memory names no vendor.
+#define PLAN_NVIDIA_VENDOR 0x10DE
+
+/*! \brief Gets the framebuffer the driver reserves for an instance.
+ *
+ * A sixteenth of the partition and 64 MB, aligned up, as in the shipped profiles.
+ */
+static uint32_t plan_reserve(uint32_t slice)
+{
+    uint32_t res = slice / 16 + 64;
+
+    return (res + PLAN_FB_ALIGN - 1) / PLAN_FB_ALIGN * PLAN_FB_ALIGN;
+}
+
+/*! \brief Parses an unsigned number ending at one of the given characters or the string end.
+ */
+static uint8_t plan_parse_u32(const char** spec, const char* ends, uint32_t* value)
+{
+    char* end = NULL;
+    unsigned long ret = strtoul(*spec, &end, 0);
+
+    if (end == *spec || **spec == '-' || ret > UINT32_MAX || strchr(ends, *end) == NULL)
+        return 0;
+
+    *value = ret;
+    *spec = end;
+
+    return 1;
+}
+
+/*! \failure Malformed Memory - Returns 0 when the memory is not [VENDOR:]DEVICE=FB_MB:BAR1_MB.
+ */
+uint8_t plan_parse_memory(const char* spec, struct GpuMemory* memory)
+{
+    struct GpuMemory ret = { PLAN_NVIDIA_VENDOR, 0, 0, 0 };
+
+    if (!plan_parse_u32(&spec, ":=", &ret.device_id))
+        return 0;
+
+    if (*spec == ':') {
+        ret.vendor_id = ret.device_id;
+        ++spec;
+
+        if (!plan_parse_u32(&spec, "=", &ret.device_id))
+            return 0;
+    }
+
+    if (*spec++ != '=')
+        return 0;
+
+    if (!plan_parse_u32(&spec, ":", &ret.fb_size) || *spec++ != ':' ||
+        !plan_parse_u32(&spec, "", &ret.bar1_size) || ret.fb_size == 0 || ret.bar1_size == 0)
+        return 0;
+
+    *memory = ret;
+
+    return 1;
+}
+
+/*! \failure Malformed Mix - Returns 0 when a partition is not a positive number.
+ * \failure Long Mix - Returns 0 when the mix has more partitions than the list holds.
+ */
+size_t plan_parse_mix(const char* list, uint32_t* counts, size_t size)
+{
+    size_t ret = 0;
+
+    while (ret < size) {
+        if (!plan_parse_u32(&list, ",", &counts[ret]) || counts[ret] == 0)
+            return 0;
+
+        ++ret;
+
+        if (*list++ == '\0')
+            return ret;
+    }
+
+    return 0;
+}
+
+/*! \failure Too Many Partitions - Returns 0 when a partition is smaller than its reservation.
+ * \failure Small Aperture - Returns 0 when a partition gets less than PLAN_BAR1_MIN of BAR1.
+ */
+uint8_t plan_type(const struct GpuMemory* memory, uint32_t instances, struct PlanType* type)
+{
+    if (instances == 0)
+        return 0;
+
+    uint32_t slice = memory->fb_size / instances / PLAN_FB_ALIGN * PLAN_FB_ALIGN;
+    uint32_t res = plan_reserve(slice);
+    uint32_t bar1 = memory->bar1_size / instances;
+    uint32_t bar1_max = instances == 1 ? PLAN_BAR1_MAX : PLAN_BAR1_SHARED_MAX;
+
+    if (slice <= res || bar1 < PLAN_BAR1_MIN)
+        return 0;
+
+    if (bar1 > bar1_max)
+        bar1 = bar1_max;
+
+    /* The aperture of an instance is a power of two. */
+    type->bar1_len = 1u << (31 - __builtin_clz(bar1));
+    type->max_instances = instances;
+    type->fb_len = slice - res;
+    type->fb_res = res;
+    type->fb_unused = memory->fb_size - slice * instances;
+
+    return 1;
+}
+
+/*! \failure Unplannable Mix - Returns 0, writing nothing, when a partition count does not fit the GPU.
+ */
+uint8_t plan_write_config(FILE* out, const struct GpuMemory* memory, const uint32_t* counts, size_t size, uint32_t first_num)
+{
+    struct PlanType types[PLAN_MAX_MIX];
+
+    if (size == 0 || size > PLAN_MAX_MIX)
+        return 0;
+
+    for (size_t i = 0; i < size; ++i)
+        if (!plan_type(memory, counts[i], &types[i]))
+            return 0;
+
+    fprintf(
+        out,
+        "# Planned for 0x%.4X:0x%.4X with %u MB of framebuffer and %u MB of BAR1.\n"
+        "[[config]]\n"
+        "    [[config.gpu_config]]\n"
+        "    vendor_id = 0x%.4X\n"
+        "    device_id = 0x%.4X\n",
+        memory->vendor_id, memory->device_id, memory->fb_size, memory->bar1_size,
+        memory->vendor_id, memory->device_id
+    );
+
+    for (size_t i = 0; i < size; ++i) {
+        fprintf(
+            out,
+            "    [[config.request]]\n"
+            "    num = %u\n"
+            "    name = \"GVM [Class /%u]\"\n"
+            "    max_instances = %u\n"
+            "    fb_len = %u\n"
+            "    fb_res = %u\n"
+            "    bar1_len = 0x%X\n",
+            first_num + (uint32_t) i, types[i].max_instances, types[i].max_instances,
+            types[i].fb_len, types[i].fb_res, types[i].bar1_len
+        );
+    }
+
+    return 1;
+}
+
+/*! \brief Appends an issue to a report.
+ *
+ * \failure Allocation Failure - The issue is only counted when it could not be stored.
+ */
+static void plan_issue(
+    struct PlanReport* report,
+    enum PlanSeverity severity,
+    const struct GpuMemory* memory,
+    uint32_t num,
+    const char* fmt,
+    ...
+)
+{
+    va_list args;
+
+    if (severity == PLAN_ERROR)
+        ++report->errors;
+
+    /* Grown one at a time, a catalog has a handful of types. */
+    struct PlanIssue* issues = realloc(report->issues, (report->size + 1) * sizeof(*issues));
+
+    if (issues == NULL)
+        return;
+
+    report->issues = issues;
+
+    struct PlanIssue* issue = &issues[report->size++];
+
+    issue->severity = severity;
+    issue->device_id = memory->device_id;
+    issue->num = num;
+
+    va_start(args, fmt);
+    vsnprintf(issue->message, sizeof(issue->message), fmt, args);
+    va_end(args);
+}
+
+uint8_t plan_validate(const struct GpuMemory* memory, const struct MDevRequest* requests, size_t count, struct PlanReport* report)
+{
+    size_t errors = report->errors;
+
+    for (size_t i = 0; i < count; ++i) {
+        const struct MDevRequest* request = &requests[i];
+        uint64_t slice = (uint64_t) request->fb_len + request->fb_res;
+        uint64_t fb = slice * request->max_inst;
+        uint64_t bar1 = (uint64_t) request->bar1_len * request->max_inst;
+
+        if (request->max_inst == 0 || request->fb_len == 0) {
+            plan_issue(report, PLAN_ERROR, memory, request->num, "has no instance or no framebuffer");
+            continue;
+        }
+
+        if (fb > memory->fb_size)
+            plan_issue(
+                report, PLAN_ERROR, memory, request->num,
+                "needs %llu MB of framebuffer, the GPU has %u MB", (unsigned long long) fb, memory->fb_size
+            );
+
+        if (bar1 > memory->bar1_size)
+            plan_issue(
+                report, PLAN_ERROR, memory, request->num,
+                "needs %llu MB of BAR1, the GPU has %u MB", (unsigned long long) bar1, memory->bar1_size
+            );
+
+        if (fb > memory->fb_size || bar1 > memory->bar1_size)
+            continue;
+
+        uint32_t res = plan_reserve(slice / PLAN_FB_ALIGN * PLAN_FB_ALIGN);
+
+        if (request->fb_res < res)
+            plan_issue(
+                report, PLAN_WARNING, memory, request->num,
+                "reserves %u MB of framebuffer per instance, %u MB are planned", request->fb_res, res
+            );
+
+        if (memory->fb_size - fb >= (uint64_t) PLAN_FB_ALIGN * request->max_inst)
+            plan_issue(
+                report, PLAN_WARNING, memory, request->num,
+                "leaves %llu MB of framebuffer unused", (unsigned long long) (memory->fb_size - fb)
+            );
+    }
+
+    return report->errors == errors;
+}
+
+/*! \brief Checks if a configuration can target a GPU model.
+ */
+static uint8_t plan_config_targets(const struct GpuConfig* config, const struct GpuMemory* memory)
+{
+    if (config->gpu_size == 0)
+        return 1;
+
+    for (size_t i = 0; i < config->gpu_size; ++i) {
+        const struct Gpu* gpu = &config->gpus[i];
+
+        if ((gpu->vendor_id == 0xFFFFFFFF || gpu->vendor_id == memory->vendor_id) &&
+            (gpu->device_id == 0xFFFFFFFF || gpu->device_id == memory->device_id))
+            return 1;
+    }
+
+    return 0;
+}
+
+uint8_t plan_validate_configs(const struct GpuMemory* memories, size_t memory_count, const struct GpuConfigs* configs, struct PlanReport* report)
+{
+    uint8_t ret = 1;
+
+    for (size_t i = 0; i < configs->config_size; ++i) {
+        const struct GpuConfig* config = &configs->configs[i];
+
+        for (size_t j = 0; j < memory_count; ++j)
+            if (plan_config_targets(config, &memories[j]))
+                ret = plan_validate(&memories[j], config->requests, config->mdev_size, report) && ret;
+    }
+
+    return ret;
+}
+
+uint8_t plan_validate_catalog(const struct GpuMemory* memories, size_t memory_count, const struct ConfigCatalog* catalog, struct PlanReport* report)
+{
+    uint8_t ret = 1;
+
+    for (size_t i = 0; i < memory_count; ++i) {
+        struct Gpu gpu;
+
+        memset(&gpu, 0xFF, sizeof(gpu));
+        gpu.vendor_id = memories[i].vendor_id;
+        gpu.device_id = memories[i].device_id;
+
+        const struct GpuConfig* config = config_catalog_lookup(catalog, &gpu);
+
+        if (config != NULL)
+            ret = plan_validate(&memories[i], config->requests, config->mdev_size, report) && ret;
+    }
+
+    return ret;
+}
+
+void plan_print_report(const struct PlanReport* report, FILE* out)
+{
+    for (size_t i = 0; i < report->size; ++i) {
+        const struct PlanIssue* issue = &report->issues[i];
+
+        fprintf(
+            out, "%s: type %u on 0x%.4X %s\n", issue->severity == PLAN_ERROR ? "error" : "warning",
+            issue->num, issue->device_id, issue->message
+        );
+    }
+}
+
+void plan_free_report(struct PlanReport* report)
+{
+    free(report->issues);
+    report->issues = NULL;
+    report->size = 0;
+    report->errors = 0;
+}
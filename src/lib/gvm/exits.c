@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <gvm/exits.h>
+
+#include <utils/epoch.h>
+
+//! Number of exits handled per epoll_wait.
+#define VM_EXIT_EVENTS 16
+
+/*! \brief Opens a pidfd.
+ *
+ * \return The pidfd, -1 if the process does not exist or the kernel has no pidfds.
+ */
+static int vm_pidfd_open(uint32_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, (pid_t) pid, 0);
+#else
+    (void) pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/*! \failure Epoll Failure - Returns -1, sessions are then only released when removed.
+ */
+int vm_exits_open(struct VmMgr* mgr)
+{
+    mgr->exit_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    return mgr->exit_fd;
+}
+
+void vm_exits_close(struct VmMgr* mgr)
+{
+    if (mgr->exit_fd != -1)
+        close(mgr->exit_fd);
+
+    mgr->exit_fd = -1;
+}
+
+/*! \failure Pidfd Failure - Returns 0 and leaves pid_fd at -1 when the process already exited
+ *                           or the kernel predates pidfds (5.3).
+ */
+uint8_t vm_watch_exit(struct VmMgr* mgr, struct VmSession* session)
+{
+    session->pid_fd = -1;
+
+    if (mgr->exit_fd == -1 || session->qemu_pid == 0)
+        return 0;
+
+    int fd = vm_pidfd_open(session->qemu_pid);
+
+    if (fd == -1)
+        return 0;
+
+    struct epoll_event event = {.events = EPOLLIN, .data = {.fd = fd}};
+
+    if (epoll_ctl(mgr->exit_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        close(fd);
+        return 0;
+    }
+
+    session->pid_fd = fd;
+
+    return 1;
+}
+
+/*! \brief Ends the session watched by a pidfd.
+ *
+ * \return If a session was ended.
+ */
+static uint8_t vm_handle_exit(struct VmMgr* mgr, int pid_fd, VmExitFn exited, void* user)
+{
+    struct VmSession session = {};
+
+    epoch_enter();
+
+    const struct VmSession* watched = vm_find_watched(vm_sessions(mgr), pid_fd);
+
+    if (watched != NULL)
+        session = *watched;
+
+    epoch_exit();
+
+    /* A start still adding its session is found on a later call, the pidfd stays readable. */
+    if (session.qemu_pid == 0 || !vm_end_session(mgr, &session.mdev, session.qemu_pid))
+        return 0;
+
+    if (exited != NULL)
+        exited(&session, user);
+
+    return 1;
+}
+
+size_t handle_vm_exits(struct VmMgr* mgr, VmExitFn exited, void* user)
+{
+    struct epoll_event events[VM_EXIT_EVENTS];
+    size_t ret = 0;
+    int ready;
+
+    if (mgr->exit_fd == -1)
+        return 0;
+
+    do {
+        ready = epoll_wait(mgr->exit_fd, events, VM_EXIT_EVENTS, 0);
+
+        for (int i = 0; i < ready; ++i)
+            ret += vm_handle_exit(mgr, events[i].data.fd, exited, user);
+    } while (ready == VM_EXIT_EVENTS);
+
+    return ret;
+}
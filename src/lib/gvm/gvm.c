@@ -0,0 +1,403 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <gvm/gvm.h>
+
+#include <gpu/nvidia/manager.h>
+#include <gpu/nvidia/resman/events.h>
+
+#include <gvm/exits.h>
+#include <gvm/nvidia/manager.h>
+#include <gvm/pool.h>
+#include <gvm/sessions.h>
+#include <gvm/vm_mgr.h>
+
+#include <utils/configs.h>
+#include <utils/epoch.h>
+#include <utils/uuid.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*! \brief Embedding context. */
+struct GvmContext {
+    struct NvMdev mgr;                  //!< Manager of the GPUs.
+    struct VmMgr vm_mgr;                //!< VM manager, valid once subscribed.
+    struct VgpuPool* pool;              //!< Warm pool, NULL until a type is kept ready.
+    uint8_t subscribed;                 //!< If the VM events are set up.
+    uint8_t registered;                 //!< If the mdev types were registered.
+    GvmEventCallback callback;          //!< Subscriber.
+    void* user;                         //!< User data of the subscriber.
+};
+
+uint32_t gvm_api_version(void)
+{
+    return GVM_API_VERSION;
+}
+
+/*! \failure No Driver - Returns NULL when the RM client could not be created.
+ */
+struct GvmContext* gvm_open(uint32_t flags)
+{
+    struct GvmContext* ret = calloc(1, sizeof(struct GvmContext));
+    uint32_t mgr_flags = 0;
+
+    if (ret == NULL)
+        return NULL;
+
+    if (flags & GVM_OPEN_LAZY)
+        mgr_flags |= NV_MGR_LAZY;
+    if (flags & GVM_OPEN_SHARDED)
+        mgr_flags |= NV_MGR_SHARDED;
+
+    ret->mgr = create_nv_mgr_flags(mgr_flags);
+
+    if (ret->mgr.fd == -1) {
+        free(ret);
+        return NULL;
+    }
+
+    return ret;
+}
+
+void gvm_close(struct GvmContext* ctx)
+{
+    if (ctx == NULL)
+        return;
+
+    if (ctx->subscribed)
+        free_nv_vm_events(&ctx->vm_mgr);
+
+    vm_free_sessions(&ctx->vm_mgr);
+
+    if (ctx->subscribed)
+        vm_exits_close(&ctx->vm_mgr);
+
+    ctx->vm_mgr.pool = NULL;
+    vgpu_pool_free(ctx->pool);
+    free_nv_mgr(&ctx->mgr);
+    free(ctx);
+}
+
+uint32_t gvm_gpu_count(const struct GvmContext* ctx)
+{
+    uint32_t ret = 0;
+
+    if (ctx == NULL)
+        return 0;
+
+    epoch_enter();
+
+    const struct NvGpuView* view = nv_mgr_view(&ctx->mgr);
+
+    if (view != NULL)
+        ret = view->gpus.size;
+
+    epoch_exit();
+
+    return ret;
+}
+
+/*! \failure Short Structure - Only the members fitting the size of the caller are written.
+ */
+int gvm_gpu_info(const struct GvmContext* ctx, uint32_t index, struct GvmGpuInfo* info)
+{
+    struct GvmGpuInfo ret = {};
+
+    if (ctx == NULL || info == NULL || info->size < sizeof(uint32_t))
+        return GVM_ERR_INVALID;
+
+    /* Queries read the published snapshot and never wait for a reload. */
+    epoch_enter();
+
+    const struct NvGpuView* view = nv_mgr_view(&ctx->mgr);
+
+    if (view == NULL || index >= view->gpus.size) {
+        epoch_exit();
+        return GVM_ERR_NOT_FOUND;
+    }
+
+    const struct NvMdevGpu* mgpu = nv_registry_at(&view->gpus, index);
+
+    ret.size = info->size < sizeof(ret) ? info->size : sizeof(ret);
+    ret.id = mgpu->gpu->identifier;
+    ret.domain = mgpu->gpu->domain;
+    ret.bus = mgpu->gpu->bus;
+    ret.slot = mgpu->gpu->slot;
+    ret.vendor_id = mgpu->gpu->vendor_id;
+    ret.device_id = mgpu->gpu->device_id;
+    ret.sub_vendor_id = mgpu->gpu->sub_vendor_id;
+    ret.sub_device_id = mgpu->gpu->sub_device_id;
+    ret.attached = mgpu->attached;
+    ret.mdev = mgpu->mdev != NULL;
+
+    epoch_exit();
+
+    memcpy(info, &ret, ret.size);
+
+    return GVM_OK;
+}
+
+/*! \failure Registered - Returns GVM_ERR_STATE once the mdev types were registered.
+ * \failure Invalid Config - Returns GVM_ERR_INVALID, provisioning nothing, when the configuration
+ *                          cannot be loaded.
+ */
+int gvm_provision(struct GvmContext* ctx, const char* path)
+{
+    struct stat sb;
+
+    if (ctx == NULL || path == NULL)
+        return GVM_ERR_INVALID;
+
+    if (ctx->registered)
+        return GVM_ERR_STATE;
+
+    if (stat(path, &sb) == -1)
+        return GVM_ERR_NOT_FOUND;
+
+    if (S_ISDIR(sb.st_mode)) {
+        struct ConfigCatalog catalog = get_config_catalog(path);
+
+        if (catalog.arena == NULL)
+            return GVM_ERR_INVALID;
+
+        create_nv_mgr_catalog_mdevs(&ctx->mgr, &catalog);
+        free_config_catalog(&catalog);
+    } else {
+        struct GpuConfigs configs = get_configs(path);
+
+        if (configs.arena == NULL)
+            return GVM_ERR_INVALID;
+
+        for (size_t i = 0; i < configs.config_size; ++i) {
+            struct GpuConfig config = configs.configs[i];
+
+            create_nv_mgr_mdevs(&ctx->mgr, config.gpus, config.gpu_size, config.requests, config.mdev_size);
+        }
+
+        free_configs(&configs);
+    }
+
+    return GVM_OK;
+}
+
+/*! \failure Registered - Returns GVM_ERR_STATE once the mdev types were registered.
+ */
+int gvm_register(struct GvmContext* ctx)
+{
+    if (ctx == NULL)
+        return GVM_ERR_INVALID;
+
+    if (ctx->registered)
+        return GVM_ERR_STATE;
+
+    register_nv_mgr_mdevs(&ctx->mgr);
+    ctx->registered = 1;
+
+    return GVM_OK;
+}
+
+/*! \brief Formats the PCI address of a GPU of a context, as the pool names it.
+ *
+ * \return GVM_OK, or GVM_ERR_NOT_FOUND when no GPU has the index.
+ */
+static int gvm_gpu_bdf(const struct GvmContext* ctx, uint32_t index, char* bdf)
+{
+    epoch_enter();
+
+    const struct NvGpuView* view = nv_mgr_view(&ctx->mgr);
+
+    if (view == NULL || index >= view->gpus.size) {
+        epoch_exit();
+        return GVM_ERR_NOT_FOUND;
+    }
+
+    const struct Gpu* gpu = nv_registry_at(&view->gpus, index)->gpu;
+
+    snprintf(bdf, VGPU_POOL_BDF, "%.4x:%.2x:%.2x.%x", gpu->domain, gpu->bus, gpu->slot, 0);
+
+    epoch_exit();
+
+    return GVM_OK;
+}
+
+/*! \failure Unregistered - Returns GVM_ERR_STATE before gvm_register, the mdev types do not
+ *                          exist yet.
+ * \failure Memory Failure - Returns GVM_ERR_MEMORY when the pool or its target cannot be
+ *                           allocated.
+ */
+int gvm_pool_set(struct GvmContext* ctx, uint32_t index, const char* type, uint32_t count)
+{
+    char bdf[VGPU_POOL_BDF];
+
+    if (ctx == NULL || type == NULL || type[0] == '\0' || strlen(type) >= VGPU_POOL_TYPE)
+        return GVM_ERR_INVALID;
+
+    if (!ctx->registered)
+        return GVM_ERR_STATE;
+
+    int ret = gvm_gpu_bdf(ctx, index, bdf);
+
+    if (ret != GVM_OK)
+        return ret;
+
+    if (ctx->pool == NULL) {
+        ctx->pool = vgpu_pool_create(NULL);
+
+        if (ctx->pool == NULL)
+            return GVM_ERR_MEMORY;
+
+        ctx->vm_mgr.pool = ctx->pool;
+    }
+
+    if (!vgpu_pool_add(ctx->pool, bdf, type, count))
+        return GVM_ERR_MEMORY;
+
+    /* The first instances are ready on return, the refill thread replaces the taken ones. */
+    vgpu_pool_fill(ctx->pool);
+    vgpu_pool_start(ctx->pool);
+
+    return GVM_OK;
+}
+
+/*! \failure Empty Pool - Returns GVM_ERR_NOT_FOUND when no instance is ready, including before
+ *                        the type is kept ready with gvm_pool_set.
+ */
+int gvm_pool_take(struct GvmContext* ctx, uint32_t index, const char* type, char uuid[GVM_UUID_SIZE])
+{
+    struct VgpuInstance instance;
+    char bdf[VGPU_POOL_BDF];
+
+    if (ctx == NULL || type == NULL || uuid == NULL)
+        return GVM_ERR_INVALID;
+
+    int ret = gvm_gpu_bdf(ctx, index, bdf);
+
+    if (ret != GVM_OK)
+        return ret;
+
+    if (ctx->pool == NULL || !vgpu_pool_take(ctx->pool, bdf, type, &instance))
+        return GVM_ERR_NOT_FOUND;
+
+    uuid_format(&instance.uuid, uuid);
+
+    return GVM_OK;
+}
+
+/*! \failure Event Failure - Returns GVM_ERR_RM when the VM events could not be opened.
+ */
+int gvm_subscribe(struct GvmContext* ctx, GvmEventCallback callback, void* user)
+{
+    if (ctx == NULL || callback == NULL)
+        return GVM_ERR_INVALID;
+
+    if (!ctx->subscribed) {
+        ctx->vm_mgr = init_nv_vm_mgr(&ctx->mgr);
+        ctx->vm_mgr.pool = ctx->pool;
+
+        if (ctx->vm_mgr.events == NULL) {
+            vm_exits_close(&ctx->vm_mgr);
+            return GVM_ERR_RM;
+        }
+
+        ctx->subscribed = 1;
+    }
+
+    ctx->callback = callback;
+    ctx->user = user;
+
+    return GVM_OK;
+}
+
+/*! \brief Reports an event of a VM to the subscriber. */
+static void gvm_report_vm(
+    struct GvmContext* ctx,
+    uint32_t type,
+    const struct UUID* mdev,
+    uint32_t gpu_id,
+    uint32_t qemu_pid
+)
+{
+    struct GvmEvent event = {sizeof(struct GvmEvent), type, gpu_id, qemu_pid, ""};
+
+    uuid_format(mdev, event.mdev);
+    ctx->callback(&event, ctx->user);
+}
+
+/*! \brief Starts a VM and reports it to the subscriber, as a VmStartFn of gvm_dispatch. */
+static void gvm_start(const struct VmStartRequest* request, void* user)
+{
+    struct GvmContext* ctx = (struct GvmContext*) user;
+    const struct RmVmStartInfo* info = &request->info;
+
+    start_vm_request(&ctx->vm_mgr, &ctx->mgr, request);
+    gvm_report_vm(ctx, GVM_EVENT_VM_START, &info->uuid, info->pci_id, info->qemu_pid);
+}
+
+/*! \brief Reports an ended session to the subscriber, as a VmExitFn of gvm_dispatch. */
+static void gvm_exited(const struct VmSession* session, void* user)
+{
+    gvm_report_vm(user, GVM_EVENT_VM_EXIT, &session->mdev, session->gpu_id, session->qemu_pid);
+}
+
+/*! \failure Poll Failure - Returns -errno when waiting failed, e.g. -EINTR on a signal.
+ */
+int gvm_dispatch(struct GvmContext* ctx, int timeout_ms)
+{
+    if (ctx == NULL)
+        return GVM_ERR_INVALID;
+
+    if (!ctx->subscribed)
+        return GVM_ERR_STATE;
+
+    struct pollfd fds[2] = {
+        {.fd = rm_event_hub_fd(ctx->vm_mgr.events), .events = POLLIN},
+        {.fd = ctx->vm_mgr.exit_fd, .events = POLLIN}
+    };
+    int polled = poll(fds, 2, timeout_ms);
+    int ret = 0;
+
+    if (polled == -1)
+        return -errno;
+
+    if (polled == 0)
+        return 0;
+
+    if (fds[0].revents & POLLIN) {
+        struct VmEvents events = drain_vm_events(&ctx->vm_mgr, &ctx->mgr, gvm_start, ctx);
+
+        ret += events.starts;
+
+        for (uint32_t i = 0; i < events.binds; ++i) {
+            struct GvmEvent event = {sizeof(struct GvmEvent), GVM_EVENT_VM_BIND, 0, 0, ""};
+
+            ctx->callback(&event, ctx->user);
+            ++ret;
+        }
+    }
+
+    if (fds[1].revents & POLLIN)
+        ret += handle_vm_exits(&ctx->vm_mgr, gvm_exited, ctx);
+
+    return ret;
+}
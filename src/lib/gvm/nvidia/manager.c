@@ -17,84 +17,51 @@
  *
  */
 #include <gpu/nvidia/device.h>
+#include <gpu/nvidia/manager.h>
 #include <gpu/nvidia/resman/api.h>
 #include <gpu/nvidia/resman/classes.h>
+#include <gpu/nvidia/resman/events.h>
 #include <gpu/nvidia/resman/types.h>
 
+#include <gvm/exits.h>
 #include <gvm/nvidia/init.h>
 #include <gvm/nvidia/manager.h>
+#include <gvm/pool.h>
+#include <gvm/sessions.h>
 
-#include <sys/select.h>
+#include <utils/clock.h>
+#include <utils/epoch.h>
+#include <utils/uuid.h>
 
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-//! RM Event ID.
-const uint32_t RM_EVENT = 4;
+//! Notification index of the VM start requests.
+#define VM_NOTIFY_START 2
 
-/*! \brief Inline function to create VM specific Event IDs. */
-static inline uint32_t compose_vm_id(uint32_t t, uint32_t i)
-{
-    return 0xDAE00000 | (t << 8) | i;
-}
-
-/*! \brief Code to initialize events for the VM manager.
- *
- * This makes a event handler for the VM manager.
- *
- * \param ctl_fd - Control file descriptor.
- * \param res - Parent resource on the base of the system.
- * \param event - Event id.
- * \param notify - Notification settings.
- * \param flags - Flags to use for the event.
- * \return Returns a file descriptor to associate to the event.
- */
-static int event_init(
-    int ctl_fd,
-    struct NvResource* res,
-    uint32_t event,
-    uint32_t notify,
-    uint32_t flags
-)
-{
-    int fd = nv_open_dev(255);
-
-    rm_alloc_os_event(fd, res->client, res->object);
-
-    struct RmAllocEvent rm_event = {};
+//! Notification index of the VM bind requests.
+#define VM_NOTIFY_BIND 3
 
-    rm_event.parent = res->client;
-    rm_event.event_class = 0x00000079;
-    rm_event.notify = notify | flags;
-    rm_event.event_data = fd;
-
-    rm_alloc_res(ctl_fd, res, event, 0x00000005, &rm_event);
-
-    struct RmSetNotification set_notify = {};
-
-    set_notify.event = notify;
-    set_notify.action = 2;
-
-    RM_CTRL(ctl_fd, res, 0x00000501, set_notify);
-
-    return fd;
-}
+//! Events read from the hub at once.
+#define VM_EVENT_BATCH 16
 
 /*! \todo Proper logging.
  */
 struct VmMgr init_nv_vm_mgr(struct NvMdev* mgr)
 {
-    const uint32_t event_start = compose_vm_id(RM_EVENT, 0);
-    const uint32_t event_bind = compose_vm_id(RM_EVENT, 1);
-
     struct VmMgr ret = {};
 
-    for (int i = 0; i < 32 && mgr->gpus[i] != NULL; ++i) {
-        struct NvMdevGpu* gpu = mgr->gpus[i];
+    for (uint32_t i = 0; i < mgr->gpus.size; ++i) {
+        struct NvMdevGpu* gpu = nv_registry_at(&mgr->gpus, i);
 
         uint32_t persistence = 0;
 
+        if (!gpu->attached)
+            continue;
+
         RM_CTRL(gpu->ctl_fd, gpu->dev, 0x00800288, persistence);
 
         if (persistence == 1) {
@@ -105,61 +72,113 @@ struct VmMgr init_nv_vm_mgr(struct NvMdev* mgr)
 
     printf("Persistence set correctly.\n");
 
-    ret.event_start = event_init(mgr->fd, mgr->res, event_start, 2, 0x10000000);
-    ret.event_bind = event_init(mgr->fd, mgr->res, event_bind, 3, 0x10000000);
-    ret.root = mgr->res->client;
+    /* Every VM event shares one file, more events do not add fds to poll. */
+    uint32_t client = mgr->res->client;
 
-    printf("Events initialized for start and bind VM.\n");
+    ret.events = rm_event_hub_create(mgr->fd);
+    ret.start_event = rm_event_hub_add(ret.events, client, client, NV0000_SET_NOTIFICATION, VM_NOTIFY_START, RM_EVENT_NONSTALL);
+    ret.bind_event = rm_event_hub_add(ret.events, client, client, NV0000_SET_NOTIFICATION, VM_NOTIFY_BIND, RM_EVENT_NONSTALL);
+    ret.root = client;
+
+    if (ret.start_event == 0 || ret.bind_event == 0) {
+        rm_event_hub_free(ret.events);
+        ret.events = NULL;
+        printf("Events could not be initialized for start and bind VM.\n");
+    } else {
+        printf("Events initialized for start and bind VM.\n");
+    }
+
+    if (vm_exits_open(&ret) == -1)
+        printf("QEMU exits cannot be watched, sessions are kept until replaced.\n");
 
     return ret;
 }
 
-/*! \todo Proper logging.
+void free_nv_vm_events(struct VmMgr* mgr)
+{
+    rm_event_hub_free(mgr->events);
+    mgr->events = NULL;
+}
+
+/*! \failure No Events - Returns 0 when the events of the manager could not be set up.
  */
-void handle_vm_start(struct VmMgr* mgr, struct NvMdev* mdev_mgr)
+size_t read_vm_events(struct VmMgr* mgr, struct VmEvents* events)
 {
-    int        n_fds;
-    fd_set     read_fds;
+    struct RmEventData batch[VM_EVENT_BATCH];
+    size_t ret = 0;
+    size_t count;
+
+    memset(events, 0, sizeof(struct VmEvents));
 
-    FD_ZERO(&read_fds);
+    do {
+        count = rm_event_hub_read(mgr->events, batch, VM_EVENT_BATCH);
 
-    FD_SET(mgr->event_start, &read_fds);
-    FD_SET(mgr->event_bind, &read_fds);
+        for (size_t i = 0; i < count; ++i) {
+            if (batch[i].object == mgr->start_event)
+                ++events->starts;
+            else if (batch[i].object == mgr->bind_event)
+                ++events->binds;
+        }
 
-    n_fds = (mgr->event_start > mgr->event_bind ? mgr->event_start : mgr->event_bind) + 1;
+        ret += count;
+    } while (count == VM_EVENT_BATCH);
 
-    select(n_fds, &read_fds, NULL, NULL, NULL);
+    return ret;
+}
 
-    if (FD_ISSET(mgr->event_start, &read_fds)) {
-        printf("Got a start request from the NVIDIA kernel module\n");
-        start_vm(mgr, mdev_mgr);
-    } else if (FD_ISSET(mgr->event_bind, &read_fds)) {
-        printf("Got a bind request from the NVIDIA kernel module\n");
-    }
+/*! \brief Managers handle_vm_start starts the requests with. */
+struct VmStartNow {
+    struct VmMgr* mgr;          //!< Manager for the VM management system.
+    struct NvMdev* mdev_mgr;    //!< Manager for the mediated devices.
+};
+
+/*! \brief Starts a VM on the calling thread, as a VmStartFn of handle_vm_start. */
+static void vm_start_now(const struct VmStartRequest* request, void* user)
+{
+    struct VmStartNow* now = (struct VmStartNow*) user;
+
+    printf("Got a start request from the NVIDIA kernel module\n");
+    start_vm_request(now->mgr, now->mdev_mgr, request);
 }
 
 /*! \todo Proper logging.
  */
-void start_vm(struct VmMgr* mgr, struct NvMdev* mdev_mgr)
+void handle_vm_start(struct VmMgr* mgr, struct NvMdev* mdev_mgr)
+{
+    struct pollfd fds = {.fd = rm_event_hub_fd(mgr->events), .events = POLLIN, .revents = 0};
+    struct VmStartNow now = {mgr, mdev_mgr};
+
+    if (mgr->events == NULL || poll(&fds, 1, -1) <= 0)
+        return;
+
+    if (drain_vm_events(mgr, mdev_mgr, vm_start_now, &now).binds != 0)
+        printf("Got a bind request from the NVIDIA kernel module\n");
+}
+
+/*! \failure RM Failure - Returns 0 when the RM has no start request to report.
+ */
+uint8_t read_vm_start(struct NvMdev* mdev_mgr, struct VmStartRequest* request)
 {
-    struct RmVmStartInfo vm_start_info = {};
+    memset(request, 0, sizeof(struct VmStartRequest));
 
-    RM_CTRL(mdev_mgr->fd, mdev_mgr->res, 0x00000C01, vm_start_info);
+    request->requested_ns = clock_now_ns();
+
+    return RM_CTRL(mdev_mgr->fd, mdev_mgr->res, 0x00000C01, request->info) != NULL;
+}
 
-    struct UUID uuid = vm_start_info.uuid;
+/*! \failure Unknown GPU - Closes the vgpu fd and adds no session when the GPU of the request is
+ *                         not managed.
+ * \todo Proper logging.
+ */
+void start_vm_request(struct VmMgr* mgr, struct NvMdev* mdev_mgr, const struct VmStartRequest* request)
+{
+    const struct RmVmStartInfo* info = &request->info;
+    struct UUID uuid = info->uuid;
     struct UUID vm_uuid = {};
 
-    vm_uuid.time_low = 0xEE1AEACA;
-    vm_uuid.time_mid = 0xFD56;
-    vm_uuid.time_hi_and_version = 0x470F;
-    vm_uuid.clock_seq_hi_and_reserved = 0xBB;
-    vm_uuid.clock_seq_low = 0x85;
-    vm_uuid.node[0] = 0x1E;
-    vm_uuid.node[1] = 0xF6;
-    vm_uuid.node[2] = 0x67;
-    vm_uuid.node[3] = 0x54;
-    vm_uuid.node[4] = 0x9D;
-    vm_uuid.node[5] = 0xE5;
+    /* Every VM gets its own UUID, the one QEMU knows it by when there is one. */
+    if (!vm_qemu_uuid(info->qemu_pid, &vm_uuid))
+        uuid_generate(&vm_uuid);
 
     printf(
         "MDEV UUID: %.8X-%.4X-%.4X-%.2X%.2X-%.2X%.2X%.2X%.2X%.2X%.2X\n"
@@ -169,8 +188,8 @@ void start_vm(struct VmMgr* mgr, struct NvMdev* mdev_mgr)
         uuid.clock_seq_hi_and_reserved, uuid.clock_seq_low,
         uuid.node[0], uuid.node[1], uuid.node[2], uuid.node[3],
         uuid.node[4], uuid.node[5],
-        vm_start_info.config,
-        vm_start_info.qemu_pid
+        info->config,
+        info->qemu_pid
     );
 
     struct RmVmNotifyStart notify_start = {};
@@ -179,18 +198,90 @@ void start_vm(struct VmMgr* mgr, struct NvMdev* mdev_mgr)
     notify_start.vm = vm_uuid;
     strcpy(notify_start.name, "GVM VM");
 
-    printf("Opened /dev/nvidia-vgpu%d\n", vm_start_info.mdev_id);
+    /* Starts may run concurrently on the reactors, each session owns its fd. */
+    int mdev_fd = vgpu_pool_claim(mgr->pool, &uuid, info->mdev_id);
+
+    if (mdev_fd != -1) {
+        printf("Got /dev/nvidia-vgpu%d from the warm pool\n", info->mdev_id);
+    } else {
+        mdev_fd = nv_open_mdev(info->mdev_id);
+        printf("Opened /dev/nvidia-vgpu%d\n", info->mdev_id);
+    }
+
+    /* Lookups go through the published snapshot so a concurrent reload never blocks them. */
+    epoch_enter();
+
+    const struct NvGpuView* view = nv_mgr_view(mdev_mgr);
+    const struct NvMdevGpu* gpu = view != NULL ? nv_registry_find_id(&view->gpus, info->pci_id) : NULL;
+
+    if (gpu == NULL || gpu->mdev == NULL) {
+        epoch_exit();
+        if (mdev_fd != -1)
+            close(mdev_fd);
+        return;
+    }
+
+    RM_CTRL(mdev_fd, gpu->mdev, 0xA0810107, notify_start);
+    epoch_exit();
 
-    mgr->mdev_fd = nv_open_mdev(vm_start_info.mdev_id);
+    struct VmSession session = {};
 
-    for (int i = 0; i < 32 && mdev_mgr->gpus[i] != NULL; ++i) {
-        struct NvMdevGpu* gpu = mdev_mgr->gpus[i];
+    session.mdev = uuid;
+    session.vm = vm_uuid;
+    session.gpu_id = info->pci_id;
+    session.qemu_pid = info->qemu_pid;
+    session.mdev_id = info->mdev_id;
+    session.mdev_fd = mdev_fd;
+    session.requested_ns = request->requested_ns;
+    session.started_ns = clock_now_ns();
+    session.started_unix = time(NULL);
 
-        if (gpu->gpu->identifier != vm_start_info.pci_id)
+    if (!vm_mdev_type(&uuid, &session.mdev_type))
+        session.mdev_type = 0;
+
+    /* Watched before the session is published, so its pidfd is released with it. */
+    vm_watch_exit(mgr, &session);
+
+    if (!vm_add_session(mgr, &session)) {
+        if (mdev_fd != -1)
+            close(mdev_fd);
+        if (session.pid_fd != -1)
+            close(session.pid_fd);
+    }
+
+    printf("Started VM\n");
+}
+
+struct VmEvents drain_vm_events(struct VmMgr* mgr, struct NvMdev* mdev_mgr, VmStartFn start, void* user)
+{
+    struct VmEvents ret;
+    uint32_t starts;
+
+    read_vm_events(mgr, &ret);
+    starts = ret.starts;
+    ret.starts = 0;
+
+    for (uint32_t i = 0; i < starts; ++i) {
+        struct VmStartRequest request;
+
+        if (!read_vm_start(mdev_mgr, &request))
             continue;
 
-        RM_CTRL(mgr->mdev_fd, gpu->mdev, 0xA0810107, notify_start);
-        printf("Started VM\n");
-        break;
+        start(&request, user);
+        ++ret.starts;
     }
+
+    return ret;
+}
+
+uint8_t start_vm(struct VmMgr* mgr, struct NvMdev* mdev_mgr)
+{
+    struct VmStartRequest request;
+
+    if (!read_vm_start(mdev_mgr, &request))
+        return 0;
+
+    start_vm_request(mgr, mdev_mgr, &request);
+
+    return 1;
 }
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <gpu/nvidia/manager.h>
+
+#include <gvm/nvidia/reactors.h>
+
+#include <utils/epoch.h>
+#include <utils/topology.h>
+
+#include <stdlib.h>
+
+/*! \brief Gets the CPUs a reactor of a GPU should run on.
+ *
+ * \param gpu - GPU served by the reactor.
+ * \param mode - Mode of the reactors.
+ * \param set - Returns the CPUs.
+ * \return If the CPUs are known.
+ */
+static uint8_t nv_reactor_cpus(const struct NvMdevGpu* gpu, uint8_t mode, struct CpuSet* set)
+{
+    const struct Gpu* info = gpu->gpu;
+
+    /* A node reactor serves every GPU of the node, not only the CPUs next to this one. */
+    if (mode == NV_REACTORS_PER_NODE && numa_node_cpus(gpu->numa_node, set))
+        return 1;
+
+    if (pci_local_cpus(info->domain, info->bus, info->slot, 0, set))
+        return 1;
+
+    return numa_node_cpus(gpu->numa_node, set);
+}
+
+/*! \brief Finds the reactor serving a key.
+ *
+ * \return Index of the reactor, reactors->size if there is none.
+ */
+static uint32_t nv_reactor_find(const struct NvReactors* reactors, int64_t key)
+{
+    uint32_t i = 0;
+
+    while (i < reactors->size && reactors->keys[i] != key)
+        ++i;
+
+    return i;
+}
+
+/*! \failure Memory Failure - Returns the reactors created so far, GPUs without a reactor use
+ *                            the fallback of nv_reactor_for_gpu.
+ */
+struct NvReactors create_nv_reactors(struct NvMdev* mgr, uint8_t mode)
+{
+    struct NvReactors ret = {.mode = mode};
+    uint32_t size = mgr->gpus.size;
+
+    if (size == 0)
+        return ret;
+
+    ret.keys = calloc(size, sizeof(int64_t));
+    ret.reactors = calloc(size, sizeof(struct Reactor*));
+
+    if (ret.keys == NULL || ret.reactors == NULL) {
+        free(ret.keys);
+        free(ret.reactors);
+        ret.keys = NULL;
+        ret.reactors = NULL;
+        return ret;
+    }
+
+    for (uint32_t i = 0; i < size; ++i) {
+        const struct NvMdevGpu* gpu = nv_registry_at(&mgr->gpus, i);
+        int64_t key = mode == NV_REACTORS_PER_GPU ? (int64_t) gpu->gpu->identifier : gpu->numa_node;
+
+        if (nv_reactor_find(&ret, key) != ret.size)
+            continue;
+
+        struct CpuSet cpus;
+        uint8_t pinned = nv_reactor_cpus(gpu, mode, &cpus);
+        struct Reactor* reactor = reactor_create(gpu->numa_node, pinned ? &cpus : NULL);
+
+        if (reactor == NULL)
+            continue;
+
+        ret.keys[ret.size] = key;
+        ret.reactors[ret.size] = reactor;
+        ++ret.size;
+    }
+
+    return ret;
+}
+
+struct Reactor* nv_reactor_for_gpu(const struct NvReactors* reactors, const struct NvMdev* mgr, uint32_t gpu_id)
+{
+    if (reactors->size == 0)
+        return NULL;
+
+    int32_t node = -1;
+    uint8_t found = 0;
+
+    epoch_enter();
+
+    const struct NvGpuView* view = nv_mgr_view(mgr);
+    const struct NvMdevGpu* gpu = view != NULL ? nv_registry_find_id(&view->gpus, gpu_id) : NULL;
+
+    if (gpu != NULL) {
+        node = gpu->numa_node;
+        found = 1;
+    }
+
+    epoch_exit();
+
+    uint32_t i = reactors->size;
+
+    if (reactors->mode == NV_REACTORS_PER_GPU)
+        i = nv_reactor_find(reactors, gpu_id);
+
+    if (i == reactors->size && found) {
+        i = 0;
+
+        while (i < reactors->size && reactor_node(reactors->reactors[i]) != node)
+            ++i;
+    }
+
+    return reactors->reactors[i < reactors->size ? i : 0];
+}
+
+void free_nv_reactors(struct NvReactors* reactors)
+{
+    for (uint32_t i = 0; i < reactors->size; ++i)
+        reactor_destroy(reactors->reactors[i]);
+
+    free(reactors->keys);
+    free(reactors->reactors);
+
+    reactors->size = 0;
+    reactors->keys = NULL;
+    reactors->reactors = NULL;
+}
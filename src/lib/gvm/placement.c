@@ -0,0 +1,746 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <gvm/placement.h>
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*! \brief Node of a free framebuffer index, a treap keyed by free framebuffer then GPU id. */
+struct PlacementNode {
+    uint64_t free;                      //!< Free framebuffer of the GPU when indexed.
+    uint32_t gpu_id;                    //!< RM id of the GPU.
+    uint32_t priority;                  //!< Heap priority of the node.
+    struct PlacementNode* left;         //!< Nodes with a smaller key.
+    struct PlacementNode* right;        //!< Nodes with a larger key.
+};
+
+/*! \brief Free framebuffer indexes of a mdev type. */
+struct PlacementIndex {
+    uint32_t type;                      //!< Number of the mdev type.
+    struct PlacementNode* all;          //!< GPUs with room for an instance.
+    uint32_t node_count;                //!< Number of NUMA nodes indexed.
+    struct PlacementNode** nodes;       //!< GPUs with room for an instance, per NUMA node.
+};
+
+struct PlacementGpu;
+
+/*! \brief Mdev type registered on a GPU. */
+struct PlacementSlot {
+    struct PlacementNode all;           //!< Node in the index of every GPU.
+    struct PlacementNode local;         //!< Node in the index of the NUMA node of the GPU.
+    struct PlacementGpu* gpu;           //!< GPU the type is registered on.
+    struct PlacementIndex* index;       //!< Indexes of the type.
+    struct PlacementType type;          //!< Type.
+    uint32_t instances;                 //!< Instances of the type on the GPU.
+    uint32_t started;                   //!< Instances whose VM started, at the last sync.
+    uint32_t synced;                    //!< Sessions counted by the sync in progress.
+    uint8_t indexed;                    //!< If the slot is in the indexes of the type.
+};
+
+/*! \brief GPU of a placement engine. */
+struct PlacementGpu {
+    uint32_t gpu_id;                    //!< RM id of the GPU.
+    int32_t numa_node;                  //!< NUMA node of the GPU, -1 if unknown.
+    uint64_t fb_total;                  //!< Framebuffer available to the instances.
+    uint64_t fb_used;                   //!< Framebuffer used by the instances.
+    uint32_t instances;                 //!< Instances on the GPU.
+    uint32_t slot_count;                //!< Number of registered types.
+    struct PlacementSlot** slots;       //!< Registered types.
+};
+
+/*! \brief CPUs of a NUMA node with GPUs. */
+struct PlacementNuma {
+    int32_t node;                       //!< NUMA node.
+    struct CpuSet cpus;                 //!< CPUs of the node, empty if unknown.
+};
+
+struct Placement {
+    pthread_mutex_t lock;               //!< Protects the engine.
+    uint32_t seed;                      //!< State of the priority generator.
+    uint32_t gpu_count;                 //!< Number of GPUs.
+    uint32_t gpu_capacity;              //!< Capacity of the GPU array.
+    struct PlacementGpu** gpus;         //!< GPUs, sorted by RM id.
+    uint32_t index_count;               //!< Number of mdev types.
+    uint32_t index_capacity;            //!< Capacity of the index array.
+    struct PlacementIndex** indexes;    //!< Indexes, sorted by mdev type.
+    uint32_t numa_count;                //!< Number of NUMA nodes with GPUs.
+    struct PlacementNuma* numa;         //!< NUMA nodes with GPUs.
+};
+
+static int node_cmp(uint64_t free, uint32_t gpu_id, const struct PlacementNode* node)
+{
+    if (free != node->free)
+        return free < node->free ? -1 : 1;
+
+    if (gpu_id != node->gpu_id)
+        return gpu_id < node->gpu_id ? -1 : 1;
+
+    return 0;
+}
+
+static struct PlacementNode* treap_insert(struct PlacementNode* root, struct PlacementNode* node)
+{
+    if (root == NULL) {
+        node->left = NULL;
+        node->right = NULL;
+        return node;
+    }
+
+    if (node_cmp(node->free, node->gpu_id, root) < 0) {
+        root->left = treap_insert(root->left, node);
+
+        if (root->left->priority > root->priority) {
+            struct PlacementNode* top = root->left;
+            root->left = top->right;
+            top->right = root;
+            return top;
+        }
+    } else {
+        root->right = treap_insert(root->right, node);
+
+        if (root->right->priority > root->priority) {
+            struct PlacementNode* top = root->right;
+            root->right = top->left;
+            top->left = root;
+            return top;
+        }
+    }
+
+    return root;
+}
+
+static struct PlacementNode* treap_merge(struct PlacementNode* left, struct PlacementNode* right)
+{
+    if (left == NULL)
+        return right;
+
+    if (right == NULL)
+        return left;
+
+    if (left->priority > right->priority) {
+        left->right = treap_merge(left->right, right);
+        return left;
+    }
+
+    right->left = treap_merge(left, right->left);
+
+    return right;
+}
+
+static struct PlacementNode* treap_erase(struct PlacementNode* root, struct PlacementNode* node)
+{
+    if (root == NULL)
+        return NULL;
+
+    if (root == node)
+        return treap_merge(root->left, root->right);
+
+    if (node_cmp(node->free, node->gpu_id, root) < 0)
+        root->left = treap_erase(root->left, node);
+    else
+        root->right = treap_erase(root->right, node);
+
+    return root;
+}
+
+static struct PlacementNode* treap_min(struct PlacementNode* root)
+{
+    while (root != NULL && root->left != NULL)
+        root = root->left;
+
+    return root;
+}
+
+static struct PlacementNode* treap_max(struct PlacementNode* root)
+{
+    while (root != NULL && root->right != NULL)
+        root = root->right;
+
+    return root;
+}
+
+static uint64_t gpu_free(const struct PlacementGpu* gpu)
+{
+    return gpu->fb_used < gpu->fb_total ? gpu->fb_total - gpu->fb_used : 0;
+}
+
+static uint64_t type_need(const struct PlacementType* type)
+{
+    return type->fb_len + type->fb_res;
+}
+
+static void slot_unindex(struct PlacementSlot* slot)
+{
+    if (!slot->indexed)
+        return;
+
+    struct PlacementIndex* index = slot->index;
+
+    index->all = treap_erase(index->all, &slot->all);
+
+    if (slot->gpu->numa_node >= 0)
+        index->nodes[slot->gpu->numa_node] =
+            treap_erase(index->nodes[slot->gpu->numa_node], &slot->local);
+
+    slot->indexed = 0;
+}
+
+/*! \brief Indexes a slot under the free framebuffer of its GPU if an instance fits.
+ */
+static uint8_t slot_index(struct PlacementSlot* slot)
+{
+    struct PlacementIndex* index = slot->index;
+    struct PlacementGpu* gpu = slot->gpu;
+    uint64_t free = gpu_free(gpu);
+
+    if (slot->instances >= slot->type.max_instances || type_need(&slot->type) > free)
+        return 1;
+
+    if (gpu->numa_node >= 0 && (uint32_t) gpu->numa_node >= index->node_count) {
+        struct PlacementNode** nodes = realloc(index->nodes, (gpu->numa_node + 1) * sizeof(*nodes));
+
+        if (nodes == NULL)
+            return 0;
+
+        memset(nodes + index->node_count, 0,
+               (gpu->numa_node + 1 - index->node_count) * sizeof(*nodes));
+        index->nodes = nodes;
+        index->node_count = gpu->numa_node + 1;
+    }
+
+    slot->all.free = free;
+    slot->local.free = free;
+    index->all = treap_insert(index->all, &slot->all);
+
+    if (gpu->numa_node >= 0)
+        index->nodes[gpu->numa_node] = treap_insert(index->nodes[gpu->numa_node], &slot->local);
+
+    slot->indexed = 1;
+
+    return 1;
+}
+
+/*! \brief Moves the slots of a GPU to its current free framebuffer.
+ */
+static void gpu_reindex(struct PlacementGpu* gpu)
+{
+    for (uint32_t i = 0; i < gpu->slot_count; ++i) {
+        slot_unindex(gpu->slots[i]);
+        slot_index(gpu->slots[i]);
+    }
+}
+
+static uint32_t gpu_find(const struct Placement* engine, uint32_t gpu_id, uint8_t* found)
+{
+    uint32_t lo = 0;
+    uint32_t hi = engine->gpu_count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (engine->gpus[mid]->gpu_id < gpu_id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *found = lo < engine->gpu_count && engine->gpus[lo]->gpu_id == gpu_id;
+
+    return lo;
+}
+
+static struct PlacementGpu* gpu_get(const struct Placement* engine, uint32_t gpu_id)
+{
+    uint8_t found;
+    uint32_t pos = gpu_find(engine, gpu_id, &found);
+
+    return found ? engine->gpus[pos] : NULL;
+}
+
+static uint32_t index_find(const struct Placement* engine, uint32_t type, uint8_t* found)
+{
+    uint32_t lo = 0;
+    uint32_t hi = engine->index_count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (engine->indexes[mid]->type < type)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *found = lo < engine->index_count && engine->indexes[lo]->type == type;
+
+    return lo;
+}
+
+static struct PlacementSlot* slot_get(const struct PlacementGpu* gpu, uint32_t type)
+{
+    for (uint32_t i = 0; i < gpu->slot_count; ++i)
+        if (gpu->slots[i]->type.num == type)
+            return gpu->slots[i];
+
+    return NULL;
+}
+
+static uint32_t next_priority(struct Placement* engine)
+{
+    uint32_t x = engine->seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    engine->seed = x;
+
+    return x;
+}
+
+static uint8_t cpuset_intersects(const struct CpuSet* a, const struct CpuSet* b)
+{
+    for (uint32_t i = 0; i < CPU_SET_MAX / 64; ++i)
+        if (a->bits[i] & b->bits[i])
+            return 1;
+
+    return 0;
+}
+
+/*! \brief Chooses the slot of a new instance.
+ */
+static struct PlacementSlot* choose(const struct Placement* engine, const struct PlacementIndex* index,
+                                    const struct PlacementRequest* request)
+{
+    struct PlacementNode* node = NULL;
+
+    switch (request->policy) {
+    case PLACEMENT_SPREAD:
+        node = treap_max(index->all);
+        break;
+    case PLACEMENT_NUMA_FIRST:
+        if (request->cpus == NULL)
+            break;
+
+        for (uint32_t i = 0; i < engine->numa_count; ++i) {
+            const struct PlacementNuma* numa = &engine->numa[i];
+
+            if ((uint32_t) numa->node >= index->node_count || !cpuset_intersects(&numa->cpus, request->cpus))
+                continue;
+
+            struct PlacementNode* local = treap_min(index->nodes[numa->node]);
+
+            if (local != NULL && (node == NULL || node_cmp(local->free, local->gpu_id, node) < 0))
+                node = local;
+        }
+
+        if (node != NULL)
+            return (struct PlacementSlot*) ((char*) node - offsetof(struct PlacementSlot, local));
+        break;
+    case PLACEMENT_PACK:
+        break;
+    }
+
+    if (node == NULL)
+        node = treap_min(index->all);
+
+    return (struct PlacementSlot*) node;
+}
+
+/*! \failure Allocation Failure - Returns NULL when the engine could not be allocated.
+ */
+struct Placement* placement_create(void)
+{
+    struct Placement* engine = calloc(1, sizeof(*engine));
+
+    if (engine == NULL)
+        return NULL;
+
+    pthread_mutex_init(&engine->lock, NULL);
+    engine->seed = 0x9e3779b9;
+
+    return engine;
+}
+
+void placement_free(struct Placement* engine)
+{
+    if (engine == NULL)
+        return;
+
+    for (uint32_t i = 0; i < engine->gpu_count; ++i) {
+        for (uint32_t j = 0; j < engine->gpus[i]->slot_count; ++j)
+            free(engine->gpus[i]->slots[j]);
+
+        free(engine->gpus[i]->slots);
+        free(engine->gpus[i]);
+    }
+
+    for (uint32_t i = 0; i < engine->index_count; ++i) {
+        free(engine->indexes[i]->nodes);
+        free(engine->indexes[i]);
+    }
+
+    free(engine->gpus);
+    free(engine->indexes);
+    free(engine->numa);
+    pthread_mutex_destroy(&engine->lock);
+    free(engine);
+}
+
+/*! \failure Duplicate GPU - Returns 0 when the GPU was already added.
+ * \failure Allocation Failure - Returns 0 when the GPU could not be allocated.
+ */
+uint8_t placement_add_gpu(struct Placement* engine, uint32_t gpu_id, int32_t numa_node, uint64_t fb_total)
+{
+    uint8_t found;
+    uint8_t ret = 0;
+
+    pthread_mutex_lock(&engine->lock);
+
+    uint32_t pos = gpu_find(engine, gpu_id, &found);
+
+    if (found)
+        goto exit;
+
+    if (numa_node >= 0) {
+        uint32_t i = 0;
+
+        while (i < engine->numa_count && engine->numa[i].node != numa_node)
+            ++i;
+
+        if (i == engine->numa_count) {
+            struct PlacementNuma* numa = realloc(engine->numa, (i + 1) * sizeof(*numa));
+
+            if (numa == NULL)
+                goto exit;
+
+            engine->numa = numa;
+            numa[i].node = numa_node;
+            numa_node_cpus(numa_node, &numa[i].cpus);
+            ++engine->numa_count;
+        }
+    } else {
+        numa_node = -1;
+    }
+
+    if (engine->gpu_count == engine->gpu_capacity) {
+        uint32_t capacity = engine->gpu_capacity ? engine->gpu_capacity * 2 : 8;
+        struct PlacementGpu** gpus = realloc(engine->gpus, capacity * sizeof(*gpus));
+
+        if (gpus == NULL)
+            goto exit;
+
+        engine->gpus = gpus;
+        engine->gpu_capacity = capacity;
+    }
+
+    struct PlacementGpu* gpu = calloc(1, sizeof(*gpu));
+
+    if (gpu == NULL)
+        goto exit;
+
+    gpu->gpu_id = gpu_id;
+    gpu->numa_node = numa_node;
+    gpu->fb_total = fb_total;
+
+    memmove(engine->gpus + pos + 1, engine->gpus + pos, (engine->gpu_count - pos) * sizeof(*engine->gpus));
+    engine->gpus[pos] = gpu;
+    ++engine->gpu_count;
+    ret = 1;
+
+exit:
+    pthread_mutex_unlock(&engine->lock);
+
+    return ret;
+}
+
+/*! \failure Unknown GPU - Returns 0 when the GPU was not added.
+ * \failure Allocation Failure - Returns 0 when the type could not be allocated.
+ */
+uint8_t placement_add_type(struct Placement* engine, uint32_t gpu_id, const struct PlacementType* type)
+{
+    uint8_t found;
+    uint8_t ret = 0;
+
+    pthread_mutex_lock(&engine->lock);
+
+    struct PlacementGpu* gpu = gpu_get(engine, gpu_id);
+
+    if (gpu == NULL)
+        goto exit;
+
+    struct PlacementSlot* slot = slot_get(gpu, type->num);
+
+    if (slot != NULL) {
+        slot_unindex(slot);
+        gpu->fb_used -= slot->instances * type_need(&slot->type);
+        slot->type = *type;
+        gpu->fb_used += slot->instances * type_need(&slot->type);
+        gpu_reindex(gpu);
+        ret = 1;
+        goto exit;
+    }
+
+    uint32_t pos = index_find(engine, type->num, &found);
+
+    if (!found) {
+        if (engine->index_count == engine->index_capacity) {
+            uint32_t capacity = engine->index_capacity ? engine->index_capacity * 2 : 4;
+            struct PlacementIndex** indexes = realloc(engine->indexes, capacity * sizeof(*indexes));
+
+            if (indexes == NULL)
+                goto exit;
+
+            engine->indexes = indexes;
+            engine->index_capacity = capacity;
+        }
+
+        struct PlacementIndex* index = calloc(1, sizeof(*index));
+
+        if (index == NULL)
+            goto exit;
+
+        index->type = type->num;
+        memmove(engine->indexes + pos + 1, engine->indexes + pos,
+                (engine->index_count - pos) * sizeof(*engine->indexes));
+        engine->indexes[pos] = index;
+        ++engine->index_count;
+    }
+
+    struct PlacementSlot** slots = realloc(gpu->slots, (gpu->slot_count + 1) * sizeof(*slots));
+
+    if (slots == NULL)
+        goto exit;
+
+    gpu->slots = slots;
+    slot = calloc(1, sizeof(*slot));
+
+    if (slot == NULL)
+        goto exit;
+
+    slot->gpu = gpu;
+    slot->index = engine->indexes[pos];
+    slot->type = *type;
+    slot->all.gpu_id = gpu_id;
+    slot->all.priority = next_priority(engine);
+    slot->local.gpu_id = gpu_id;
+    slot->local.priority = next_priority(engine);
+
+    if (!slot_index(slot)) {
+        free(slot);
+        goto exit;
+    }
+
+    gpu->slots[gpu->slot_count++] = slot;
+    ret = 1;
+
+exit:
+    pthread_mutex_unlock(&engine->lock);
+
+    return ret;
+}
+
+size_t placement_add_requests(struct Placement* engine, uint32_t gpu_id, const struct MDevRequest* requests, size_t count)
+{
+    size_t ret = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        struct PlacementType type = {
+            .num = requests[i].num,
+            .max_instances = requests[i].max_inst,
+            .fb_len = (uint64_t) requests[i].fb_len << 20,
+            .fb_res = (uint64_t) requests[i].fb_res << 20,
+        };
+
+        ret += placement_add_type(engine, gpu_id, &type);
+    }
+
+    return ret;
+}
+
+/*! \failure Unknown Type - Returns 0 when the type is not registered on the GPU.
+ * \failure Overcommit - Returns 0 when the instances exceed the limit or the framebuffer of the type.
+ */
+uint8_t placement_set_instances(struct Placement* engine, uint32_t gpu_id, uint32_t type, uint32_t instances)
+{
+    uint8_t ret = 0;
+
+    pthread_mutex_lock(&engine->lock);
+
+    struct PlacementGpu* gpu = gpu_get(engine, gpu_id);
+    struct PlacementSlot* slot = gpu != NULL ? slot_get(gpu, type) : NULL;
+
+    if (slot == NULL || instances > slot->type.max_instances)
+        goto exit;
+
+    uint64_t need = type_need(&slot->type);
+    uint64_t used = gpu->fb_used - slot->instances * need + instances * need;
+
+    if (used > gpu->fb_total)
+        goto exit;
+
+    gpu->fb_used = used;
+    gpu->instances = gpu->instances - slot->instances + instances;
+    slot->instances = instances;
+    gpu_reindex(gpu);
+    ret = 1;
+
+exit:
+    pthread_mutex_unlock(&engine->lock);
+
+    return ret;
+}
+
+uint32_t placement_sync_sessions(struct Placement* engine, const struct VmSessionView* view)
+{
+    uint32_t ret = 0;
+
+    pthread_mutex_lock(&engine->lock);
+
+    for (uint32_t i = 0; i < engine->gpu_count; ++i) {
+        for (uint32_t j = 0; j < engine->gpus[i]->slot_count; ++j)
+            engine->gpus[i]->slots[j]->synced = 0;
+    }
+
+    for (size_t i = 0; view != NULL && i < view->size; ++i) {
+        const struct VmSession* session = &view->sessions[i];
+        struct PlacementGpu* gpu = gpu_get(engine, session->gpu_id);
+        struct PlacementSlot* slot = NULL;
+
+        /* Sessions of an unknown type can only belong to the type of a single type GPU. */
+        if (gpu != NULL && session->mdev_type == 0 && gpu->slot_count == 1)
+            slot = gpu->slots[0];
+        else if (gpu != NULL)
+            slot = slot_get(gpu, session->mdev_type);
+
+        if (slot != NULL)
+            ++slot->synced;
+    }
+
+    for (uint32_t i = 0; i < engine->gpu_count; ++i) {
+        struct PlacementGpu* gpu = engine->gpus[i];
+
+        if (gpu->slot_count == 0)
+            continue;
+
+        gpu->fb_used = 0;
+        gpu->instances = 0;
+
+        for (uint32_t j = 0; j < gpu->slot_count; ++j) {
+            struct PlacementSlot* slot = gpu->slots[j];
+            uint32_t pending = slot->instances > slot->started ? slot->instances - slot->started : 0;
+            uint32_t arrived = slot->synced > slot->started ? slot->synced - slot->started : 0;
+
+            /* Every new session is the start of an instance placed before it. */
+            pending = pending > arrived ? pending - arrived : 0;
+            slot->started = slot->synced;
+            slot->instances = slot->synced + pending;
+            gpu->fb_used += slot->instances * type_need(&slot->type);
+            gpu->instances += slot->instances;
+        }
+
+        gpu_reindex(gpu);
+        ++ret;
+    }
+
+    pthread_mutex_unlock(&engine->lock);
+
+    return ret;
+}
+
+/*! \failure Unknown Type - Returns 0 when no GPU registered the type.
+ * \failure No Capacity - Returns 0 when no GPU has room for the instance.
+ */
+uint8_t placement_place(struct Placement* engine, const struct PlacementRequest* request, uint32_t* gpu_id)
+{
+    uint8_t found;
+    uint8_t ret = 0;
+
+    pthread_mutex_lock(&engine->lock);
+
+    uint32_t pos = index_find(engine, request->type, &found);
+
+    if (!found)
+        goto exit;
+
+    struct PlacementSlot* slot = choose(engine, engine->indexes[pos], request);
+
+    if (slot == NULL)
+        goto exit;
+
+    struct PlacementGpu* gpu = slot->gpu;
+
+    ++slot->instances;
+    ++gpu->instances;
+    gpu->fb_used += type_need(&slot->type);
+    gpu_reindex(gpu);
+    *gpu_id = gpu->gpu_id;
+    ret = 1;
+
+exit:
+    pthread_mutex_unlock(&engine->lock);
+
+    return ret;
+}
+
+/*! \failure Unknown Instance - Returns 0 when the GPU has no instance of the type.
+ */
+uint8_t placement_release(struct Placement* engine, uint32_t gpu_id, uint32_t type)
+{
+    uint8_t ret = 0;
+
+    pthread_mutex_lock(&engine->lock);
+
+    struct PlacementGpu* gpu = gpu_get(engine, gpu_id);
+    struct PlacementSlot* slot = gpu != NULL ? slot_get(gpu, type) : NULL;
+
+    if (slot == NULL || slot->instances == 0)
+        goto exit;
+
+    --slot->instances;
+    --gpu->instances;
+    gpu->fb_used -= type_need(&slot->type);
+    gpu_reindex(gpu);
+    ret = 1;
+
+exit:
+    pthread_mutex_unlock(&engine->lock);
+
+    return ret;
+}
+
+uint8_t placement_gpu_stats(struct Placement* engine, uint32_t gpu_id, struct PlacementGpuStats* stats)
+{
+    pthread_mutex_lock(&engine->lock);
+
+    struct PlacementGpu* gpu = gpu_get(engine, gpu_id);
+
+    if (gpu != NULL) {
+        stats->gpu_id = gpu->gpu_id;
+        stats->numa_node = gpu->numa_node;
+        stats->fb_total = gpu->fb_total;
+        stats->fb_used = gpu->fb_used;
+        stats->instances = gpu->instances;
+    }
+
+    pthread_mutex_unlock(&engine->lock);
+
+    return gpu != NULL;
+}
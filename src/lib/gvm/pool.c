@@ -0,0 +1,537 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <gvm/pool.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gpu/nvidia/device.h>
+#include <utils/sysfs.h>
+#include <utils/uuid.h>
+
+//! Seconds between two refills of the background thread when nothing was taken or claimed.
+#define VGPU_POOL_PERIOD 1
+
+/*! \brief Number of instances kept ready for a type on a GPU. */
+struct VgpuPoolTarget {
+    char bdf[VGPU_POOL_BDF];            //!< PCI address of the GPU.
+    char type[VGPU_POOL_TYPE];          //!< Mdev type.
+    uint32_t target;                    //!< Instances kept ready.
+    uint32_t ready;                     //!< Instances ready.
+    uint32_t creating;                  //!< Instances being created.
+};
+
+/*! \brief Instance owned by a pool. */
+struct VgpuPoolEntry {
+    struct VgpuInstance instance;       //!< Instance.
+    uint32_t target;                    //!< Index of the target the instance was created for.
+    int fd;                             //!< Open vGPU device, -1 if not open.
+    uint8_t taken;                      //!< If the instance was handed out by vgpu_pool_take.
+};
+
+struct VgpuPool {
+    pthread_mutex_t lock;               //!< Lock protecting the pool.
+    pthread_cond_t wake;                //!< Signalled when the refill thread has work.
+    pthread_t thread;                   //!< Refill thread.
+    uint8_t started;                    //!< If the refill thread runs.
+    uint8_t stop;                       //!< If the refill thread must exit.
+    uint8_t pending;                    //!< If a refill was requested.
+    VgpuOpenFn open;                    //!< Opens the vGPU devices.
+    uint32_t target_count;              //!< Number of targets.
+    uint32_t target_capacity;           //!< Allocated targets.
+    struct VgpuPoolTarget* targets;     //!< Targets.
+    uint32_t entry_count;               //!< Number of instances.
+    uint32_t entry_capacity;            //!< Allocated instances.
+    struct VgpuPoolEntry* entries;      //!< Instances, ready or handed out.
+    struct VgpuPoolStats stats;         //!< Metrics, the counts are computed when read.
+};
+
+/*! \brief Requests a refill, must be called with the lock held. */
+static void vgpu_pool_request(struct VgpuPool* pool)
+{
+    pool->pending = 1;
+    pthread_cond_signal(&pool->wake);
+}
+
+/*! \brief Finds a target, must be called with the lock held.
+ *
+ * \return The index of the target, target_count if there is none.
+ */
+static uint32_t vgpu_pool_find(struct VgpuPool* pool, const char* bdf, const char* type)
+{
+    uint32_t ret = 0;
+
+    while (ret < pool->target_count &&
+           (strcmp(pool->targets[ret].bdf, bdf) != 0 || strcmp(pool->targets[ret].type, type) != 0))
+        ++ret;
+
+    return ret;
+}
+
+/*! \brief Removes an instance, must be called with the lock held. */
+static void vgpu_pool_remove(struct VgpuPool* pool, uint32_t index)
+{
+    struct VgpuPoolEntry* entry = &pool->entries[index];
+
+    if (!entry->taken)
+        --pool->targets[entry->target].ready;
+
+    *entry = pool->entries[--pool->entry_count];
+}
+
+/*! \brief Finds the vGPU minor of an instance and opens its device.
+ *
+ * \return The open device, -1 if the minor is not exposed yet or the device cannot be opened.
+ */
+static int vgpu_pool_open(struct VgpuPool* pool, struct VgpuInstance* instance)
+{
+    char uuid[UUID_STR_LEN + 1];
+    uint32_t minor;
+
+    uuid_format(&instance->uuid, uuid);
+
+    if (!sysfs_read_u32(&minor, "bus/mdev/devices/%s/nvidia/vgpu_minor", uuid) || minor > UINT16_MAX)
+        return -1;
+
+    instance->minor = minor;
+
+    return pool->open(minor);
+}
+
+/*! \brief Creates an instance for a target.
+ *
+ * \return If the instance was created, otherwise the target is skipped until the next fill.
+ */
+static uint8_t vgpu_pool_create_one(struct VgpuPool* pool, uint32_t target)
+{
+    struct VgpuPoolEntry entry = {};
+    char uuid[UUID_STR_LEN + 1];
+    uint32_t available = 1;
+
+    pthread_mutex_lock(&pool->lock);
+
+    struct VgpuPoolTarget* current = &pool->targets[target];
+
+    if (current->ready + current->creating >= current->target) {
+        pthread_mutex_unlock(&pool->lock);
+        return 0;
+    }
+
+    ++current->creating;
+    strcpy(entry.instance.bdf, current->bdf);
+    strcpy(entry.instance.type, current->type);
+
+    pthread_mutex_unlock(&pool->lock);
+
+    /* Creating is the slow part, it runs unlocked so claims on VM starts never wait for it. */
+    entry.target = target;
+    entry.instance.minor = -1;
+    entry.fd = -1;
+
+    sysfs_read_u32(
+        &available, "bus/pci/devices/%s/mdev_supported_types/%s/available_instances",
+        entry.instance.bdf, entry.instance.type
+    );
+
+    uint8_t created = available != 0 && uuid_generate(&entry.instance.uuid);
+
+    if (created) {
+        uuid_format(&entry.instance.uuid, uuid);
+        created = sysfs_write_str(
+            uuid, "bus/pci/devices/%s/mdev_supported_types/%s/create",
+            entry.instance.bdf, entry.instance.type
+        );
+    }
+
+    if (created)
+        entry.fd = vgpu_pool_open(pool, &entry.instance);
+
+    pthread_mutex_lock(&pool->lock);
+
+    current = &pool->targets[target];
+    --current->creating;
+
+    if (created && pool->entry_count == pool->entry_capacity) {
+        uint32_t capacity = pool->entry_capacity != 0 ? pool->entry_capacity * 2 : 16;
+        struct VgpuPoolEntry* entries = realloc(pool->entries, capacity * sizeof(*entries));
+
+        if (entries != NULL) {
+            pool->entries = entries;
+            pool->entry_capacity = capacity;
+        }
+    }
+
+    /* An instance that cannot be tracked would never be removed, it is undone as a failure. */
+    uint8_t tracked = created && pool->entry_count < pool->entry_capacity;
+
+    if (tracked) {
+        pool->entries[pool->entry_count++] = entry;
+        ++current->ready;
+        ++pool->stats.created;
+    } else if (available != 0) {
+        ++pool->stats.failures;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if (created && !tracked) {
+        if (entry.fd != -1)
+            close(entry.fd);
+
+        sysfs_write_str("1", "bus/mdev/devices/%s/remove", uuid);
+    }
+
+    return tracked;
+}
+
+/*! \brief Opens the devices of the ready instances whose vGPU appeared after their creation. */
+static void vgpu_pool_open_late(struct VgpuPool* pool)
+{
+    for (uint32_t i = 0;; ++i) {
+        pthread_mutex_lock(&pool->lock);
+
+        while (i < pool->entry_count && pool->entries[i].fd != -1)
+            ++i;
+
+        if (i >= pool->entry_count) {
+            pthread_mutex_unlock(&pool->lock);
+            return;
+        }
+
+        struct VgpuInstance instance = pool->entries[i].instance;
+
+        pthread_mutex_unlock(&pool->lock);
+
+        int fd = vgpu_pool_open(pool, &instance);
+
+        if (fd == -1)
+            continue;
+
+        pthread_mutex_lock(&pool->lock);
+
+        /* The instance may have moved or been claimed while the device was opened. */
+        uint32_t j = 0;
+
+        while (j < pool->entry_count && !uuid_equal(&pool->entries[j].instance.uuid, &instance.uuid))
+            ++j;
+
+        if (j < pool->entry_count && pool->entries[j].fd == -1) {
+            pool->entries[j].fd = fd;
+            pool->entries[j].instance.minor = instance.minor;
+            fd = -1;
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+
+        if (fd != -1)
+            close(fd);
+    }
+}
+
+/*! \brief Main loop of the refill thread. */
+static void* vgpu_pool_loop(void* arg)
+{
+    struct VgpuPool* pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (!pool->stop) {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += VGPU_POOL_PERIOD;
+
+        while (!pool->stop && !pool->pending)
+            if (pthread_cond_timedwait(&pool->wake, &pool->lock, &deadline) == ETIMEDOUT)
+                break;
+
+        if (pool->stop)
+            break;
+
+        pool->pending = 0;
+        pthread_mutex_unlock(&pool->lock);
+
+        vgpu_pool_fill(pool);
+
+        pthread_mutex_lock(&pool->lock);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/*! \failure Memory Failure - Returns NULL when the pool cannot be allocated.
+ */
+struct VgpuPool* vgpu_pool_create(VgpuOpenFn open)
+{
+    struct VgpuPool* ret = calloc(1, sizeof(struct VgpuPool));
+
+    if (ret == NULL)
+        return NULL;
+
+    pthread_mutex_init(&ret->lock, NULL);
+    pthread_cond_init(&ret->wake, NULL);
+    ret->open = open != NULL ? open : nv_open_mdev;
+
+    return ret;
+}
+
+/*! \failure Remove Failure - Instances the kernel refuses to remove are left behind.
+ */
+void vgpu_pool_free(struct VgpuPool* pool)
+{
+    if (pool == NULL)
+        return;
+
+    if (pool->started) {
+        pthread_mutex_lock(&pool->lock);
+        pool->stop = 1;
+        pthread_cond_signal(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+
+        pthread_join(pool->thread, NULL);
+    }
+
+    for (uint32_t i = 0; i < pool->entry_count; ++i) {
+        struct VgpuPoolEntry* entry = &pool->entries[i];
+        char uuid[UUID_STR_LEN + 1];
+
+        if (entry->fd != -1)
+            close(entry->fd);
+
+        /* Handed out instances belong to whoever took them, a VM may still be starting. */
+        if (entry->taken)
+            continue;
+
+        uuid_format(&entry->instance.uuid, uuid);
+        sysfs_write_str("1", "bus/mdev/devices/%s/remove", uuid);
+    }
+
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->entries);
+    free(pool->targets);
+    free(pool);
+}
+
+/*! \failure Invalid Target - Returns 0 when the address or type is empty or too long.
+ * \failure Memory Failure - Returns 0 when the target cannot be allocated.
+ */
+uint8_t vgpu_pool_add(struct VgpuPool* pool, const char* bdf, const char* type, uint32_t target)
+{
+    size_t bdf_length = strlen(bdf);
+    size_t type_length = strlen(type);
+
+    if (bdf_length == 0 || bdf_length >= VGPU_POOL_BDF || type_length == 0 || type_length >= VGPU_POOL_TYPE)
+        return 0;
+
+    pthread_mutex_lock(&pool->lock);
+
+    uint32_t index = vgpu_pool_find(pool, bdf, type);
+
+    if (index == pool->target_count && pool->target_count == pool->target_capacity) {
+        uint32_t capacity = pool->target_capacity != 0 ? pool->target_capacity * 2 : 4;
+        struct VgpuPoolTarget* targets = realloc(pool->targets, capacity * sizeof(*targets));
+
+        if (targets == NULL) {
+            pthread_mutex_unlock(&pool->lock);
+            return 0;
+        }
+
+        pool->targets = targets;
+        pool->target_capacity = capacity;
+    }
+
+    if (index == pool->target_count) {
+        memset(&pool->targets[index], 0, sizeof(struct VgpuPoolTarget));
+        strcpy(pool->targets[index].bdf, bdf);
+        strcpy(pool->targets[index].type, type);
+        ++pool->target_count;
+    }
+
+    pool->targets[index].target = target;
+    vgpu_pool_request(pool);
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return 1;
+}
+
+/*! \failure Malformed Target - Returns 0 when the @ or = is missing or the count is not a
+ *                              number.
+ */
+uint8_t vgpu_pool_parse(struct VgpuPool* pool, const char* spec)
+{
+    char type[VGPU_POOL_TYPE];
+    char bdf[VGPU_POOL_BDF];
+    const char* at = strchr(spec, '@');
+    const char* equals = strrchr(spec, '=');
+
+    if (at == NULL || equals == NULL || equals < at ||
+        (size_t) (at - spec) >= sizeof(type) || (size_t) (equals - at - 1) >= sizeof(bdf))
+        return 0;
+
+    char* end = NULL;
+    unsigned long target = strtoul(equals + 1, &end, 0);
+
+    if (end == equals + 1 || *end != '\0' || target > UINT32_MAX)
+        return 0;
+
+    memcpy(type, spec, at - spec);
+    type[at - spec] = '\0';
+    memcpy(bdf, at + 1, equals - at - 1);
+    bdf[equals - at - 1] = '\0';
+
+    return vgpu_pool_add(pool, bdf, type, target);
+}
+
+uint32_t vgpu_pool_fill(struct VgpuPool* pool)
+{
+    uint32_t ret = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    uint32_t count = pool->target_count;
+    pthread_mutex_unlock(&pool->lock);
+
+    /* Targets are only ever added, the indices stay valid unlocked. */
+    for (uint32_t i = 0; i < count; ++i)
+        while (vgpu_pool_create_one(pool, i))
+            ++ret;
+
+    vgpu_pool_open_late(pool);
+
+    return ret;
+}
+
+/*! \failure Thread Failure - Returns 0 when the thread cannot be created, the pool is then only
+ *                            filled by vgpu_pool_fill.
+ */
+uint8_t vgpu_pool_start(struct VgpuPool* pool)
+{
+    if (pool->started)
+        return 1;
+
+    pool->started = pthread_create(&pool->thread, NULL, vgpu_pool_loop, pool) == 0;
+
+    return pool->started;
+}
+
+/*! \failure Empty Pool - Returns 0 when no instance of the type is ready on the GPU.
+ */
+uint8_t vgpu_pool_take(struct VgpuPool* pool, const char* bdf, const char* type, struct VgpuInstance* instance)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    uint32_t target = vgpu_pool_find(pool, bdf, type);
+    uint32_t found = pool->entry_count;
+
+    /* Instances with an open device go first, they start the fastest. */
+    for (uint32_t i = 0; i < pool->entry_count; ++i) {
+        struct VgpuPoolEntry* entry = &pool->entries[i];
+
+        if (entry->taken || entry->target != target)
+            continue;
+
+        if (found == pool->entry_count || (entry->fd != -1 && pool->entries[found].fd == -1))
+            found = i;
+    }
+
+    if (found == pool->entry_count) {
+        pthread_mutex_unlock(&pool->lock);
+        return 0;
+    }
+
+    pool->entries[found].taken = 1;
+    --pool->targets[target].ready;
+    *instance = pool->entries[found].instance;
+    vgpu_pool_request(pool);
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return 1;
+}
+
+/*! \failure Stale Device - Closes the open device and returns -1 when the VM reports another
+ *                          minor than the one the device was opened with.
+ */
+int vgpu_pool_claim(struct VgpuPool* pool, const struct UUID* uuid, uint16_t minor)
+{
+    if (pool == NULL)
+        return -1;
+
+    pthread_mutex_lock(&pool->lock);
+
+    uint32_t i = 0;
+
+    while (i < pool->entry_count && !uuid_equal(&pool->entries[i].instance.uuid, uuid))
+        ++i;
+
+    if (i == pool->entry_count) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+
+    int ret = pool->entries[i].fd;
+    int stale = -1;
+
+    if (ret != -1 && pool->entries[i].instance.minor != minor) {
+        stale = ret;
+        ret = -1;
+    }
+
+    ++pool->stats.claimed;
+    if (ret != -1)
+        ++pool->stats.warm_starts;
+
+    vgpu_pool_remove(pool, i);
+    vgpu_pool_request(pool);
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if (stale != -1)
+        close(stale);
+
+    return ret;
+}
+
+void vgpu_pool_stats(struct VgpuPool* pool, struct VgpuPoolStats* stats)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    *stats = pool->stats;
+    stats->ready = 0;
+    stats->opened = 0;
+    stats->taken = 0;
+
+    for (uint32_t i = 0; i < pool->entry_count; ++i) {
+        if (pool->entries[i].taken) {
+            ++stats->taken;
+        } else {
+            ++stats->ready;
+            stats->opened += pool->entries[i].fd != -1;
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
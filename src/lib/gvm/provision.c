@@ -0,0 +1,517 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <gvm/provision.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <utils/clock.h>
+#include <utils/sysfs.h>
+#include <utils/uuid.h>
+
+/*! \brief Creates shared by the provisioning threads. */
+struct ProvisionRun {
+    struct ProvisionReport* report;     //!< Report holding the creates.
+    const uint32_t* parents;            //!< Index of the parent of every create.
+    const int* dirs;                    //!< Directory of the type of every parent.
+    uint32_t next;                      //!< Next create to run.
+    uint32_t in_flight;                 //!< Creates running.
+};
+
+/*! \brief Opens the directory of a type on a GPU.
+ *
+ * \return The directory, -1 if the GPU does not support the type.
+ */
+static int provision_open_type(const char* bdf, const char* type)
+{
+    char path[1024];
+
+    if (sysfs_path(path, sizeof(path), "bus/pci/devices/%s/mdev_supported_types/%s", bdf, type) == -1)
+        return -1;
+
+    return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/*! \brief Counts the instances of a type, listed in its devices directory. */
+static uint32_t provision_count_existing(int dir)
+{
+    int devices = openat(dir, "devices", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    uint32_t ret = 0;
+
+    if (devices == -1)
+        return 0;
+
+    DIR* listing = fdopendir(devices);
+
+    if (listing == NULL) {
+        close(devices);
+        return 0;
+    }
+
+    for (struct dirent* entry; (entry = readdir(listing)) != NULL;)
+        ret += entry->d_name[0] != '.';
+
+    closedir(listing);
+
+    return ret;
+}
+
+/*! \brief Reads the number of instances a type can still create.
+ *
+ * \return The available instances, 0 if unknown.
+ */
+static uint32_t provision_read_available(int dir)
+{
+    char contents[32] = "";
+    int fd = openat(dir, "available_instances", O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+        return 0;
+
+    ssize_t size = read(fd, contents, sizeof(contents) - 1);
+
+    close(fd);
+
+    if (size <= 0)
+        return 0;
+
+    contents[size] = '\0';
+
+    return strtoul(contents, NULL, 0);
+}
+
+/*! \brief Adds a GPU and type pair, or finds it if already added.
+ *
+ * \return The index of the pair, -1 if it could not be allocated.
+ */
+static int64_t provision_add_parent(struct ProvisionReport* report, int** dirs, const char* bdf, const char* type)
+{
+    for (uint32_t i = 0; i < report->parent_count; ++i)
+        if (strcmp(report->parents[i].bdf, bdf) == 0 && strcmp(report->parents[i].type, type) == 0)
+            return i;
+
+    /* Grown one at a time, a host has a handful of GPUs. */
+    uint32_t index = report->parent_count;
+    struct ProvisionParent* parents = realloc(report->parents, (index + 1) * sizeof(*parents));
+
+    if (parents == NULL)
+        return -1;
+
+    report->parents = parents;
+
+    int* grown = realloc(*dirs, (index + 1) * sizeof(*grown));
+
+    if (grown == NULL)
+        return -1;
+
+    *dirs = grown;
+
+    struct ProvisionParent* parent = &report->parents[index];
+
+    memset(parent, 0, sizeof(*parent));
+    strcpy(parent->bdf, bdf);
+    strcpy(parent->type, type);
+
+    (*dirs)[index] = provision_open_type(bdf, type);
+
+    if ((*dirs)[index] != -1) {
+        parent->existing = provision_count_existing((*dirs)[index]);
+        parent->available = provision_read_available((*dirs)[index]);
+    }
+
+    report->existing += parent->existing;
+    ++report->parent_count;
+
+    return index;
+}
+
+/*! \brief Selects the GPUs of a request.
+ *
+ * \param selected - Returns the indices of the pairs of the request, freed by the caller.
+ * \return Number of selected GPUs, -1 if the selection is malformed or cannot be allocated.
+ */
+static int64_t provision_select(
+    struct ProvisionReport* report,
+    int** dirs,
+    const struct ProvisionRequest* request,
+    uint32_t** selected
+)
+{
+    char bdf[PROVISION_BDF];
+    int64_t ret = 0;
+
+    *selected = NULL;
+
+    /* Every GPU supporting mediated devices is listed in the mdev_bus class. */
+    if (request->gpus == NULL || strcmp(request->gpus, "all") == 0) {
+        char path[1024];
+
+        if (sysfs_path(path, sizeof(path), "class/mdev_bus") == -1)
+            return -1;
+
+        DIR* listing = opendir(path);
+
+        if (listing == NULL)
+            return 0;
+
+        for (struct dirent* entry; (entry = readdir(listing)) != NULL;) {
+            if (entry->d_name[0] == '.' || strlen(entry->d_name) >= sizeof(bdf))
+                continue;
+
+            int dir = provision_open_type(entry->d_name, request->type);
+
+            if (dir == -1)
+                continue;
+
+            close(dir);
+
+            int64_t index = provision_add_parent(report, dirs, entry->d_name, request->type);
+            uint32_t* grown = index != -1 ? realloc(*selected, (ret + 1) * sizeof(*grown)) : NULL;
+
+            if (grown == NULL) {
+                closedir(listing);
+                return -1;
+            }
+
+            *selected = grown;
+            (*selected)[ret++] = index;
+        }
+
+        closedir(listing);
+
+        return ret;
+    }
+
+    /* Named GPUs are always reported, one without the type has no room for instances. */
+    for (const char* start = request->gpus; *start != '\0';) {
+        size_t length = strcspn(start, ",");
+
+        if (length == 0 || length >= sizeof(bdf))
+            return -1;
+
+        memcpy(bdf, start, length);
+        bdf[length] = '\0';
+        start += length + (start[length] == ',');
+
+        int64_t index = provision_add_parent(report, dirs, bdf, request->type);
+        uint32_t* grown = index != -1 ? realloc(*selected, (ret + 1) * sizeof(*grown)) : NULL;
+
+        if (grown == NULL)
+            return -1;
+
+        *selected = grown;
+        (*selected)[ret++] = index;
+    }
+
+    return ret;
+}
+
+/*! \brief Plans the creates of a request, the GPUs with the fewest instances first.
+ *
+ * \param planned - Creates planned per pair, by this and the previous requests.
+ * \return If the creates could be allocated.
+ */
+static uint8_t provision_plan(
+    struct ProvisionReport* report,
+    uint32_t** parents,
+    uint32_t* planned,
+    const struct ProvisionRequest* request,
+    const uint32_t* selected,
+    uint32_t selected_count
+)
+{
+    uint32_t total = 0;
+
+    for (uint32_t i = 0; i < selected_count; ++i)
+        total += report->parents[selected[i]].existing + planned[selected[i]];
+
+    for (; total < request->count; ++total) {
+        uint32_t best = UINT32_MAX;
+
+        for (uint32_t i = 0; i < selected_count; ++i) {
+            const struct ProvisionParent* parent = &report->parents[selected[i]];
+
+            if (planned[selected[i]] >= parent->available)
+                continue;
+
+            if (best == UINT32_MAX ||
+                parent->existing + planned[selected[i]] < report->parents[best].existing + planned[best])
+                best = selected[i];
+        }
+
+        if (best == UINT32_MAX) {
+            report->shortfall += request->count - total;
+            return 1;
+        }
+
+        uint32_t index = report->result_count;
+        struct ProvisionResult* results = realloc(report->results, (index + 1) * sizeof(*results));
+
+        if (results == NULL)
+            return 0;
+
+        report->results = results;
+
+        uint32_t* grown = realloc(*parents, (index + 1) * sizeof(*grown));
+
+        if (grown == NULL)
+            return 0;
+
+        *parents = grown;
+
+        struct ProvisionResult* result = &report->results[index];
+
+        memset(result, 0, sizeof(*result));
+        strcpy(result->bdf, report->parents[best].bdf);
+        strcpy(result->type, report->parents[best].type);
+        result->error = uuid_generate(&result->uuid) ? 0 : EAGAIN;
+
+        (*parents)[index] = best;
+        ++planned[best];
+        ++report->result_count;
+    }
+
+    return 1;
+}
+
+/*! \brief Writes a create relative to the directory of its type. */
+static void provision_create(struct ProvisionResult* result, int dir)
+{
+    char uuid[UUID_STR_LEN + 1];
+    uint64_t start = clock_now_ns();
+
+    uuid_format(&result->uuid, uuid);
+
+    /* Appending, like sysfs_write_str, keeps every create of a fixture file. */
+    int fd = openat(dir, "create", O_WRONLY | O_APPEND | O_CLOEXEC);
+
+    if (fd == -1) {
+        result->error = errno;
+    } else {
+        ssize_t written;
+
+        do {
+            written = write(fd, uuid, UUID_STR_LEN);
+        } while (written == -1 && errno == EINTR);
+
+        if (written == -1)
+            result->error = errno;
+        else if (written != UUID_STR_LEN)
+            result->error = EIO;
+
+        close(fd);
+    }
+
+    result->ns = clock_now_ns() - start;
+}
+
+/*! \brief Runs creates until none is left. */
+static void* provision_worker(void* arg)
+{
+    struct ProvisionRun* run = arg;
+    uint32_t index;
+
+    while ((index = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED)) < run->report->result_count) {
+        struct ProvisionResult* result = &run->report->results[index];
+        int dir = run->dirs[run->parents[index]];
+
+        if (result->error != 0)
+            continue;
+
+        if (dir == -1) {
+            result->error = ENOENT;
+            continue;
+        }
+
+        uint32_t in_flight = __atomic_add_fetch(&run->in_flight, 1, __ATOMIC_RELAXED);
+        uint32_t max = __atomic_load_n(&run->report->max_in_flight, __ATOMIC_RELAXED);
+
+        while (in_flight > max &&
+               !__atomic_compare_exchange_n(&run->report->max_in_flight, &max, in_flight, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+
+        provision_create(result, dir);
+        __atomic_sub_fetch(&run->in_flight, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+/*! \brief Runs every planned create on up to max_parallel threads, the caller included. */
+static void provision_run(struct ProvisionReport* report, const uint32_t* parents, const int* dirs, uint32_t max_parallel)
+{
+    pthread_t threads[PROVISION_MAX_PARALLEL];
+    struct ProvisionRun run = {report, parents, dirs, 0, 0};
+    uint32_t count = report->result_count < max_parallel ? report->result_count : max_parallel;
+    uint32_t started = 0;
+    uint64_t start = clock_now_ns();
+
+    /* Threads that cannot be created leave their share to the others. */
+    while (started + 1 < count && pthread_create(&threads[started], NULL, provision_worker, &run) == 0)
+        ++started;
+
+    provision_worker(&run);
+
+    for (uint32_t i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    report->elapsed_ns = clock_now_ns() - start;
+}
+
+/*! \failure Malformed Request - Returns 0 when the =, the type or the count is missing, the
+ *                               count is not a number or the type is too long.
+ */
+uint8_t provision_parse(const char* spec, struct ProvisionRequest* request)
+{
+    const char* equals = strchr(spec, '=');
+
+    if (equals == NULL || equals == spec || (size_t) (equals - spec) >= sizeof(request->type))
+        return 0;
+
+    char* end = NULL;
+    unsigned long count = strtoul(equals + 1, &end, 0);
+
+    if (end == equals + 1 || (*end != '\0' && *end != '@') || count > UINT32_MAX ||
+        (*end == '@' && end[1] == '\0'))
+        return 0;
+
+    memcpy(request->type, spec, equals - spec);
+    request->type[equals - spec] = '\0';
+    request->count = count;
+    request->gpus = *end == '@' ? end + 1 : NULL;
+
+    return 1;
+}
+
+/*! \failure Malformed Request - Returns 0 when a type is empty or a GPU list is malformed.
+ * \failure Memory Failure - Returns 0 when the plan cannot be allocated, nothing is created.
+ */
+uint8_t provision_mdevs(
+    const struct ProvisionRequest* requests,
+    size_t count,
+    uint32_t max_parallel,
+    struct ProvisionReport* report
+)
+{
+    uint32_t* parents = NULL;
+    uint32_t* planned = NULL;
+    int* dirs = NULL;
+    uint8_t ret = 1;
+
+    memset(report, 0, sizeof(*report));
+
+    for (size_t i = 0; i < count && ret; ++i) {
+        uint32_t* selected = NULL;
+        uint32_t known = report->parent_count;
+        int64_t selected_count = requests[i].type[0] != '\0' ?
+                                 provision_select(report, &dirs, &requests[i], &selected) : -1;
+
+        /* Pairs are only added by the selection, the plan grows with them. */
+        uint32_t* grown = selected_count != -1 ? realloc(planned, (report->parent_count + 1) * sizeof(*grown)) : NULL;
+
+        if (grown != NULL) {
+            for (uint32_t j = known; j < report->parent_count; ++j)
+                grown[j] = 0;
+            planned = grown;
+        }
+
+        ret = grown != NULL &&
+              provision_plan(report, &parents, planned, &requests[i], selected, selected_count);
+
+        free(selected);
+    }
+
+    if (ret)
+        provision_run(report, parents, dirs, max_parallel != 0 && max_parallel < PROVISION_MAX_PARALLEL ?
+                                             max_parallel : PROVISION_MAX_PARALLEL);
+
+    for (uint32_t i = 0; ret && i < report->result_count; ++i) {
+        struct ProvisionResult* result = &report->results[i];
+        struct ProvisionParent* parent = &report->parents[parents[i]];
+
+        if (result->ns > report->slowest_ns)
+            report->slowest_ns = result->ns;
+
+        if (result->error == 0) {
+            ++parent->created;
+            ++report->created;
+        } else {
+            ++parent->failed;
+            ++report->failed;
+        }
+    }
+
+    for (uint32_t i = 0; i < report->parent_count; ++i)
+        if (dirs[i] != -1)
+            close(dirs[i]);
+
+    free(dirs);
+    free(planned);
+    free(parents);
+
+    if (!ret)
+        provision_free_report(report);
+
+    return ret;
+}
+
+void provision_print_report(const struct ProvisionReport* report, FILE* out)
+{
+    char uuid[UUID_STR_LEN + 1];
+
+    for (uint32_t i = 0; i < report->result_count; ++i) {
+        const struct ProvisionResult* result = &report->results[i];
+
+        uuid_format(&result->uuid, uuid);
+        fprintf(
+            out, "%s %s %s: %s\n", result->bdf, result->type, uuid,
+            result->error == 0 ? "created" : strerror(result->error)
+        );
+    }
+
+    for (uint32_t i = 0; i < report->parent_count; ++i) {
+        const struct ProvisionParent* parent = &report->parents[i];
+
+        fprintf(
+            out, "GPU %s type %s: %u existing, %u created, %u failed\n",
+            parent->bdf, parent->type, parent->existing, parent->created, parent->failed
+        );
+    }
+
+    fprintf(
+        out,
+        "Provisioned %u instances in %.3f ms, slowest create %.3f ms, %u at once\n"
+        "\t%u already existed, %u failed, %u did not fit on the GPUs\n",
+        report->created, report->elapsed_ns / 1e6, report->slowest_ns / 1e6, report->max_in_flight,
+        report->existing, report->failed, report->shortfall
+    );
+}
+
+void provision_free_report(struct ProvisionReport* report)
+{
+    free(report->parents);
+    free(report->results);
+    memset(report, 0, sizeof(*report));
+}
@@ -0,0 +1,357 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gvm/scheduler.h>
+
+#include <utils/clock.h>
+
+//! Longest pattern of a priority rule.
+#define VM_SCHED_PATTERN 64
+
+/*! \brief Request waiting in a scheduler. */
+struct VmSchedItem {
+    void* data;                                 //!< Data of the request.
+    uint64_t queued_ns;                         //!< CLOCK_MONOTONIC time it was queued.
+    struct VmSchedItem* next;                   //!< Next request of the same queue.
+};
+
+/*! \brief Requests of a GPU. */
+struct VmSchedGpu {
+    uint32_t gpu_id;                            //!< RM id of the GPU.
+    uint32_t in_flight;                         //!< Requests dispatched and not done.
+    uint32_t queued;                            //!< Requests waiting.
+    struct VmSchedItem* heads[VM_SCHED_CLASSES]; //!< First request waiting per class.
+    struct VmSchedItem* tails[VM_SCHED_CLASSES]; //!< Last request waiting per class.
+};
+
+/*! \brief Priority rule. */
+struct VmSchedRule {
+    char pattern[VM_SCHED_PATTERN];             //!< Text to find in the configuration.
+    uint8_t priority_class;                     //!< Class of the matching requests.
+};
+
+struct VmScheduler {
+    pthread_mutex_t lock;                       //!< Lock protecting the queues and metrics.
+    uint32_t gpu_cap;                           //!< Most requests in flight per GPU.
+    uint8_t default_class;                      //!< Class when no rule matches.
+    uint32_t rule_count;                        //!< Number of rules.
+    struct VmSchedRule* rules;                  //!< Priority rules, in match order.
+    uint32_t gpu_count;                         //!< Number of GPUs.
+    uint32_t gpu_capacity;                      //!< Allocated GPUs.
+    struct VmSchedGpu* gpus;                    //!< GPUs with requests seen.
+    uint32_t cursor;                            //!< GPU served first by the next dispatch.
+    struct VmSchedStats stats;                  //!< Metrics.
+};
+
+/*! \brief Finds a GPU, must be called with the lock held.
+ *
+ * \param create - If the GPU is added when missing.
+ * \return The GPU, NULL if it is missing and could not be added.
+ */
+static struct VmSchedGpu* vm_sched_gpu(struct VmScheduler* sched, uint32_t gpu_id, uint8_t create)
+{
+    for (uint32_t i = 0; i < sched->gpu_count; ++i)
+        if (sched->gpus[i].gpu_id == gpu_id)
+            return &sched->gpus[i];
+
+    if (!create)
+        return NULL;
+
+    if (sched->gpu_count == sched->gpu_capacity) {
+        uint32_t capacity = sched->gpu_capacity != 0 ? sched->gpu_capacity * 2 : 8;
+        struct VmSchedGpu* gpus = realloc(sched->gpus, capacity * sizeof(*gpus));
+
+        if (gpus == NULL)
+            return NULL;
+
+        sched->gpus = gpus;
+        sched->gpu_capacity = capacity;
+    }
+
+    struct VmSchedGpu* ret = &sched->gpus[sched->gpu_count++];
+
+    memset(ret, 0, sizeof(*ret));
+    ret->gpu_id = gpu_id;
+    sched->stats.gpus = sched->gpu_count;
+
+    return ret;
+}
+
+/*! \failure Memory Failure - Returns NULL when the scheduler cannot be allocated.
+ */
+struct VmScheduler* vm_sched_create(uint32_t gpu_cap, uint8_t default_class)
+{
+    struct VmScheduler* ret = calloc(1, sizeof(struct VmScheduler));
+
+    if (ret == NULL)
+        return NULL;
+
+    pthread_mutex_init(&ret->lock, NULL);
+    ret->gpu_cap = gpu_cap != 0 ? gpu_cap : 1;
+    ret->default_class = default_class < VM_SCHED_CLASSES ? default_class : VM_SCHED_CLASSES - 1;
+
+    return ret;
+}
+
+void vm_sched_free(struct VmScheduler* sched, void (*discard)(void* data))
+{
+    if (sched == NULL)
+        return;
+
+    for (uint32_t i = 0; i < sched->gpu_count; ++i) {
+        for (uint32_t j = 0; j < VM_SCHED_CLASSES; ++j) {
+            struct VmSchedItem* item = sched->gpus[i].heads[j];
+
+            while (item != NULL) {
+                struct VmSchedItem* next = item->next;
+
+                if (discard != NULL)
+                    discard(item->data);
+
+                free(item);
+                item = next;
+            }
+        }
+    }
+
+    pthread_mutex_destroy(&sched->lock);
+    free(sched->gpus);
+    free(sched->rules);
+    free(sched);
+}
+
+/*! \failure Invalid Rule - Returns 0 when the pattern is empty or too long, or the class does
+ *                          not exist.
+ */
+uint8_t vm_sched_add_rule(struct VmScheduler* sched, const char* pattern, uint8_t priority_class)
+{
+    size_t length = strlen(pattern);
+
+    if (length == 0 || length >= VM_SCHED_PATTERN || priority_class >= VM_SCHED_CLASSES)
+        return 0;
+
+    pthread_mutex_lock(&sched->lock);
+
+    struct VmSchedRule* rules = realloc(sched->rules, (sched->rule_count + 1) * sizeof(*rules));
+
+    if (rules != NULL) {
+        memcpy(rules[sched->rule_count].pattern, pattern, length + 1);
+        rules[sched->rule_count].priority_class = priority_class;
+        sched->rules = rules;
+        ++sched->rule_count;
+    }
+
+    pthread_mutex_unlock(&sched->lock);
+
+    return rules != NULL;
+}
+
+/*! \failure Invalid Rule - Returns 0 when the rule has no '=' or its class is not a number.
+ */
+uint8_t vm_sched_parse_rule(struct VmScheduler* sched, const char* rule)
+{
+    const char* split = strrchr(rule, '=');
+
+    if (split == NULL || split == rule || split - rule >= VM_SCHED_PATTERN)
+        return 0;
+
+    char pattern[VM_SCHED_PATTERN];
+    char* end = NULL;
+    unsigned long priority_class = strtoul(split + 1, &end, 10);
+
+    if (end == split + 1 || *end != '\0')
+        return 0;
+
+    memcpy(pattern, rule, split - rule);
+    pattern[split - rule] = '\0';
+
+    return priority_class < VM_SCHED_CLASSES && vm_sched_add_rule(sched, pattern, priority_class);
+}
+
+uint8_t vm_sched_class(struct VmScheduler* sched, const char* config)
+{
+    uint8_t ret = sched->default_class;
+
+    pthread_mutex_lock(&sched->lock);
+
+    for (uint32_t i = 0; i < sched->rule_count; ++i) {
+        if (strstr(config, sched->rules[i].pattern) != NULL) {
+            ret = sched->rules[i].priority_class;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&sched->lock);
+
+    return ret;
+}
+
+/*! \failure Memory Failure - Returns 0 and leaves the data to the caller.
+ */
+uint8_t vm_sched_submit(struct VmScheduler* sched, uint32_t gpu_id, uint8_t priority_class, void* data)
+{
+    struct VmSchedItem* item = malloc(sizeof(struct VmSchedItem));
+
+    if (item == NULL)
+        return 0;
+
+    if (priority_class >= VM_SCHED_CLASSES)
+        priority_class = VM_SCHED_CLASSES - 1;
+
+    item->data = data;
+    item->queued_ns = clock_now_ns();
+    item->next = NULL;
+
+    pthread_mutex_lock(&sched->lock);
+
+    struct VmSchedGpu* gpu = vm_sched_gpu(sched, gpu_id, 1);
+
+    if (gpu == NULL) {
+        pthread_mutex_unlock(&sched->lock);
+        free(item);
+        return 0;
+    }
+
+    if (gpu->tails[priority_class] != NULL)
+        gpu->tails[priority_class]->next = item;
+    else
+        gpu->heads[priority_class] = item;
+
+    gpu->tails[priority_class] = item;
+    ++gpu->queued;
+
+    ++sched->stats.submitted;
+    ++sched->stats.queued;
+    ++sched->stats.queued_by_class[priority_class];
+
+    if (sched->stats.queued > sched->stats.max_queued)
+        sched->stats.max_queued = sched->stats.queued;
+
+    pthread_mutex_unlock(&sched->lock);
+
+    return 1;
+}
+
+uint8_t vm_sched_next(struct VmScheduler* sched, uint32_t* gpu_id, void** data)
+{
+    struct VmSchedItem* item = NULL;
+
+    pthread_mutex_lock(&sched->lock);
+
+    /* Strict priority across classes, round robin across the GPUs within a class. */
+    for (uint32_t c = 0; c < VM_SCHED_CLASSES && item == NULL; ++c) {
+        if (sched->stats.queued_by_class[c] == 0)
+            continue;
+
+        for (uint32_t i = 0; i < sched->gpu_count; ++i) {
+            uint32_t index = (sched->cursor + i) % sched->gpu_count;
+            struct VmSchedGpu* gpu = &sched->gpus[index];
+
+            if (gpu->heads[c] == NULL || gpu->in_flight >= sched->gpu_cap)
+                continue;
+
+            item = gpu->heads[c];
+            gpu->heads[c] = item->next;
+
+            if (gpu->heads[c] == NULL)
+                gpu->tails[c] = NULL;
+
+            --gpu->queued;
+            ++gpu->in_flight;
+            --sched->stats.queued;
+            --sched->stats.queued_by_class[c];
+            ++sched->stats.in_flight;
+            ++sched->stats.dispatched;
+
+            sched->cursor = (index + 1) % sched->gpu_count;
+            *gpu_id = gpu->gpu_id;
+            break;
+        }
+    }
+
+    if (item != NULL) {
+        uint64_t wait_ns = clock_now_ns() - item->queued_ns;
+
+        sched->stats.wait_ns_total += wait_ns;
+
+        if (wait_ns > sched->stats.wait_ns_max)
+            sched->stats.wait_ns_max = wait_ns;
+    }
+
+    pthread_mutex_unlock(&sched->lock);
+
+    if (item == NULL)
+        return 0;
+
+    *data = item->data;
+    free(item);
+
+    return 1;
+}
+
+void vm_sched_done(struct VmScheduler* sched, uint32_t gpu_id)
+{
+    pthread_mutex_lock(&sched->lock);
+
+    struct VmSchedGpu* gpu = vm_sched_gpu(sched, gpu_id, 0);
+
+    if (gpu != NULL && gpu->in_flight > 0) {
+        --gpu->in_flight;
+        --sched->stats.in_flight;
+        ++sched->stats.completed;
+    }
+
+    pthread_mutex_unlock(&sched->lock);
+}
+
+size_t vm_sched_pump(struct VmScheduler* sched, VmSchedDispatch dispatch, void* user)
+{
+    size_t ret = 0;
+    uint32_t gpu_id;
+    void* data;
+
+    while (vm_sched_next(sched, &gpu_id, &data)) {
+        dispatch(gpu_id, data, user);
+        ++ret;
+    }
+
+    return ret;
+}
+
+void vm_sched_stats(struct VmScheduler* sched, struct VmSchedStats* stats)
+{
+    pthread_mutex_lock(&sched->lock);
+    *stats = sched->stats;
+    pthread_mutex_unlock(&sched->lock);
+}
+
+uint32_t vm_sched_gpu_depth(struct VmScheduler* sched, uint32_t gpu_id)
+{
+    pthread_mutex_lock(&sched->lock);
+
+    struct VmSchedGpu* gpu = vm_sched_gpu(sched, gpu_id, 0);
+    uint32_t ret = gpu != NULL ? gpu->queued : 0;
+
+    pthread_mutex_unlock(&sched->lock);
+
+    return ret;
+}
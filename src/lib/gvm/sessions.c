@@ -0,0 +1,379 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gvm/sessions.h>
+
+#include <utils/epoch.h>
+#include <utils/sysfs.h>
+#include <utils/uuid.h>
+
+//! Largest QEMU command line read to find its UUID.
+#define QEMU_CMDLINE_MAX 65536
+
+/*! \brief Frees a session snapshot once it is retired.
+ *
+ * \param ptr - Snapshot to free.
+ */
+static void vm_free_view(void* ptr)
+{
+    struct VmSessionView* view = ptr;
+
+    free(view->sessions);
+    free(view->index);
+    free(view->pid_index);
+    free(view->loads);
+    free(view);
+}
+
+/*! \brief Releases the vgpu fd and pidfd of a session.
+ *
+ * \param session - Session to release.
+ * \param keep - Session taking over the resources, NULL if none.
+ */
+static void vm_release_session(const struct VmSession* session, const struct VmSession* keep)
+{
+    if (session->mdev_fd != -1 && (keep == NULL || keep->mdev_fd != session->mdev_fd))
+        close(session->mdev_fd);
+
+    /* Closing the pidfd also drops it from the exit watch. */
+    if (session->pid_fd != -1 && (keep == NULL || keep->pid_fd != session->pid_fd))
+        close(session->pid_fd);
+}
+
+/*! \brief Orders GPU loads by GPU id. */
+static int vm_compare_loads(const void* first, const void* second)
+{
+    uint32_t a = ((const struct VmGpuLoad*) first)->gpu_id;
+    uint32_t b = ((const struct VmGpuLoad*) second)->gpu_id;
+
+    return (a > b) - (a < b);
+}
+
+/*! \brief Gets the first slot of a pidfd in an index of capacity slots. */
+static uint32_t vm_pid_slot(int pid_fd, uint32_t capacity)
+{
+    return (uint32_t) (((uint64_t) pid_fd * 0x9E3779B97F4A7C15ULL) >> 32) & (capacity - 1);
+}
+
+/*! \brief Builds the UUID and pidfd indexes and the GPU loads of a snapshot.
+ *
+ * \param view - Snapshot whose sessions are set.
+ * \return If the index could be allocated.
+ */
+static uint8_t vm_index_view(struct VmSessionView* view)
+{
+    view->capacity = 8;
+
+    while (view->capacity < view->size * 2)
+        view->capacity *= 2;
+
+    view->index = calloc(view->capacity, sizeof(*view->index));
+    view->pid_index = calloc(view->capacity, sizeof(*view->pid_index));
+    view->loads = calloc(view->size + 1, sizeof(*view->loads));
+
+    if (view->index == NULL || view->pid_index == NULL || view->loads == NULL)
+        return 0;
+
+    for (uint32_t i = 0; i < view->size; ++i) {
+        uint32_t slot = uuid_hash(&view->sessions[i].mdev) & (view->capacity - 1);
+
+        while (view->index[slot] != 0)
+            slot = (slot + 1) & (view->capacity - 1);
+
+        view->index[slot] = i + 1;
+
+        if (view->sessions[i].pid_fd != -1) {
+            slot = vm_pid_slot(view->sessions[i].pid_fd, view->capacity);
+
+            while (view->pid_index[slot] != 0)
+                slot = (slot + 1) & (view->capacity - 1);
+
+            view->pid_index[slot] = i + 1;
+        }
+
+        view->loads[i].gpu_id = view->sessions[i].gpu_id;
+        view->loads[i].sessions = 1;
+    }
+
+    qsort(view->loads, view->size, sizeof(*view->loads), vm_compare_loads);
+
+    for (uint32_t i = 0; i < view->size; ++i) {
+        if (view->gpu_count > 0 && view->loads[view->gpu_count - 1].gpu_id == view->loads[i].gpu_id)
+            ++view->loads[view->gpu_count - 1].sessions;
+        else
+            view->loads[view->gpu_count++] = view->loads[i];
+    }
+
+    return 1;
+}
+
+/*! \brief Publishes a copy of the sessions without the one of a mediated device.
+ *
+ * Writers never block each other, a writer that lost the race to publish copies the sessions
+ * again from the snapshot that won.
+ *
+ * \param mgr - VM manager owning the sessions.
+ * \param mdev - UUID of the mediated device whose session is left out.
+ * \param qemu_pid - Only leave the session out if it runs in this QEMU process, 0 for any.
+ * \param session - Session appended to the copy, NULL to only remove.
+ * \return If a session was left out, or 0xFF if the copy could not be allocated.
+ */
+static uint8_t vm_update_sessions(
+    struct VmMgr* mgr,
+    const struct UUID* mdev,
+    uint32_t qemu_pid,
+    const struct VmSession* session
+)
+{
+    struct VmSessionView* old;
+    struct VmSessionView* view;
+    struct VmSession removed;
+    uint8_t ret;
+
+    epoch_enter();
+
+    do {
+        old = __atomic_load_n(&mgr->sessions, __ATOMIC_ACQUIRE);
+
+        uint32_t size = old != NULL ? old->size : 0;
+
+        view = calloc(1, sizeof(*view));
+
+        if (view != NULL)
+            view->sessions = calloc(size + 1, sizeof(*view->sessions));
+
+        if (view == NULL || view->sessions == NULL) {
+            epoch_exit();
+            free(view);
+            return 0xFF;
+        }
+
+        ret = 0;
+
+        for (uint32_t i = 0; i < size; ++i) {
+            if (uuid_equal(&old->sessions[i].mdev, mdev) &&
+                (qemu_pid == 0 || old->sessions[i].qemu_pid == qemu_pid)) {
+                removed = old->sessions[i];
+                ret = 1;
+            } else {
+                view->sessions[view->size++] = old->sessions[i];
+            }
+        }
+
+        if (session != NULL)
+            view->sessions[view->size++] = *session;
+
+        view->generation = old != NULL ? old->generation + 1 : 0;
+
+        if (!vm_index_view(view)) {
+            epoch_exit();
+            vm_free_view(view);
+            return 0xFF;
+        }
+
+        if (__atomic_compare_exchange_n(&mgr->sessions, &old, view, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            break;
+
+        vm_free_view(view);
+    } while (1);
+
+    epoch_exit();
+    epoch_retire(old, vm_free_view);
+
+    /* Only the writer that published the removal releases the session. */
+    if (ret == 1)
+        vm_release_session(&removed, session);
+
+    return ret;
+}
+
+/*! \failure Out Of Memory - The sessions are left unchanged.
+ */
+uint8_t vm_add_session(struct VmMgr* mgr, const struct VmSession* session)
+{
+    return vm_update_sessions(mgr, &session->mdev, 0, session) != 0xFF;
+}
+
+/*! \failure Out Of Memory - The sessions are left unchanged.
+ */
+uint8_t vm_remove_session(struct VmMgr* mgr, const struct UUID* mdev)
+{
+    return vm_update_sessions(mgr, mdev, 0, NULL) == 1;
+}
+
+/*! \failure Out Of Memory - The sessions are left unchanged.
+ */
+uint8_t vm_end_session(struct VmMgr* mgr, const struct UUID* mdev, uint32_t qemu_pid)
+{
+    return vm_update_sessions(mgr, mdev, qemu_pid, NULL) == 1;
+}
+
+const struct VmSessionView* vm_sessions(const struct VmMgr* mgr)
+{
+    return __atomic_load_n(&mgr->sessions, __ATOMIC_ACQUIRE);
+}
+
+const struct VmSession* vm_find_session(const struct VmSessionView* view, const struct UUID* mdev)
+{
+    if (view == NULL)
+        return NULL;
+
+    uint32_t slot = uuid_hash(mdev) & (view->capacity - 1);
+
+    /* The index is at most half full, so the probe always reaches an empty slot. */
+    while (view->index[slot] != 0) {
+        const struct VmSession* session = &view->sessions[view->index[slot] - 1];
+
+        if (uuid_equal(&session->mdev, mdev))
+            return session;
+
+        slot = (slot + 1) & (view->capacity - 1);
+    }
+
+    return NULL;
+}
+
+const struct VmSession* vm_find_watched(const struct VmSessionView* view, int pid_fd)
+{
+    if (view == NULL || pid_fd == -1)
+        return NULL;
+
+    uint32_t slot = vm_pid_slot(pid_fd, view->capacity);
+
+    while (view->pid_index[slot] != 0) {
+        const struct VmSession* session = &view->sessions[view->pid_index[slot] - 1];
+
+        if (session->pid_fd == pid_fd)
+            return session;
+
+        slot = (slot + 1) & (view->capacity - 1);
+    }
+
+    return NULL;
+}
+
+uint32_t vm_gpu_sessions(const struct VmSessionView* view, uint32_t gpu_id)
+{
+    if (view == NULL)
+        return 0;
+
+    uint32_t low = 0;
+    uint32_t high = view->gpu_count;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+
+        if (view->loads[mid].gpu_id < gpu_id)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low < view->gpu_count && view->loads[low].gpu_id == gpu_id ? view->loads[low].sessions : 0;
+}
+
+/*! \failure Missing Device - Returns 0 when the mdev_type link of the device cannot be read.
+ * \failure Foreign Type - Returns 0 when the type is not an nvidia-<num> type.
+ */
+uint8_t vm_mdev_type(const struct UUID* mdev, uint32_t* type)
+{
+    char name[64];
+    char uuid[UUID_STR_LEN + 1];
+    char* end;
+
+    uuid_format(mdev, uuid);
+
+    if (!sysfs_read_link(name, sizeof(name), "bus/mdev/devices/%s/mdev_type", uuid))
+        return 0;
+
+    if (strncmp(name, "nvidia-", 7) != 0 || name[7] == '\0')
+        return 0;
+
+    unsigned long num = strtoul(name + 7, &end, 10);
+
+    if (*end != '\0' || num == 0 || num > UINT32_MAX)
+        return 0;
+
+    *type = (uint32_t)num;
+
+    return 1;
+}
+
+/*! \failure Missing Process - Returns 0 when the command line of the process cannot be read.
+ */
+uint8_t vm_qemu_uuid(uint32_t pid, struct UUID* uuid)
+{
+    char path[64];
+
+    snprintf(path, sizeof(path), "/proc/%u/cmdline", pid);
+
+    FILE* in_file = fopen(path, "r");
+
+    if (in_file == NULL)
+        return 0;
+
+    char* cmdline = malloc(QEMU_CMDLINE_MAX + 1);
+    size_t size = cmdline != NULL ? fread(cmdline, 1, QEMU_CMDLINE_MAX, in_file) : 0;
+
+    fclose(in_file);
+
+    if (cmdline == NULL)
+        return 0;
+
+    cmdline[size] = '\0';
+
+    uint8_t ret = 0;
+
+    /* Arguments are NUL separated, the UUID is either the next argument or after a '='. */
+    for (size_t i = 0; i < size && !ret; i += strlen(cmdline + i) + 1) {
+        const char* arg = cmdline + i;
+
+        if (arg[0] == '-' && arg[1] == '-')
+            ++arg;
+
+        if (strcmp(arg, "-uuid") == 0) {
+            size_t next = i + strlen(cmdline + i) + 1;
+
+            ret = next < size && uuid_parse(cmdline + next, uuid);
+        } else if (strncmp(arg, "-uuid=", 6) == 0) {
+            ret = uuid_parse(arg + 6, uuid);
+        }
+    }
+
+    free(cmdline);
+
+    return ret;
+}
+
+void vm_free_sessions(struct VmMgr* mgr)
+{
+    struct VmSessionView* view = __atomic_exchange_n(&mgr->sessions, NULL, __ATOMIC_ACQ_REL);
+
+    if (view == NULL)
+        return;
+
+    for (uint32_t i = 0; i < view->size; ++i)
+        vm_release_session(&view->sessions[i], NULL);
+
+    epoch_retire(view, vm_free_view);
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <utils/arena.h>
+
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+//! Default size of an arena block.
+#define ARENA_DEFAULT_BLOCK 4096
+
+/*! \brief Adds a block which can hold at least size bytes. */
+static struct ArenaBlock* arena_grow(struct Arena* arena, size_t size)
+{
+    size_t block_size = arena->block_size > size ? arena->block_size : size;
+    struct ArenaBlock* block = malloc(sizeof(struct ArenaBlock) + block_size);
+
+    if (block == NULL)
+        return NULL;
+
+    block->prev = arena->head;
+    block->used = 0;
+    block->size = block_size;
+    arena->head = block;
+
+    return block;
+}
+
+/*! \failure Out Of Memory - Returns NULL when the arena could not be allocated.
+ */
+struct Arena* arena_create(size_t block_size)
+{
+    struct Arena* ret = calloc(1, sizeof(struct Arena));
+
+    if (ret == NULL)
+        return NULL;
+
+    ret->block_size = block_size == 0 ? ARENA_DEFAULT_BLOCK : block_size;
+
+    return ret;
+}
+
+/*! \failure Out Of Memory - Returns NULL when a new block could not be allocated.
+ */
+void* arena_alloc(struct Arena* arena, size_t size)
+{
+    const size_t align = alignof(max_align_t);
+    struct ArenaBlock* block = arena->head;
+
+    size_t pad = 0;
+
+    if (block != NULL)
+        pad = -(uintptr_t) (block->data + block->used) & (align - 1);
+
+    if (block == NULL || block->size - block->used < size + pad) {
+        block = arena_grow(arena, size + align);
+        if (block == NULL)
+            return NULL;
+        pad = -(uintptr_t) block->data & (align - 1);
+    }
+
+    void* ret = block->data + block->used + pad;
+    block->used += size + pad;
+
+    memset(ret, 0, size);
+
+    return ret;
+}
+
+/*! \failure Out Of Memory - Returns NULL when the string could not be copied.
+ */
+char* arena_strdup(struct Arena* arena, const char* str)
+{
+    size_t len = strlen(str) + 1;
+    char* ret = arena_alloc(arena, len);
+
+    if (ret != NULL)
+        memcpy(ret, str, len);
+
+    return ret;
+}
+
+void arena_free(struct Arena* arena)
+{
+    if (arena == NULL)
+        return;
+
+    struct ArenaBlock* block = arena->head;
+
+    while (block != NULL) {
+        struct ArenaBlock* prev = block->prev;
+        free(block);
+        block = prev;
+    }
+
+    free(arena);
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <utils/busypoll.h>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <utils/clock.h>
+
+//! Most pause instructions between two polls of a spin.
+#define BUSY_POLL_MAX_PAUSES 1024
+
+/*! \brief Hints the CPU that the thread is spinning. */
+static inline void busy_poll_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+void busy_poll_init(struct BusyPoll* poller, uint64_t max_ns)
+{
+    poller->max_ns = max_ns;
+    poller->budget_ns = max_ns;
+    poller->spin_hits = 0;
+    poller->blocks = 0;
+}
+
+/*! \brief Grows the spin budget, an event came within reach of a spin. */
+static void busy_poll_grow(struct BusyPoll* poller)
+{
+    poller->budget_ns = poller->budget_ns * 2 < poller->max_ns ? poller->budget_ns * 2 : poller->max_ns;
+}
+
+/*! \brief Shrinks the spin budget, the spin expired without an event. */
+static void busy_poll_shrink(struct BusyPoll* poller)
+{
+    uint64_t min_ns = poller->max_ns < BUSY_POLL_MIN_NS ? poller->max_ns : BUSY_POLL_MIN_NS;
+
+    poller->budget_ns = poller->budget_ns / 2 > min_ns ? poller->budget_ns / 2 : min_ns;
+}
+
+/*! \failure Poll Failure - Returns -1 with errno set by poll, e.g. EINTR on a signal.
+ */
+int busy_poll(struct BusyPoll* poller, struct pollfd* fds, nfds_t count, int timeout_ms)
+{
+    if (poller->max_ns == 0 || timeout_ms == 0)
+        return poll(fds, count, timeout_ms);
+
+    uint64_t start = clock_now_ns();
+    uint64_t now = start;
+    uint32_t pauses = 1;
+    int ret;
+
+    while (now - start < poller->budget_ns) {
+        ret = poll(fds, count, 0);
+
+        if (ret != 0) {
+            if (ret > 0) {
+                ++poller->spin_hits;
+                busy_poll_grow(poller);
+            }
+            return ret;
+        }
+
+        /* Backs off exponentially, so a long spin does not hammer the fds with syscalls. */
+        for (uint32_t i = 0; i < pauses; ++i)
+            busy_poll_pause();
+
+        if (pauses < BUSY_POLL_MAX_PAUSES)
+            pauses *= 2;
+
+        now = clock_now_ns();
+    }
+
+    int remaining_ms = timeout_ms;
+
+    if (timeout_ms > 0) {
+        uint64_t spent_ms = (now - start) / 1000000;
+
+        remaining_ms = spent_ms < (uint64_t) timeout_ms ? timeout_ms - (int) spent_ms : 0;
+    }
+
+    uint64_t spun_ns = now - start;
+
+    ++poller->blocks;
+    ret = poll(fds, count, remaining_ms);
+
+    /* An event shortly after the spin expired would have been caught by a longer spin. */
+    if (ret > 0 && clock_now_ns() - now <= spun_ns)
+        busy_poll_grow(poller);
+    else
+        busy_poll_shrink(poller);
+
+    return ret;
+}
+
+/*! \failure Permission Failure - Returns 0 without CAP_SYS_NICE or a real time limit.
+ */
+uint8_t thread_set_fifo(int priority)
+{
+    struct sched_param param = {.sched_priority = priority};
+
+    return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+}
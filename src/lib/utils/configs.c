@@ -16,22 +16,365 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  *
  */
+#include <utils/arena.h>
 #include <utils/configs.h>
 
 #include <toml.h>
 
+#include <dirent.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+//! Maximum number of threads parsing a config directory.
+#define CONFIG_MAX_THREADS 8
+
+//! Number of slots in a schema hash index (must be a power of two, at most 256).
+#define CONFIG_HASH_BITS 5
+
+//! Seed for the schema hash, chosen so every shipped schema is collision free.
+#define CONFIG_HASH_SEED 0x811CA1AB
+
+//! Vendor id of the selectors naming a device id but no vendor id.
+#define CONFIG_DEFAULT_VENDOR 0x10DE
+
+/*! \brief Type of a configuration field. */
+enum ConfigFieldType {
+    CONFIG_INT,                    //!< Integer field.
+    CONFIG_BOOL,                   //!< Boolean field.
+    CONFIG_STRING,                 //!< String field, copied into the arena.
+    CONFIG_TABLE                   //!< Sub table, decoded into a separate structure.
+};
+
+struct ConfigSchema;
+
+/*! \brief Description of a single configuration key.
+ *
+ * Describes where the value for a key is stored in the decoded structure.
+ */
+struct ConfigField {
+    const char* key;               //!< TOML key.
+    enum ConfigFieldType type;     //!< Type of the value.
+    size_t offset;                 //!< Offset of the member in the structure.
+    size_t size;                   //!< Size of the member in the structure.
+    uint64_t def;                  //!< Default value for integers and booleans.
+    const char* def_str;           //!< Default value for strings.
+    uint8_t required;              //!< If the key must be present.
+    const struct ConfigSchema* sub;//!< Schema of a sub table.
+};
+
+/*! \brief Schema of a TOML table.
+ *
+ * The hash index maps the hash of a key onto the field decoding it.
+ */
+struct ConfigSchema {
+    const struct ConfigField* fields;          //!< Fields of the table.
+    size_t size;                               //!< Number of fields.
+    size_t object_size;                        //!< Size of a decoded sub table.
+    uint8_t index[1 << CONFIG_HASH_BITS];      //!< Field index + 1, or 0 when empty.
+};
+
+//! Declares a field of a structure.
+#define CONFIG_FIELD(type, member, key, kind, def, def_str, required, sub) \
+    { key, kind, offsetof(type, member), sizeof(((type*) 0)->member), def, def_str, required, sub }
+
+//! Fields of a gpu selector, unset fields match any gpu.
+static const struct ConfigField GPU_FIELDS[] = {
+    CONFIG_FIELD(struct Gpu, domain, "domain", CONFIG_INT, 0xFFFFFFFF, NULL, 0, NULL),
+    CONFIG_FIELD(struct Gpu, bus, "bus", CONFIG_INT, 0xFFFFFFFF, NULL, 0, NULL),
+    CONFIG_FIELD(struct Gpu, slot, "slot", CONFIG_INT, 0xFFFFFFFF, NULL, 0, NULL),
+    CONFIG_FIELD(struct Gpu, function, "function", CONFIG_INT, 0xFFFFFFFF, NULL, 0, NULL),
+    CONFIG_FIELD(struct Gpu, vendor_id, "vendor_id", CONFIG_INT, 0xFFFFFFFF, NULL, 0, NULL),
+    CONFIG_FIELD(struct Gpu, device_id, "device_id", CONFIG_INT, 0xFFFFFFFF, NULL, 0, NULL),
+    CONFIG_FIELD(struct Gpu, sub_vendor_id, "sub_vendor_id", CONFIG_INT, 0xFFFFFFFF, NULL, 0, NULL),
+    CONFIG_FIELD(struct Gpu, sub_device_id, "sub_device_id", CONFIG_INT, 0xFFFFFFFF, NULL, 0, NULL),
+    CONFIG_FIELD(struct Gpu, identifier, "identifier", CONFIG_INT, 0xFFFFFFFF, NULL, 0, NULL)
+};
+
+//! Fields of a virtual display.
+static const struct ConfigField DISPLAY_FIELDS[] = {
+    CONFIG_FIELD(struct VirtDisplay, num_heads, "num_heads", CONFIG_INT, 1, NULL, 0, NULL),
+    CONFIG_FIELD(struct VirtDisplay, max_res_x, "max_res_x", CONFIG_INT, 1024, NULL, 0, NULL),
+    CONFIG_FIELD(struct VirtDisplay, max_res_y, "max_res_y", CONFIG_INT, 1024, NULL, 0, NULL),
+    CONFIG_FIELD(struct VirtDisplay, frl_config, "frl_config", CONFIG_INT, 120, NULL, 0, NULL),
+    CONFIG_FIELD(struct VirtDisplay, frl_enable, "frl_enable", CONFIG_INT, 0, NULL, 0, NULL)
+};
+
+//! Schema of a virtual display.
+static struct ConfigSchema DISPLAY_SCHEMA = {
+    DISPLAY_FIELDS, sizeof(DISPLAY_FIELDS) / sizeof(DISPLAY_FIELDS[0]), sizeof(struct VirtDisplay), {}
+};
+
+//! Fields of a mediated device request.
+static const struct ConfigField REQUEST_FIELDS[] = {
+    CONFIG_FIELD(struct MDevRequest, num, "num", CONFIG_INT, 0, NULL, 1, NULL),
+    CONFIG_FIELD(struct MDevRequest, fb_len, "fb_len", CONFIG_INT, 0, NULL, 1, NULL),
+    CONFIG_FIELD(struct MDevRequest, fb_res, "fb_res", CONFIG_INT, 0, NULL, 1, NULL),
+    CONFIG_FIELD(struct MDevRequest, max_inst, "max_instances", CONFIG_INT, 0, NULL, 1, NULL),
+    CONFIG_FIELD(struct MDevRequest, v_dev_id, "v_dev_id", CONFIG_INT, 0xFFFFFFFFFFFFFFFF, NULL, 0, NULL),
+    CONFIG_FIELD(struct MDevRequest, p_dev_id, "p_dev_id", CONFIG_INT, 0xFFFFFFFFFFFFFFFF, NULL, 0, NULL),
+    CONFIG_FIELD(struct MDevRequest, ecc_support, "ecc_support", CONFIG_BOOL, 0, NULL, 0, NULL),
+    CONFIG_FIELD(struct MDevRequest, multi_mdev, "multi_mdev", CONFIG_BOOL, 0, NULL, 0, NULL),
+    CONFIG_FIELD(struct MDevRequest, map_vid_size, "map_vid_size", CONFIG_INT, 24, NULL, 0, NULL),
+    CONFIG_FIELD(struct MDevRequest, enc_cap, "enc_cap", CONFIG_INT, 100, NULL, 0, NULL),
+    CONFIG_FIELD(struct MDevRequest, bar1_len, "bar1_len", CONFIG_INT, 0x100, NULL, 0, NULL),
+    CONFIG_FIELD(struct MDevRequest, name, "name", CONFIG_STRING, 0, "GVM GPU", 0, NULL),
+    CONFIG_FIELD(struct MDevRequest, gpu_class, "class", CONFIG_STRING, 0, "Compute", 0, NULL),
+    CONFIG_FIELD(struct MDevRequest, disp, "display", CONFIG_TABLE, 0, NULL, 0, &DISPLAY_SCHEMA)
+};
+
+//! Schema of a gpu selector.
+static struct ConfigSchema GPU_SCHEMA = {
+    GPU_FIELDS, sizeof(GPU_FIELDS) / sizeof(GPU_FIELDS[0]), sizeof(struct Gpu), {}
+};
+
+//! Schema of a mediated device request.
+static struct ConfigSchema REQUEST_SCHEMA = {
+    REQUEST_FIELDS, sizeof(REQUEST_FIELDS) / sizeof(REQUEST_FIELDS[0]), sizeof(struct MDevRequest), {}
+};
+
+//! Guards building the schema indexes, which are shared between parser threads.
+static pthread_once_t SCHEMA_ONCE = PTHREAD_ONCE_INIT;
+
 static inline void failed_parse(const char* s)
 {
-    printf("Missing required field in request config '%s', exiting program\n", s);
-    exit(1);
+    printf("Missing required field in request config '%s'\n", s);
+}
+
+/*! \brief Hashes a key into a schema index slot. */
+static inline uint32_t config_hash(const char* key)
+{
+    uint32_t hash = CONFIG_HASH_SEED;
+
+    for (; *key != '\0'; ++key)
+        hash = (hash ^ (uint8_t) *key) * 16777619;
+
+    return hash >> (32 - CONFIG_HASH_BITS);
 }
 
+/*! \brief Builds the hash index of a schema.
+ *
+ * Collisions fall back to linear probing, so adding keys never breaks decoding.
+ *
+ * \param schema - Schema to index.
+ */
+static void config_index(struct ConfigSchema* schema)
+{
+    const uint32_t mask = (1 << CONFIG_HASH_BITS) - 1;
+
+    for (size_t i = 0; i < schema->size; ++i) {
+        uint32_t slot = config_hash(schema->fields[i].key);
+
+        while (schema->index[slot] != 0)
+            slot = (slot + 1) & mask;
+
+        schema->index[slot] = i + 1;
+    }
+}
+
+/*! \brief Builds the hash index of every schema. */
+static void config_index_all(void)
+{
+    config_index(&GPU_SCHEMA);
+    config_index(&DISPLAY_SCHEMA);
+    config_index(&REQUEST_SCHEMA);
+}
+
+/*! \brief Finds the field decoding a key.
+ *
+ * \param schema - Schema to search.
+ * \param key - Key to search for.
+ * \return Index of the field, or -1 if the key is unknown.
+ */
+static int config_lookup(struct ConfigSchema* schema, const char* key)
+{
+    const uint32_t mask = (1 << CONFIG_HASH_BITS) - 1;
+
+    for (uint32_t slot = config_hash(key); schema->index[slot] != 0; slot = (slot + 1) & mask) {
+        int i = schema->index[slot] - 1;
+
+        if (strcmp(schema->fields[i].key, key) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+/*! \brief Stores an integer into a structure member of any width. */
+static void config_store(void* object, const struct ConfigField* field, uint64_t value)
+{
+    char* ptr = (char*) object + field->offset;
+
+    switch (field->size) {
+        case sizeof(uint8_t):
+            *(uint8_t*) ptr = value;
+            break;
+        case sizeof(uint16_t):
+            *(uint16_t*) ptr = value;
+            break;
+        case sizeof(uint32_t):
+            *(uint32_t*) ptr = value;
+            break;
+        case sizeof(uint64_t):
+            *(uint64_t*) ptr = value;
+            break;
+    }
+}
+
+static uint8_t config_decode(
+    struct Arena* arena,
+    struct ConfigSchema* schema,
+    toml_table_t* table,
+    void* object
+);
+
+/*! \brief Decodes a sub table into a structure allocated in the arena.
+ *
+ * \return The decoded structure, NULL if it could not be allocated or decoded.
+ */
+static void* config_decode_sub(struct Arena* arena, const struct ConfigField* field, toml_table_t* table)
+{
+    struct ConfigSchema* sub = (struct ConfigSchema*) field->sub;
+    void* ret = arena_alloc(arena, sub->object_size);
+
+    if (ret == NULL || !config_decode(arena, sub, table, ret))
+        return NULL;
+
+    return ret;
+}
+
+/*! \brief Decodes a TOML table using a schema.
+ *
+ * Defaults are applied first, after which every key in the table is visited once, dispatched
+ * through the schema hash index and decoded from the value at its index, so a table is decoded
+ * in a single linear pass.
+ *
+ * \param arena - Arena owning the decoded strings and sub tables.
+ * \param schema - Schema of the table.
+ * \param table - Table to decode, NULL only applies the defaults.
+ * \param object - Structure to decode into.
+ * \return If every required key was found and every value could be stored.
+ */
+static uint8_t config_decode(
+    struct Arena* arena,
+    struct ConfigSchema* schema,
+    toml_table_t* table,
+    void* object
+)
+{
+    uint64_t found = 0;
+    uint8_t ret = 1;
+
+    for (size_t i = 0; i < schema->size; ++i) {
+        const struct ConfigField* field = &schema->fields[i];
+        void** ptr = (void**) ((char*) object + field->offset);
+
+        if (field->type == CONFIG_STRING)
+            *ptr = (void*) field->def_str;
+        else if (field->type != CONFIG_TABLE)
+            config_store(object, field, field->def);
+    }
+
+    for (int i = 0; table != NULL; ++i) {
+        const char* key = toml_key_in(table, i);
+
+        if (key == NULL)
+            break;
+
+        int idx = config_lookup(schema, key);
+
+        if (idx == -1)
+            continue;
+
+        const struct ConfigField* field = &schema->fields[idx];
+        void** ptr = (void**) ((char*) object + field->offset);
+        toml_raw_t raw = toml_raw_key_at(table, i);
+        uint8_t ok = 0;
+        int64_t value = 0;
+        int flag = 0;
+        char* str = NULL;
+
+        switch (field->type) {
+            case CONFIG_INT:
+                ok = raw != NULL && toml_rtoi(raw, &value) == 0;
+                if (ok)
+                    config_store(object, field, field->size == sizeof(uint64_t) ?
+                                 (unsigned) value : (uint64_t) value);
+                break;
+            case CONFIG_BOOL:
+                ok = raw != NULL && toml_rtob(raw, &flag) == 0;
+                if (ok)
+                    config_store(object, field, flag != 0);
+                break;
+            case CONFIG_STRING:
+                ok = raw != NULL && toml_rtos(raw, &str) == 0;
+                if (ok) {
+                    *ptr = arena_strdup(arena, str);
+                    ret = ret && *ptr != NULL;
+                    free(str);
+                }
+                break;
+            case CONFIG_TABLE:
+                *ptr = config_decode_sub(arena, field, toml_table_key_at(table, i));
+                ok = *ptr != NULL;
+                break;
+        }
+
+        if (ok)
+            found |= 1ULL << idx;
+    }
+
+    for (size_t i = 0; i < schema->size; ++i) {
+        const struct ConfigField* field = &schema->fields[i];
+        void** ptr = (void**) ((char*) object + field->offset);
+
+        if (field->required && !(found & (1ULL << i))) {
+            failed_parse(field->key);
+            ret = 0;
+        }
+
+        if (field->type == CONFIG_TABLE && *ptr == NULL) {
+            *ptr = config_decode_sub(arena, field, NULL);
+            ret = ret && *ptr != NULL;
+        }
+    }
+
+    return ret;
+}
+
+/*! \brief Decodes an array of tables into an array allocated in the arena.
+ *
+ * \param arena - Arena owning the decoded array.
+ * \param schema - Schema of every table in the array.
+ * \param array - Array of tables, NULL produces an empty array.
+ * \param size - Returns the size of the decoded array.
+ * \return The decoded array, NULL if a table could not be decoded.
+ */
+static void* config_decode_array(
+    struct Arena* arena,
+    struct ConfigSchema* schema,
+    toml_array_t* array,
+    size_t* size
+)
+{
+    *size = array != NULL ? toml_array_nelem(array) : 0;
+
+    char* ret = arena_alloc(arena, *size * schema->object_size);
+
+    for (size_t i = 0; i < *size && ret != NULL; ++i)
+        if (!config_decode(arena, schema, toml_table_at(array, i), ret + i * schema->object_size))
+            ret = NULL;
+
+    return ret;
+}
+
+/*! \failure Invalid Config - Returns empty configurations without an arena when the file cannot
+ *                          be read or parsed, misses a required key or the arena cannot hold it.
+ */
 struct GpuConfigs get_configs(const char* name)
 {
     FILE *fp;
@@ -52,159 +395,364 @@ struct GpuConfigs get_configs(const char* name)
 
     toml_array_t* config_array = toml_array_in(base, "config");
 
-    ret.config_size = toml_array_nelem(config_array);
-    ret.configs = calloc(ret.config_size, sizeof(struct GpuConfig));
+    pthread_once(&SCHEMA_ONCE, config_index_all);
 
-    for (size_t i = 0; i < ret.config_size; ++i) {
+    ret.arena = arena_create(0);
+    ret.config_size = config_array != NULL ? toml_array_nelem(config_array) : 0;
+    ret.configs = ret.arena != NULL ? arena_alloc(ret.arena, ret.config_size * sizeof(struct GpuConfig)) : NULL;
+
+    uint8_t loaded = ret.configs != NULL;
+
+    for (size_t i = 0; loaded && i < ret.config_size; ++i) {
         toml_table_t* config = toml_table_at(config_array, i);
 
-        toml_array_t* gpu_array = toml_array_in(config, "gpu_config");
-        ret.configs[i].gpu_size = toml_array_nelem(gpu_array);
-        int max_gpu_size = ret.configs[i].gpu_size * sizeof(struct Gpu);
-        ret.configs[i].gpus = malloc(max_gpu_size);
-        memset(ret.configs[i].gpus, 0xFF, max_gpu_size);
+        ret.configs[i].gpus = config_decode_array(
+            ret.arena,
+            &GPU_SCHEMA,
+            toml_array_in(config, "gpu_config"),
+            &ret.configs[i].gpu_size
+        );
+        ret.configs[i].requests = config_decode_array(
+            ret.arena,
+            &REQUEST_SCHEMA,
+            toml_array_in(config, "request"),
+            &ret.configs[i].mdev_size
+        );
+
+        loaded = ret.configs[i].gpus != NULL && ret.configs[i].requests != NULL;
+    }
 
-        for (size_t j = 0; j < ret.configs[i].gpu_size; ++j) {
-            toml_table_t* gpu = toml_table_at(gpu_array, j);
-            toml_datum_t info = {};
+    toml_free(base);
 
-            info = toml_int_in(gpu, "domain");
-            if (info.ok)
-                ret.configs[i].gpus[j].domain = info.u.i;
+    if (!loaded) {
+        printf("Could not load config '%s'\n", name);
+        free_configs(&ret);
+    }
 
-            info = toml_int_in(gpu, "bus");
-            if (info.ok)
-                ret.configs[i].gpus[j].bus = info.u.i;
+    return ret;
+}
 
-            info = toml_int_in(gpu, "slot");
-            if (info.ok)
-                ret.configs[i].gpus[j].slot = info.u.i;
+void free_configs(struct GpuConfigs* configs)
+{
+    arena_free(configs->arena);
 
-            info = toml_int_in(gpu, "function");
-            if (info.ok)
-                ret.configs[i].gpus[j].function = info.u.i;
+    configs->arena = NULL;
+    configs->configs = NULL;
+    configs->config_size = 0;
+}
 
-            info = toml_int_in(gpu, "vendor_id");
-            if (info.ok)
-                ret.configs[i].gpus[j].vendor_id = info.u.i;
+/*! \brief Work shared by the threads parsing a config directory. */
+struct ConfigLoader {
+    char** names;                  //!< Paths of the files to parse.
+    struct GpuConfigs* files;      //!< Parsed files.
+    size_t size;                   //!< Number of files.
+    size_t next;                   //!< Next file to parse.
+};
 
-            info = toml_int_in(gpu, "device_id");
-            if (info.ok)
-                ret.configs[i].gpus[j].device_id = info.u.i;
+/*! \brief Parses files from the loader until every file has been taken. */
+static void* config_loader_thread(void* arg)
+{
+    struct ConfigLoader* loader = arg;
 
-            info = toml_int_in(gpu, "sub_vendor_id");
-            if (info.ok)
-                ret.configs[i].gpus[j].sub_vendor_id = info.u.i;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&loader->next, 1, __ATOMIC_RELAXED);
 
-            info = toml_int_in(gpu, "sub_device_id");
-            if (info.ok)
-                ret.configs[i].gpus[j].sub_device_id = info.u.i;
+        if (i >= loader->size)
+            break;
 
-            info = toml_int_in(gpu, "identifier");
-            if (info.ok)
-                ret.configs[i].gpus[j].identifier = info.u.i;
-        }
+        loader->files[i] = get_configs(loader->names[i]);
+    }
 
-        toml_array_t* req_array = toml_array_in(config, "request");
-        ret.configs[i].mdev_size = toml_array_nelem(req_array);
-        ret.configs[i].requests = calloc(ret.configs[i].mdev_size, sizeof(struct MDevRequest));
+    return NULL;
+}
 
-        for (size_t j = 0; j < ret.configs[i].mdev_size; ++j) {
-            toml_table_t* mdev = toml_table_at(req_array, j);
-            toml_table_t* display = toml_table_in(mdev, "display");
-            toml_datum_t info = {};
+/*! \brief Selects TOML files in a config directory. */
+static int config_filter(const struct dirent* entry)
+{
+    size_t len = strlen(entry->d_name);
 
-            info = toml_int_in(mdev, "num");
-            if (!info.ok)
-                failed_parse("num");
+    return entry->d_name[0] != '.' && len > 5 && strcmp(entry->d_name + len - 5, ".toml") == 0;
+}
 
-            ret.configs[i].requests[j].num = info.u.i;
+/*! \brief Key of a vendor/device pair in the catalog. */
+static inline uint64_t catalog_key(uint32_t vendor_id, uint32_t device_id)
+{
+    return ((uint64_t) vendor_id << 32) | device_id;
+}
 
-            info = toml_int_in(mdev, "fb_len");
-            if (!info.ok)
-                failed_parse("fb_len");
+/*! \brief Configuration indexed under a catalog key. */
+struct CatalogPair {
+    uint64_t key;                  //!< Vendor/device key.
+    size_t order;                  //!< Load order of the configuration.
+    struct GpuConfig* config;      //!< Indexed configuration.
+};
 
-            ret.configs[i].requests[j].fb_len = info.u.i;
+/*! \brief Orders catalog pairs by key, then by load order. */
+static int catalog_pair_cmp(const void* a, const void* b)
+{
+    const struct CatalogPair* x = a;
+    const struct CatalogPair* y = b;
 
-            info = toml_int_in(mdev, "fb_res");
-            if (!info.ok)
-                failed_parse("fb_res");
+    if (x->key != y->key)
+        return x->key < y->key ? -1 : 1;
 
-            ret.configs[i].requests[j].fb_res = info.u.i;
+    return (x->order > y->order) - (x->order < y->order);
+}
 
-            info = toml_int_in(mdev, "max_instances");
-            if (!info.ok)
-                failed_parse("max_instances");
+/*! \brief Indexes the configurations of every parsed file.
+ *
+ * \param catalog - Catalog with parsed files to index.
+ * \return If the index could be allocated.
+ */
+static uint8_t catalog_index(struct ConfigCatalog* catalog)
+{
+    size_t pair_size = 0;
+    size_t order = 0;
 
-            ret.configs[i].requests[j].max_inst = info.u.i;
+    for (size_t f = 0; f < catalog->file_size; ++f)
+        for (size_t i = 0; i < catalog->files[f].config_size; ++i)
+            pair_size += catalog->files[f].configs[i].gpu_size + 1;
 
-            info = toml_int_in(mdev, "v_dev_id");
-            ret.configs[i].requests[j].v_dev_id =
-                info.ok ? ((unsigned) info.u.i) : 0xFFFFFFFFFFFFFFFF;
+    struct CatalogPair* pairs = calloc(pair_size, sizeof(struct CatalogPair));
+    size_t pair_count = 0;
 
-            info = toml_int_in(mdev, "p_dev_id");
-            ret.configs[i].requests[j].p_dev_id =
-                info.ok ? ((unsigned) info.u.i) : 0xFFFFFFFFFFFFFFFF;
+    catalog->generic = arena_alloc(catalog->arena, pair_size * sizeof(struct GpuConfig*));
 
-            info = toml_bool_in(mdev, "ecc_support");
-            ret.configs[i].requests[j].ecc_support =
-                info.ok ? info.u.i != 0 : 0;
+    if (pairs == NULL || catalog->generic == NULL) {
+        free(pairs);
+        return 0;
+    }
 
-            info = toml_bool_in(mdev, "multi_mdev");
-            ret.configs[i].requests[j].multi_mdev =
-                info.ok ? info.u.i != 0 : 0;
+    for (size_t f = 0; f < catalog->file_size; ++f) {
+        for (size_t i = 0; i < catalog->files[f].config_size; ++i, ++order) {
+            struct GpuConfig* config = &catalog->files[f].configs[i];
+            uint8_t generic = config->gpu_size == 0;
 
-            info = toml_int_in(mdev, "map_vid_size");
-            ret.configs[i].requests[j].map_vid_size =
-                info.ok ? info.u.i : 24;
+            for (size_t j = 0; j < config->gpu_size; ++j) {
+                struct Gpu* gpu = &config->gpus[j];
 
-            info = toml_int_in(mdev, "enc_cap");
-            ret.configs[i].requests[j].enc_cap =
-                info.ok ? info.u.i : 100;
+                if (gpu->device_id == 0xFFFFFFFF) {
+                    generic = 1;
+                    continue;
+                }
 
-            info = toml_int_in(mdev, "bar1_len");
-            ret.configs[i].requests[j].bar1_len =
-                info.ok ? info.u.i : 0x100;
+                uint32_t vendor_id = gpu->vendor_id != 0xFFFFFFFF ? gpu->vendor_id : CONFIG_DEFAULT_VENDOR;
 
-            info = toml_string_in(mdev, "name");
-            ret.configs[i].requests[j].name =
-                info.ok ? info.u.s : "GVM GPU";
+                pairs[pair_count].key = catalog_key(vendor_id, gpu->device_id);
+                pairs[pair_count].order = order;
+                pairs[pair_count].config = config;
+                ++pair_count;
+            }
 
-            info = toml_string_in(mdev, "class");
-            ret.configs[i].requests[j].gpu_class =
-                info.ok ? info.u.s : "Compute";
+            if (generic)
+                catalog->generic[catalog->generic_size++] = config;
+        }
+    }
 
-            ret.configs[i].requests[j].disp = calloc(1, sizeof(struct VirtDisplay));
+    qsort(pairs, pair_count, sizeof(struct CatalogPair), catalog_pair_cmp);
 
-            info.ok = 0;
-            if (display)
-                info = toml_int_in(display, "num_heads");
-            ret.configs[i].requests[j].disp->num_heads =
-                info.ok ? info.u.i : 1;
+    catalog->entries = arena_alloc(catalog->arena, pair_count * sizeof(struct ConfigCatalogEntry));
+    struct GpuConfig** configs = arena_alloc(catalog->arena, pair_count * sizeof(struct GpuConfig*));
 
-            if (display)
-                info = toml_int_in(display, "max_res_x");
-            ret.configs[i].requests[j].disp->max_res_x =
-                info.ok ? info.u.i : 1024;
+    if (catalog->entries == NULL || configs == NULL) {
+        free(pairs);
+        return 0;
+    }
 
-            if (display)
-                info = toml_int_in(display, "max_res_y");
-            ret.configs[i].requests[j].disp->max_res_y =
-                info.ok ? info.u.i : 1024;
+    for (size_t i = 0; i < pair_count; ++i) {
+        struct ConfigCatalogEntry* entry = NULL;
 
-            if (display)
-                info = toml_int_in(display, "frl_config");
-            ret.configs[i].requests[j].disp->num_heads =
-                info.ok ? info.u.i : 120;
+        if (catalog->entry_size > 0)
+            entry = &catalog->entries[catalog->entry_size - 1];
 
-            if (display)
-                info = toml_int_in(display, "frl_enable");
-            ret.configs[i].requests[j].disp->num_heads =
-                info.ok ? info.u.i : 0;
+        if (entry == NULL || catalog_key(entry->vendor_id, entry->device_id) != pairs[i].key) {
+            entry = &catalog->entries[catalog->entry_size++];
+            entry->vendor_id = pairs[i].key >> 32;
+            entry->device_id = pairs[i].key & 0xFFFFFFFF;
+            entry->configs = &configs[i];
+        } else if (entry->configs[entry->size - 1] == pairs[i].config) {
+            continue;
         }
+
+        entry->configs[entry->size++] = pairs[i].config;
     }
 
-    toml_free(base);
+    free(pairs);
+
+    return 1;
+}
+
+/*! \failure Invalid Path - Returns an empty catalog without an arena if the path can not be opened.
+ * \failure Invalid Config - Returns an empty catalog without an arena if a file cannot be loaded.
+ */
+struct ConfigCatalog get_config_catalog(const char* path)
+{
+    struct ConfigCatalog ret = {};
+    struct ConfigLoader loader = {};
+    struct dirent** list = NULL;
+    struct stat sb;
+
+    if (stat(path, &sb) == -1)
+        return ret;
+
+    ret.arena = arena_create(0);
+
+    if (ret.arena == NULL)
+        return ret;
+
+    if (S_ISDIR(sb.st_mode)) {
+        int n = scandir(path, &list, config_filter, alphasort);
+
+        loader.size = n > 0 ? n : 0;
+        loader.names = arena_alloc(ret.arena, loader.size * sizeof(char*));
+
+        for (size_t i = 0; i < loader.size; ++i) {
+            if (loader.names != NULL)
+                loader.names[i] = arena_alloc(ret.arena, strlen(path) + strlen(list[i]->d_name) + 2);
+
+            if (loader.names != NULL && loader.names[i] != NULL)
+                sprintf(loader.names[i], "%s/%s", path, list[i]->d_name);
+
+            free(list[i]);
+        }
+
+        free(list);
+    } else {
+        loader.size = 1;
+        loader.names = arena_alloc(ret.arena, sizeof(char*));
+
+        if (loader.names != NULL)
+            loader.names[0] = arena_strdup(ret.arena, path);
+    }
+
+    loader.files = arena_alloc(ret.arena, loader.size * sizeof(struct GpuConfigs));
+
+    uint8_t named = loader.names != NULL && loader.files != NULL;
+
+    for (size_t i = 0; named && i < loader.size; ++i)
+        named = loader.names[i] != NULL;
+
+    if (!named) {
+        free_config_catalog(&ret);
+        return ret;
+    }
+
+    pthread_t threads[CONFIG_MAX_THREADS];
+    size_t thread_size = loader.size < CONFIG_MAX_THREADS ? loader.size : CONFIG_MAX_THREADS;
+    size_t started = 0;
+
+    for (; started + 1 < thread_size; ++started)
+        if (pthread_create(&threads[started], NULL, config_loader_thread, &loader) != 0)
+            break;
+
+    config_loader_thread(&loader);
+
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    ret.files = loader.files;
+    ret.file_size = loader.size;
+
+    /* A file that cannot be loaded fails the catalog, its gpus would silently get another one. */
+    uint8_t loaded = 1;
+
+    for (size_t i = 0; i < ret.file_size; ++i)
+        loaded = loaded && ret.files[i].arena != NULL;
+
+    if (!loaded || !catalog_index(&ret))
+        free_config_catalog(&ret);
+
+    return ret;
+}
+
+/*! \brief Ranks how closely a selector targets a gpu.
+ *
+ * \return Number of fields the selector sets, -1 if the gpu does not match it.
+ */
+static int config_selector_rank(const struct Gpu* selector, const struct Gpu* gpu)
+{
+    int ret = 0;
+
+    /* Every selector field is a 32-bit id whose unset value matches any gpu. */
+    for (size_t i = 0; i < GPU_SCHEMA.size; ++i) {
+        size_t offset = GPU_SCHEMA.fields[i].offset;
+        uint32_t wanted = *(const uint32_t*) ((const char*) selector + offset);
+
+        if (wanted == 0xFFFFFFFF)
+            continue;
+
+        if (wanted != *(const uint32_t*) ((const char*) gpu + offset))
+            return -1;
+
+        ++ret;
+    }
+
+    return ret;
+}
+
+/*! \brief Finds the configuration of a list whose selector targets a gpu the most closely.
+ *
+ * \return The configuration, NULL if none matches the gpu.
+ */
+static const struct GpuConfig* config_best(struct GpuConfig* const* configs, size_t size, const struct Gpu* gpu)
+{
+    const struct GpuConfig* ret = NULL;
+    int best = -1;
+
+    for (size_t i = 0; i < size; ++i) {
+        int rank = configs[i]->gpu_size == 0 ? 0 : -1;
+
+        for (size_t j = 0; j < configs[i]->gpu_size; ++j) {
+            int selector = config_selector_rank(&configs[i]->gpus[j], gpu);
+
+            if (selector > rank)
+                rank = selector;
+        }
+
+        if (rank > best) {
+            best = rank;
+            ret = configs[i];
+        }
+    }
 
     return ret;
 }
+
+const struct GpuConfig* config_catalog_lookup(const struct ConfigCatalog* catalog, const struct Gpu* gpu)
+{
+    const uint64_t key = catalog_key(gpu->vendor_id, gpu->device_id);
+    size_t low = 0;
+    size_t high = catalog->entry_size;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        const struct ConfigCatalogEntry* entry = &catalog->entries[mid];
+        uint64_t mid_key = catalog_key(entry->vendor_id, entry->device_id);
+
+        if (mid_key == key) {
+            const struct GpuConfig* ret = config_best(entry->configs, entry->size, gpu);
+
+            if (ret != NULL)
+                return ret;
+
+            break;
+        }
+
+        if (mid_key < key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return config_best(catalog->generic, catalog->generic_size, gpu);
+}
+
+void free_config_catalog(struct ConfigCatalog* catalog)
+{
+    for (size_t i = 0; i < catalog->file_size; ++i)
+        free_configs(&catalog->files[i]);
+
+    arena_free(catalog->arena);
+
+    memset(catalog, 0, sizeof(struct ConfigCatalog));
+}
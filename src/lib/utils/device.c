@@ -73,8 +73,8 @@ int32_t get_param(const char* filename, const char* parameter)
     int32_t ret = -1;
     FILE *in_file = fopen(filename, "r");
 
-    struct stat sb;
-    stat(filename, &sb);
+    if (in_file == NULL)
+        return -1;
 
     char file_contents[1024] = "";
     char name[1024] = "";
@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <utils/epoch.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+//! Number of retired objects between two reclaim attempts of epoch_retire.
+#define EPOCH_RECLAIM_THRESHOLD 64
+
+/*! \brief Critical section state of a thread.
+ *
+ * Records are never freed, a record released by an exiting thread is reused by the next
+ * thread that registers.
+ */
+struct EpochRecord {
+    _Atomic uint64_t state;             //!< Observed epoch shifted by one, lowest bit set if active.
+    _Atomic uint32_t in_use;            //!< If a thread owns the record.
+    uint32_t depth;                     //!< Nesting depth of the critical sections.
+    struct EpochRecord* next;           //!< Next registered record.
+};
+
+/*! \brief Memory waiting for the readers of its epoch to leave. */
+struct EpochRetired {
+    void* ptr;                          //!< Retired memory.
+    void (*destructor)(void*);          //!< Function releasing the memory.
+    uint64_t epoch;                     //!< Global epoch when the memory was retired.
+    struct EpochRetired* next;          //!< Next retired memory.
+};
+
+//! Global epoch.
+static _Atomic uint64_t GLOBAL_EPOCH = 1;
+
+//! Every record ever registered.
+static struct EpochRecord* _Atomic RECORDS = NULL;
+
+//! Retired memory, newest first.
+static struct EpochRetired* RETIRED = NULL;
+
+//! Number of retired objects.
+static size_t RETIRED_SIZE = 0;
+
+//! Lock protecting the retired list.
+static pthread_mutex_t RETIRED_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+//! Key releasing the record of an exiting thread.
+static pthread_key_t RECORD_KEY;
+
+//! Guard for creating the record key.
+static pthread_once_t RECORD_ONCE = PTHREAD_ONCE_INIT;
+
+//! Record of the calling thread.
+static __thread struct EpochRecord* LOCAL_RECORD = NULL;
+
+/*! \brief Releases the record of an exiting thread. */
+static void epoch_release_record(void* record)
+{
+    struct EpochRecord* rec = record;
+
+    atomic_store(&rec->state, 0);
+    atomic_store(&rec->in_use, 0);
+}
+
+/*! \brief Creates the key releasing thread records. */
+static void epoch_create_key(void)
+{
+    pthread_key_create(&RECORD_KEY, epoch_release_record);
+}
+
+/*! \brief Gets or registers the record of the calling thread. */
+static struct EpochRecord* epoch_record(void)
+{
+    struct EpochRecord* rec = LOCAL_RECORD;
+
+    if (rec != NULL)
+        return rec;
+
+    pthread_once(&RECORD_ONCE, epoch_create_key);
+
+    for (rec = atomic_load(&RECORDS); rec != NULL; rec = rec->next) {
+        uint32_t expected = 0;
+
+        if (atomic_compare_exchange_strong(&rec->in_use, &expected, 1))
+            break;
+    }
+
+    if (rec == NULL) {
+        rec = calloc(1, sizeof(struct EpochRecord));
+
+        if (rec == NULL)
+            abort();
+
+        atomic_store(&rec->in_use, 1);
+        rec->next = atomic_load(&RECORDS);
+
+        while (!atomic_compare_exchange_weak(&RECORDS, &rec->next, rec))
+            ;
+    }
+
+    rec->depth = 0;
+    LOCAL_RECORD = rec;
+    pthread_setspecific(RECORD_KEY, rec);
+
+    return rec;
+}
+
+void epoch_enter(void)
+{
+    struct EpochRecord* rec = epoch_record();
+
+    if (rec->depth++ == 0) {
+        atomic_store(&rec->state, (atomic_load(&GLOBAL_EPOCH) << 1) | 1);
+        /* The announcement must be visible before any shared node is read. */
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+}
+
+void epoch_exit(void)
+{
+    struct EpochRecord* rec = LOCAL_RECORD;
+
+    if (rec != NULL && rec->depth > 0 && --rec->depth == 0)
+        atomic_store_explicit(&rec->state, 0, memory_order_release);
+}
+
+/*! \brief Advances the global epoch if every active thread observed it.
+ *
+ * \return The current global epoch.
+ */
+static uint64_t epoch_try_advance(void)
+{
+    uint64_t epoch = atomic_load(&GLOBAL_EPOCH);
+
+    for (struct EpochRecord* rec = atomic_load(&RECORDS); rec != NULL; rec = rec->next) {
+        uint64_t state = atomic_load(&rec->state);
+
+        if ((state & 1) && (state >> 1) != epoch)
+            return epoch;
+    }
+
+    if (atomic_compare_exchange_strong(&GLOBAL_EPOCH, &epoch, epoch + 1))
+        return epoch + 1;
+
+    return epoch;
+}
+
+void epoch_reclaim(void)
+{
+    uint64_t epoch = epoch_try_advance();
+    struct EpochRetired* freed = NULL;
+
+    pthread_mutex_lock(&RETIRED_LOCK);
+
+    /* Readers may still be in the epoch after the retiring one. */
+    for (struct EpochRetired** it = &RETIRED; *it != NULL;) {
+        struct EpochRetired* retired = *it;
+
+        if (retired->epoch + 2 <= epoch) {
+            *it = retired->next;
+            retired->next = freed;
+            freed = retired;
+            --RETIRED_SIZE;
+        } else {
+            it = &retired->next;
+        }
+    }
+
+    pthread_mutex_unlock(&RETIRED_LOCK);
+
+    while (freed != NULL) {
+        struct EpochRetired* next = freed->next;
+
+        freed->destructor(freed->ptr);
+        free(freed);
+        freed = next;
+    }
+}
+
+/*! \failure Out Of Memory - Aborts, the memory can not be released safely.
+ */
+void epoch_retire(void* ptr, void (*destructor)(void*))
+{
+    if (ptr == NULL)
+        return;
+
+    struct EpochRetired* retired = malloc(sizeof(struct EpochRetired));
+
+    if (retired == NULL)
+        abort();
+
+    retired->ptr = ptr;
+    retired->destructor = destructor;
+    retired->epoch = atomic_load(&GLOBAL_EPOCH);
+
+    pthread_mutex_lock(&RETIRED_LOCK);
+    retired->next = RETIRED;
+    RETIRED = retired;
+    size_t size = ++RETIRED_SIZE;
+    pthread_mutex_unlock(&RETIRED_LOCK);
+
+    if (size % EPOCH_RECLAIM_THRESHOLD == 0)
+        epoch_reclaim();
+}
+
+void epoch_barrier(void)
+{
+    for (;;) {
+        epoch_reclaim();
+
+        pthread_mutex_lock(&RETIRED_LOCK);
+        size_t size = RETIRED_SIZE;
+        pthread_mutex_unlock(&RETIRED_LOCK);
+
+        if (size == 0)
+            return;
+
+        sched_yield();
+    }
+}
@@ -0,0 +1,433 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <utils/reactor.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+//! Number of events handled per wakeup.
+#define REACTOR_EVENTS 16
+
+/*! \brief Task queued on a reactor. */
+struct ReactorTask {
+    ReactorFn fn;                       //!< Task.
+    void* user;                         //!< Pointer given to the task.
+    struct ReactorTask* next;           //!< Next queued task.
+};
+
+/*! \brief File descriptor watched by a reactor. */
+struct ReactorWatch {
+    int fd;                             //!< Watched fd, -1 once removed.
+    ReactorHandler handler;             //!< Handler of the fd.
+    void* user;                         //!< Pointer given to the handler.
+    struct ReactorWatch* next;          //!< Next watch of the reactor.
+};
+
+struct Reactor {
+    pthread_t thread;                   //!< Thread of the reactor.
+    int32_t node;                       //!< NUMA node served.
+    struct CpuSet cpus;                 //!< CPUs to pin the thread to.
+    uint8_t has_cpus;                   //!< If the thread must be pinned.
+    uint8_t pinned;                     //!< If pinning the thread succeeded.
+    int epoll_fd;                       //!< Epoll instance, created by the thread.
+    int wake_fd;                        //!< Eventfd waking the thread.
+    pthread_mutex_t lock;               //!< Lock protecting the queue.
+    pthread_cond_t ready;               //!< Signalled once the thread is set up.
+    uint8_t started;                    //!< If the thread is set up.
+    uint8_t stop;                       //!< If the thread must exit.
+    struct ReactorTask* head;           //!< First queued task.
+    struct ReactorTask* tail;           //!< Last queued task.
+    struct ReactorWatch* watches;       //!< Watches, only used by the thread.
+    struct ReactorWatch* removed;       //!< Watches freed after the current events.
+};
+
+/*! \brief Task waited for by reactor_call. */
+struct ReactorCall {
+    ReactorFn fn;                       //!< Task.
+    void* user;                         //!< Pointer given to the task.
+    pthread_mutex_t lock;               //!< Lock for waiting on completion.
+    pthread_cond_t done_cond;           //!< Signalled on completion.
+    uint8_t done;                       //!< If the task ran.
+};
+
+/*! \brief Watch added by reactor_add_fd. */
+struct ReactorAdd {
+    struct Reactor* reactor;            //!< Reactor to add to.
+    int fd;                             //!< File descriptor to watch.
+    uint32_t events;                    //!< Epoll events.
+    ReactorHandler handler;             //!< Handler of the fd.
+    void* user;                         //!< Pointer given to the handler.
+    uint8_t ret;                        //!< If the fd is watched.
+};
+
+/*! \brief Watch removed by reactor_remove_fd. */
+struct ReactorRemove {
+    struct Reactor* reactor;            //!< Reactor to remove from.
+    int fd;                             //!< File descriptor to stop watching.
+};
+
+/*! \brief Wakes the thread of a reactor. */
+static void reactor_wake(struct Reactor* reactor)
+{
+    uint64_t value = 1;
+    ssize_t written;
+
+    do {
+        written = write(reactor->wake_fd, &value, sizeof(value));
+    } while (written == -1 && errno == EINTR);
+}
+
+/*! \brief Runs the queued tasks.
+ *
+ * \return If the reactor must exit.
+ */
+static uint8_t reactor_run_tasks(struct Reactor* reactor)
+{
+    pthread_mutex_lock(&reactor->lock);
+
+    struct ReactorTask* task = reactor->head;
+    uint8_t stop = reactor->stop;
+
+    reactor->head = NULL;
+    reactor->tail = NULL;
+
+    pthread_mutex_unlock(&reactor->lock);
+
+    while (task != NULL) {
+        struct ReactorTask* next = task->next;
+
+        task->fn(task->user);
+        free(task);
+        task = next;
+    }
+
+    return stop;
+}
+
+/*! \brief Frees the watches removed while handling events. */
+static void reactor_free_removed(struct Reactor* reactor)
+{
+    while (reactor->removed != NULL) {
+        struct ReactorWatch* next = reactor->removed->next;
+
+        free(reactor->removed);
+        reactor->removed = next;
+    }
+}
+
+/*! \brief Main loop of a reactor. */
+static void* reactor_loop(void* arg)
+{
+    struct Reactor* reactor = arg;
+    struct epoll_event events[REACTOR_EVENTS];
+
+    reactor->pinned = reactor->has_cpus && cpuset_pin_thread(&reactor->cpus);
+
+    /* Created once pinned, so no part of the loop runs off the CPUs of the reactor. */
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    int wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if (epoll_fd != -1 && wake_fd != -1) {
+        struct epoll_event wake = {.events = EPOLLIN, .data = {.ptr = NULL}};
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &wake) == -1) {
+            close(wake_fd);
+            wake_fd = -1;
+        }
+    }
+
+    pthread_mutex_lock(&reactor->lock);
+    reactor->epoll_fd = epoll_fd;
+    reactor->wake_fd = wake_fd;
+    reactor->started = 1;
+    pthread_cond_broadcast(&reactor->ready);
+    pthread_mutex_unlock(&reactor->lock);
+
+    if (epoll_fd == -1 || wake_fd == -1)
+        return NULL;
+
+    for (;;) {
+        int ready = epoll_wait(epoll_fd, events, REACTOR_EVENTS, -1);
+
+        for (int i = 0; i < ready; ++i) {
+            struct ReactorWatch* watch = events[i].data.ptr;
+
+            if (watch == NULL) {
+                uint64_t value;
+
+                /* Nonblocking, an empty eventfd means the wake was already consumed. */
+                if (read(wake_fd, &value, sizeof(value)) == -1)
+                    continue;
+            } else if (watch->fd != -1) {
+                watch->handler(watch->fd, events[i].events, watch->user);
+            }
+        }
+
+        /* A handler may remove a watch that is still pending in this batch. */
+        reactor_free_removed(reactor);
+
+        if (reactor_run_tasks(reactor))
+            break;
+    }
+
+    /* Tasks posted while stopping still run. */
+    reactor_run_tasks(reactor);
+
+    return NULL;
+}
+
+/*! \failure Thread Failure - Returns NULL when the thread, its epoll instance or its eventfd
+ *                            cannot be created.
+ */
+struct Reactor* reactor_create(int32_t node, const struct CpuSet* cpus)
+{
+    struct Reactor* ret = calloc(1, sizeof(struct Reactor));
+
+    if (ret == NULL)
+        return NULL;
+
+    ret->node = node;
+    ret->epoll_fd = -1;
+    ret->wake_fd = -1;
+
+    if (cpus != NULL) {
+        ret->cpus = *cpus;
+        ret->has_cpus = 1;
+    }
+
+    pthread_mutex_init(&ret->lock, NULL);
+    pthread_cond_init(&ret->ready, NULL);
+
+    if (pthread_create(&ret->thread, NULL, reactor_loop, ret) != 0)
+        goto fail;
+
+    pthread_mutex_lock(&ret->lock);
+    while (!ret->started)
+        pthread_cond_wait(&ret->ready, &ret->lock);
+    pthread_mutex_unlock(&ret->lock);
+
+    if (ret->epoll_fd != -1 && ret->wake_fd != -1)
+        return ret;
+
+    pthread_join(ret->thread, NULL);
+
+    if (ret->epoll_fd != -1)
+        close(ret->epoll_fd);
+    if (ret->wake_fd != -1)
+        close(ret->wake_fd);
+
+fail:
+    pthread_cond_destroy(&ret->ready);
+    pthread_mutex_destroy(&ret->lock);
+    free(ret);
+
+    return NULL;
+}
+
+void reactor_destroy(struct Reactor* reactor)
+{
+    if (reactor == NULL)
+        return;
+
+    pthread_mutex_lock(&reactor->lock);
+    reactor->stop = 1;
+    pthread_mutex_unlock(&reactor->lock);
+
+    reactor_wake(reactor);
+    pthread_join(reactor->thread, NULL);
+
+    while (reactor->watches != NULL) {
+        struct ReactorWatch* next = reactor->watches->next;
+
+        free(reactor->watches);
+        reactor->watches = next;
+    }
+
+    close(reactor->epoll_fd);
+    close(reactor->wake_fd);
+    pthread_cond_destroy(&reactor->ready);
+    pthread_mutex_destroy(&reactor->lock);
+    free(reactor);
+}
+
+/*! \failure Memory Failure - Returns 0 when the task cannot be allocated.
+ */
+uint8_t reactor_post(struct Reactor* reactor, ReactorFn fn, void* user)
+{
+    struct ReactorTask* task = malloc(sizeof(struct ReactorTask));
+
+    if (task == NULL)
+        return 0;
+
+    task->fn = fn;
+    task->user = user;
+    task->next = NULL;
+
+    pthread_mutex_lock(&reactor->lock);
+
+    if (reactor->tail != NULL)
+        reactor->tail->next = task;
+    else
+        reactor->head = task;
+
+    reactor->tail = task;
+
+    pthread_mutex_unlock(&reactor->lock);
+
+    reactor_wake(reactor);
+
+    return 1;
+}
+
+/*! \brief Runs a waited task and signals its caller. */
+static void reactor_run_call(void* user)
+{
+    struct ReactorCall* call = user;
+
+    call->fn(call->user);
+
+    pthread_mutex_lock(&call->lock);
+    call->done = 1;
+    pthread_cond_signal(&call->done_cond);
+    pthread_mutex_unlock(&call->lock);
+}
+
+/*! \failure Memory Failure - Returns 0 without running the task when it cannot be queued.
+ */
+uint8_t reactor_call(struct Reactor* reactor, ReactorFn fn, void* user)
+{
+    if (pthread_equal(pthread_self(), reactor->thread)) {
+        fn(user);
+        return 1;
+    }
+
+    struct ReactorCall call = {.fn = fn, .user = user, .done = 0};
+
+    pthread_mutex_init(&call.lock, NULL);
+    pthread_cond_init(&call.done_cond, NULL);
+
+    uint8_t ret = reactor_post(reactor, reactor_run_call, &call);
+
+    if (ret) {
+        pthread_mutex_lock(&call.lock);
+        while (!call.done)
+            pthread_cond_wait(&call.done_cond, &call.lock);
+        pthread_mutex_unlock(&call.lock);
+    }
+
+    pthread_cond_destroy(&call.done_cond);
+    pthread_mutex_destroy(&call.lock);
+
+    return ret;
+}
+
+/*! \brief Adds a watch on the thread of the reactor. */
+static void reactor_run_add(void* user)
+{
+    struct ReactorAdd* add = user;
+    struct Reactor* reactor = add->reactor;
+    struct ReactorWatch* watch = malloc(sizeof(struct ReactorWatch));
+
+    add->ret = 0;
+
+    if (watch == NULL)
+        return;
+
+    watch->fd = add->fd;
+    watch->handler = add->handler;
+    watch->user = add->user;
+
+    struct epoll_event event = {.events = add->events, .data = {.ptr = watch}};
+
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, add->fd, &event) == -1) {
+        free(watch);
+        return;
+    }
+
+    watch->next = reactor->watches;
+    reactor->watches = watch;
+    add->ret = 1;
+}
+
+/*! \failure Watch Failure - Returns 0 when the watch cannot be allocated or epoll rejects the
+ *                           file descriptor.
+ */
+uint8_t reactor_add_fd(struct Reactor* reactor, int fd, uint32_t events, ReactorHandler handler, void* user)
+{
+    struct ReactorAdd add = {
+        .reactor = reactor,
+        .fd = fd,
+        .events = events,
+        .handler = handler,
+        .user = user,
+        .ret = 0
+    };
+
+    reactor_call(reactor, reactor_run_add, &add);
+
+    return add.ret;
+}
+
+/*! \brief Removes a watch on the thread of the reactor. */
+static void reactor_run_remove(void* user)
+{
+    struct ReactorRemove* remove = user;
+    struct Reactor* reactor = remove->reactor;
+    struct ReactorWatch** it = &reactor->watches;
+
+    while (*it != NULL && (*it)->fd != remove->fd)
+        it = &(*it)->next;
+
+    if (*it == NULL)
+        return;
+
+    struct ReactorWatch* watch = *it;
+
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+
+    *it = watch->next;
+    watch->fd = -1;
+    watch->next = reactor->removed;
+    reactor->removed = watch;
+}
+
+/*! \failure Memory Failure - Only removes the fd from epoll when the removal cannot be queued,
+ *                            the watch is then freed with the reactor.
+ */
+void reactor_remove_fd(struct Reactor* reactor, int fd)
+{
+    struct ReactorRemove remove = {.reactor = reactor, .fd = fd};
+
+    if (!reactor_call(reactor, reactor_run_remove, &remove))
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int32_t reactor_node(const struct Reactor* reactor)
+{
+    return reactor->node;
+}
+
+uint8_t reactor_pinned(const struct Reactor* reactor)
+{
+    return reactor->pinned;
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <utils/sysfs.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+//! Root of the sysfs tree.
+static const char* SYSFS_ROOT = "/sys";
+
+const char* get_sysfs_root(void)
+{
+    return SYSFS_ROOT;
+}
+
+void set_sysfs_root(const char* root)
+{
+    SYSFS_ROOT = root != NULL ? root : "/sys";
+}
+
+/*! \failure Truncated Path - Returns -1 when the path does not fit the buffer.
+ */
+int sysfs_path(char* buffer, size_t size, const char* fmt, ...)
+{
+    va_list args;
+    int len = snprintf(buffer, size, "%s/", SYSFS_ROOT);
+
+    if (len < 0 || (size_t) len >= size)
+        return -1;
+
+    va_start(args, fmt);
+    int ret = vsnprintf(buffer + len, size - len, fmt, args);
+    va_end(args);
+
+    if (ret < 0 || (size_t) ret >= size - len)
+        return -1;
+
+    return len + ret;
+}
+
+/*! \failure Missing Attribute - Returns 0 when the attribute does not exist.
+ * \failure Invalid Attribute - Returns 0 when the attribute is not an integer.
+ */
+uint8_t sysfs_read_u32(uint32_t* value, const char* fmt, ...)
+{
+    char path[1024];
+    char contents[64] = "";
+    va_list args;
+    int len = snprintf(path, sizeof(path), "%s/", SYSFS_ROOT);
+
+    va_start(args, fmt);
+    vsnprintf(path + len, sizeof(path) - len, fmt, args);
+    va_end(args);
+
+    FILE* in_file = fopen(path, "r");
+
+    if (in_file == NULL)
+        return 0;
+
+    char* line = fgets(contents, sizeof(contents), in_file);
+    fclose(in_file);
+
+    if (line == NULL)
+        return 0;
+
+    char* end = NULL;
+    unsigned long ret = strtoul(contents, &end, 0);
+
+    if (end == contents)
+        return 0;
+
+    *value = ret;
+
+    return 1;
+}
+
+/*! \failure Missing Attribute - Returns 0 when the attribute does not exist.
+ * \failure Truncated Line - Lines longer than the buffer are truncated.
+ */
+uint8_t sysfs_read_str(char* value, size_t size, const char* fmt, ...)
+{
+    char path[1024];
+    va_list args;
+    int len = snprintf(path, sizeof(path), "%s/", SYSFS_ROOT);
+
+    va_start(args, fmt);
+    vsnprintf(path + len, sizeof(path) - len, fmt, args);
+    va_end(args);
+
+    FILE* in_file = fopen(path, "r");
+
+    if (in_file == NULL)
+        return 0;
+
+    char* line = fgets(value, size, in_file);
+    fclose(in_file);
+
+    if (line == NULL)
+        return 0;
+
+    value[strcspn(value, "\n")] = '\0';
+
+    return 1;
+}
+
+/*! \failure Missing Link - Returns 0 when the path does not exist or is not a link.
+ * \failure Truncated Name - Returns 0 when the name does not fit the buffer.
+ */
+uint8_t sysfs_read_link(char* value, size_t size, const char* fmt, ...)
+{
+    char path[1024];
+    char target[1024];
+    va_list args;
+    int len = snprintf(path, sizeof(path), "%s/", SYSFS_ROOT);
+
+    va_start(args, fmt);
+    vsnprintf(path + len, sizeof(path) - len, fmt, args);
+    va_end(args);
+
+    ssize_t target_len = readlink(path, target, sizeof(target) - 1);
+
+    if (target_len <= 0)
+        return 0;
+
+    target[target_len] = '\0';
+
+    const char* slash = strrchr(target, '/');
+    const char* name = slash != NULL ? slash + 1 : target;
+
+    if (strlen(name) >= size)
+        return 0;
+
+    strcpy(value, name);
+
+    return 1;
+}
+
+/*! \failure Missing Attribute - Returns 0 when the attribute does not exist.
+ * \failure Rejected Value - Returns 0 when the kernel refuses the value.
+ */
+uint8_t sysfs_write_str(const char* value, const char* fmt, ...)
+{
+    char path[1024];
+    va_list args;
+    int len = snprintf(path, sizeof(path), "%s/", SYSFS_ROOT);
+
+    va_start(args, fmt);
+    vsnprintf(path + len, sizeof(path) - len, fmt, args);
+    va_end(args);
+
+    int fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+
+    if (fd == -1)
+        return 0;
+
+    size_t size = strlen(value);
+    ssize_t written;
+
+    do {
+        written = write(fd, value, size);
+    } while (written == -1 && errno == EINTR);
+
+    close(fd);
+
+    return written == (ssize_t) size;
+}
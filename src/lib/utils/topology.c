@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#define _GNU_SOURCE
+
+#include <utils/sysfs.h>
+#include <utils/topology.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*! \failure Malformed List - The set holds the CPUs parsed before the error.
+ */
+uint8_t cpulist_parse(const char* list, struct CpuSet* set)
+{
+    const char* cursor = list;
+
+    memset(set, 0, sizeof(*set));
+
+    while (*cursor != '\0' && *cursor != '\n') {
+        char* end = NULL;
+        unsigned long first = strtoul(cursor, &end, 10);
+        unsigned long last = first;
+
+        if (end == cursor)
+            return 0;
+
+        if (*end == '-') {
+            cursor = end + 1;
+            last = strtoul(cursor, &end, 10);
+
+            if (end == cursor)
+                return 0;
+        }
+
+        if (last < first || last >= CPU_SET_MAX)
+            return 0;
+
+        for (unsigned long cpu = first; cpu <= last; ++cpu)
+            set->bits[cpu / 64] |= 1ULL << (cpu % 64);
+
+        cursor = end;
+
+        if (*cursor == ',')
+            ++cursor;
+        else if (*cursor != '\0' && *cursor != '\n')
+            return 0;
+    }
+
+    return 1;
+}
+
+uint32_t cpuset_count(const struct CpuSet* set)
+{
+    uint32_t ret = 0;
+
+    for (uint32_t i = 0; i < CPU_SET_MAX / 64; ++i)
+        ret += __builtin_popcountll(set->bits[i]);
+
+    return ret;
+}
+
+/*! \failure Affinity Failure - Returns 0 when no CPU of the set is usable by the thread.
+ */
+uint8_t cpuset_pin_thread(const struct CpuSet* set)
+{
+    cpu_set_t affinity;
+
+    CPU_ZERO(&affinity);
+
+    for (uint32_t cpu = 0; cpu < CPU_SET_MAX && cpu < CPU_SETSIZE; ++cpu)
+        if (cpuset_test(set, cpu))
+            CPU_SET(cpu, &affinity);
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(affinity), &affinity) == 0;
+}
+
+/*! \failure No Node - Returns -1 when the attribute is missing, as on single node systems.
+ */
+int32_t pci_numa_node(uint32_t domain, uint32_t bus, uint32_t slot, uint32_t function)
+{
+    char value[32];
+
+    if (!sysfs_read_str(
+            value, sizeof(value), "bus/pci/devices/%.4x:%.2x:%.2x.%x/numa_node",
+            domain, bus, slot, function))
+        return -1;
+
+    char* end = NULL;
+    long ret = strtol(value, &end, 10);
+
+    return end == value || ret < 0 ? -1 : (int32_t) ret;
+}
+
+uint8_t pci_local_cpus(uint32_t domain, uint32_t bus, uint32_t slot, uint32_t function, struct CpuSet* set)
+{
+    char value[1024];
+
+    memset(set, 0, sizeof(*set));
+
+    return sysfs_read_str(
+               value, sizeof(value), "bus/pci/devices/%.4x:%.2x:%.2x.%x/local_cpulist",
+               domain, bus, slot, function) &&
+           cpulist_parse(value, set) && cpuset_count(set) > 0;
+}
+
+uint8_t numa_node_cpus(int32_t node, struct CpuSet* set)
+{
+    char value[1024];
+
+    memset(set, 0, sizeof(*set));
+
+    return node >= 0 &&
+           sysfs_read_str(value, sizeof(value), "devices/system/node/node%d/cpulist", node) &&
+           cpulist_parse(value, set) && cpuset_count(set) > 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <utils/uevent.h>
+
+#include <errno.h>
+#include <linux/netlink.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+//! Largest uevent message, the kernel limits the environment of an event to 2048 bytes.
+#define UEVENT_BUFFER_SIZE 8192
+
+/*! \failure No Netlink - Occurs when the socket cannot be created or bound, e.g. in a container
+ *                        without a network namespace of its own.
+ */
+int uevent_open(void)
+{
+    struct sockaddr_nl addr = {};
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+
+    if (fd == -1)
+        return -1;
+
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;
+
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*! \brief Copies a value into a fixed size field, truncating it.
+ *
+ * \param dst - Field to copy into.
+ * \param size - Size of the field.
+ * \param value - Value to copy.
+ * \param length - Length of the value.
+ */
+static void uevent_copy(char* dst, size_t size, const char* value, size_t length)
+{
+    if (length >= size)
+        length = size - 1;
+
+    memcpy(dst, value, length);
+    dst[length] = '\0';
+}
+
+/*! \failure Truncated - Values longer than their field are truncated.
+ */
+uint8_t uevent_parse(const char* buf, size_t size, struct Uevent* event)
+{
+    memset(event, 0, sizeof(*event));
+
+    /* Kernel messages start with action@devpath, udev ones with "libudev". */
+    size_t header = strnlen(buf, size);
+    const char* at = memchr(buf, '@', header);
+
+    if (at == NULL)
+        return 0;
+
+    for (size_t i = header + 1; i < size; i += strnlen(buf + i, size - i) + 1) {
+        const char* key = buf + i;
+        size_t length = strnlen(key, size - i);
+        const char* value = memchr(key, '=', length);
+
+        if (value == NULL)
+            continue;
+
+        /* The last pair may lack its terminator, numbers are copied before being parsed. */
+        size_t value_length = length - (++value - key);
+        char number[32];
+
+        uevent_copy(number, sizeof(number), value, value_length);
+
+        if (strncmp(key, "ACTION=", 7) == 0)
+            uevent_copy(event->action, sizeof(event->action), value, value_length);
+        else if (strncmp(key, "SUBSYSTEM=", 10) == 0)
+            uevent_copy(event->subsystem, sizeof(event->subsystem), value, value_length);
+        else if (strncmp(key, "DRIVER=", 7) == 0)
+            uevent_copy(event->driver, sizeof(event->driver), value, value_length);
+        else if (strncmp(key, "DEVPATH=", 8) == 0)
+            uevent_copy(event->devpath, sizeof(event->devpath), value, value_length);
+        else if (strncmp(key, "SEQNUM=", 7) == 0)
+            event->seqnum = strtoull(number, NULL, 10);
+        else if (strncmp(key, "PCI_SLOT_NAME=", 14) == 0)
+            event->has_slot = sscanf(
+                number, "%x:%x:%x.%x", &event->domain, &event->bus, &event->slot, &event->function
+            ) == 4;
+    }
+
+    /* The action of the header is used when the environment omits it. */
+    if (event->action[0] == '\0')
+        uevent_copy(event->action, sizeof(event->action), buf, at - buf);
+
+    return event->action[0] != '\0';
+}
+
+/*! \failure Interrupted - Receiving is retried when interrupted by a signal.
+ */
+int uevent_recv(int fd, struct Uevent* event)
+{
+    char buf[UEVENT_BUFFER_SIZE];
+
+    while (1) {
+        struct sockaddr_storage addr = {};
+        socklen_t addr_size = sizeof(addr);
+        ssize_t size = recvfrom(fd, buf, sizeof(buf) - 1, MSG_DONTWAIT, (struct sockaddr*) &addr, &addr_size);
+
+        if (size == -1 && errno == EINTR)
+            continue;
+
+        if (size == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+
+        buf[size] = '\0';
+
+        /* Only the kernel may send on the uevent multicast group. */
+        if (addr.ss_family == AF_NETLINK && ((struct sockaddr_nl*) &addr)->nl_pid != 0)
+            continue;
+
+        if (uevent_parse(buf, size, event))
+            return 1;
+    }
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <utils/uuid.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/random.h>
+
+/*! \brief Parses a hexadecimal digit.
+ *
+ * \return Value of the digit, or -1 if the character is not one.
+ */
+static int uuid_hex(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+
+    return -1;
+}
+
+/*! \failure Malformed UUID - Returns 0 and leaves the UUID unchanged.
+ */
+uint8_t uuid_parse(const char* str, struct UUID* uuid)
+{
+    uint8_t bytes[16];
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < UUID_STR_LEN; ++i) {
+        if (i == 8 || i == 13 || i == 18 || i == 23) {
+            if (str[i] != '-')
+                return 0;
+            continue;
+        }
+
+        int high = uuid_hex(str[i]);
+        int low = high != -1 ? uuid_hex(str[i + 1]) : -1;
+
+        if (low == -1)
+            return 0;
+
+        bytes[count++] = (high << 4) | low;
+        ++i;
+    }
+
+    /* The first three fields are stored in host order, as printed. */
+    uuid->time_low = (uint32_t) bytes[0] << 24 | (uint32_t) bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+    uuid->time_mid = bytes[4] << 8 | bytes[5];
+    uuid->time_hi_and_version = bytes[6] << 8 | bytes[7];
+    uuid->clock_seq_hi_and_reserved = bytes[8];
+    uuid->clock_seq_low = bytes[9];
+    memcpy(uuid->node, &bytes[10], sizeof(uuid->node));
+
+    return 1;
+}
+
+void uuid_format(const struct UUID* uuid, char* str)
+{
+    snprintf(
+        str, UUID_STR_LEN + 1,
+        "%.8x-%.4x-%.4x-%.2x%.2x-%.2x%.2x%.2x%.2x%.2x%.2x",
+        uuid->time_low, uuid->time_mid, uuid->time_hi_and_version,
+        uuid->clock_seq_hi_and_reserved, uuid->clock_seq_low,
+        uuid->node[0], uuid->node[1], uuid->node[2], uuid->node[3],
+        uuid->node[4], uuid->node[5]
+    );
+}
+
+/*! \failure Entropy Failure - Returns 0 when the kernel cannot provide random bytes.
+ */
+uint8_t uuid_generate(struct UUID* uuid)
+{
+    uint8_t bytes[16];
+    size_t done = 0;
+
+    while (done < sizeof(bytes)) {
+        ssize_t ret = getrandom(bytes + done, sizeof(bytes) - done, 0);
+
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return 0;
+
+        done += ret;
+    }
+
+    uuid->time_low = (uint32_t) bytes[0] << 24 | (uint32_t) bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+    uuid->time_mid = bytes[4] << 8 | bytes[5];
+    uuid->time_hi_and_version = ((bytes[6] & 0x0F) | 0x40) << 8 | bytes[7];
+    uuid->clock_seq_hi_and_reserved = (bytes[8] & 0x3F) | 0x80;
+    uuid->clock_seq_low = bytes[9];
+    memcpy(uuid->node, &bytes[10], sizeof(uuid->node));
+
+    return 1;
+}
+
+uint8_t uuid_equal(const struct UUID* first, const struct UUID* second)
+{
+    return memcmp(first, second, sizeof(struct UUID)) == 0;
+}
+
+uint64_t uuid_hash(const struct UUID* uuid)
+{
+    uint64_t halves[2];
+
+    _Static_assert(sizeof(struct UUID) == sizeof(halves), "UUIDs are 128 bits");
+    memcpy(halves, uuid, sizeof(halves));
+
+    uint64_t ret = halves[0] ^ (halves[1] * 0x9E3779B97F4A7C15ULL);
+
+    ret = (ret ^ (ret >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    ret = (ret ^ (ret >> 27)) * 0x94D049BB133111EBULL;
+
+    return ret ^ (ret >> 31);
+}
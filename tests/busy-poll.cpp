@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <utils/busypoll.h>
+#include <utils/colors.h>
+
+using std::cout;
+
+/*! \page busy-poll-test Busy Poll Test
+ *
+ * \tableofcontents
+ *
+ * These tests check the adaptive busy poller of the event loop on eventfds. The following
+ * tests are implemented:
+ *
+ * -# \ref busy-events - Catches events while spinning.
+ * -# \ref busy-timeout - Honours the timeout.
+ * -# \ref busy-adapt - Adapts the spin to the event rate.
+ * -# \ref busy-disabled - Blocks without spinning.
+ * -# \ref busy-delivery - Delivers the events of another thread.
+ *
+ * \section busy-events Spin Events
+ *
+ * This test determines if an event arriving during the spin is reported without blocking.
+ * The pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * busy_poll_init(p, 1 s), write(fd), busy_poll(p, fd, -1) == 1 && p.spin_hits == 1 &&
+ * p.blocks == 0
+ * ```
+ *
+ * \section busy-timeout Timeout
+ *
+ * This test determines if the spin counts toward the timeout and an idle wait returns 0.
+ * The pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * busy_poll_init(p, 5 ms), busy_poll(p, fd, 20) == 0 && 20 ms <= elapsed < 1 s
+ * ```
+ *
+ * \section busy-adapt Adaptive Spin
+ *
+ * This test determines if idle waits shrink the spin to its minimum and events caught while
+ * spinning grow it back to its maximum. The pseudo-code that is executed to determine if this
+ * test is a success is:
+ *
+ * ```{.c}
+ * busy_poll(p, idle fd, 1) * 20, p.budget_ns == BUSY_POLL_MIN_NS,
+ * (write(fd), busy_poll(p, fd, -1)) * 20, p.budget_ns == p.max_ns
+ * ```
+ *
+ * \section busy-disabled Disabled Spin
+ *
+ * This test determines if a poller without a spin behaves as poll. The pseudo-code that is
+ * executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * busy_poll_init(p, 0), busy_poll(p, idle fd, 1) == 0, write(fd), busy_poll(p, fd, -1) == 1,
+ * p.spin_hits == 0
+ * ```
+ *
+ * \section busy-delivery Wake Delivery
+ *
+ * This test determines if every event written by another thread wakes the waiter, with a
+ * blocking poll and with the busy poller. The wake latencies are measured by the
+ * \ref busy-poll-bench. The pseudo-code that is executed to determine if this test is a
+ * success is:
+ *
+ * ```{.c}
+ * (sleep(gap), write(fd)) * N || (busy_poll(p, fd, 1 s), read(fd)) * N,
+ * received(blocking) == N && received(busy) == N
+ * ```
+ */
+
+//! Nanoseconds in a millisecond.
+static const uint64_t MS_NS = 1000000;
+
+/*! \brief Gets the monotonic time in nanoseconds, as the poller measures it. */
+static uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+/*! \brief Signals an eventfd. */
+static void signal_fd(int fd, uint64_t value = 1)
+{
+    if (write(fd, &value, sizeof(value)) != sizeof(value))
+        cout << "\tcannot signal the eventfd\n";
+}
+
+/*! \brief Consumes the counter of an eventfd. */
+static uint64_t drain_fd(int fd)
+{
+    uint64_t value = 0;
+
+    if (read(fd, &value, sizeof(value)) != sizeof(value))
+        return 0;
+
+    return value;
+}
+
+bool busy_events()
+{
+    int fd = eventfd(0, EFD_NONBLOCK);
+    struct pollfd pfd = {.fd = fd, .events = POLLIN, .revents = 0};
+    struct BusyPoll poller;
+
+    busy_poll_init(&poller, 1000 * MS_NS);
+    signal_fd(fd);
+
+    int ret = busy_poll(&poller, &pfd, 1, -1);
+
+    close(fd);
+
+    return ret == 1 && (pfd.revents & POLLIN) && poller.spin_hits == 1 && poller.blocks == 0;
+}
+
+bool busy_timeout()
+{
+    int fd = eventfd(0, EFD_NONBLOCK);
+    struct pollfd pfd = {.fd = fd, .events = POLLIN, .revents = 0};
+    struct BusyPoll poller;
+
+    busy_poll_init(&poller, 5 * MS_NS);
+
+    uint64_t start = now_ns();
+    int ret = busy_poll(&poller, &pfd, 1, 20);
+    uint64_t elapsed = now_ns() - start;
+
+    close(fd);
+
+    return ret == 0 && elapsed >= 19 * MS_NS && elapsed < 1000 * MS_NS && poller.blocks == 1;
+}
+
+bool busy_adapt()
+{
+    int fd = eventfd(0, EFD_NONBLOCK);
+    struct pollfd pfd = {.fd = fd, .events = POLLIN, .revents = 0};
+    struct BusyPoll poller;
+    bool shrunk, grown;
+
+    busy_poll_init(&poller, 100000);
+
+    for (uint32_t i = 0; i < 20; ++i)
+        busy_poll(&poller, &pfd, 1, 1);
+
+    shrunk = poller.budget_ns == BUSY_POLL_MIN_NS;
+
+    for (uint32_t i = 0; i < 20; ++i) {
+        signal_fd(fd);
+        busy_poll(&poller, &pfd, 1, -1);
+        drain_fd(fd);
+    }
+
+    grown = poller.budget_ns == poller.max_ns;
+
+    close(fd);
+
+    return shrunk && grown && poller.spin_hits == 20;
+}
+
+bool busy_disabled()
+{
+    int fd = eventfd(0, EFD_NONBLOCK);
+    struct pollfd pfd = {.fd = fd, .events = POLLIN, .revents = 0};
+    struct BusyPoll poller;
+
+    busy_poll_init(&poller, 0);
+
+    bool idle = busy_poll(&poller, &pfd, 1, 1) == 0;
+
+    signal_fd(fd);
+
+    bool ready = busy_poll(&poller, &pfd, 1, -1) == 1;
+
+    close(fd);
+
+    return idle && ready && poller.spin_hits == 0 && poller.budget_ns == 0;
+}
+
+/*! \brief Counts the events of another thread a poller is woken by.
+ *
+ * \param max_ns - Longest spin of the poller, 0 for a blocking poll.
+ * \param count - Number of events.
+ * \return Number of events received.
+ */
+static uint32_t deliver(uint64_t max_ns, uint32_t count)
+{
+    int fd = eventfd(0, EFD_NONBLOCK);
+    struct pollfd pfd = {.fd = fd, .events = POLLIN, .revents = 0};
+    struct BusyPoll poller;
+    std::atomic<bool> acked(true);
+    uint32_t ret = 0;
+
+    busy_poll_init(&poller, max_ns);
+
+    /* The writer waits for the previous event to be read, so every event wakes the waiter. */
+    std::thread writer([&]() {
+        for (uint32_t i = 0; i < count; ++i) {
+            while (!acked.load(std::memory_order_acquire))
+                std::this_thread::yield();
+
+            acked.store(false, std::memory_order_relaxed);
+            std::this_thread::sleep_for(std::chrono::microseconds(50 + (i * 37) % 150));
+            signal_fd(fd);
+        }
+    });
+
+    for (; ret < count; ++ret) {
+        if (busy_poll(&poller, &pfd, 1, 1000) != 1 || drain_fd(fd) != 1)
+            break;
+
+        acked.store(true, std::memory_order_release);
+    }
+
+    /* A lost event leaves the writer waiting, it is released so it can finish. */
+    acked.store(true, std::memory_order_release);
+    writer.join();
+    close(fd);
+
+    return ret;
+}
+
+bool busy_delivery()
+{
+    const uint32_t NUM_EVENTS = 200;
+
+    return deliver(0, NUM_EVENTS) == NUM_EVENTS && deliver(500000, NUM_EVENTS) == NUM_EVENTS;
+}
+
+int main()
+{
+    const uint32_t NUM_TESTS = 5;
+
+    const std::string test_names[] = {
+        "Spin Events",
+        "Timeout",
+        "Adaptive Spin",
+        "Disabled Spin",
+        "Wake Delivery"
+    };
+    const std::string test_details[] = {
+        "An event present during the spin was not reported without blocking.",
+        "The wait did not honour its timeout.",
+        "The spin did not shrink when idle or grow back with events.",
+        "A poller without a spin did not behave as poll.",
+        "Events written by another thread were lost."
+    };
+
+    bool (*tests[])(void) = {
+        busy_events, busy_timeout, busy_adapt, busy_disabled, busy_delivery
+    };
+
+    uint32_t failures = 0;
+
+    for (uint32_t i = 0; i < NUM_TESTS; ++i) {
+        bool test_result = tests[i]() == 1;
+
+        if (test_result)
+            cout << GREEN_COLOR << test_names[i]
+                 << " succeeded" RESET_COLOR "\n";
+        else {
+            ++failures;
+            cout << RED_COLOR << test_names[i]
+                 << ": " << test_details[i]
+                 << RESET_COLOR "\n";
+        }
+    }
+
+    if (failures == 0)
+        cout << GREEN_COLOR << "All tests succeeded" RESET_COLOR "\n";
+    else
+        cout << RED_COLOR << failures << "/"
+             << NUM_TESTS << " tests failed" RESET_COLOR "\n";
+}
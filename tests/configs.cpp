@@ -0,0 +1,373 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <iostream>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+#include <string.h>
+
+#include <utils/colors.h>
+#include <utils/configs.h>
+
+using std::cout;
+
+namespace fs = std::filesystem;
+
+/*! \page configs-test Configuration Test
+ *
+ * \tableofcontents
+ *
+ * This code tests the configuration parser, the following tests are implemented:
+ *
+ * -# \ref configs-generic - Parses the generic configuration.
+ * -# \ref configs-missing - Parses a configuration which does not exist.
+ * -# \ref configs-free - Frees a parsed configuration.
+ * -# \ref configs-defaults - Applies the defaults of missing fields.
+ * -# \ref configs-display - Decodes the display table of a request.
+ * -# \ref configs-catalog - Selects the profile of a gpu from a config directory.
+ * -# \ref configs-catalog-generic - Selects the generic profile for an unknown gpu.
+ *
+ * \section configs-generic Generic Configuration
+ *
+ * This test parses the generic configuration and checks the parsed request. The pseudo-code that is executed to
+ * determine if this test is a success is:
+ *
+ * ```{.c}
+ * configs.config_size == 1 && configs.configs[0].requests[0].num == 22
+ * ```
+ *
+ * \section configs-missing Missing Configuration
+ *
+ * This test determines if a missing configuration returns an empty configuration. The pseudo-code that is executed
+ * to determine if this test is a success is:
+ *
+ * ```{.c}
+ * get_configs("configs/missing.toml").config_size == 0
+ * ```
+ *
+ * \section configs-free Free Configuration
+ *
+ * This test determines if freeing a configuration releases the arena. The pseudo-code that is executed to determine
+ * if this test is a success is:
+ *
+ * ```{.c}
+ * free_configs(&configs), configs.arena == NULL && configs.configs == NULL
+ * ```
+ *
+ * \section configs-defaults Default Fields
+ *
+ * This test determines if fields missing in the generic configuration take their defaults. The pseudo-code that is
+ * executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * request.map_vid_size == 24 && request.disp->num_heads == 1 && request.disp->frl_config == 120
+ * ```
+ *
+ * \section configs-display Display Fields
+ *
+ * This test determines if every display field of the Ampere profile is decoded into its own member. The
+ * pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * request.disp->num_heads == 4 && request.disp->frl_config == 120 && request.disp->frl_enable == 1
+ * ```
+ *
+ * \section configs-catalog Catalog Profile
+ *
+ * This test loads a config directory with two profiles targeting a device id, one of them only on a bus and without
+ * a vendor id, and a generic profile. It determines if a gpu of that device selects the single profile targeting it
+ * the most closely. The pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * config_catalog_lookup(&catalog, &ampere)->requests[0].num == 529 &&
+ * config_catalog_lookup(&catalog, &ampere on bus 0x41)->requests[0].num == 530
+ * ```
+ *
+ * \section configs-catalog-generic Catalog Generic Profile
+ *
+ * This test determines if a gpu without a profile selects the generic profile, and if a shipped NVIDIA profile only
+ * goes to the devices it targets. The pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * config_catalog_lookup(&catalog, &unknown) == generic && config_catalog_lookup(&shipped, &ampere) == Open_vAmpere &&
+ * config_catalog_lookup(&shipped, &t4) == Open_vTuring && config_catalog_lookup(&shipped, &unknown) == Open_vGeneric
+ * ```
+ */
+
+bool configs_generic()
+{
+    struct GpuConfigs configs = get_configs("configs/generic.toml");
+
+    bool ret = configs.config_size == 1 &&
+               configs.configs[0].gpu_size == 1 &&
+               configs.configs[0].gpus[0].vendor_id == 0x10DE &&
+               configs.configs[0].gpus[0].device_id == 0xFFFFFFFF &&
+               configs.configs[0].mdev_size == 1 &&
+               configs.configs[0].requests[0].num == 22 &&
+               configs.configs[0].requests[0].fb_len == 896 &&
+               strcmp(configs.configs[0].requests[0].name, "GVM GPU") == 0 &&
+               strcmp(configs.configs[0].requests[0].gpu_class, "Compute") == 0 &&
+               configs.configs[0].requests[0].disp->max_res_x == 3840;
+
+    free_configs(&configs);
+
+    return ret;
+}
+
+bool configs_missing()
+{
+    struct GpuConfigs configs = get_configs("configs/missing.toml");
+
+    bool ret = configs.config_size == 0 && configs.arena == NULL;
+
+    free_configs(&configs);
+
+    return ret;
+}
+
+bool configs_free()
+{
+    struct GpuConfigs configs = get_configs("etc/gvm/user/Nvidia/Open_vAmpere.toml");
+
+    bool ret = configs.config_size == 1 && configs.arena != NULL;
+
+    free_configs(&configs);
+
+    return ret && configs.arena == NULL && configs.configs == NULL && configs.config_size == 0;
+}
+
+bool configs_defaults()
+{
+    struct GpuConfigs configs = get_configs("configs/generic.toml");
+
+    bool ret = configs.config_size == 1 && configs.configs[0].mdev_size == 1;
+
+    if (ret) {
+        struct MDevRequest request = configs.configs[0].requests[0];
+
+        ret = request.map_vid_size == 24 &&
+              request.ecc_support == 0 &&
+              request.disp->num_heads == 1 &&
+              request.disp->max_res_y == 2160 &&
+              request.disp->frl_config == 120 &&
+              request.disp->frl_enable == 0;
+    }
+
+    free_configs(&configs);
+
+    return ret;
+}
+
+bool configs_display()
+{
+    struct GpuConfigs configs = get_configs("etc/gvm/user/Nvidia/Open_vAmpere.toml");
+
+    bool ret = configs.config_size == 1 && configs.configs[0].mdev_size > 0;
+
+    if (ret) {
+        struct MDevRequest request = configs.configs[0].requests[0];
+
+        ret = request.num == 529 &&
+              request.v_dev_id == 0x20B01479 &&
+              request.p_dev_id == 0xFFFFFFFFFFFFFFFF &&
+              request.ecc_support == 1 &&
+              request.disp->num_heads == 4 &&
+              request.disp->max_res_x == 3840 &&
+              request.disp->frl_config == 120 &&
+              request.disp->frl_enable == 1;
+    }
+
+    free_configs(&configs);
+
+    return ret;
+}
+
+/*! \brief Config directory with a profile targeting the A100, one targeting the A100 on bus 0x41 without naming
+ *         its vendor, and a generic profile.
+ */
+class CatalogFixture {
+public:
+    CatalogFixture()
+    {
+        char root[] = "/tmp/gvm-catalog-XXXXXX";
+
+        if (mkdtemp(root) == NULL)
+            return;
+
+        this->root = root;
+
+        std::ofstream(this->root + "/a100.toml") <<
+            "[[config]]\n"
+            "    [[config.gpu_config]]\n"
+            "    vendor_id = 0x10DE\n"
+            "    device_id = 0x20B0\n"
+            "    [[config.request]]\n"
+            "    num = 529\n"
+            "    max_instances = 1\n"
+            "    fb_len = 38336\n"
+            "    fb_res = 2624\n";
+        std::ofstream(this->root + "/a100-bus.toml") <<
+            "[[config]]\n"
+            "    [[config.gpu_config]]\n"
+            "    device_id = 0x20B0\n"
+            "    bus = 0x41\n"
+            "    [[config.request]]\n"
+            "    num = 530\n"
+            "    max_instances = 2\n"
+            "    fb_len = 19136\n"
+            "    fb_res = 1344\n";
+        std::ofstream(this->root + "/generic.toml") <<
+            "[[config]]\n"
+            "    [[config.gpu_config]]\n"
+            "    vendor_id = 0x10DE\n"
+            "    [[config.request]]\n"
+            "    num = 22\n"
+            "    max_instances = 1\n"
+            "    fb_len = 896\n"
+            "    fb_res = 128\n";
+    }
+
+    ~CatalogFixture()
+    {
+        if (!this->root.empty())
+            fs::remove_all(this->root);
+    }
+
+    std::string root;
+};
+
+bool configs_catalog()
+{
+    CatalogFixture fixture;
+    struct ConfigCatalog catalog = get_config_catalog(fixture.root.c_str());
+    struct Gpu ampere = {};
+
+    ampere.vendor_id = 0x10DE;
+    ampere.device_id = 0x20B0;
+    ampere.bus = 0x01;
+
+    const struct GpuConfig* config = config_catalog_lookup(&catalog, &ampere);
+    bool ret = !fixture.root.empty() &&
+               catalog.file_size == 3 &&
+               catalog.entry_size == 1 &&
+               config != NULL && config->requests[0].num == 529;
+
+    /* The selector naming no vendor is indexed as an NVIDIA one, and sets more fields. */
+    ampere.bus = 0x41;
+    config = config_catalog_lookup(&catalog, &ampere);
+    ret = ret && config != NULL && config->requests[0].num == 530;
+
+    free_config_catalog(&catalog);
+
+    return ret && catalog.files == NULL;
+}
+
+bool configs_catalog_generic()
+{
+    CatalogFixture fixture;
+    struct ConfigCatalog catalog = get_config_catalog(fixture.root.c_str());
+    struct Gpu unknown = {};
+
+    unknown.vendor_id = 0x10DE;
+    unknown.device_id = 0x1234;
+
+    bool ret = !fixture.root.empty() &&
+               catalog.generic_size == 1 &&
+               config_catalog_lookup(&catalog, &unknown) == catalog.generic[0] &&
+               config_catalog_lookup(&catalog, &unknown) == &catalog.files[2].configs[0];
+
+    free_config_catalog(&catalog);
+
+    /* Every GPU gets a single shipped profile, the architecture ones only for their devices. */
+    struct ConfigCatalog shipped = get_config_catalog("etc/gvm/user/Nvidia");
+    struct Gpu ampere = unknown;
+    struct Gpu t4 = unknown;
+    struct Gpu other = unknown;
+
+    ampere.device_id = 0x20B0;
+    t4.device_id = 0x1EB8;
+    other.vendor_id = 0x1002;
+
+    ret = ret && shipped.file_size == 4 && shipped.generic_size == 1 &&
+          config_catalog_lookup(&shipped, &ampere) == &shipped.files[0].configs[0] &&
+          config_catalog_lookup(&shipped, &unknown) == &shipped.files[1].configs[0] &&
+          config_catalog_lookup(&shipped, &t4) == &shipped.files[3].configs[0] &&
+          config_catalog_lookup(&shipped, &other) == NULL;
+
+    free_config_catalog(&shipped);
+
+    return ret;
+}
+
+int main()
+{
+    const uint32_t NUM_TESTS = 7;
+
+    const std::string test_names[] = {
+        "Generic Configuration",
+        "Missing Configuration",
+        "Free Configuration",
+        "Default Fields",
+        "Display Fields",
+        "Catalog Profile",
+        "Catalog Generic Profile"
+    };
+    const std::string test_details[] = {
+        "The generic configuration was parsed incorrectly, run the test from the repository root.",
+        "A missing configuration produced configurations.",
+        "The configuration was not released correctly.",
+        "Missing fields did not take their default values.",
+        "The display table was decoded incorrectly.",
+        "The profile targeting an Ampere gpu the most closely was not selected for it.",
+        "The generic profile was not selected for an unknown gpu, or a gpu got another architecture's profile."
+    };
+
+    bool (*tests[])(void) = {
+        configs_generic,
+        configs_missing,
+        configs_free,
+        configs_defaults,
+        configs_display,
+        configs_catalog,
+        configs_catalog_generic
+    };
+
+    uint32_t failures = 0;
+
+    for (uint32_t i = 0; i < NUM_TESTS; ++i) {
+        bool test_result = tests[i]() == 1;
+
+        if (test_result)
+            cout << GREEN_COLOR << test_names[i]
+                 << " succeeded" RESET_COLOR "\n";
+        else {
+            ++failures;
+            cout << RED_COLOR << test_names[i]
+                 << ": " << test_details[i]
+                 << RESET_COLOR "\n";
+        }
+    }
+
+    if (failures == 0)
+        cout << GREEN_COLOR << "All tests succeeded" RESET_COLOR "\n";
+    else
+        cout << RED_COLOR << failures << "/"
+             << NUM_TESTS << " tests failed" RESET_COLOR "\n";
+}
@@ -0,0 +1,426 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <iostream>
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <gpu/nvidia/resman/api.h>
+#include <gpu/nvidia/resman/classes.h>
+#include <gpu/nvidia/resman/ioctl.h>
+
+#include <gvm/coro.hpp>
+
+#include <utils/colors.h>
+
+#include "sim-rm.hpp"
+
+using std::cout;
+using gvm::Scheduler;
+using gvm::Task;
+
+/*! \page coroutines-test Coroutine Test
+ *
+ * \tableofcontents
+ *
+ * These tests check the coroutine scheduler over the event sources of the VM manager. The VM
+ * events come from a simulated RM Core installed through rm_set_ioctl and eventfds stand in
+ * for the vGPU files. The following tests are implemented:
+ *
+ * -# \ref coro-tasks - Chains tasks returning values.
+ * -# \ref coro-fds - Waits for file descriptors.
+ * -# \ref coro-pids - Waits for process exits.
+ * -# \ref coro-sleep - Waits for delays.
+ * -# \ref coro-vms - Runs thousands of VM lifecycles on one thread.
+ * -# \ref coro-teardown - Destroys the unfinished coroutines.
+ *
+ * \section coro-tasks Task Chains
+ *
+ * This test determines if nested tasks return their values to the awaiting coroutine. The
+ * pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * depth(n) = n == 0 ? 0 : 1 + co_await depth(n - 1), spawn(result = co_await depth(10000)),
+ * run() && result == 10000
+ * ```
+ *
+ * \section coro-fds File Descriptor Waits
+ *
+ * This test determines if several coroutines waiting for the same file descriptor resume in
+ * arrival order once it is ready, and if a file which cannot be watched resumes at once. The
+ * pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * spawn(co_await readable(fd), order += i) * 3, spawn(co_await sleep_for(1 ms), write(fd)),
+ * run() && order == (0, 1, 2) && co_await readable(regular file) == 0
+ * ```
+ *
+ * \section coro-pids Process Exits
+ *
+ * This test determines if the exit of a process resumes the coroutine waiting for it. The
+ * pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * pid = fork(sleep 20 ms), spawn(exited = co_await pid_exit(pid)), run() && exited
+ * ```
+ *
+ * \section coro-sleep Delays
+ *
+ * This test determines if delays are waited for and if many delays elapse concurrently. The
+ * pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * spawn(co_await sleep_for(5 ms)) * 1000, run() && 5 ms <= elapsed < 1 s
+ * ```
+ *
+ * \section coro-vms VM Lifecycles
+ *
+ * This test determines if an accept loop awaiting the start requests spawns a lifecycle per VM
+ * which waits for its vGPU, with every VM multiplexed on the thread of the scheduler. The
+ * pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * spawn(accept: request = co_await start_event(), spawn(co_await vgpu_ready(fd[request]))),
+ * fire(start) * 4096, write(fd) * 64, run() && completed == 4096
+ * ```
+ *
+ * \section coro-teardown Teardown
+ *
+ * This test determines if destroying a scheduler destroys the coroutines still waiting and
+ * closes their file descriptors. The pseudo-code that is executed to determine if this test
+ * is a success is:
+ *
+ * ```{.c}
+ * spawn(co_await readable(fd)), spawn(co_await sleep_for(1 h)), run_once(0),
+ * ~Scheduler(), open fds == before
+ * ```
+ */
+
+//! Number of start requests read.
+static uint32_t sim_starts = 0;
+
+/*! \brief Issues an ioctl on the simulated RM Core, which answers the start requests. */
+int sim_ioctl(int fd, unsigned long request, void* data)
+{
+    struct RmControlRes* ctrl = (struct RmControlRes*) data;
+
+    if (fd == SIM_FD && request == NV_CONTROL_RES && ctrl->cmd == 0x00000C01) {
+        struct RmVmStartInfo* info = (struct RmVmStartInfo*) ctrl->params;
+
+        info->mdev_id = sim_starts;
+        info->pci_id = 0x100;
+        info->qemu_pid = 1000 + sim_starts++;
+        ctrl->status = 0;
+        return 0;
+    }
+
+    return sim_rm_ioctl(fd, request, data);
+}
+
+/*! \brief Counts the open file descriptors of the process. */
+static size_t open_fds()
+{
+    size_t ret = 0;
+
+    for (auto& entry : std::filesystem::directory_iterator("/proc/self/fd")) {
+        (void) entry;
+        ++ret;
+    }
+
+    return ret;
+}
+
+/*! \brief Returns the depth of a chain of tasks. */
+static Task<int> depth(int n)
+{
+    if (n == 0)
+        co_return 0;
+
+    co_return 1 + co_await depth(n - 1);
+}
+
+bool coro_tasks()
+{
+    Scheduler scheduler;
+    int result = -1;
+
+    scheduler.spawn([](int& result) -> Task<> {
+        result = co_await depth(10000);
+    }(result));
+
+    return scheduler && scheduler.size() == 1 && scheduler.run() && result == 10000 && scheduler.size() == 0;
+}
+
+bool coro_fds()
+{
+    Scheduler scheduler;
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int file = open("/proc/self/stat", O_RDONLY | O_CLOEXEC);
+    std::vector<int> order;
+    uint32_t file_events = 1;
+
+    for (int i = 0; i < 3; ++i) {
+        scheduler.spawn([](Scheduler& s, int fd, int i, std::vector<int>& order) -> Task<> {
+            uint32_t events = co_await s.readable(fd);
+
+            if (events & EPOLLIN)
+                order.push_back(i);
+        }(scheduler, fd, i, order));
+    }
+
+    scheduler.spawn([](Scheduler& s, int fd) -> Task<> {
+        co_await s.sleep_for(std::chrono::milliseconds(1));
+        uint32_t events = co_await s.writable(fd);
+
+        if (events & EPOLLOUT)
+            signal_fd(fd);
+    }(scheduler, fd));
+
+    scheduler.spawn([](Scheduler& s, int file, uint32_t& events) -> Task<> {
+        events = co_await s.readable(file);
+    }(scheduler, file, file_events));
+
+    bool ret = scheduler.run() && order == std::vector<int>({0, 1, 2}) && file_events == 0;
+
+    close(fd);
+    close(file);
+
+    return ret;
+}
+
+bool coro_pids()
+{
+    Scheduler scheduler;
+    bool exited = false;
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        usleep(20000);
+        _exit(0);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    scheduler.spawn([](Scheduler& s, pid_t pid, bool& exited) -> Task<> {
+        exited = co_await s.pid_exit(pid);
+    }(scheduler, pid, exited));
+
+    bool ret = pid > 0 && scheduler.run() && exited;
+
+    ret = ret && std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(15);
+
+    waitpid(pid, NULL, 0);
+
+    return ret;
+}
+
+bool coro_sleep()
+{
+    const uint32_t NUM_SLEEPS = 1000;
+
+    Scheduler scheduler;
+    uint32_t elapsed = 0;
+
+    for (uint32_t i = 0; i < NUM_SLEEPS; ++i) {
+        scheduler.spawn([](Scheduler& s, uint32_t& elapsed) -> Task<> {
+            bool slept = co_await s.sleep_for(std::chrono::milliseconds(5));
+
+            if (slept)
+                ++elapsed;
+        }(scheduler, elapsed));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool ret = scheduler.run();
+    auto time = std::chrono::steady_clock::now() - start;
+
+    return ret && elapsed == NUM_SLEEPS && time >= std::chrono::milliseconds(5) && time < std::chrono::seconds(1);
+}
+
+/*! \brief Lifecycle of a VM, waiting for its vGPU. */
+static Task<> vm_lifecycle(Scheduler& s, struct VmStartRequest request, const std::vector<int>& vgpus,
+                           uint32_t& completed)
+{
+    uint32_t events = co_await s.vgpu_ready(vgpus[request.info.mdev_id % vgpus.size()]);
+
+    if (events != 0)
+        ++completed;
+}
+
+/*! \brief Accepts the start requests, spawning a lifecycle per VM. */
+static Task<> vm_accept(Scheduler& s, gvm::VmEventSource& source, uint32_t count,
+                        const std::vector<int>& vgpus, uint32_t& completed)
+{
+    for (uint32_t i = 0; i < count; ++i) {
+        std::optional<struct VmStartRequest> request = co_await source.start_event();
+
+        if (!request)
+            co_return;
+
+        s.spawn(vm_lifecycle(s, *request, vgpus, completed));
+    }
+}
+
+bool coro_vms()
+{
+    const uint32_t NUM_VMS = 4096;
+    const uint32_t NUM_VGPUS = 64;
+
+    Scheduler scheduler;
+    struct NvResource client = {};
+    struct NvMdev mdev = {};
+    struct VmMgr mgr = {};
+    std::vector<int> vgpus;
+    uint32_t completed = 0;
+
+    client.client = 1;
+    client.object = 1;
+    mdev.fd = SIM_FD;
+    mdev.res = &client;
+
+    mgr.events = rm_event_hub_create_fd(SIM_FD, eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+    mgr.start_event = rm_event_hub_add(mgr.events, 1, 1, NV0000_SET_NOTIFICATION, 2, 0);
+    mgr.bind_event = rm_event_hub_add(mgr.events, 1, 1, NV0000_SET_NOTIFICATION, 3, 0);
+    mgr.exit_fd = -1;
+
+    for (uint32_t i = 0; i < NUM_VGPUS; ++i)
+        vgpus.push_back(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+
+    gvm::VmEventSource source(scheduler, mgr, mdev);
+
+    scheduler.spawn(vm_accept(scheduler, source, NUM_VMS, vgpus, completed));
+
+    /* The starts arrive in bursts while the accepted VMs already wait for their vGPU. */
+    scheduler.spawn([](Scheduler& s, struct VmMgr& mgr, const std::vector<int>& vgpus) -> Task<> {
+        for (uint32_t i = 0; i < NUM_VMS; ++i) {
+            sim_fire(mgr.start_event);
+            if (i % 256 == 255)
+                co_await s.sleep_for(std::chrono::microseconds(100));
+        }
+
+        while (sim_starts < NUM_VMS)
+            co_await s.sleep_for(std::chrono::milliseconds(1));
+
+        sim_fire(mgr.bind_event);
+
+        for (int vgpu : vgpus)
+            signal_fd(vgpu);
+    }(scheduler, mgr, vgpus));
+
+    auto start = std::chrono::steady_clock::now();
+    bool ret = scheduler.run();
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+    cout << "\tVM lifecycles: " << completed << " ops in " << ms << " ms ("
+         << (ms > 0 ? completed * 1000 / ms : completed) << " ops/s) on one thread\n";
+
+    ret = ret && completed == NUM_VMS && sim_starts == NUM_VMS && scheduler.size() == 0;
+
+    free_nv_vm_events(&mgr);
+
+    for (int vgpu : vgpus)
+        close(vgpu);
+
+    return ret;
+}
+
+bool coro_teardown()
+{
+    size_t before = open_fds();
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    bool ret;
+
+    {
+        Scheduler scheduler;
+
+        scheduler.spawn([](Scheduler& s, int fd) -> Task<> {
+            co_await s.readable(fd);
+        }(scheduler, fd));
+
+        scheduler.spawn([](Scheduler& s) -> Task<> {
+            co_await s.sleep_for(std::chrono::hours(1));
+        }(scheduler));
+
+        scheduler.run_once(0);
+
+        ret = scheduler.size() == 2 && open_fds() == before + 3;
+    }
+
+    close(fd);
+
+    return ret && open_fds() == before;
+}
+
+int main()
+{
+    const uint32_t NUM_TESTS = 6;
+
+    const std::string test_names[] = {
+        "Task Chains",
+        "File Descriptor Waits",
+        "Process Exits",
+        "Delays",
+        "VM Lifecycles",
+        "Teardown"
+    };
+    const std::string test_details[] = {
+        "A nested task did not return its value to the awaiting coroutine.",
+        "The waiters of a file descriptor did not resume in order, or an unwatchable file waited.",
+        "The exit of a process did not resume the coroutine waiting for it.",
+        "A delay did not elapse, or the delays did not elapse concurrently.",
+        "A VM start was lost or a lifecycle did not finish.",
+        "A waiting coroutine or its file descriptors outlived the scheduler."
+    };
+
+    bool (*tests[])(void) = {
+        coro_tasks, coro_fds, coro_pids, coro_sleep, coro_vms, coro_teardown
+    };
+
+    rm_set_ioctl(sim_ioctl);
+
+    uint32_t failures = 0;
+
+    for (uint32_t i = 0; i < NUM_TESTS; ++i) {
+        bool test_result = tests[i]() == 1;
+
+        if (test_result)
+            cout << GREEN_COLOR << test_names[i]
+                 << " succeeded" RESET_COLOR "\n";
+        else {
+            ++failures;
+            cout << RED_COLOR << test_names[i]
+                 << ": " << test_details[i]
+                 << RESET_COLOR "\n";
+        }
+    }
+
+    rm_set_ioctl(NULL);
+
+    if (failures == 0)
+        cout << GREEN_COLOR << "All tests succeeded" RESET_COLOR "\n";
+    else
+        cout << RED_COLOR << failures << "/"
+             << NUM_TESTS << " tests failed" RESET_COLOR "\n";
+}
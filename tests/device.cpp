@@ -24,6 +24,11 @@
 
 #include <utils/colors.h>
 #include <utils/device.h>
+#include <utils/sysfs.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
 
 using std::cout;
 
@@ -38,6 +43,7 @@ using std::cout;
  * -# \ref dev-check - Determines if the system has a particular file.
  * -# \ref dev-major-null - Determines the major number for a known device.
  * -# \ref dev-major-ok - Determines the major number for a known device.
+ * -# \ref sysfs-read - Reads an attribute from a fixture sysfs root.
  * -# \ref nvidia-tests - Tests specifically designed for determine
  *                        Nvidia GPUs.
  *    -# \ref nvmode - Gets the parameter for DeviceFileMode
@@ -74,6 +80,15 @@ using std::cout;
  * get_major("mem") == 1
  * ```
  *
+ * \section sysfs-read Sysfs Attribute Read
+ *
+ * This test determines if a hexadecimal PCI attribute is read relative to an overridden sysfs root. The
+ * pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * set_sysfs_root(fixture), sysfs_read_u32(&id, "bus/pci/devices/%s/device", bdf) && id == 0x20B0
+ * ```
+ *
  * \section nvidia-tests Nvidia Specific Tests
  *
  * These tests are specifically designed to test the Nvidia device creations.
@@ -117,6 +132,54 @@ bool dev_major_ok()
     return get_major("mem") == 1;
 }
 
+bool sysfs_read()
+{
+    char root[] = "/tmp/gvm-sysfs-XXXXXX";
+    char path[1024];
+    uint32_t id = 0;
+
+    if (mkdtemp(root) == NULL)
+        return false;
+
+    set_sysfs_root(root);
+
+    sysfs_path(path, sizeof(path), "bus");
+    mkdir(path, 0755);
+    sysfs_path(path, sizeof(path), "bus/pci");
+    mkdir(path, 0755);
+    sysfs_path(path, sizeof(path), "bus/pci/devices");
+    mkdir(path, 0755);
+    sysfs_path(path, sizeof(path), "bus/pci/devices/0000:01:00.0");
+    mkdir(path, 0755);
+    sysfs_path(path, sizeof(path), "bus/pci/devices/0000:01:00.0/device");
+
+    FILE* out_file = fopen(path, "w");
+
+    if (out_file != NULL) {
+        fputs("0x20b0\n", out_file);
+        fclose(out_file);
+    }
+
+    bool ret = sysfs_read_u32(&id, "bus/pci/devices/%.4x:%.2x:%.2x.%x/device", 0, 1, 0, 0) &&
+               id == 0x20B0 &&
+               !sysfs_read_u32(&id, "bus/pci/devices/0000:02:00.0/device");
+
+    unlink(path);
+    sysfs_path(path, sizeof(path), "bus/pci/devices/0000:01:00.0");
+    rmdir(path);
+    sysfs_path(path, sizeof(path), "bus/pci/devices");
+    rmdir(path);
+    sysfs_path(path, sizeof(path), "bus/pci");
+    rmdir(path);
+    sysfs_path(path, sizeof(path), "bus");
+    rmdir(path);
+    rmdir(root);
+
+    set_sysfs_root(NULL);
+
+    return ret;
+}
+
 bool nvmode()
 {
     return get_param("/proc/driver/nvidia/params", "DeviceFileMode") == 438;
@@ -150,12 +213,13 @@ bool nvdev()
 
 int main()
 {
-    const uint32_t NUM_TESTS = 6;
+    const uint32_t NUM_TESTS = 7;
 
     const std::string test_names[] = {
         "Device Check Test",
         "Device Major Number Identifier Null",
         "Device Major Number Identifier",
+        "Sysfs Attribute Read",
         "DeviceFileMode Nvidia Check",
         "Open /dev/nvidiactl File",
         "Open /dev/nvidia0 File"
@@ -164,13 +228,14 @@ int main()
         "The device \"tty\" and \"/dev/tty\" do not exist on the system.",
         "The device major \"invalid-gvm\" is not equal to -1.",
         "The device major \"mem\" is not equal to 1.",
+        "The sysfs attribute was not read from the fixture root.",
         "The Nvidia Device File Mode is not equal to 438.",
         "Could not open nvidiactl file, try using sudo to run this test.",
         "Could not open nvidia0 file, try using sudo to run this test."
     };
 
     bool (*tests[])(void) = {
-        dev_check, dev_major_null, dev_major_ok, nvmode,
+        dev_check, dev_major_null, dev_major_ok, sysfs_read, nvmode,
         nvctl, nvdev
     };
 
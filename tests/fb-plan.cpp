@@ -0,0 +1,389 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <iostream>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+#include <unistd.h>
+
+#include <gpu/plan.h>
+
+#include <utils/colors.h>
+#include <utils/configs.h>
+
+using std::cout;
+
+namespace fs = std::filesystem;
+
+/*! \page fb-plan-test Framebuffer Plan Test
+ *
+ * \tableofcontents
+ *
+ * These tests check the planner of the framebuffer and BAR1 of mdev types, and the checks
+ * of configurations against the memory of their GPUs. The following tests are implemented:
+ *
+ * -# \ref plan-parse - Parses the GPU memory and the partition mixes.
+ * -# \ref plan-profile - Reproduces the shipped Ampere profile.
+ * -# \ref plan-packing - Gives every partition the largest aligned slice.
+ * -# \ref plan-validate - Reports the types which do not fit or waste memory.
+ * -# \ref plan-config - Writes a configuration the parser reads back.
+ * -# \ref plan-catalog - Checks a catalog as the GPUs would use it.
+ *
+ * \section plan-parse Parsing
+ *
+ * This test determines if the memory of a GPU model and a partition mix are parsed, and if
+ * malformed ones are refused. The pseudo-code that is executed to determine if this test is a
+ * success is:
+ *
+ * ```{.c}
+ * parse("0x20B0=40960:65536") && parse("0x1002:0x73BF=16384:256") && !parse("0x20B0=40960") &&
+ * parse_mix("1,2,4,8") == 4 && parse_mix("1,,2") == 0
+ * ```
+ *
+ * \section plan-profile Ampere Profile
+ *
+ * This test determines if the types planned for a 40 GB Ampere GPU are the ones of the shipped
+ * profile, and if the profile passes the checks. The pseudo-code that is executed to determine
+ * if this test is a success is:
+ *
+ * ```{.c}
+ * plan(40960, 1, 2, 4, 8) == Open_vAmpere.toml && validate(Open_vAmpere.toml).size == 0
+ * ```
+ *
+ * \section plan-packing Packing
+ *
+ * This test determines if the planned types fill the GPUs for many framebuffer sizes and
+ * partition counts, leaving less than an aligned slice per instance unused. The pseudo-code
+ * that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * for fb, n: fits(type) && unused < PLAN_FB_ALIGN * n && bar1 is a power of two <= its maximum
+ * ```
+ *
+ * \section plan-validate Validation
+ *
+ * This test determines if types which do not fit the framebuffer or the BAR1 of their GPU
+ * are errors, and if types wasting framebuffer are warnings. The pseudo-code that is executed
+ * to determine if this test is a success is:
+ *
+ * ```{.c}
+ * validate(fits) && !validate(fb too large) && !validate(bar1 too large) &&
+ * validate(small reservation) == warning && validate(unused framebuffer) == warning
+ * ```
+ *
+ * \section plan-config Configuration
+ *
+ * This test determines if a planned configuration is read back by the configuration parser
+ * with the planned values, and passes the checks. The pseudo-code that is executed to
+ * determine if this test is a success is:
+ *
+ * ```{.c}
+ * write(0x1E30, 1,3,10), get_configs() == planned && validate().size == 0
+ * ```
+ *
+ * \section plan-catalog Catalog
+ *
+ * This test determines if a catalog is checked with the configuration its GPUs would get, a
+ * generic one only for the GPUs no configuration targets. The pseudo-code that is executed
+ * to determine if this test is a success is:
+ *
+ * ```{.c}
+ * dir(a100.toml targeting 0x20B0, generic.toml needing 2560 MB of BAR1),
+ * validate(dir, 0x20B0 with 256 MB BAR1).size == 0 && validate(dir, unknown with 256 MB BAR1).errors == 1 &&
+ * validate(Nvidia, 0x20B0).size == 0
+ * ```
+ */
+
+bool plan_parse()
+{
+    struct GpuMemory memory;
+    uint32_t counts[4];
+
+    bool ret = plan_parse_memory("0x20B0=40960:65536", &memory) && memory.vendor_id == 0x10DE &&
+               memory.device_id == 0x20B0 && memory.fb_size == 40960 && memory.bar1_size == 65536;
+
+    ret = ret && plan_parse_memory("0x1002:0x73BF=16384:256", &memory) && memory.vendor_id == 0x1002 &&
+          memory.device_id == 0x73BF && memory.fb_size == 16384 && memory.bar1_size == 256;
+
+    for (const char* spec : { "0x20B0", "0x20B0=40960", "0x20B0=0:256", "0x20B0=40960:256x", "-1=1:1", "=1:1", "0x20B0:40960:256" })
+        ret = ret && !plan_parse_memory(spec, &memory);
+
+    ret = ret && plan_parse_mix("1,2,4,8", counts, 4) == 4 && counts[0] == 1 && counts[3] == 8 &&
+          plan_parse_mix("16", counts, 4) == 1 && counts[0] == 16;
+
+    for (const char* mix : { "", "1,,2", "0", "1,2,", "1,2,4,8,16", "a" })
+        ret = ret && plan_parse_mix(mix, counts, 4) == 0;
+
+    return ret;
+}
+
+bool plan_profile()
+{
+    struct GpuMemory memory = { 0x10DE, 0x20B0, 40960, 65536 };
+    struct GpuConfigs configs = get_configs("etc/gvm/user/Nvidia/Open_vAmpere.toml");
+    bool ret = configs.config_size == 1 && configs.configs[0].mdev_size == 4;
+
+    for (size_t i = 0; ret && i < configs.configs[0].mdev_size; ++i) {
+        const struct MDevRequest& request = configs.configs[0].requests[i];
+        struct PlanType type;
+
+        ret = plan_type(&memory, request.max_inst, &type) && type.fb_len == request.fb_len &&
+              type.fb_res == request.fb_res && type.bar1_len == request.bar1_len && type.fb_unused == 0;
+    }
+
+    struct PlanReport report = {};
+
+    ret = ret && plan_validate_configs(&memory, 1, &configs, &report) && report.size == 0;
+
+    plan_free_report(&report);
+    free_configs(&configs);
+
+    return ret;
+}
+
+bool plan_packing()
+{
+    bool ret = true;
+
+    for (uint32_t fb = 4096; ret && fb <= 98304; fb += 997) {
+        struct GpuMemory memory = { 0x10DE, 0x1234, fb, 16384 };
+
+        for (uint32_t n = 1; ret && n <= 32; ++n) {
+            struct PlanType type;
+
+            if (!plan_type(&memory, n, &type)) {
+                /* Only partitions smaller than their reservation are refused. */
+                ret = fb / n / PLAN_FB_ALIGN * PLAN_FB_ALIGN <= fb / n / 16 + 64 + PLAN_FB_ALIGN;
+                continue;
+            }
+
+            uint32_t slice = type.fb_len + type.fb_res;
+            uint32_t bar1_max = n == 1 ? PLAN_BAR1_MAX : PLAN_BAR1_SHARED_MAX;
+
+            ret = slice % PLAN_FB_ALIGN == 0 && slice * n + type.fb_unused == fb &&
+                  type.fb_unused < PLAN_FB_ALIGN * n && type.fb_res >= slice / 16 + 64 &&
+                  (type.bar1_len & (type.bar1_len - 1)) == 0 && type.bar1_len * n <= memory.bar1_size &&
+                  type.bar1_len >= PLAN_BAR1_MIN && type.bar1_len <= bar1_max;
+        }
+    }
+
+    struct GpuMemory small = { 0x10DE, 0x1234, 1024, 16384 };
+    struct GpuMemory narrow = { 0x10DE, 0x1234, 40960, 256 };
+    struct PlanType type;
+
+    return ret && !plan_type(&small, 32, &type) && !plan_type(&narrow, 8, &type) &&
+           plan_type(&narrow, 4, &type) && type.bar1_len == 64 && !plan_type(&small, 0, &type);
+}
+
+bool plan_validate_types()
+{
+    struct GpuMemory memory = { 0x10DE, 0x20B0, 40960, 8192 };
+    struct MDevRequest requests[6] = {};
+    const uint32_t values[6][5] = {
+        /* num, max_instances, fb_len, fb_res, bar1_len */
+        { 1, 4, 9536, 704, 0x400 },     // Fits exactly.
+        { 2, 4, 9600, 704, 0x400 },     // Needs 41216 MB of framebuffer.
+        { 3, 8, 4736, 384, 0x800 },     // Needs 16384 MB of BAR1.
+        { 4, 4, 9984, 256, 0x400 },     // Reserves less than planned.
+        { 5, 4, 8512, 704, 0x400 },     // Leaves 4096 MB unused.
+        { 6, 0, 9536, 704, 0x400 }      // Has no instance.
+    };
+
+    for (int i = 0; i < 6; ++i) {
+        requests[i].num = values[i][0];
+        requests[i].max_inst = values[i][1];
+        requests[i].fb_len = values[i][2];
+        requests[i].fb_res = values[i][3];
+        requests[i].bar1_len = values[i][4];
+    }
+
+    struct PlanReport report = {};
+    bool ret = plan_validate(&memory, requests, 1, &report) && report.size == 0;
+
+    ret = ret && !plan_validate(&memory, requests + 1, 1, &report) && report.size == 1 &&
+          report.issues[0].severity == PLAN_ERROR && report.issues[0].num == 2;
+
+    ret = ret && !plan_validate(&memory, requests + 2, 1, &report) && report.size == 2 &&
+          report.issues[1].severity == PLAN_ERROR && report.issues[1].num == 3;
+
+    ret = ret && plan_validate(&memory, requests + 3, 2, &report) && report.size == 4 &&
+          report.errors == 2 && report.issues[2].severity == PLAN_WARNING && report.issues[2].num == 4 &&
+          report.issues[3].severity == PLAN_WARNING && report.issues[3].num == 5;
+
+    ret = ret && !plan_validate(&memory, requests + 5, 1, &report) && report.errors == 3;
+
+    plan_free_report(&report);
+
+    return ret && report.issues == NULL && report.size == 0;
+}
+
+bool plan_config()
+{
+    char path[] = "/tmp/gvm-plan-XXXXXX";
+    int fd = mkstemp(path);
+
+    if (fd == -1)
+        return false;
+
+    struct GpuMemory memory = { 0x10DE, 0x1E30, 24576, 8192 };
+    struct GpuMemory other = { 0x10DE, 0x20B0, 1024, 256 };
+    const uint32_t counts[] = { 1, 3, 10 };
+    FILE* out = fdopen(fd, "w");
+    bool ret = out != NULL && plan_write_config(out, &memory, counts, 3, 600);
+
+    if (out != NULL)
+        fclose(out);
+
+    struct GpuConfigs configs = get_configs(path);
+
+    ret = ret && configs.config_size == 1 && configs.configs[0].mdev_size == 3 &&
+          configs.configs[0].gpu_size == 1 && configs.configs[0].gpus[0].device_id == 0x1E30 &&
+          configs.configs[0].gpus[0].vendor_id == 0x10DE;
+
+    for (size_t i = 0; ret && i < 3; ++i) {
+        const struct MDevRequest& request = configs.configs[0].requests[i];
+        struct PlanType type;
+
+        ret = plan_type(&memory, counts[i], &type) && request.num == 600 + i &&
+              request.max_inst == counts[i] && request.fb_len == type.fb_len &&
+              request.fb_res == type.fb_res && request.bar1_len == type.bar1_len;
+    }
+
+    struct PlanReport report = {};
+    const struct GpuMemory memories[] = { memory, other };
+
+    /* The configuration only targets its own model. */
+    ret = ret && plan_validate_configs(memories, 2, &configs, &report) && report.size == 0;
+
+    const uint32_t too_many[] = { 1, 512 };
+
+    ret = ret && !plan_write_config(stdout, &memory, too_many, 2, 1);
+
+    plan_free_report(&report);
+    free_configs(&configs);
+    unlink(path);
+
+    return ret;
+}
+
+bool plan_catalog()
+{
+    char root[] = "/tmp/gvm-plan-catalog-XXXXXX";
+
+    if (mkdtemp(root) == NULL)
+        return false;
+
+    std::ofstream(std::string(root) + "/a100.toml") <<
+        "[[config]]\n"
+        "    [[config.gpu_config]]\n"
+        "    vendor_id = 0x10DE\n"
+        "    device_id = 0x20B0\n"
+        "    [[config.request]]\n"
+        "    num = 529\n"
+        "    max_instances = 1\n"
+        "    fb_len = 38336\n"
+        "    fb_res = 2624\n"
+        "    bar1_len = 0x100\n";
+    std::ofstream(std::string(root) + "/generic.toml") <<
+        "[[config]]\n"
+        "    [[config.gpu_config]]\n"
+        "    vendor_id = 0x10DE\n"
+        "    [[config.request]]\n"
+        "    num = 1\n"
+        "    max_instances = 10\n"
+        "    fb_len = 896\n"
+        "    fb_res = 128\n"
+        "    bar1_len = 0x100\n";
+
+    struct ConfigCatalog catalog = get_config_catalog(root);
+    struct GpuMemory ampere = { 0x10DE, 0x20B0, 40960, 256 };
+    struct GpuMemory unknown = { 0x10DE, 0x2236, 10240, 256 };
+    struct PlanReport report = {};
+
+    /* The generic profile does not fit the BAR1, but the A100 never gets it. */
+    bool ret = catalog.file_size == 2 && plan_validate_catalog(&ampere, 1, &catalog, &report) && report.size == 0;
+
+    ret = ret && !plan_validate_catalog(&unknown, 1, &catalog, &report) && report.size == 1 &&
+          report.errors == 1 && report.issues[0].num == 1;
+
+    plan_free_report(&report);
+    free_config_catalog(&catalog);
+    fs::remove_all(root);
+
+    /* An A100 only gets the shipped Ampere profile, which fills it exactly. */
+    struct ConfigCatalog shipped = get_config_catalog("etc/gvm/user/Nvidia");
+
+    ampere.bar1_size = 65536;
+    ret = ret && plan_validate_catalog(&ampere, 1, &shipped, &report) && report.size == 0;
+
+    plan_free_report(&report);
+    free_config_catalog(&shipped);
+
+    return ret;
+}
+
+int main()
+{
+    const uint32_t NUM_TESTS = 6;
+
+    const std::string test_names[] = {
+        "Parsing",
+        "Ampere Profile",
+        "Packing",
+        "Validation",
+        "Configuration",
+        "Catalog"
+    };
+    const std::string test_details[] = {
+        "A GPU memory or a mix was parsed wrong, or a malformed one was accepted.",
+        "The planned types differ from the shipped profile, or the profile failed the checks.",
+        "A planned type overflows its GPU or leaves an aligned slice per instance unused.",
+        "A type was reported with the wrong severity, or not reported.",
+        "The written configuration was not read back with the planned values.",
+        "A catalog was checked with configurations its GPUs would not use."
+    };
+
+    bool (*tests[])(void) = {
+        plan_parse, plan_profile, plan_packing, plan_validate_types, plan_config, plan_catalog
+    };
+
+    uint32_t failures = 0;
+
+    for (uint32_t i = 0; i < NUM_TESTS; ++i) {
+        bool test_result = tests[i]() == 1;
+
+        if (test_result)
+            cout << GREEN_COLOR << test_names[i]
+                 << " succeeded" RESET_COLOR "\n";
+        else {
+            ++failures;
+            cout << RED_COLOR << test_names[i]
+                 << ": " << test_details[i]
+                 << RESET_COLOR "\n";
+        }
+    }
+
+    if (failures == 0)
+        cout << GREEN_COLOR << "All tests succeeded" RESET_COLOR "\n";
+    else
+        cout << RED_COLOR << failures << "/"
+             << NUM_TESTS << " tests failed" RESET_COLOR "\n";
+}
@@ -0,0 +1,300 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <gpu/nvidia/device.h>
+
+#include <gvm/gvm.h>
+
+#include <utils/colors.h>
+
+#include "sim-rm.hpp"
+
+using std::cout;
+
+/*! \page gvm-api-test Embedding API Test
+ *
+ * \tableofcontents
+ *
+ * These tests check the embedding API of libgvm without a GPU. They are run from the root of the repository, where
+ * the shared library is built into bin. The following tests are implemented:
+ *
+ * -# \ref api-version - Reports the version of the API.
+ * -# \ref api-invalid - Rejects a missing context.
+ * -# \ref api-exports - Exports only the embedding API from the shared library.
+ * -# \ref api-context - Drives a context over a simulated RM Core.
+ *
+ * \section api-version API Version
+ *
+ * This test determines if the library implements the API of its header. The pseudo-code that is executed to
+ * determine if this test is a success is:
+ *
+ * ```{.c}
+ * gvm_api_version() == GVM_API_VERSION
+ * ```
+ *
+ * \section api-invalid API Invalid Context
+ *
+ * This test determines if every call handles a missing context. The pseudo-code that is executed to determine if
+ * this test is a success is:
+ *
+ * ```{.c}
+ * gvm_gpu_count(NULL) == 0 && gvm_gpu_info(NULL, 0, &info) == GVM_ERR_INVALID &&
+ * gvm_provision(NULL, "") == GVM_ERR_INVALID && gvm_dispatch(NULL, 0) == GVM_ERR_INVALID
+ * ```
+ *
+ * \section api-exports API Exports
+ *
+ * This test determines if the shared library hides its internal symbols. The pseudo-code that is executed to
+ * determine if this test is a success is:
+ *
+ * ```{.c}
+ * lib = dlopen("bin/libgvm.so.0"), dlsym(lib, "gvm_open") != NULL && dlsym(lib, "gvm_pool_take") != NULL &&
+ * dlsym(lib, "rm_alloc_res") == NULL
+ * ```
+ *
+ * \section api-context API Context
+ *
+ * This test determines if a context reports PCI domains beyond 16 bits, rejects a configuration
+ * missing a required key without exiting, keeps no instance ready before the types exist,
+ * registers its mdev types once, reports only the queued events it could handle and reports an
+ * interrupted wait. The ioctls are routed to a simulated RM Core through rm_set_ioctl and the
+ * NVIDIA devices are opened as eventfds through nv_set_open_dev. The pseudo-code that is
+ * executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * ctx = gvm_open(0), gvm_gpu_info(ctx, 0, &info) == GVM_OK && info.domain == 0x10000,
+ * gvm_provision(ctx, config without fb_len) == GVM_ERR_INVALID,
+ * gvm_pool_set(ctx, 0) == GVM_ERR_STATE && gvm_pool_take(ctx, 0) == GVM_ERR_NOT_FOUND,
+ * gvm_register(ctx) == GVM_OK && gvm_register(ctx) == GVM_ERR_STATE,
+ * gvm_pool_set(ctx, 2) == GVM_ERR_NOT_FOUND,
+ * gvm_subscribe(ctx, callback, NULL) == GVM_OK, fire(start), fire(bind),
+ * gvm_dispatch(ctx, 1 s) == 1 && dispatched == (GVM_EVENT_VM_BIND), alarm(10 ms),
+ * gvm_dispatch(ctx, 1 s) == -EINTR
+ * ```
+ */
+
+//! PCI domain of the simulated GPUs, beyond 16 bits as behind a VMD controller.
+static const uint32_t SIM_DOMAIN = 0x10000;
+
+//! Types of the events without a VM received by the subscriber.
+static std::vector<uint32_t> sim_dispatched;
+
+/*! \brief Issues an ioctl on the simulated RM Core, whose GPUs are in SIM_DOMAIN and which has no
+ * VM start request pending.
+ */
+int sim_ioctl(int fd, unsigned long request, void* data)
+{
+    int ret = sim_rm_ioctl(fd, request, data);
+    struct RmControlRes* ctrl = (struct RmControlRes*) data;
+
+    if (ret == 0 && request == NV_CONTROL_RES && ctrl->cmd == NV0000_GET_PCI_INFO)
+        ((struct Nv0000CtrlGpuGetPciInfoParams*) ctrl->params)->domain = SIM_DOMAIN;
+
+    if (ret == 0 && request == NV_CONTROL_RES && ctrl->cmd == 0x00000C01)
+        ctrl->status = SIM_ERROR;
+
+    return ret;
+}
+
+/*! \brief Opens a NVIDIA device, an eventfd standing in for it. */
+static int sim_open_dev(uint16_t minor)
+{
+    (void) minor;
+
+    return eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+/*! \brief Interrupts a wait, without restarting it. */
+static void sim_alarm(int)
+{
+}
+
+/*! \brief Receives the events of the context. */
+static void sim_callback(const struct GvmEvent* event, void*)
+{
+    /* A bind names no VM, a record of another size or with a VM is not a bind. */
+    if (event->size == sizeof(struct GvmEvent) && event->mdev[0] == '\0' && event->qemu_pid == 0)
+        sim_dispatched.push_back(event->type);
+}
+
+bool api_version()
+{
+    return gvm_api_version() == GVM_API_VERSION;
+}
+
+bool api_invalid()
+{
+    struct GvmGpuInfo info = {};
+
+    info.size = sizeof(info);
+    gvm_close(NULL);
+
+    return gvm_gpu_count(NULL) == 0 &&
+           gvm_gpu_info(NULL, 0, &info) == GVM_ERR_INVALID &&
+           gvm_provision(NULL, "") == GVM_ERR_INVALID &&
+           gvm_register(NULL) == GVM_ERR_INVALID &&
+           gvm_subscribe(NULL, NULL, NULL) == GVM_ERR_INVALID &&
+           gvm_dispatch(NULL, 0) == GVM_ERR_INVALID;
+}
+
+bool api_exports()
+{
+    void* lib = dlopen("bin/libgvm.so.0", RTLD_NOW | RTLD_LOCAL);
+
+    if (lib == NULL)
+        return false;
+
+    auto version = (uint32_t (*)(void)) dlsym(lib, "gvm_api_version");
+    bool ret = version != NULL && version() == GVM_API_VERSION &&
+               dlsym(lib, "gvm_open") != NULL && dlsym(lib, "gvm_dispatch") != NULL &&
+               dlsym(lib, "gvm_pool_take") != NULL &&
+               dlsym(lib, "rm_alloc_res") == NULL && dlsym(lib, "create_nv_mgr") == NULL;
+
+    dlclose(lib);
+
+    return ret;
+}
+
+bool api_context()
+{
+    struct GvmGpuInfo info = {};
+    struct sigaction action = {};
+    struct itimerval timer = {};
+
+    sim_reset();
+    sim_probed = {0x100, 0x200};
+    sim_any_fd = true;
+    rm_set_ioctl(sim_ioctl);
+    nv_set_open_dev(sim_open_dev);
+
+    struct GvmContext* ctx = gvm_open(0);
+
+    info.size = sizeof(info);
+
+    bool ret = ctx != NULL && gvm_gpu_count(ctx) == 2 && gvm_gpu_info(ctx, 1, &info) == GVM_OK;
+
+    ret = ret && info.id == 0x200 && info.domain == SIM_DOMAIN && info.bus == 0x2;
+
+    /* A bad file from the caller is an error, it must not end the process embedding the library. */
+    char invalid[] = "/tmp/gvm-api-XXXXXX";
+    int invalid_fd = mkstemp(invalid);
+
+    if (invalid_fd != -1) {
+        std::ofstream(invalid) << "[[config]]\n    [[config.request]]\n    num = 1\n    max_instances = 1\n";
+        close(invalid_fd);
+    }
+
+    ret = ret && invalid_fd != -1 && gvm_provision(ctx, invalid) == GVM_ERR_INVALID;
+
+    if (invalid_fd != -1)
+        unlink(invalid);
+
+    /* Instances are only kept ready once the types exist, nothing is ready to take before. */
+    char uuid[GVM_UUID_SIZE];
+
+    ret = ret && gvm_pool_set(ctx, 0, "nvidia-63", 2) == GVM_ERR_STATE;
+    ret = ret && gvm_pool_take(ctx, 0, "nvidia-63", uuid) == GVM_ERR_NOT_FOUND;
+    ret = ret && gvm_pool_take(ctx, 2, "nvidia-63", uuid) == GVM_ERR_NOT_FOUND;
+
+    ret = ret && gvm_register(ctx) == GVM_OK && gvm_register(ctx) == GVM_ERR_STATE;
+    ret = ret && gvm_pool_set(ctx, 2, "nvidia-63", 2) == GVM_ERR_NOT_FOUND;
+    ret = ret && gvm_pool_set(ctx, 0, "", 2) == GVM_ERR_INVALID;
+    ret = ret && gvm_provision(ctx, "etc/gvm/user") == GVM_ERR_STATE;
+    ret = ret && gvm_subscribe(ctx, sim_callback, NULL) == GVM_OK && sim_os_events.size() == 1;
+
+    /* The start and the bind are both queued, but the RM has no start pending. */
+    std::vector<uint32_t> handles;
+
+    for (const auto& event : sim_events)
+        handles.push_back(event.first);
+
+    for (uint32_t handle : handles)
+        sim_fire(handle);
+
+    ret = ret && gvm_dispatch(ctx, 1000) == 1 && sim_dispatched == std::vector<uint32_t>{GVM_EVENT_VM_BIND};
+
+    action.sa_handler = sim_alarm;
+    sigaction(SIGALRM, &action, NULL);
+    timer.it_value.tv_usec = 10000;
+    setitimer(ITIMER_REAL, &timer, NULL);
+
+    ret = ret && gvm_dispatch(ctx, 1000) == -EINTR;
+
+    gvm_close(ctx);
+
+    nv_set_open_dev(NULL);
+    rm_set_ioctl(NULL);
+
+    return ret && sim_live == 0;
+}
+
+int main()
+{
+    const uint32_t NUM_TESTS = 4;
+
+    const std::string test_names[] = {
+        "API Version",
+        "API Invalid Context",
+        "API Exports",
+        "API Context"
+    };
+    const std::string test_details[] = {
+        "The library does not implement the API version of its header.",
+        "A call did not reject the missing context.",
+        "bin/libgvm.so.0 is missing or exports internal symbols.",
+        "The context truncated the PCI domain, accepted a bad configuration or pool, registered twice or lost an interrupted wait."
+    };
+
+    bool (*tests[])(void) = {
+        api_version, api_invalid, api_exports, api_context
+    };
+
+    uint32_t failures = 0;
+
+    for (uint32_t i = 0; i < NUM_TESTS; ++i) {
+        bool test_result = tests[i]() == 1;
+
+        if (test_result)
+            cout << GREEN_COLOR << test_names[i]
+                 << " succeeded" RESET_COLOR "\n";
+        else {
+            ++failures;
+            cout << RED_COLOR << test_names[i]
+                 << ": " << test_details[i]
+                 << RESET_COLOR "\n";
+        }
+    }
+
+    if (failures == 0)
+        cout << GREEN_COLOR << "All tests succeeded" RESET_COLOR "\n";
+    else
+        cout << RED_COLOR << failures << "/"
+             << NUM_TESTS << " tests failed" RESET_COLOR "\n";
+}
@@ -0,0 +1,386 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gvm/provision.h>
+
+#include <utils/colors.h>
+#include <utils/sysfs.h>
+#include <utils/uuid.h>
+
+#include "sysfs-fixture.hpp"
+
+using std::cout;
+
+namespace fs = std::filesystem;
+
+/*! \page mdev-provision-test Mdev Provisioning Test
+ *
+ * \tableofcontents
+ *
+ * These tests check the bulk provisioning of mdev instances. The GPUs are a sysfs fixture set
+ * with set_sysfs_root, where the create attribute of every type is a FIFO read by a thread
+ * standing in for the driver. The driver only starts reading after a delay, so every create
+ * written before lasts as long as the delay. The following tests are implemented:
+ *
+ * -# \ref provision-parse - Parses the provisioning requests.
+ * -# \ref provision-parallel - Fills a host with 64 instances.
+ * -# \ref provision-idempotence - Provisions the same host again.
+ * -# \ref provision-shortfall - Requests more instances than the GPUs have room for.
+ *
+ * \section provision-parse Request Parsing
+ *
+ * This test determines if the requests are parsed from their TYPE=COUNT[@GPUS] form. The
+ * pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * parse("nvidia-63=8") && parse("nvidia-63=8@0000:01:00.0,0000:02:00.0") && !parse("nvidia-63")
+ * ```
+ *
+ * \section provision-parallel Parallel Creates
+ *
+ * This test determines if the creates of 64 instances over 4 GPUs run at once, taking about as
+ * long as a single create. The pseudo-code that is executed to determine if this test is a
+ * success is:
+ *
+ * ```{.c}
+ * provision(nvidia-63=64), created == 64 && 16 per GPU && max_in_flight == 64 &&
+ * elapsed < 4 * delay
+ * ```
+ *
+ * \section provision-idempotence Idempotence
+ *
+ * This test determines if provisioning counts the existing instances, creating only the
+ * missing ones on the GPUs with the fewest. The pseudo-code that is executed to determine if
+ * this test is a success is:
+ *
+ * ```{.c}
+ * provision(nvidia-63=8), provision(nvidia-63=8) creates 0,
+ * provision(nvidia-63=10@gpu1,gpu2) creates 2 on gpu2
+ * ```
+ *
+ * \section provision-shortfall Shortfall
+ *
+ * This test determines if the instances the GPUs have no room for are reported, and if
+ * malformed GPU lists are refused. The pseudo-code that is executed to determine if this test
+ * is a success is:
+ *
+ * ```{.c}
+ * provision(nvidia-63=30@gpu1,gpu5) == 20 created + 10 shortfall, !provision(@gpu1,,gpu2)
+ * ```
+ */
+
+//! Number of GPUs of the fixture supporting the type.
+static const uint32_t SIM_GPUS = 4;
+
+//! Instances every GPU can create.
+static const uint32_t SIM_AVAILABLE = 20;
+
+/*! \brief Sysfs tree created for the tests.
+ *
+ * GPUs 0000:01:00.0 to 0000:04:00.0 support nvidia-63, 0000:05:00.0 supports mediated
+ * devices but not the type. A driver thread per GPU reads the creates of the type once the
+ * delay passed and lists every created instance in the devices directory of the type.
+ */
+class ProvisionFixture : public SysfsFixture {
+public:
+    ProvisionFixture(std::chrono::milliseconds delay) : SysfsFixture("provision")
+    {
+        if (!SysfsFixture::valid())
+            return;
+
+        for (uint32_t i = 1; i <= SIM_GPUS + 1; ++i) {
+            fs::create_directories(this->path("class/mdev_bus/" + bdf(i)));
+            fs::create_directories(this->path("bus/pci/devices/" + bdf(i) + "/mdev_supported_types"));
+        }
+
+        for (uint32_t i = 1; i <= SIM_GPUS; ++i) {
+            std::string type = this->type_path(i);
+
+            fs::create_directories(type + "/devices");
+            std::ofstream(type + "/available_instances") << SIM_AVAILABLE << "\n";
+
+            if (mkfifo((type + "/create").c_str(), 0600) == -1)
+                return;
+
+            this->drivers.emplace_back(&ProvisionFixture::drive, this, type, delay);
+        }
+    }
+
+    ~ProvisionFixture()
+    {
+        this->stop = true;
+
+        for (std::thread& driver : this->drivers)
+            driver.join();
+    }
+
+    bool valid() const
+    {
+        return SysfsFixture::valid() && this->drivers.size() == SIM_GPUS;
+    }
+
+    /*! \brief Gets the PCI address of a GPU. */
+    static std::string bdf(uint32_t gpu)
+    {
+        return "0000:0" + std::to_string(gpu) + ":00.0";
+    }
+
+    /*! \brief Counts the instances listed by the driver of a GPU. */
+    uint32_t instances(uint32_t gpu) const
+    {
+        uint32_t ret = 0;
+
+        for (auto& entry : fs::directory_iterator(this->type_path(gpu) + "/devices")) {
+            (void) entry;
+            ++ret;
+        }
+
+        return ret;
+    }
+
+    /*! \brief Waits for the driver to list a number of instances over every GPU. */
+    bool wait_instances(uint32_t count) const
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+
+        while (std::chrono::steady_clock::now() < deadline) {
+            uint32_t total = 0;
+
+            for (uint32_t i = 1; i <= SIM_GPUS; ++i)
+                total += this->instances(i);
+
+            if (total == count)
+                return true;
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        return false;
+    }
+
+private:
+    /*! \brief Gets the path of the type of a GPU. */
+    std::string type_path(uint32_t gpu) const
+    {
+        return this->path("bus/pci/devices/" + bdf(gpu) + "/mdev_supported_types/nvidia-63");
+    }
+
+    /*! \brief Reads the creates of a type, listing the created instances.
+     *
+     * The FIFO stays open for reading until the fixture is destroyed, a create never writes to
+     * a closed FIFO.
+     */
+    void drive(std::string type, std::chrono::milliseconds delay)
+    {
+        std::this_thread::sleep_for(delay);
+
+        int fd = open((type + "/create").c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        std::string pending;
+
+        while (fd != -1 && !this->stop) {
+            struct pollfd waiter = {fd, POLLIN, 0};
+            char buffer[UUID_STR_LEN * 16];
+
+            poll(&waiter, 1, 10);
+
+            ssize_t size = read(fd, buffer, sizeof(buffer));
+
+            /* Without writers the FIFO stays readable, it is only polled again later. */
+            if (size <= 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+
+            pending.append(buffer, size);
+
+            for (; pending.size() >= UUID_STR_LEN; pending.erase(0, UUID_STR_LEN))
+                fs::create_directory(type + "/devices/" + pending.substr(0, UUID_STR_LEN));
+        }
+
+        if (fd != -1)
+            close(fd);
+    }
+
+    std::vector<std::thread> drivers;   //!< Driver threads, one per GPU with the type.
+    std::atomic<bool> stop = false;     //!< If the drivers must exit.
+};
+
+/*! \brief Provisions a single request. */
+static bool provision(const char* spec, uint32_t max_parallel, struct ProvisionReport* report)
+{
+    struct ProvisionRequest request;
+
+    return provision_parse(spec, &request) && provision_mdevs(&request, 1, max_parallel, report);
+}
+
+bool provision_parse_requests()
+{
+    struct ProvisionRequest request;
+
+    bool ret = provision_parse("nvidia-63=8", &request) && strcmp(request.type, "nvidia-63") == 0 &&
+               request.count == 8 && request.gpus == NULL;
+
+    ret = ret && provision_parse("nvidia-63=0x10@0000:01:00.0,0000:02:00.0", &request) &&
+          request.count == 16 && strcmp(request.gpus, "0000:01:00.0,0000:02:00.0") == 0;
+
+    return ret && provision_parse("nvidia-63=1@all", &request) && strcmp(request.gpus, "all") == 0 &&
+           !provision_parse("nvidia-63", &request) &&
+           !provision_parse("=8", &request) &&
+           !provision_parse("nvidia-63=", &request) &&
+           !provision_parse("nvidia-63=8@", &request) &&
+           !provision_parse("nvidia-63=eight", &request) &&
+           !provision_parse("nvidia-63-with-a-name-that-is-too-long=8", &request);
+}
+
+bool provision_parallel()
+{
+    const auto DELAY = std::chrono::milliseconds(100);
+
+    ProvisionFixture fixture(DELAY);
+    struct ProvisionReport report;
+
+    if (!fixture.valid() || !provision("nvidia-63=64", 0, &report))
+        return false;
+
+    auto elapsed = std::chrono::nanoseconds(report.elapsed_ns);
+
+    cout << "\tProvisioning: " << report.created << " ops in " << report.elapsed_ns / 1000000 << " ms ("
+         << report.created * 1000000000ULL / (report.elapsed_ns != 0 ? report.elapsed_ns : 1)
+         << " ops/s), slowest create " << report.slowest_ns / 1000000 << " ms, "
+         << report.max_in_flight << " at once\n";
+
+    bool ret = report.created == 64 && report.failed == 0 && report.shortfall == 0 && report.existing == 0 &&
+               report.parent_count == SIM_GPUS && report.max_in_flight == 64 &&
+               elapsed >= DELAY && elapsed < 4 * DELAY && fixture.wait_instances(64);
+
+    for (uint32_t i = 0; ret && i < report.parent_count; ++i)
+        ret = report.parents[i].created == 16 && fixture.instances(i + 1) == 16;
+
+    provision_free_report(&report);
+
+    return ret;
+}
+
+bool provision_idempotence()
+{
+    ProvisionFixture fixture(std::chrono::milliseconds(0));
+    struct ProvisionReport report;
+    struct ProvisionReport again;
+    struct ProvisionReport more;
+
+    if (!fixture.valid() || !provision("nvidia-63=8", 1, &report))
+        return false;
+
+    bool ret = report.created == 8 && report.max_in_flight == 1 && fixture.wait_instances(8) &&
+               provision("nvidia-63=8", 0, &again) && again.created == 0 && again.result_count == 0 &&
+               again.existing == 8;
+
+    /* GPU 1 has 2 instances and GPU 2 has 2, a new request tops up both. */
+    std::string spec = "nvidia-63=6@" + ProvisionFixture::bdf(1) + "," + ProvisionFixture::bdf(2);
+
+    ret = ret && provision(spec.c_str(), 0, &more) && more.created == 2 && more.existing == 4 &&
+          more.parents[0].created == 1 && more.parents[1].created == 1 && fixture.wait_instances(10) &&
+          fixture.instances(1) == 3 && fixture.instances(2) == 3;
+
+    provision_free_report(&report);
+    provision_free_report(&again);
+    provision_free_report(&more);
+
+    return ret;
+}
+
+bool provision_shortfall()
+{
+    ProvisionFixture fixture(std::chrono::milliseconds(0));
+    struct ProvisionReport report;
+    struct ProvisionReport malformed;
+
+    std::string spec = "nvidia-63=30@" + ProvisionFixture::bdf(1) + "," + ProvisionFixture::bdf(5);
+    std::string bad = "nvidia-63=2@" + ProvisionFixture::bdf(1) + ",," + ProvisionFixture::bdf(2);
+
+    if (!fixture.valid() || !provision(spec.c_str(), 0, &report))
+        return false;
+
+    bool ret = report.created == SIM_AVAILABLE && report.shortfall == 30 - SIM_AVAILABLE &&
+               report.parent_count == 2 && report.parents[1].available == 0 &&
+               fixture.wait_instances(SIM_AVAILABLE) && !provision(bad.c_str(), 0, &malformed) &&
+               malformed.result_count == 0 && malformed.results == NULL;
+
+    provision_free_report(&report);
+
+    return ret;
+}
+
+int main()
+{
+    const uint32_t NUM_TESTS = 4;
+
+    const std::string test_names[] = {
+        "Request Parsing",
+        "Parallel Creates",
+        "Idempotence",
+        "Shortfall"
+    };
+    const std::string test_details[] = {
+        "A request was parsed wrong or a malformed one was accepted.",
+        "The creates did not run at once, or were not spread over the GPUs.",
+        "Existing instances were created again, or the new ones not spread by need.",
+        "The instances without room were not reported, or a malformed GPU list was accepted."
+    };
+
+    bool (*tests[])(void) = {
+        provision_parse_requests, provision_parallel, provision_idempotence, provision_shortfall
+    };
+
+    uint32_t failures = 0;
+
+    for (uint32_t i = 0; i < NUM_TESTS; ++i) {
+        bool test_result = tests[i]() == 1;
+
+        if (test_result)
+            cout << GREEN_COLOR << test_names[i]
+                 << " succeeded" RESET_COLOR "\n";
+        else {
+            ++failures;
+            cout << RED_COLOR << test_names[i]
+                 << ": " << test_details[i]
+                 << RESET_COLOR "\n";
+        }
+    }
+
+    if (failures == 0)
+        cout << GREEN_COLOR << "All tests succeeded" RESET_COLOR "\n";
+    else
+        cout << RED_COLOR << failures << "/"
+             << NUM_TESTS << " tests failed" RESET_COLOR "\n";
+}
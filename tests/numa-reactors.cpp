@@ -0,0 +1,410 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <iostream>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <gpu/nvidia/manager.h>
+#include <gpu/nvidia/resman/api.h>
+#include <gpu/nvidia/resman/classes.h>
+#include <gpu/nvidia/resman/ioctl.h>
+
+#include <gvm/nvidia/reactors.h>
+
+#include <utils/colors.h>
+#include <utils/epoch.h>
+#include <utils/reactor.h>
+#include <utils/sysfs.h>
+#include <utils/topology.h>
+
+#include "sim-rm.hpp"
+#include "sysfs-fixture.hpp"
+
+using std::cout;
+
+/*! \page numa-reactors-test NUMA Reactors Test
+ *
+ * \tableofcontents
+ *
+ * These tests check how the GPUs are mapped to NUMA nodes and served by pinned reactor
+ * threads. The topology is read from a sysfs fixture set with set_sysfs_root and the ioctls
+ * are routed to a simulated RM Core, so they run without a GPU or a NUMA machine. The
+ * following tests are implemented:
+ *
+ * -# \ref cpulist-parse - Parses sysfs CPU lists.
+ * -# \ref pci-topology - Reads the NUMA node and local CPUs of PCI devices.
+ * -# \ref reactor-tasks - Runs tasks on a pinned reactor.
+ * -# \ref reactor-fds - Calls the handler of a watched file descriptor.
+ * -# \ref gpu-reactors - Groups the GPUs of a manager on reactors.
+ *
+ * \section cpulist-parse CPU List Parsing
+ *
+ * This test determines if CPU lists are parsed and if malformed ones are rejected. The
+ * pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * cpulist_parse("0-3,8,10-11\n", &set) && cpuset_count(&set) == 7 &&
+ * !cpulist_parse("3-1", &set) && !cpulist_parse("1,x", &set) && !cpulist_parse("4096", &set)
+ * ```
+ *
+ * \section pci-topology PCI Topology
+ *
+ * This test determines if the NUMA node and the local CPUs of a PCI device are read from
+ * sysfs. The pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * pci_numa_node(0, 3, 0, 0) == 1 && pci_local_cpus(0, 3, 0, 0, &set) &&
+ * pci_numa_node(0, 9, 0, 0) == -1 && !numa_node_cpus(7, &set)
+ * ```
+ *
+ * \section reactor-tasks Reactor Tasks
+ *
+ * This test determines if the tasks of a reactor run in order, on its thread and on the CPU it
+ * is pinned to. The pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * reactor = reactor_create(0, {cpu}), reactor_post(record) * 64, reactor_call(record),
+ * order == 0..64 && thread != main && sched_getcpu() == cpu
+ * ```
+ *
+ * \section reactor-fds Reactor File Descriptors
+ *
+ * This test determines if the handler of a watched file descriptor is called on the reactor
+ * and never after it is removed. The pseudo-code that is executed to determine if this test is
+ * a success is:
+ *
+ * ```{.c}
+ * reactor_add_fd(reactor, eventfd, EPOLLIN, handler), write(eventfd), calls == 1,
+ * reactor_remove_fd(reactor, eventfd), write(eventfd), calls == 1
+ * ```
+ *
+ * \section gpu-reactors GPU Reactors
+ *
+ * This test determines if the GPUs of a manager share the reactor of their NUMA node, or get
+ * their own one. The pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * nodes(0x100, 0x200, 0x300) == (0, 0, 1), create_nv_reactors(node).size == 2 &&
+ * for_gpu(0x100) == for_gpu(0x200) != for_gpu(0x300), create_nv_reactors(gpu).size == 3
+ * ```
+ */
+
+/*! \brief Sysfs tree created for the tests.
+ *
+ * GPUs on buses 1 and 2 are on node 0, the GPU on bus 3 is on node 1. Every node holds the
+ * first CPU the tests may run on, so pinning succeeds on any machine.
+ */
+class NumaFixture : public SysfsFixture {
+public:
+    NumaFixture(uint32_t cpu) : SysfsFixture("numa")
+    {
+        std::string cpus = std::to_string(cpu) + "\n";
+
+        this->write("bus/pci/devices/0000:01:00.0/numa_node", "0\n");
+        this->write("bus/pci/devices/0000:02:00.0/numa_node", "0\n");
+        this->write("bus/pci/devices/0000:03:00.0/numa_node", "1\n");
+        this->write("bus/pci/devices/0000:03:00.0/local_cpulist", cpus);
+        this->write("bus/pci/devices/0000:09:00.0/numa_node", "-1\n");
+        this->write("devices/system/node/node0/cpulist", cpus);
+        this->write("devices/system/node/node1/cpulist", cpus);
+    }
+};
+
+/*! \brief Gets the first CPU the tests may run on. */
+static uint32_t first_cpu()
+{
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        for (uint32_t cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &set))
+                return cpu;
+
+    return 0;
+}
+
+bool cpulist_parse_test()
+{
+    struct CpuSet set;
+
+    bool ret = cpulist_parse("0-3,8,10-11\n", &set) && cpuset_count(&set) == 7 &&
+               cpuset_test(&set, 3) && !cpuset_test(&set, 4) && cpuset_test(&set, 11);
+
+    ret = ret && cpulist_parse("", &set) && cpuset_count(&set) == 0;
+
+    return ret && !cpulist_parse("3-1", &set) && !cpulist_parse("1,x", &set) &&
+           !cpulist_parse("4096", &set) && !cpulist_parse("1-", &set);
+}
+
+bool pci_topology_test()
+{
+    NumaFixture fixture(first_cpu());
+    struct CpuSet set;
+
+    if (!fixture.valid())
+        return false;
+
+    bool ret = pci_numa_node(0, 1, 0, 0) == 0 && pci_numa_node(0, 3, 0, 0) == 1;
+
+    ret = ret && pci_local_cpus(0, 3, 0, 0, &set) && cpuset_test(&set, first_cpu());
+    ret = ret && !pci_local_cpus(0, 1, 0, 0, &set);
+    ret = ret && numa_node_cpus(1, &set) && cpuset_count(&set) == 1;
+
+    return ret && pci_numa_node(0, 9, 0, 0) == -1 && pci_numa_node(0, 4, 0, 0) == -1 &&
+           !numa_node_cpus(7, &set) && !numa_node_cpus(-1, &set);
+}
+
+/*! \brief Tasks recorded by a reactor. */
+struct TaskRecord {
+    std::vector<uint32_t> order;        //!< Indexes of the tasks in the order they ran.
+    std::vector<int> cpus;              //!< CPUs the tasks ran on.
+    pthread_t thread;                   //!< Thread of the last task.
+};
+
+/*! \brief Task of a recorded reactor. */
+struct RecordedTask {
+    TaskRecord* record;                 //!< Record to write to.
+    uint32_t index;                     //!< Index of the task.
+};
+
+static void record_task(void* user)
+{
+    RecordedTask* task = (RecordedTask*) user;
+
+    task->record->order.push_back(task->index);
+    task->record->cpus.push_back(sched_getcpu());
+    task->record->thread = pthread_self();
+}
+
+bool reactor_tasks()
+{
+    const uint32_t NUM_TASKS = 64;
+
+    uint32_t cpu = first_cpu();
+    struct CpuSet set = {};
+
+    set.bits[cpu / 64] |= 1ULL << (cpu % 64);
+
+    struct Reactor* reactor = reactor_create(0, &set);
+
+    if (reactor == NULL)
+        return false;
+
+    TaskRecord record;
+    RecordedTask tasks[NUM_TASKS + 1];
+    bool ret = reactor_pinned(reactor) && reactor_node(reactor) == 0;
+
+    for (uint32_t i = 0; i < NUM_TASKS; ++i) {
+        tasks[i] = {&record, i};
+        ret = ret && reactor_post(reactor, record_task, &tasks[i]);
+    }
+
+    tasks[NUM_TASKS] = {&record, NUM_TASKS};
+    ret = ret && reactor_call(reactor, record_task, &tasks[NUM_TASKS]);
+
+    reactor_destroy(reactor);
+
+    ret = ret && record.order.size() == NUM_TASKS + 1 && !pthread_equal(record.thread, pthread_self());
+
+    for (uint32_t i = 0; ret && i < record.order.size(); ++i)
+        ret = record.order[i] == i && record.cpus[i] == (int) cpu;
+
+    return ret;
+}
+
+/*! \brief Watch of the reactor file descriptor test. */
+struct FdWatch {
+    std::atomic<uint32_t> calls;        //!< Number of handler calls.
+    pthread_t thread;                   //!< Thread of the last call.
+};
+
+static void handle_fd(int fd, uint32_t events, void* user)
+{
+    FdWatch* watch = (FdWatch*) user;
+    uint64_t value;
+
+    if ((events & EPOLLIN) && read(fd, &value, sizeof(value)) == sizeof(value)) {
+        watch->thread = pthread_self();
+        ++watch->calls;
+    }
+}
+
+static void noop_task(void* user)
+{
+    (void) user;
+}
+
+/*! \brief Waits until a handler was called.
+ *
+ * \return If the handler was called before the timeout.
+ */
+static bool wait_calls(FdWatch* watch, uint32_t calls)
+{
+    for (uint32_t i = 0; i < 2000 && watch->calls < calls; ++i)
+        usleep(1000);
+
+    return watch->calls == calls;
+}
+
+bool reactor_fds()
+{
+    struct Reactor* reactor = reactor_create(-1, NULL);
+    int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if (reactor == NULL || fd == -1) {
+        reactor_destroy(reactor);
+        if (fd != -1)
+            close(fd);
+        return false;
+    }
+
+    FdWatch watch;
+    uint64_t value = 1;
+
+    watch.calls = 0;
+
+    bool ret = !reactor_pinned(reactor) && reactor_add_fd(reactor, fd, EPOLLIN, handle_fd, &watch);
+
+    ret = ret && !reactor_add_fd(reactor, -1, EPOLLIN, handle_fd, &watch);
+    ret = ret && write(fd, &value, sizeof(value)) == sizeof(value) && wait_calls(&watch, 1);
+    ret = ret && !pthread_equal(watch.thread, pthread_self());
+
+    reactor_remove_fd(reactor, fd);
+
+    ret = ret && write(fd, &value, sizeof(value)) == sizeof(value);
+
+    /* A task queued after the write runs once the reactor handled the eventfd if it would. */
+    reactor_call(reactor, noop_task, NULL);
+    usleep(10000);
+
+    ret = ret && watch.calls == 1;
+
+    reactor_destroy(reactor);
+    close(fd);
+
+    return ret;
+}
+
+bool gpu_reactors()
+{
+    NumaFixture fixture(first_cpu());
+
+    if (!fixture.valid())
+        return false;
+
+    struct NvMdev mgr = {};
+
+    sim_probed = {0x100, 0x200, 0x300};
+    mgr.fd = SIM_FD;
+    mgr.res = rm_alloc_res(SIM_FD, NULL, 0, 0, NULL);
+
+    sync_nv_mgr_gpus(&mgr);
+
+    bool ret = mgr.gpus.size == 3 &&
+               nv_registry_find_id(&mgr.gpus, 0x100)->numa_node == 0 &&
+               nv_registry_find_id(&mgr.gpus, 0x200)->numa_node == 0 &&
+               nv_registry_find_id(&mgr.gpus, 0x300)->numa_node == 1;
+
+    struct NvReactors nodes = create_nv_reactors(&mgr, NV_REACTORS_PER_NODE);
+    struct Reactor* first = nv_reactor_for_gpu(&nodes, &mgr, 0x100);
+    struct Reactor* last = nv_reactor_for_gpu(&nodes, &mgr, 0x300);
+
+    ret = ret && nodes.size == 2 && first != NULL && last != NULL && first != last;
+    ret = ret && nv_reactor_for_gpu(&nodes, &mgr, 0x200) == first;
+    ret = ret && reactor_node(first) == 0 && reactor_node(last) == 1;
+    ret = ret && reactor_pinned(first) && reactor_pinned(last);
+    ret = ret && nv_reactor_for_gpu(&nodes, &mgr, 0x900) == nodes.reactors[0];
+
+    free_nv_reactors(&nodes);
+
+    struct NvReactors gpus = create_nv_reactors(&mgr, NV_REACTORS_PER_GPU);
+
+    ret = ret && gpus.size == 3;
+    ret = ret && nv_reactor_for_gpu(&gpus, &mgr, 0x100) != nv_reactor_for_gpu(&gpus, &mgr, 0x200);
+    ret = ret && reactor_node(nv_reactor_for_gpu(&gpus, &mgr, 0x300)) == 1;
+
+    free_nv_reactors(&gpus);
+
+    struct NvReactors none = {};
+
+    ret = ret && nv_reactor_for_gpu(&none, &mgr, 0x100) == NULL && nodes.size == 0;
+
+    free_nv_mgr(&mgr);
+
+    return ret && sim_live == 0;
+}
+
+int main()
+{
+    const uint32_t NUM_TESTS = 5;
+
+    const std::string test_names[] = {
+        "CPU List Parsing",
+        "PCI Topology",
+        "Reactor Tasks",
+        "Reactor File Descriptors",
+        "GPU Reactors"
+    };
+    const std::string test_details[] = {
+        "A CPU list was parsed incorrectly or a malformed one was accepted.",
+        "The NUMA node or the local CPUs of a PCI device were read incorrectly.",
+        "Reactor tasks ran out of order, on the caller or off the pinned CPU.",
+        "A watched fd was not handled on the reactor or was handled after its removal.",
+        "The GPUs were not grouped on the reactors of their NUMA nodes."
+    };
+
+    bool (*tests[])(void) = {
+        cpulist_parse_test, pci_topology_test, reactor_tasks, reactor_fds, gpu_reactors
+    };
+
+    rm_set_ioctl(sim_rm_ioctl);
+
+    uint32_t failures = 0;
+
+    for (uint32_t i = 0; i < NUM_TESTS; ++i) {
+        bool test_result = tests[i]() == 1;
+
+        if (test_result)
+            cout << GREEN_COLOR << test_names[i]
+                 << " succeeded" RESET_COLOR "\n";
+        else {
+            ++failures;
+            cout << RED_COLOR << test_names[i]
+                 << ": " << test_details[i]
+                 << RESET_COLOR "\n";
+        }
+    }
+
+    rm_set_ioctl(NULL);
+    epoch_barrier();
+
+    if (failures == 0)
+        cout << GREEN_COLOR << "All tests succeeded" RESET_COLOR "\n";
+    else
+        cout << RED_COLOR << failures << "/"
+             << NUM_TESTS << " tests failed" RESET_COLOR "\n";
+}
@@ -0,0 +1,316 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <gpu/nvidia/manager.h>
+#include <gpu/nvidia/resman/api.h>
+#include <gpu/nvidia/resman/classes.h>
+#include <gpu/nvidia/resman/ioctl.h>
+
+#include <utils/colors.h>
+#include <utils/epoch.h>
+#include <utils/uevent.h>
+
+#include "sim-rm.hpp"
+
+using std::cout;
+
+/*! \page nvidia-hotplug-test GPU Hotplug Test
+ *
+ * \tableofcontents
+ *
+ * These tests check how the manager follows GPUs appearing and disappearing while it runs. The
+ * ioctls are routed to a simulated RM Core through rm_set_ioctl and the uevents are delivered
+ * through a socket pair, so they run without a GPU. The following tests are implemented:
+ *
+ * -# \ref uevent-parse - Parses kernel uevent messages.
+ * -# \ref uevent-recv - Receives uevents from an injected socket.
+ * -# \ref hotplug-add - Adds a GPU bound to the nvidia driver.
+ * -# \ref hotplug-remove - Removes a GPU unbound from the nvidia driver.
+ *
+ * \section uevent-parse Uevent Parsing
+ *
+ * This test determines if the fields of a kernel uevent are parsed and if udev messages are
+ * rejected. The pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * uevent_parse("bind@/devices/...\0ACTION=bind\0...PCI_SLOT_NAME=0000:41:00.0", &event) &&
+ * event.bus == 0x41 && !uevent_parse("libudev\0...", &event)
+ * ```
+ *
+ * \section uevent-recv Uevent Reception
+ *
+ * This test determines if uevents are received from any datagram socket until none is pending.
+ * The pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * send(kernel), send(udev), send(kernel), uevent_recv(fd) == 1, uevent_recv(fd) == 1,
+ * uevent_recv(fd) == 0
+ * ```
+ *
+ * \section hotplug-add Hotplug Addition
+ *
+ * This test determines if a GPU bound to the nvidia driver is probed and attached while the
+ * other GPUs are left untouched. The pseudo-code that is executed to determine if this test is
+ * a success is:
+ *
+ * ```{.c}
+ * probed += 0x300, send(bind nvidia), handle_nv_mgr_uevents(mgr, fd, NULL) == 1,
+ * nv_registry_find_id(gpus, 0x300)->mdev != NULL && nv_registry_find_id(gpus, 0x100) == before
+ * ```
+ *
+ * \section hotplug-remove Hotplug Removal
+ *
+ * This test determines if a GPU unbound from the nvidia driver is torn down and if events of
+ * other devices are ignored. The pseudo-code that is executed to determine if this test is a
+ * success is:
+ *
+ * ```{.c}
+ * send(unbind other), handle_nv_mgr_uevents(mgr, fd, NULL) == 0 && no probe,
+ * probed -= 0x200, send(unbind 0x200), handle_nv_mgr_uevents(mgr, fd, NULL) == 1 && detached(0x200)
+ * ```
+ */
+
+/*! \brief Builds a kernel uevent message for a PCI device.
+ *
+ * \param action - Action of the event.
+ * \param driver - Driver of the device, empty for none.
+ * \param slot - PCI slot name of the device.
+ * \return The message, with NUL separated fields.
+ */
+static std::string pci_uevent(const std::string& action, const std::string& driver, const std::string& slot)
+{
+    std::string ret = action + "@/devices/pci0000:00/0000:00:01.0/" + slot;
+
+    ret += '\0';
+    ret += "ACTION=" + action + '\0';
+    ret += "DEVPATH=/devices/pci0000:00/0000:00:01.0/" + slot + '\0';
+    ret += "SUBSYSTEM=pci";
+    ret += '\0';
+
+    if (!driver.empty())
+        ret += "DRIVER=" + driver + '\0';
+
+    ret += "PCI_SLOT_NAME=" + slot + '\0';
+    ret += "SEQNUM=42";
+
+    return ret;
+}
+
+/*! \brief Creates a manager on the simulated RM Core.
+ *
+ * \return The manager, with the GPUs probed by the simulated RM Core attached.
+ */
+static struct NvMdev sim_mgr()
+{
+    struct NvMdev ret = {};
+
+    ret.fd = SIM_FD;
+    ret.res = rm_alloc_res(SIM_FD, NULL, 0, 0, NULL);
+
+    sync_nv_mgr_gpus(&ret);
+
+    return ret;
+}
+
+bool uevent_parse_test()
+{
+    std::string message = pci_uevent("bind", "nvidia", "0000:41:00.0");
+    std::string udev = std::string("libudev") + '\0' + "ACTION=bind" + '\0' + "SUBSYSTEM=pci";
+    struct Uevent event;
+
+    bool ret = uevent_parse(message.data(), message.size(), &event) &&
+               strcmp(event.action, "bind") == 0 &&
+               strcmp(event.subsystem, "pci") == 0 &&
+               strcmp(event.driver, "nvidia") == 0 &&
+               event.has_slot && event.domain == 0 && event.bus == 0x41 && event.slot == 0 &&
+               event.seqnum == 42;
+
+    return ret && !uevent_parse(udev.data(), udev.size(), &event);
+}
+
+bool uevent_recv_test()
+{
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) == -1)
+        return false;
+
+    std::string first = pci_uevent("add", "", "0000:01:00.0");
+    std::string udev = std::string("libudev") + '\0' + "ACTION=add";
+    std::string second = pci_uevent("remove", "", "0000:02:00.0");
+    struct Uevent event;
+
+    send(fds[1], first.data(), first.size(), 0);
+    send(fds[1], udev.data(), udev.size(), 0);
+    send(fds[1], second.data(), second.size(), 0);
+
+    bool ret = uevent_recv(fds[0], &event) == 1 && strcmp(event.action, "add") == 0;
+
+    ret = ret && uevent_recv(fds[0], &event) == 1 && strcmp(event.action, "remove") == 0 && event.bus == 2;
+    ret = ret && uevent_recv(fds[0], &event) == 0;
+
+    close(fds[0]);
+    close(fds[1]);
+
+    return ret;
+}
+
+bool hotplug_add()
+{
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) == -1)
+        return false;
+
+    sim_probed = {0x100, 0x200};
+
+    struct NvMdev mgr = sim_mgr();
+    struct NvMdevGpu* before = nv_registry_find_id(&mgr.gpus, 0x100);
+    struct NvResource* before_dev = before != NULL ? before->dev : NULL;
+
+    sim_probed.push_back(0x300);
+
+    std::string unrelated = pci_uevent("bind", "snd_hda_intel", "0000:03:00.1");
+    std::string bind = pci_uevent("bind", "nvidia", "0000:03:00.0");
+
+    send(fds[1], unrelated.data(), unrelated.size(), 0);
+    send(fds[1], bind.data(), bind.size(), 0);
+
+    bool ret = mgr.gpus.size == 2 && before != NULL && before->mdev != NULL;
+
+    ret = ret && handle_nv_mgr_uevents(&mgr, fds[0], NULL) == 1;
+
+    struct NvMdevGpu* added = nv_registry_find_id(&mgr.gpus, 0x300);
+
+    ret = ret && mgr.gpus.size == 3 && added != NULL && added->mdev != NULL;
+    ret = ret && nv_registry_find_bdf(&mgr.gpus, NV_GPU_BDF(0, 3, 0, 0)) == added;
+    ret = ret && nv_registry_find_id(&mgr.gpus, 0x100) == before && before->dev == before_dev;
+    ret = ret && sim_attached.count(0x300) == 1;
+
+    epoch_enter();
+
+    const struct NvGpuView* view = nv_mgr_view(&mgr);
+
+    ret = ret && view != NULL && view->gpus.size == 3 && nv_registry_find_id(&view->gpus, 0x300) != NULL;
+
+    epoch_exit();
+
+    free_nv_mgr(&mgr);
+    close(fds[0]);
+    close(fds[1]);
+
+    return ret && sim_live == 0 && sim_attached.empty();
+}
+
+bool hotplug_remove()
+{
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) == -1)
+        return false;
+
+    sim_probed = {0x100, 0x200, 0x300};
+
+    struct NvMdev mgr = sim_mgr();
+    int64_t live = sim_live;
+
+    std::string unrelated = pci_uevent("unbind", "", "0000:05:00.0");
+
+    send(fds[1], unrelated.data(), unrelated.size(), 0);
+
+    uint32_t probes = sim_probes;
+    bool ret = mgr.gpus.size == 3 && handle_nv_mgr_uevents(&mgr, fds[0], NULL) == 0 && sim_probes == probes;
+
+    sim_probed = {0x100, 0x300};
+
+    std::string unbind = pci_uevent("unbind", "", "0000:02:00.0");
+
+    send(fds[1], unbind.data(), unbind.size(), 0);
+
+    ret = ret && handle_nv_mgr_uevents(&mgr, fds[0], NULL) == 1;
+    ret = ret && mgr.gpus.size == 2 && nv_registry_find_id(&mgr.gpus, 0x200) == NULL;
+    ret = ret && nv_registry_at(&mgr.gpus, 0)->gpu->identifier == 0x100;
+    ret = ret && nv_registry_at(&mgr.gpus, 1)->gpu->identifier == 0x300;
+    ret = ret && sim_attached.count(0x200) == 0 && sim_attached.size() == 2;
+
+    /* The device, sub device and mdev configurator of the GPU are freed. */
+    ret = ret && sim_live == live - 3;
+
+    free_nv_mgr(&mgr);
+    close(fds[0]);
+    close(fds[1]);
+
+    return ret && sim_live == 0 && sim_attached.empty();
+}
+
+int main()
+{
+    const uint32_t NUM_TESTS = 4;
+
+    const std::string test_names[] = {
+        "Uevent Parsing",
+        "Uevent Reception",
+        "Hotplug Addition",
+        "Hotplug Removal"
+    };
+    const std::string test_details[] = {
+        "A kernel uevent was not parsed or a udev message was accepted.",
+        "The uevents of the injected socket were not received in order.",
+        "A GPU bound to the nvidia driver was not attached or another GPU was touched.",
+        "A GPU unbound from the nvidia driver was not torn down or an unrelated event was handled."
+    };
+
+    bool (*tests[])(void) = {
+        uevent_parse_test, uevent_recv_test, hotplug_add, hotplug_remove
+    };
+
+    rm_set_ioctl(sim_rm_ioctl);
+
+    uint32_t failures = 0;
+
+    for (uint32_t i = 0; i < NUM_TESTS; ++i) {
+        bool test_result = tests[i]() == 1;
+
+        if (test_result)
+            cout << GREEN_COLOR << test_names[i]
+                 << " succeeded" RESET_COLOR "\n";
+        else {
+            ++failures;
+            cout << RED_COLOR << test_names[i]
+                 << ": " << test_details[i]
+                 << RESET_COLOR "\n";
+        }
+    }
+
+    rm_set_ioctl(NULL);
+    epoch_barrier();
+
+    if (failures == 0)
+        cout << GREEN_COLOR << "All tests succeeded" RESET_COLOR "\n";
+    else
+        cout << RED_COLOR << failures << "/"
+             << NUM_TESTS << " tests failed" RESET_COLOR "\n";
+}
@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <iostream>
+
+#include <stdlib.h>
+
+#include <gpu/nvidia/registry.h>
+#include <gpu/nvidia/resources.h>
+
+#include <utils/colors.h>
+
+using std::cout;
+
+/*! \page nvidia-registry-test Nvidia GPU Registry Test
+ *
+ * \tableofcontents
+ *
+ * This code tests the registry holding the GPUs of the Nvidia manager without a GPU on the
+ * system. The following tests are implemented:
+ *
+ * -# \ref registry-lookup - Finds GPUs by RM id, PCI address and minor.
+ * -# \ref registry-growth - Registers more GPUs than the RM can probe at once.
+ * -# \ref registry-remove - Removes GPUs while keeping the order of the others.
+ *
+ * \section registry-lookup Registry Lookup
+ *
+ * This test determines if every index of the registry finds the GPU it was given, and if a
+ * duplicated RM id is rejected. The pseudo-code that is executed to determine if this test is
+ * a success is:
+ *
+ * ```{.c}
+ * nv_registry_find_id(reg, id) == gpu && nv_registry_find_bdf(reg, bdf) == gpu &&
+ * nv_registry_find_minor(reg, minor) == gpu && !nv_registry_add(reg, duplicate)
+ * ```
+ *
+ * \section registry-growth Registry Growth
+ *
+ * This test determines if the registry grows past 32 GPUs while iterating in insertion order.
+ * The pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * for (i = 0; i < 1024; ++i) nv_registry_add(reg, gpus[i]);
+ * nv_registry_at(reg, i) == gpus[i] && nv_registry_find_id(reg, ids[i]) == gpus[i]
+ * ```
+ *
+ * \section registry-remove Registry Removal
+ *
+ * This test determines if removing GPUs keeps the remaining ones in order and findable. The
+ * pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * nv_registry_remove(reg, ids[odd]) == gpus[odd] &&
+ * nv_registry_at(reg, i) == gpus[2 * i] && nv_registry_find_bdf(reg, removed) == NULL
+ * ```
+ */
+
+/*! \brief Creates a GPU for the registry without touching the RM.
+ *
+ * \param index - Index used to derive the id, PCI address and minor.
+ * \return The GPU.
+ */
+static struct NvMdevGpu* fake_gpu(uint32_t index)
+{
+    struct NvMdevGpu* ret = (struct NvMdevGpu*) calloc(1, sizeof(*ret));
+
+    ret->gpu = (struct Gpu*) calloc(1, sizeof(*ret->gpu));
+    ret->gpu->identifier = 0x100 + index * 0x100;
+    ret->gpu->domain = index / 256;
+    ret->gpu->bus = index % 256;
+    ret->gpu->slot = index % 32;
+    ret->gpu->function = 0;
+    ret->minor = index;
+
+    return ret;
+}
+
+/*! \brief Frees the GPUs created by fake_gpu.
+ *
+ * \param gpus - GPUs to free.
+ * \param size - Number of GPUs.
+ */
+static void free_fake_gpus(struct NvMdevGpu** gpus, uint32_t size)
+{
+    for (uint32_t i = 0; i < size; ++i) {
+        free(gpus[i]->gpu);
+        free(gpus[i]);
+    }
+}
+
+bool registry_lookup()
+{
+    struct NvGpuRegistry registry = {};
+    struct NvMdevGpu* gpus[4];
+    bool ret = true;
+
+    for (uint32_t i = 0; i < 4; ++i) {
+        gpus[i] = fake_gpu(i);
+        ret = ret && nv_registry_add(&registry, gpus[i]);
+    }
+
+    for (uint32_t i = 0; i < 4; ++i) {
+        struct Gpu* gpu = gpus[i]->gpu;
+
+        ret = ret && nv_registry_find_id(&registry, gpu->identifier) == gpus[i];
+        ret = ret && nv_registry_find_bdf(&registry, NV_GPU_BDF(gpu->domain, gpu->bus, gpu->slot, 0)) == gpus[i];
+        ret = ret && nv_registry_find_minor(&registry, i) == gpus[i];
+    }
+
+    struct NvMdevGpu* duplicate = fake_gpu(2);
+
+    ret = ret && !nv_registry_add(&registry, duplicate) && registry.size == 4;
+    ret = ret && nv_registry_find_id(&registry, 0xDEAD) == NULL;
+    ret = ret && nv_registry_find_bdf(&registry, NV_GPU_BDF(0, 0x80, 0, 0)) == NULL;
+
+    free_fake_gpus(&duplicate, 1);
+    free_fake_gpus(gpus, 4);
+    nv_registry_free(&registry);
+
+    return ret;
+}
+
+bool registry_growth()
+{
+    const uint32_t SIZE = 1024;
+
+    struct NvGpuRegistry registry = {};
+    struct NvMdevGpu** gpus = (struct NvMdevGpu**) calloc(SIZE, sizeof(*gpus));
+    bool ret = true;
+
+    for (uint32_t i = 0; i < SIZE; ++i) {
+        gpus[i] = fake_gpu(i);
+        ret = ret && nv_registry_add(&registry, gpus[i]);
+    }
+
+    ret = ret && registry.size == SIZE;
+
+    for (uint32_t i = 0; i < SIZE; ++i) {
+        ret = ret && nv_registry_at(&registry, i) == gpus[i];
+        ret = ret && nv_registry_find_id(&registry, gpus[i]->gpu->identifier) == gpus[i];
+        ret = ret && nv_registry_find_minor(&registry, i) == gpus[i];
+    }
+
+    free_fake_gpus(gpus, SIZE);
+    free(gpus);
+    nv_registry_free(&registry);
+
+    return ret && registry.size == 0;
+}
+
+bool registry_remove()
+{
+    const uint32_t SIZE = 64;
+
+    struct NvGpuRegistry registry = {};
+    struct NvMdevGpu* gpus[SIZE];
+    bool ret = true;
+
+    for (uint32_t i = 0; i < SIZE; ++i) {
+        gpus[i] = fake_gpu(i);
+        ret = ret && nv_registry_add(&registry, gpus[i]);
+    }
+
+    for (uint32_t i = 1; i < SIZE; i += 2)
+        ret = ret && nv_registry_remove(&registry, gpus[i]->gpu->identifier) == gpus[i];
+
+    ret = ret && registry.size == SIZE / 2;
+    ret = ret && nv_registry_remove(&registry, gpus[1]->gpu->identifier) == NULL;
+
+    for (uint32_t i = 0; i < SIZE; ++i) {
+        struct Gpu* gpu = gpus[i]->gpu;
+        struct NvMdevGpu* expected = i % 2 == 0 ? gpus[i] : NULL;
+
+        if (i % 2 == 0)
+            ret = ret && nv_registry_at(&registry, i / 2) == gpus[i];
+
+        ret = ret && nv_registry_find_id(&registry, gpu->identifier) == expected;
+        ret = ret && nv_registry_find_bdf(&registry, NV_GPU_BDF(gpu->domain, gpu->bus, gpu->slot, 0)) == expected;
+        ret = ret && nv_registry_find_minor(&registry, i) == expected;
+    }
+
+    free_fake_gpus(gpus, SIZE);
+    nv_registry_free(&registry);
+
+    return ret;
+}
+
+int main()
+{
+    const uint32_t NUM_TESTS = 3;
+
+    const std::string test_names[] = {
+        "Registry Lookup",
+        "Registry Growth",
+        "Registry Removal"
+    };
+    const std::string test_details[] = {
+        "A GPU was not found by its id, PCI address or minor, or a duplicated id was accepted.",
+        "The registry did not grow past 32 GPUs in insertion order.",
+        "Removing GPUs did not keep the remaining ones in order and findable."
+    };
+
+    bool (*tests[])(void) = {
+        registry_lookup, registry_growth, registry_remove
+    };
+
+    uint32_t failures = 0;
+
+    for (uint32_t i = 0; i < NUM_TESTS; ++i) {
+        bool test_result = tests[i]() == 1;
+
+        if (test_result)
+            cout << GREEN_COLOR << test_names[i]
+                 << " succeeded" RESET_COLOR "\n";
+        else {
+            ++failures;
+            cout << RED_COLOR << test_names[i]
+                 << ": " << test_details[i]
+                 << RESET_COLOR "\n";
+        }
+    }
+
+    if (failures == 0)
+        cout << GREEN_COLOR << "All tests succeeded" RESET_COLOR "\n";
+    else
+        cout << RED_COLOR << failures << "/"
+             << NUM_TESTS << " tests failed" RESET_COLOR "\n";
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <gpu/nvidia/device.h>
+#include <gpu/nvidia/manager.h>
+#include <gpu/nvidia/resman/api.h>
+
+#include <utils/colors.h>
+
+#include "sim-rm.hpp"
+
+using std::cout;
+
+/*! \page nvidia-shards-test Sharded Manager Test
+ *
+ * \tableofcontents
+ *
+ * These tests check the RM clients of a manager created with and without NV_MGR_SHARDED. The
+ * ioctls are routed to a simulated RM Core through rm_set_ioctl and the NVIDIA devices are
+ * opened on /dev/null through nv_set_open_dev, so they run without a GPU. The following tests
+ * are implemented:
+ *
+ * -# \ref shards-single - Shares the main client without NV_MGR_SHARDED.
+ * -# \ref shards-clients - Gives every GPU its own client and frees them all.
+ *
+ * \section shards-single Single Client
+ *
+ * This test determines if the GPUs of a manager created without flags are allocated under its
+ * client. The pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * mgr = create_nv_mgr_flags(0), clients == {mgr.res} && every gpu->dev->client == mgr.res,
+ * free_nv_mgr(&mgr), clients == {} && live == 0
+ * ```
+ *
+ * \section shards-clients Sharded Clients
+ *
+ * This test determines if every GPU of a sharded manager owns a client on its own control
+ * file, its objects are allocated under it, and if freeing the manager frees every client,
+ * detaches the GPUs and closes the files. The pseudo-code that is executed to determine if this
+ * test is a success is:
+ *
+ * ```{.c}
+ * mgr = create_nv_mgr_flags(NV_MGR_SHARDED), clients == {mgr.res, gpu->shard...} &&
+ * every clients[gpu->shard] == gpu->ctl_fd && gpu->dev->client == gpu->shard,
+ * free_nv_mgr(&mgr), clients == {} && live == 0 && none attached && files closed
+ * ```
+ */
+
+//! Files opened for the NVIDIA devices.
+static std::vector<int> sim_files;
+
+/*! \brief Opens a NVIDIA device, /dev/null standing in for it. */
+static int sim_open_dev(uint16_t minor)
+{
+    (void) minor;
+
+    int fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+
+    sim_files.push_back(fd);
+
+    return fd;
+}
+
+/*! \brief Checks if every file opened for the NVIDIA devices was closed. */
+static bool files_closed()
+{
+    for (int fd : sim_files)
+        if (fcntl(fd, F_GETFD) != -1)
+            return false;
+
+    return true;
+}
+
+bool shards_single()
+{
+    sim_reset();
+    sim_files.clear();
+    sim_probed = {0x100, 0x200, 0x300};
+
+    struct NvMdev mgr = create_nv_mgr_flags(0);
+    bool ret = mgr.res != NULL && mgr.gpus.size == 3 && sim_clients.size() == 1;
+
+    ret = ret && sim_clients.count(mgr.res->object) == 1 && sim_clients[mgr.res->object] == mgr.fd;
+
+    for (uint32_t i = 0; ret && i < mgr.gpus.size; ++i) {
+        struct NvMdevGpu* gpu = nv_registry_at(&mgr.gpus, i);
+
+        ret = gpu->shard == NULL && gpu->dev != NULL && gpu->dev->client == mgr.res->object;
+        ret = ret && gpu->ctl_fd == mgr.fd;
+    }
+
+    free_nv_mgr(&mgr);
+
+    return ret && sim_clients.empty() && sim_live == 0 && sim_attached.empty() && files_closed();
+}
+
+bool shards_clients()
+{
+    sim_reset();
+    sim_files.clear();
+    sim_probed = {0x100, 0x200, 0x300};
+
+    struct NvMdev mgr = create_nv_mgr_flags(NV_MGR_SHARDED);
+    bool ret = mgr.res != NULL && mgr.gpus.size == 3 && sim_clients.size() == 4;
+    std::set<uint32_t> clients = {mgr.res->object};
+    std::set<int> fds = {mgr.fd};
+
+    for (uint32_t i = 0; ret && i < mgr.gpus.size; ++i) {
+        struct NvMdevGpu* gpu = nv_registry_at(&mgr.gpus, i);
+
+        ret = gpu->shard != NULL && gpu->root == gpu->shard->object;
+        ret = ret && sim_clients.count(gpu->shard->object) == 1 && sim_clients[gpu->shard->object] == gpu->ctl_fd;
+        ret = ret && gpu->dev != NULL && gpu->dev->client == gpu->shard->object;
+        ret = ret && gpu->mdev != NULL && gpu->mdev->client == gpu->shard->object;
+
+        if (ret) {
+            clients.insert(gpu->shard->object);
+            fds.insert(gpu->ctl_fd);
+        }
+    }
+
+    ret = ret && clients.size() == 4 && fds.size() == 4 && sim_attached.size() == 3;
+
+    free_nv_mgr(&mgr);
+
+    return ret && sim_clients.empty() && sim_live == 0 && sim_attached.empty() && files_closed();
+}
+
+int main()
+{
+    const uint32_t NUM_TESTS = 2;
+
+    const std::string test_names[] = {
+        "Single Client",
+        "Sharded Clients"
+    };
+    const std::string test_details[] = {
+        "The GPUs were not allocated under the client of the manager or it was not freed.",
+        "A GPU did not own a client on its own file or a client was not freed."
+    };
+
+    bool (*tests[])(void) = {
+        shards_single, shards_clients
+    };
+
+    rm_set_ioctl(sim_rm_ioctl);
+    nv_set_open_dev(sim_open_dev);
+    sim_any_fd = true;
+
+    uint32_t failures = 0;
+
+    for (uint32_t i = 0; i < NUM_TESTS; ++i) {
+        bool test_result = tests[i]() == 1;
+
+        if (test_result)
+            cout << GREEN_COLOR << test_names[i]
+                 << " succeeded" RESET_COLOR "\n";
+        else {
+            ++failures;
+            cout << RED_COLOR << test_names[i]
+                 << ": " << test_details[i]
+                 << RESET_COLOR "\n";
+        }
+    }
+
+    nv_set_open_dev(NULL);
+    rm_set_ioctl(NULL);
+
+    if (failures == 0)
+        cout << GREEN_COLOR << "All tests succeeded" RESET_COLOR "\n";
+    else
+        cout << RED_COLOR << failures << "/"
+             << NUM_TESTS << " tests failed" RESET_COLOR "\n";
+}
@@ -0,0 +1,352 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <stdlib.h>
+
+#include <gpu/nvidia/manager.h>
+#include <gvm/sessions.h>
+
+#include <utils/colors.h>
+#include <utils/epoch.h>
+
+using std::cout;
+
+/*! \page nvidia-snapshots-test Published Snapshot Test
+ *
+ * \tableofcontents
+ *
+ * These tests check the snapshots of the GPUs and VM sessions that readers use without taking
+ * a lock. They run without a GPU. The following tests are implemented:
+ *
+ * -# \ref gpu-view - Publishes the GPUs of a manager and updates them.
+ * -# \ref session-view - Adds, replaces and removes VM sessions.
+ * -# \ref concurrent-views - Reads the snapshots while other threads replace them.
+ *
+ * \section gpu-view GPU Snapshot
+ *
+ * This test determines if a published snapshot is unaffected by later changes to the GPUs and
+ * if the next publication reflects them. The pseudo-code that is executed to determine if this
+ * test is a success is:
+ *
+ * ```{.c}
+ * nv_mgr_publish(mgr), old = nv_mgr_view(mgr), nv_registry_remove(&mgr->gpus, id),
+ * nv_mgr_publish(mgr), old->gpus.size == 4 && nv_mgr_view(mgr)->gpus.size == 3
+ * ```
+ *
+ * \section session-view Session Snapshot
+ *
+ * This test determines if sessions are found by the UUID of their mediated device. The
+ * pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * vm_add_session(mgr, a), vm_add_session(mgr, b), vm_add_session(mgr, a'),
+ * vm_find_session(vm_sessions(mgr), a) == a' && vm_remove_session(mgr, b) && size == 1
+ * ```
+ *
+ * \section concurrent-views Concurrent Snapshots
+ *
+ * This test determines if readers always observe consistent snapshots while writers publish new
+ * ones. Run with ThreadSanitizer or AddressSanitizer to catch races and use after free. The
+ * pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * readers: epoch_enter(), consistent(nv_mgr_view(mgr)) && consistent(vm_sessions(vm)), epoch_exit()
+ * writers: vm_add_session(vm, s), vm_remove_session(vm, s) || nv_mgr_publish(mgr)
+ * ```
+ */
+
+/*! \brief Creates a GPU for a manager without touching the RM.
+ *
+ * \param index - Index used to derive the id, PCI address and minor.
+ * \return The GPU.
+ */
+static struct NvMdevGpu* fake_gpu(uint32_t index)
+{
+    struct NvMdevGpu* ret = (struct NvMdevGpu*) calloc(1, sizeof(*ret));
+
+    ret->gpu = (struct Gpu*) calloc(1, sizeof(*ret->gpu));
+    ret->gpu->identifier = 0x100 + index * 0x100;
+    ret->gpu->bus = index + 1;
+    ret->minor = index;
+
+    return ret;
+}
+
+/*! \brief Frees the GPUs of a manager created with fake_gpu, then the manager.
+ *
+ * \param mgr - Manager without a control file descriptor.
+ */
+static void free_fake_mgr(struct NvMdev* mgr)
+{
+    for (uint32_t i = 0; i < mgr->gpus.size; ++i) {
+        free(nv_registry_at(&mgr->gpus, i)->gpu);
+        free(nv_registry_at(&mgr->gpus, i));
+    }
+
+    free_nv_mgr(mgr);
+}
+
+/*! \brief Creates a session whose QEMU PID is derived from its UUID.
+ *
+ * \param index - Index used to derive the UUID.
+ * \return The session.
+ */
+static struct VmSession fake_session(uint32_t index)
+{
+    struct VmSession ret = {};
+
+    ret.mdev.time_low = index;
+    ret.qemu_pid = index * 2;
+    ret.gpu_id = 0x100;
+    ret.mdev_fd = -1;
+    ret.pid_fd = -1;
+
+    return ret;
+}
+
+bool gpu_view()
+{
+    struct NvMdev mgr = {};
+    bool ret = true;
+
+    mgr.fd = -1;
+
+    for (uint32_t i = 0; i < 4; ++i)
+        nv_registry_add(&mgr.gpus, fake_gpu(i));
+
+    nv_mgr_publish(&mgr);
+
+    epoch_enter();
+
+    const struct NvGpuView* old = nv_mgr_view(&mgr);
+    struct NvMdevGpu* removed = nv_registry_remove(&mgr.gpus, 0x200);
+
+    nv_registry_at(&mgr.gpus, 0)->attached = 1;
+    nv_mgr_publish(&mgr);
+
+    const struct NvGpuView* view = nv_mgr_view(&mgr);
+
+    ret = old != NULL && old->generation == 0 && old->gpus.size == 4;
+    ret = ret && nv_registry_find_id(&old->gpus, 0x200) != NULL && !nv_registry_at(&old->gpus, 0)->attached;
+    ret = ret && view != NULL && view->generation == 1 && view->gpus.size == 3;
+    ret = ret && nv_registry_find_id(&view->gpus, 0x200) == NULL && nv_registry_at(&view->gpus, 0)->attached;
+    ret = ret && nv_registry_find_id(&view->gpus, 0x300) != removed;
+
+    epoch_exit();
+
+    free(removed->gpu);
+    free(removed);
+    free_fake_mgr(&mgr);
+
+    epoch_enter();
+    ret = ret && nv_mgr_view(&mgr) == NULL;
+    epoch_exit();
+
+    epoch_barrier();
+
+    return ret;
+}
+
+bool session_view()
+{
+    struct VmMgr mgr = {};
+    struct VmSession first = fake_session(1);
+    struct VmSession second = fake_session(2);
+    struct VmSession replaced = fake_session(1);
+    bool ret = true;
+
+    replaced.qemu_pid = 0x1234;
+
+    ret = vm_add_session(&mgr, &first) && vm_add_session(&mgr, &second) && vm_add_session(&mgr, &replaced);
+
+    epoch_enter();
+
+    const struct VmSessionView* view = vm_sessions(&mgr);
+    const struct VmSession* found = vm_find_session(view, &first.mdev);
+
+    ret = ret && view != NULL && view->size == 2 && view->generation == 2;
+    ret = ret && found != NULL && found->qemu_pid == 0x1234;
+
+    epoch_exit();
+
+    ret = ret && vm_remove_session(&mgr, &second.mdev) && !vm_remove_session(&mgr, &second.mdev);
+
+    epoch_enter();
+
+    view = vm_sessions(&mgr);
+    ret = ret && view->size == 1 && vm_find_session(view, &second.mdev) == NULL;
+
+    epoch_exit();
+
+    vm_free_sessions(&mgr);
+    epoch_barrier();
+
+    return ret;
+}
+
+bool concurrent_views()
+{
+    const uint32_t READERS = 4;
+    const uint32_t WRITERS = 2;
+    const uint32_t UPDATES = 2000;
+
+    struct NvMdev mgr = {};
+    struct VmMgr vm_mgr = {};
+    std::atomic<bool> done(false);
+    std::atomic<uint64_t> reads(0);
+    std::atomic<uint32_t> inconsistent(0);
+    std::vector<std::thread> threads;
+
+    mgr.fd = -1;
+
+    for (uint32_t i = 0; i < 8; ++i)
+        nv_registry_add(&mgr.gpus, fake_gpu(i));
+
+    nv_mgr_publish(&mgr);
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < READERS; ++i) {
+        threads.emplace_back([&]() {
+            uint64_t local = 0;
+
+            while (!done.load()) {
+                epoch_enter();
+
+                const struct NvGpuView* view = nv_mgr_view(&mgr);
+                const struct VmSessionView* sessions = vm_sessions(&vm_mgr);
+
+                if (view == NULL || view->gpus.size != 8)
+                    ++inconsistent;
+
+                for (uint32_t j = 0; view != NULL && j < view->gpus.size; ++j) {
+                    const struct NvMdevGpu* gpu = nv_registry_at(&view->gpus, j);
+
+                    if (nv_registry_find_id(&view->gpus, gpu->gpu->identifier) != gpu)
+                        ++inconsistent;
+                }
+
+                for (uint32_t j = 0; sessions != NULL && j < sessions->size; ++j)
+                    if (sessions->sessions[j].qemu_pid != sessions->sessions[j].mdev.time_low * 2)
+                        ++inconsistent;
+
+                epoch_exit();
+                ++local;
+            }
+
+            reads += local;
+        });
+    }
+
+    std::vector<std::thread> writers;
+
+    for (uint32_t i = 0; i < WRITERS; ++i) {
+        writers.emplace_back([&, i]() {
+            for (uint32_t j = 0; j < UPDATES; ++j) {
+                struct VmSession session = fake_session(i * UPDATES + j);
+
+                if (!vm_add_session(&vm_mgr, &session))
+                    ++inconsistent;
+
+                if (j % 2 == 1 && !vm_remove_session(&vm_mgr, &session.mdev))
+                    ++inconsistent;
+            }
+        });
+    }
+
+    writers.emplace_back([&]() {
+        for (uint32_t j = 0; j < UPDATES; ++j)
+            nv_mgr_publish(&mgr);
+    });
+
+    for (auto& writer : writers)
+        writer.join();
+
+    done = true;
+
+    for (auto& thread : threads)
+        thread.join();
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    cout << "\tsnapshot reads: " << reads.load() << " ops in " << secs * 1e3 << " ms ("
+         << (uint64_t) (reads.load() / (secs > 0 ? secs : 1e-9)) << " ops/s)\n";
+
+    epoch_enter();
+
+    const struct VmSessionView* sessions = vm_sessions(&vm_mgr);
+    bool ret = sessions != NULL && sessions->size == WRITERS * UPDATES / 2;
+
+    ret = ret && nv_mgr_view(&mgr)->generation == UPDATES;
+
+    epoch_exit();
+
+    vm_free_sessions(&vm_mgr);
+    free_fake_mgr(&mgr);
+    epoch_barrier();
+
+    return ret && inconsistent.load() == 0;
+}
+
+int main()
+{
+    const uint32_t NUM_TESTS = 3;
+
+    const std::string test_names[] = {
+        "GPU Snapshot",
+        "Session Snapshot",
+        "Concurrent Snapshots"
+    };
+    const std::string test_details[] = {
+        "A published GPU snapshot changed or the next one did not reflect the GPUs.",
+        "A session was not added, replaced or removed by the UUID of its mediated device.",
+        "A reader observed an inconsistent snapshot or an update was lost."
+    };
+
+    bool (*tests[])(void) = {
+        gpu_view, session_view, concurrent_views
+    };
+
+    uint32_t failures = 0;
+
+    for (uint32_t i = 0; i < NUM_TESTS; ++i) {
+        bool test_result = tests[i]() == 1;
+
+        if (test_result)
+            cout << GREEN_COLOR << test_names[i]
+                 << " succeeded" RESET_COLOR "\n";
+        else {
+            ++failures;
+            cout << RED_COLOR << test_names[i]
+                 << ": " << test_details[i]
+                 << RESET_COLOR "\n";
+        }
+    }
+
+    if (failures == 0)
+        cout << GREEN_COLOR << "All tests succeeded" RESET_COLOR "\n";
+    else
+        cout << RED_COLOR << failures << "/"
+             << NUM_TESTS << " tests failed" RESET_COLOR "\n";
+}
@@ -0,0 +1,428 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <gvm/placement.h>
+
+#include <utils/colors.h>
+#include <utils/sysfs.h>
+
+#include "sysfs-fixture.hpp"
+
+using std::cout;
+
+/*! \page placement-test Placement Test
+ *
+ * \tableofcontents
+ *
+ * These tests check the placement engine choosing the GPU of new vGPU instances. The CPUs of
+ * the NUMA nodes are read from a sysfs fixture set with set_sysfs_root. The following tests
+ * are implemented:
+ *
+ * -# \ref placement-pack - Packs the instances on the fullest GPU they fit in.
+ * -# \ref placement-spread - Spreads the instances over the emptiest GPUs.
+ * -# \ref placement-limits - Honours the instance limits and the released instances.
+ * -# \ref placement-numa - Prefers the GPUs local to the CPUs of the VM.
+ * -# \ref placement-occupancy - Takes the occupancy of the GPUs from outside.
+ * -# \ref placement-scale - Matches a linear scan over thousands of GPUs.
+ *
+ * \section placement-pack Packing
+ *
+ * This test determines if small instances are packed on one GPU, keeping a whole GPU free
+ * for a large instance. The pseudo-code that is executed to determine if this test is a
+ * success is:
+ *
+ * ```{.c}
+ * gpus(1, 2, 16 GiB), place(4 GiB) * 4 on gpu 1 && place(16 GiB) on gpu 2
+ * ```
+ *
+ * \section placement-spread Spreading
+ *
+ * This test determines if instances are spread over the GPUs with the most free framebuffer.
+ * The pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * gpus(1, 2, 16 GiB), place(4 GiB) * 4 == 2 per gpu && place(16 GiB) fails
+ * ```
+ *
+ * \section placement-limits Limits
+ *
+ * This test determines if the instance limit of a type and the framebuffer of the GPUs are
+ * honoured, and if released instances make room again. The pseudo-code that is executed to
+ * determine if this test is a success is:
+ *
+ * ```{.c}
+ * gpu(8 GiB), type(1 GiB, max 2), type(3 GiB, max 4), place(1 GiB) * 2, !place(1 GiB),
+ * place(3 GiB) * 2, !place(3 GiB), release(3 GiB), place(3 GiB) && !release(unknown)
+ * ```
+ *
+ * \section placement-numa NUMA Locality
+ *
+ * This test determines if the GPUs local to the CPUs of the VM are chosen first, and if the
+ * other GPUs are used once they are full. The pseudo-code that is executed to determine if
+ * this test is a success is:
+ *
+ * ```{.c}
+ * node0(cpus 0-3, gpu 1 half used), node1(cpus 4-7, gpu 2), place(cpus 5) == gpu 2 until full,
+ * then gpu 1 && place(pack) == gpu 1
+ * ```
+ *
+ * \section placement-occupancy Occupancy
+ *
+ * This test determines if the instances set from outside, directly or from the sessions of a
+ * VM manager, are taken into account. Instances placed but not started yet are kept until
+ * their sessions arrive. The pseudo-code that is executed to determine if this test is a
+ * success is:
+ *
+ * ```{.c}
+ * set_instances(gpu 1, 3), place(pack) == gpu 1, sync(gpu 1: 2, gpu 2: 3, mixed gpu 3: 2),
+ * gpu 1 == 4 && gpu 3 == 2, place(pack) == gpu 2, sync(gpu 1: 1) && gpu 1 == 3 && gpu 2 == 4
+ * ```
+ *
+ * \section placement-scale Scale
+ *
+ * This test determines if the indexes choose the same GPUs as a scan of every GPU through a
+ * long run of random placements and releases over thousands of GPUs. The pseudo-code that is
+ * executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * gpus(4096, 4 nodes), random(place, release) * 200000, choice == scan choice
+ * ```
+ */
+
+//! One gibibyte.
+static const uint64_t GIB = 1ull << 30;
+
+/*! \brief Sysfs tree holding the CPUs of two NUMA nodes. */
+class NodeFixture : public SysfsFixture {
+public:
+    NodeFixture() : SysfsFixture("placement")
+    {
+        this->write("devices/system/node/node0/cpulist", "0-3\n");
+        this->write("devices/system/node/node1/cpulist", "4-7\n");
+    }
+};
+
+/*! \brief Adds a GPU with the types of the tests, 4 GiB and 16 GiB instances. */
+static bool add_gpu(struct Placement* engine, uint32_t gpu_id, int32_t node, uint64_t fb)
+{
+    struct PlacementType small = { 1, 4, 4 * GIB, 0 };
+    struct PlacementType large = { 2, 1, 16 * GIB - 64 * (1 << 20), 64 * (1 << 20) };
+
+    return placement_add_gpu(engine, gpu_id, node, fb) &&
+           placement_add_type(engine, gpu_id, &small) &&
+           placement_add_type(engine, gpu_id, &large);
+}
+
+/*! \brief Places an instance, returning its GPU or 0 if it did not fit. */
+static uint32_t place(struct Placement* engine, uint32_t type, enum PlacementPolicy policy,
+                      const struct CpuSet* cpus = NULL)
+{
+    struct PlacementRequest request = { type, policy, cpus };
+    uint32_t gpu_id = 0;
+
+    return placement_place(engine, &request, &gpu_id) ? gpu_id : 0;
+}
+
+bool placement_pack()
+{
+    struct Placement* engine = placement_create();
+    bool ret = engine != NULL && add_gpu(engine, 1, -1, 16 * GIB) && add_gpu(engine, 2, -1, 16 * GIB);
+
+    for (int i = 0; ret && i < 4; ++i)
+        ret = place(engine, 1, PLACEMENT_PACK) == 1;
+
+    ret = ret && place(engine, 2, PLACEMENT_PACK) == 2 && place(engine, 1, PLACEMENT_PACK) == 0;
+
+    placement_free(engine);
+
+    return ret;
+}
+
+bool placement_spread()
+{
+    struct Placement* engine = placement_create();
+    bool ret = engine != NULL && add_gpu(engine, 1, -1, 16 * GIB) && add_gpu(engine, 2, -1, 16 * GIB);
+    uint32_t per_gpu[3] = {};
+
+    for (int i = 0; ret && i < 4; ++i)
+        ++per_gpu[place(engine, 1, PLACEMENT_SPREAD)];
+
+    struct PlacementGpuStats stats;
+
+    ret = ret && per_gpu[0] == 0 && per_gpu[1] == 2 && per_gpu[2] == 2 &&
+          place(engine, 2, PLACEMENT_SPREAD) == 0 &&
+          placement_gpu_stats(engine, 1, &stats) && stats.instances == 2 &&
+          stats.fb_used == 8 * GIB && stats.fb_total == 16 * GIB;
+
+    placement_free(engine);
+
+    return ret;
+}
+
+bool placement_limits()
+{
+    struct Placement* engine = placement_create();
+    struct PlacementType small = { 1, 2, GIB, 0 };
+    struct PlacementType medium = { 2, 4, 3 * GIB - (1 << 20), 1 << 20 };
+    bool ret = engine != NULL && placement_add_gpu(engine, 7, -1, 8 * GIB) &&
+               !placement_add_gpu(engine, 7, -1, 8 * GIB) &&
+               placement_add_type(engine, 7, &small) && placement_add_type(engine, 7, &medium) &&
+               !placement_add_type(engine, 8, &small);
+
+    ret = ret && place(engine, 1, PLACEMENT_PACK) == 7 && place(engine, 1, PLACEMENT_PACK) == 7 &&
+          place(engine, 1, PLACEMENT_PACK) == 0;
+
+    /* 2 GiB are used, two 3 GiB instances fit before the framebuffer runs out. */
+    ret = ret && place(engine, 2, PLACEMENT_PACK) == 7 && place(engine, 2, PLACEMENT_PACK) == 7 &&
+          place(engine, 2, PLACEMENT_PACK) == 0;
+
+    ret = ret && placement_release(engine, 7, 2) && place(engine, 2, PLACEMENT_PACK) == 7 &&
+          place(engine, 3, PLACEMENT_PACK) == 0 && !placement_release(engine, 8, 2) &&
+          !placement_release(engine, 7, 3);
+
+    ret = ret && placement_release(engine, 7, 1) && placement_release(engine, 7, 1) &&
+          !placement_release(engine, 7, 1);
+
+    placement_free(engine);
+
+    return ret;
+}
+
+bool placement_numa()
+{
+    NodeFixture fixture;
+    struct Placement* engine = placement_create();
+    struct CpuSet cpus;
+    bool ret = fixture.valid() && engine != NULL && cpulist_parse("5", &cpus) &&
+               add_gpu(engine, 1, 0, 16 * GIB) && add_gpu(engine, 2, 1, 16 * GIB) &&
+               add_gpu(engine, 3, -1, 16 * GIB);
+
+    /* Packing alone would fill the half used GPU of node 0 first. */
+    ret = ret && placement_set_instances(engine, 1, 1, 2);
+
+    for (int i = 0; ret && i < 4; ++i)
+        ret = place(engine, 1, PLACEMENT_NUMA_FIRST, &cpus) == 2;
+
+    ret = ret && place(engine, 1, PLACEMENT_NUMA_FIRST, &cpus) == 1 &&
+          place(engine, 1, PLACEMENT_PACK) == 1 && place(engine, 1, PLACEMENT_NUMA_FIRST) == 3;
+
+    placement_free(engine);
+
+    return ret;
+}
+
+bool placement_occupancy()
+{
+    struct Placement* engine = placement_create();
+    struct PlacementType small = { 1, 4, 4 * GIB, 0 };
+    bool ret = engine != NULL && placement_add_gpu(engine, 1, -1, 16 * GIB) &&
+               placement_add_gpu(engine, 2, -1, 16 * GIB) && add_gpu(engine, 3, -1, 16 * GIB) &&
+               placement_add_type(engine, 1, &small) && placement_add_type(engine, 2, &small);
+
+    ret = ret && placement_set_instances(engine, 1, 1, 3) && !placement_set_instances(engine, 1, 1, 5) &&
+          !placement_set_instances(engine, 1, 2, 1) && place(engine, 1, PLACEMENT_PACK) == 1;
+
+    ret = ret && placement_set_instances(engine, 3, 1, 1);
+
+    const uint32_t session_gpus[] = { 1, 1, 2, 2, 2, 3, 3 };
+    struct VmSession sessions[7] = {};
+    struct VmSessionView view = {};
+
+    for (size_t i = 0; i < 7; ++i) {
+        sessions[i].gpu_id = session_gpus[i];
+        sessions[i].mdev_type = 1;
+    }
+
+    /* An unknown type counts for the only type of GPU 2. */
+    sessions[4].mdev_type = 0;
+    view.size = 7;
+    view.sessions = sessions;
+
+    struct PlacementGpuStats stats;
+
+    /* Two of the instances of GPU 1 did not start yet, GPU 3 started its set instance. */
+    ret = ret && placement_sync_sessions(engine, &view) == 3 &&
+          placement_gpu_stats(engine, 1, &stats) && stats.instances == 4 &&
+          placement_gpu_stats(engine, 2, &stats) && stats.instances == 3 &&
+          placement_gpu_stats(engine, 3, &stats) && stats.instances == 2 &&
+          place(engine, 1, PLACEMENT_PACK) == 2;
+
+    /* A VM of GPU 1 exited, the instance placed on GPU 2 is still pending. */
+    view.size = 6;
+    view.sessions = sessions + 1;
+
+    ret = ret && placement_sync_sessions(engine, &view) == 3 &&
+          placement_gpu_stats(engine, 1, &stats) && stats.instances == 3 && stats.fb_used == 12 * GIB &&
+          placement_gpu_stats(engine, 2, &stats) && stats.instances == 4;
+
+    struct MDevRequest requests[2] = {};
+
+    requests[0].num = 5;
+    requests[0].max_inst = 2;
+    requests[0].fb_len = 7 * 1024;
+    requests[0].fb_res = 1024;
+    requests[1].num = 6;
+    requests[1].max_inst = 1;
+    requests[1].fb_len = 16 * 1024;
+
+    ret = ret && placement_add_gpu(engine, 4, -1, 16 * GIB) && placement_add_requests(engine, 4, requests, 2) == 2 &&
+          place(engine, 5, PLACEMENT_PACK) == 4 && place(engine, 5, PLACEMENT_PACK) == 4 &&
+          place(engine, 5, PLACEMENT_PACK) == 0 && place(engine, 6, PLACEMENT_PACK) == 0;
+
+    placement_free(engine);
+
+    return ret;
+}
+
+/*! \brief GPU of the linear scan the indexes are checked against. */
+struct ScanGpu {
+    uint32_t gpu_id;
+    uint64_t fb_total;
+    uint64_t fb_used;
+    uint32_t instances[3];
+};
+
+bool placement_scale()
+{
+    const uint32_t NUM_GPUS = 4096;
+    const uint32_t NUM_OPS = 200000;
+    const uint32_t max_instances[3] = { 0, 4, 1 };
+    const uint64_t need[3] = { 0, 4 * GIB, 16 * GIB };
+    struct Placement* engine = placement_create();
+    std::vector<ScanGpu> gpus;
+    std::mt19937 rng(49);
+    bool ret = engine != NULL;
+
+    for (uint32_t i = 0; ret && i < NUM_GPUS; ++i) {
+        uint32_t gpu_id = 0x100 + i * 3;
+        uint64_t fb = (i % 3 + 1) * 16 * GIB;
+
+        ret = add_gpu(engine, gpu_id, -1, fb);
+        gpus.push_back({ gpu_id, fb, 0, {} });
+    }
+
+    std::chrono::nanoseconds elapsed {};
+    uint64_t placements = 0;
+
+    for (uint32_t op = 0; ret && op < NUM_OPS; ++op) {
+        uint32_t type = rng() % 8 == 0 ? 2 : 1;
+
+        if (rng() % 5 < 2) {
+            ScanGpu& gpu = gpus[rng() % NUM_GPUS];
+
+            if (gpu.instances[type] > 0) {
+                --gpu.instances[type];
+                gpu.fb_used -= need[type];
+                ret = placement_release(engine, gpu.gpu_id, type);
+            }
+
+            continue;
+        }
+
+        enum PlacementPolicy policy = rng() % 2 ? PLACEMENT_PACK : PLACEMENT_SPREAD;
+        ScanGpu* best = NULL;
+
+        for (ScanGpu& gpu : gpus) {
+            uint64_t free = gpu.fb_total - gpu.fb_used;
+
+            if (gpu.instances[type] >= max_instances[type] || free < need[type])
+                continue;
+
+            uint64_t best_free = best != NULL ? best->fb_total - best->fb_used : 0;
+
+            if (best == NULL || (policy == PLACEMENT_PACK ? free < best_free : free >= best_free))
+                best = &gpu;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        uint32_t gpu_id = place(engine, type, policy);
+        elapsed += std::chrono::steady_clock::now() - start;
+        ++placements;
+
+        ret = gpu_id == (best != NULL ? best->gpu_id : 0);
+
+        if (best != NULL) {
+            ++best->instances[type];
+            best->fb_used += need[type];
+        }
+    }
+
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+
+    cout << "\tplacements: " << placements << " ops over " << NUM_GPUS << " GPUs in " << us / 1000
+         << " ms (" << (us > 0 ? placements * 1000000 / us : placements) << " ops/s)\n";
+
+    placement_free(engine);
+
+    return ret;
+}
+
+int main()
+{
+    const uint32_t NUM_TESTS = 6;
+
+    const std::string test_names[] = {
+        "Packing",
+        "Spreading",
+        "Limits",
+        "NUMA Locality",
+        "Occupancy",
+        "Scale"
+    };
+    const std::string test_details[] = {
+        "Small instances were spread, leaving no GPU for a large one.",
+        "Instances were not spread over the emptiest GPUs.",
+        "An instance limit or the framebuffer of a GPU was exceeded, or a release was wrong.",
+        "A remote GPU was chosen while a local one had room, or no fallback happened.",
+        "The instances set from outside or from the sessions were not taken into account.",
+        "The indexes chose another GPU than a scan of every GPU."
+    };
+
+    bool (*tests[])(void) = {
+        placement_pack, placement_spread, placement_limits, placement_numa,
+        placement_occupancy, placement_scale
+    };
+
+    uint32_t failures = 0;
+
+    for (uint32_t i = 0; i < NUM_TESTS; ++i) {
+        bool test_result = tests[i]() == 1;
+
+        if (test_result)
+            cout << GREEN_COLOR << test_names[i]
+                 << " succeeded" RESET_COLOR "\n";
+        else {
+            ++failures;
+            cout << RED_COLOR << test_names[i]
+                 << ": " << test_details[i]
+                 << RESET_COLOR "\n";
+        }
+    }
+
+    if (failures == 0)
+        cout << GREEN_COLOR << "All tests succeeded" RESET_COLOR "\n";
+    else
+        cout << RED_COLOR << failures << "/"
+             << NUM_TESTS << " tests failed" RESET_COLOR "\n";
+}
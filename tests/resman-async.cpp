@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <iostream>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <gpu/nvidia/resman/api.h>
+#include <gpu/nvidia/resman/async.h>
+#include <gpu/nvidia/resman/ioctl.h>
+
+#include <utils/colors.h>
+#include <utils/epoch.h>
+
+#include "sim-rm.hpp"
+
+using std::cout;
+
+/*! \page resman-async-test RM Asynchronous Executor Test
+ *
+ * \tableofcontents
+ *
+ * These tests issue asynchronous RM operations on a simulated RM Core installed with rm_set_ioctl. The following
+ * tests are implemented:
+ *
+ * -# \ref async-future - Waits on an asynchronous control as a future.
+ * -# \ref async-notify - Reports completions through callbacks and an eventfd.
+ * -# \ref async-order - Issues the operations of a GPU in submission order.
+ * -# \ref async-cancel - Cancels an operation queued behind a blocked one.
+ * -# \ref async-deadline - Expires an operation whose deadline passed while queued.
+ *
+ * \section async-future Asynchronous Future
+ *
+ * This test determines if an asynchronous allocation and control can be waited on. The pseudo-code that is executed
+ * to determine if this test is a success is:
+ *
+ * ```{.c}
+ * op = rm_alloc_res_async(async, 0, fd, NULL, 0, 0, NULL, NULL), rm_async_wait(op, -1) == RM_ASYNC_DONE,
+ * op = rm_ctrl_res_async(async, 0, fd, client, client, cmd, &data, size, NULL),
+ * rm_async_wait(op, -1) == RM_ASYNC_DONE && rm_async_result(op) == &data
+ * ```
+ *
+ * \section async-notify Asynchronous Notification
+ *
+ * This test determines if the completions of controls for several GPUs are reported. The pseudo-code that is
+ * executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * for gpu in GPUS: for i in CTRLS: rm_ctrl_res_async(..., {callback, user, event_fd, 0})
+ * callbacks == GPUS * CTRLS && read(event_fd) == GPUS * CTRLS
+ * ```
+ *
+ * \section async-order Asynchronous Order
+ *
+ * This test determines if controls queued for the same GPU are issued in order. The pseudo-code that is executed to
+ * determine if this test is a success is:
+ *
+ * ```{.c}
+ * for i in CTRLS: rm_ctrl_res_async(async, gpu, fd, client, client, i, ...), issued commands == 0..CTRLS
+ * ```
+ *
+ * \section async-cancel Asynchronous Cancel
+ *
+ * This test determines if a queued operation can be cancelled before it is issued. The pseudo-code that is executed
+ * to determine if this test is a success is:
+ *
+ * ```{.c}
+ * blocked = rm_ctrl_res_async(..., BLOCK_CMD, ...), op = rm_ctrl_res_async(...),
+ * rm_async_cancel(op) && rm_async_state(op) == RM_ASYNC_CANCELLED && op was not issued
+ * ```
+ *
+ * \section async-deadline Asynchronous Deadline
+ *
+ * This test determines if an operation expires when its deadline passes before it is issued. The pseudo-code that is
+ * executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * blocked = rm_ctrl_res_async(..., BLOCK_CMD, ...), op = rm_ctrl_res_async(..., {NULL, NULL, -1, 1}),
+ * sleep(10ms), unblock, rm_async_wait(op, -1) == RM_ASYNC_EXPIRED
+ * ```
+ */
+
+//! Control command which blocks until it is released.
+static const uint32_t BLOCK_CMD = 0xB10C;
+
+//! If a blocked control may return.
+static std::atomic<bool> sim_release(false);
+
+//! If a blocked control is being issued.
+static std::atomic<bool> sim_blocked(false);
+
+//! Commands issued by the simulated RM Core.
+static std::vector<uint32_t> sim_commands;
+
+//! Lock protecting the issued commands.
+static std::mutex sim_lock;
+
+/*! \brief Issues an ioctl on the simulated RM Core, which records the controls and blocks on BLOCK_CMD. */
+int sim_ioctl(int fd, unsigned long request, void* data)
+{
+    if (fd != SIM_FD || request != NV_CONTROL_RES)
+        return sim_rm_ioctl(fd, request, data);
+
+    struct RmControlRes* ctrl_res = (struct RmControlRes*) data;
+
+    if (ctrl_res->cmd == BLOCK_CMD) {
+        sim_blocked = true;
+        while (!sim_release.load())
+            usleep(100);
+        sim_blocked = false;
+    }
+
+    std::lock_guard<std::mutex> guard(sim_lock);
+    sim_commands.push_back(ctrl_res->cmd);
+    ctrl_res->status = 0;
+
+    return 0;
+}
+
+bool async_future()
+{
+    struct RmAsync* async = rm_async_create(2);
+    uint32_t data = 0;
+    bool ret = false;
+
+    if (async == NULL)
+        return false;
+
+    struct RmAsyncOp* op = rm_alloc_res_async(async, 0, SIM_FD, NULL, 0, 0, NULL, NULL);
+    struct NvResource* client = NULL;
+
+    if (op != NULL && rm_async_wait(op, -1) == RM_ASYNC_DONE)
+        client = (struct NvResource*) rm_async_result(op);
+    rm_async_release(op);
+
+    if (client != NULL) {
+        op = rm_ctrl_res_async(async, 0, SIM_FD, client->client, client->object, 1, &data, sizeof(data), NULL);
+        ret = op != NULL && rm_async_wait(op, -1) == RM_ASYNC_DONE && rm_async_result(op) == &data;
+        rm_async_release(op);
+        rm_free_tree(SIM_FD, client);
+    }
+
+    rm_async_destroy(async);
+
+    return ret;
+}
+
+//! Number of completion callbacks.
+static std::atomic<uint32_t> callbacks(0);
+
+void count_callback(struct RmAsyncOp* op, void* user)
+{
+    if (rm_async_state(op) == RM_ASYNC_DONE && user == &callbacks)
+        ++callbacks;
+}
+
+bool async_notify()
+{
+    const uint32_t GPUS = 8;
+    const uint32_t CTRLS = 64;
+
+    struct RmAsync* async = rm_async_create(4);
+    int event_fd = eventfd(0, 0);
+    uint32_t data = 0;
+    uint64_t events = 0;
+    std::vector<struct RmAsyncOp*> ops;
+
+    if (async == NULL || event_fd == -1)
+        return false;
+
+    struct RmAsyncCompletion completion = {count_callback, &callbacks, event_fd, 0};
+
+    for (uint32_t gpu = 0; gpu < GPUS; ++gpu)
+        for (uint32_t i = 0; i < CTRLS; ++i)
+            ops.push_back(rm_ctrl_res_async(async, gpu, SIM_FD, 1, 1, 2, &data, sizeof(data), &completion));
+
+    for (auto op : ops) {
+        rm_async_wait(op, -1);
+        rm_async_release(op);
+    }
+
+    rm_async_destroy(async);
+
+    bool ret = read(event_fd, &events, sizeof(events)) == sizeof(events) &&
+               events == GPUS * CTRLS && callbacks == GPUS * CTRLS;
+
+    close(event_fd);
+
+    return ret;
+}
+
+bool async_order()
+{
+    const uint32_t CTRLS = 256;
+
+    struct RmAsync* async = rm_async_create(4);
+    uint32_t data = 0;
+    struct RmAsyncOp* last = NULL;
+
+    if (async == NULL)
+        return false;
+
+    sim_commands.clear();
+
+    for (uint32_t i = 0; i < CTRLS; ++i) {
+        rm_async_release(last);
+        last = rm_ctrl_res_async(async, 7, SIM_FD, 1, 1, i, &data, sizeof(data), NULL);
+    }
+
+    rm_async_wait(last, -1);
+    rm_async_release(last);
+    rm_async_destroy(async);
+
+    bool ret = sim_commands.size() == CTRLS;
+
+    for (uint32_t i = 0; ret && i < CTRLS; ++i)
+        ret = sim_commands[i] == i;
+
+    return ret;
+}
+
+bool async_cancel()
+{
+    struct RmAsync* async = rm_async_create(1);
+    uint32_t data = 0;
+
+    if (async == NULL)
+        return false;
+
+    sim_commands.clear();
+    sim_release = false;
+
+    struct RmAsyncOp* blocked = rm_ctrl_res_async(async, 0, SIM_FD, 1, 1, BLOCK_CMD, &data, sizeof(data), NULL);
+    struct RmAsyncOp* op = rm_ctrl_res_async(async, 0, SIM_FD, 1, 1, 3, &data, sizeof(data), NULL);
+
+    while (!sim_blocked.load())
+        usleep(100);
+
+    bool ret = rm_async_cancel(op) && rm_async_state(op) == RM_ASYNC_CANCELLED &&
+               !rm_async_cancel(blocked) && rm_async_wait(blocked, 1) == RM_ASYNC_PENDING;
+
+    sim_release = true;
+    ret = ret && rm_async_wait(blocked, -1) == RM_ASYNC_DONE;
+
+    rm_async_release(op);
+    rm_async_release(blocked);
+    rm_async_destroy(async);
+
+    return ret && sim_commands.size() == 1 && sim_commands[0] == BLOCK_CMD;
+}
+
+bool async_deadline()
+{
+    struct RmAsync* async = rm_async_create(1);
+    uint32_t data = 0;
+
+    if (async == NULL)
+        return false;
+
+    sim_commands.clear();
+    sim_release = false;
+
+    struct RmAsyncCompletion completion = {NULL, NULL, -1, 1};
+    struct RmAsyncOp* blocked = rm_ctrl_res_async(async, 0, SIM_FD, 1, 1, BLOCK_CMD, &data, sizeof(data), NULL);
+    struct RmAsyncOp* op = rm_ctrl_res_async(async, 0, SIM_FD, 1, 1, 4, &data, sizeof(data), &completion);
+
+    usleep(10000);
+    sim_release = true;
+
+    bool ret = rm_async_wait(op, -1) == RM_ASYNC_EXPIRED && rm_async_result(op) == NULL;
+
+    rm_async_release(op);
+    rm_async_release(blocked);
+    rm_async_destroy(async);
+
+    return ret && sim_commands.size() == 1;
+}
+
+int main()
+{
+    const uint32_t NUM_TESTS = 5;
+
+    const std::string test_names[] = {
+        "Asynchronous Future",
+        "Asynchronous Notification",
+        "Asynchronous Order",
+        "Asynchronous Cancel",
+        "Asynchronous Deadline"
+    };
+    const std::string test_details[] = {
+        "The asynchronous allocation or control did not complete.",
+        "Not every completion was reported through the callback and eventfd.",
+        "The controls of a GPU were not issued in submission order.",
+        "The queued control was issued or not reported as cancelled.",
+        "The queued control was issued after its deadline."
+    };
+
+    bool (*tests[])(void) = {
+        async_future, async_notify, async_order, async_cancel, async_deadline
+    };
+
+    uint32_t failures = 0;
+
+    rm_set_ioctl(sim_ioctl);
+
+    for (uint32_t i = 0; i < NUM_TESTS; ++i) {
+        bool test_result = tests[i]() == 1;
+
+        if (test_result)
+            cout << GREEN_COLOR << test_names[i]
+                 << " succeeded" RESET_COLOR "\n";
+        else {
+            ++failures;
+            cout << RED_COLOR << test_names[i]
+                 << ": " << test_details[i]
+                 << RESET_COLOR "\n";
+        }
+    }
+
+    rm_set_ioctl(NULL);
+    epoch_barrier();
+
+    if (failures == 0)
+        cout << GREEN_COLOR << "All tests succeeded" RESET_COLOR "\n";
+    else
+        cout << RED_COLOR << failures << "/"
+             << NUM_TESTS << " tests failed" RESET_COLOR "\n";
+}
@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <gpu/nvidia/resman/api.h>
+#include <gpu/nvidia/resman/classes.h>
+
+#include <utils/colors.h>
+
+#include "sim-rm.hpp"
+
+using std::cout;
+
+/*! \page resman-attach-test RM GPU Attachment Test
+ *
+ * \tableofcontents
+ *
+ * These tests check how GPUs are attached to and detached from the driver in batches. The
+ * ioctls are routed to a simulated RM Core through rm_set_ioctl, which attaches the GPUs of a
+ * control in order and reports the first one it cannot attach. The following tests are
+ * implemented:
+ *
+ * -# \ref attach-batched - Attaches the GPUs with one control per 32 GPUs.
+ * -# \ref attach-fallback - Retries the GPUs a failed batch did not attach.
+ * -# \ref detach-batched - Detaches the GPUs with one control per 32 GPUs.
+ * -# \ref detach-fallback - Detaches the GPUs one at a time when a batch fails.
+ *
+ * \section attach-batched Batched Attachment
+ *
+ * This test determines if 40 GPUs are attached with two controls. The pseudo-code that is
+ * executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * rm_attach_gpus(fd, client, ids, 40, attached) == 40 && calls == (ids[0..32], ids[32..40]) &&
+ * every attached
+ * ```
+ *
+ * \section attach-fallback Attachment Fallback
+ *
+ * This test determines if the GPUs before the failed_gpu_id of a failed batch count as
+ * attached, the reported GPU is not retried and the others are retried one at a time. The
+ * pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * unattachable = (ids[5], ids[20]), rm_attach_gpus(fd, client, ids, 40, attached) == 38 &&
+ * calls == (ids[0..32], ids[6], ..., ids[31], ids[32..40]) && !attached[5] && !attached[20]
+ * ```
+ *
+ * \section detach-batched Batched Detachment
+ *
+ * This test determines if 40 GPUs are detached with two controls. The pseudo-code that is
+ * executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * rm_detach_gpus(fd, client, ids, 40), calls == (ids[0..32], ids[32..40]) && none attached
+ * ```
+ *
+ * \section detach-fallback Detachment Fallback
+ *
+ * This test determines if every GPU of a failed batch is detached on its own. The pseudo-code
+ * that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * batch_fails = true, rm_detach_gpus(fd, client, ids, 40),
+ * calls == (ids[0..32], ids[0], ..., ids[31], ids[32..40], ids[32], ..., ids[39]) && none attached
+ * ```
+ */
+
+//! Number of GPUs attached and detached by the tests.
+static const uint32_t NUM_GPUS = 40;
+
+/*! \brief Returns the ids of the GPUs of the tests. */
+static std::vector<uint32_t> gpu_ids()
+{
+    std::vector<uint32_t> ret;
+
+    for (uint32_t i = 0; i < NUM_GPUS; ++i)
+        ret.push_back(0x100 * (i + 1));
+
+    return ret;
+}
+
+/*! \brief Returns the GPU ids from first to last, excluded. */
+static std::vector<uint32_t> slice(const std::vector<uint32_t>& ids, uint32_t first, uint32_t last)
+{
+    return std::vector<uint32_t>(ids.begin() + first, ids.begin() + last);
+}
+
+bool attach_batched()
+{
+    sim_reset();
+
+    struct NvResource* client = rm_alloc_res(SIM_FD, NULL, 0, 0, NULL);
+    std::vector<uint32_t> ids = gpu_ids();
+    uint8_t attached[NUM_GPUS] = {};
+
+    bool ret = client != NULL && rm_attach_gpus(SIM_FD, client, ids.data(), NUM_GPUS, attached) == NUM_GPUS;
+
+    ret = ret && sim_attach_calls.size() == 2;
+    ret = ret && sim_attach_calls[0] == slice(ids, 0, 32) && sim_attach_calls[1] == slice(ids, 32, NUM_GPUS);
+    ret = ret && sim_attached.size() == NUM_GPUS;
+
+    for (uint32_t i = 0; i < NUM_GPUS; ++i)
+        ret = ret && attached[i] == 1;
+
+    rm_free_tree(SIM_FD, client);
+
+    return ret;
+}
+
+bool attach_fallback()
+{
+    sim_reset();
+
+    struct NvResource* client = rm_alloc_res(SIM_FD, NULL, 0, 0, NULL);
+    std::vector<uint32_t> ids = gpu_ids();
+    uint8_t attached[NUM_GPUS] = {};
+
+    sim_unattachable = {ids[5], ids[20]};
+
+    bool ret = client != NULL && rm_attach_gpus(SIM_FD, client, ids.data(), NUM_GPUS, attached) == NUM_GPUS - 2;
+
+    /* The batch, the GPUs after ids[5] one at a time, then the next batch. */
+    std::vector<std::vector<uint32_t>> expected = {slice(ids, 0, 32)};
+
+    for (uint32_t i = 6; i < 32; ++i)
+        expected.push_back({ids[i]});
+    expected.push_back(slice(ids, 32, NUM_GPUS));
+
+    ret = ret && sim_attach_calls == expected;
+    ret = ret && sim_attached.size() == NUM_GPUS - 2;
+
+    for (uint32_t i = 0; i < NUM_GPUS; ++i)
+        ret = ret && attached[i] == (i != 5 && i != 20);
+
+    rm_free_tree(SIM_FD, client);
+
+    return ret;
+}
+
+bool detach_batched()
+{
+    sim_reset();
+
+    std::vector<uint32_t> ids = gpu_ids();
+
+    sim_attached.insert(ids.begin(), ids.end());
+
+    rm_detach_gpus(SIM_FD, 0x1, ids.data(), NUM_GPUS);
+
+    bool ret = sim_detach_calls.size() == 2;
+
+    ret = ret && sim_detach_calls[0] == slice(ids, 0, 32) && sim_detach_calls[1] == slice(ids, 32, NUM_GPUS);
+
+    return ret && sim_attached.empty();
+}
+
+bool detach_fallback()
+{
+    sim_reset();
+
+    std::vector<uint32_t> ids = gpu_ids();
+    std::vector<std::vector<uint32_t>> expected = {slice(ids, 0, 32)};
+
+    sim_attached.insert(ids.begin(), ids.end());
+    sim_detach_batch_fails = true;
+
+    rm_detach_gpus(SIM_FD, 0x1, ids.data(), NUM_GPUS);
+
+    for (uint32_t i = 0; i < 32; ++i)
+        expected.push_back({ids[i]});
+    expected.push_back(slice(ids, 32, NUM_GPUS));
+    for (uint32_t i = 32; i < NUM_GPUS; ++i)
+        expected.push_back({ids[i]});
+
+    return sim_detach_calls == expected && sim_attached.empty();
+}
+
+int main()
+{
+    const uint32_t NUM_TESTS = 4;
+
+    const std::string test_names[] = {
+        "Batched Attachment",
+        "Attachment Fallback",
+        "Batched Detachment",
+        "Detachment Fallback"
+    };
+    const std::string test_details[] = {
+        "The GPUs were not attached with one control per 32 GPUs.",
+        "The GPUs of a failed batch were not retried or the failed GPU was reported attached.",
+        "The GPUs were not detached with one control per 32 GPUs.",
+        "The GPUs of a failed batch were not detached one at a time."
+    };
+
+    bool (*tests[])(void) = {
+        attach_batched, attach_fallback, detach_batched, detach_fallback
+    };
+
+    rm_set_ioctl(sim_rm_ioctl);
+
+    uint32_t failures = 0;
+
+    for (uint32_t i = 0; i < NUM_TESTS; ++i) {
+        bool test_result = tests[i]() == 1;
+
+        if (test_result)
+            cout << GREEN_COLOR << test_names[i]
+                 << " succeeded" RESET_COLOR "\n";
+        else {
+            ++failures;
+            cout << RED_COLOR << test_names[i]
+                 << ": " << test_details[i]
+                 << RESET_COLOR "\n";
+        }
+    }
+
+    rm_set_ioctl(NULL);
+
+    if (failures == 0)
+        cout << GREEN_COLOR << "All tests succeeded" RESET_COLOR "\n";
+    else
+        cout << RED_COLOR << failures << "/"
+             << NUM_TESTS << " tests failed" RESET_COLOR "\n";
+}
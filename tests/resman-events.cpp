@@ -0,0 +1,397 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <iostream>
+#include <chrono>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include <gpu/nvidia/resman/api.h>
+#include <gpu/nvidia/resman/classes.h>
+#include <gpu/nvidia/resman/events.h>
+#include <gpu/nvidia/resman/ioctl.h>
+
+#include <gvm/nvidia/manager.h>
+
+#include <utils/colors.h>
+
+#include "sim-rm.hpp"
+
+using std::cout;
+
+/*! \page resman-events-test RM Event Hub Test
+ *
+ * \tableofcontents
+ *
+ * These tests check the hub multiplexing the RM events on one file. The ioctls are routed to a
+ * simulated RM Core through rm_set_ioctl, which queues the data of the events it fires on the
+ * file they were allocated for and signals it through an eventfd. The following tests are
+ * implemented:
+ *
+ * -# \ref events-register - Shares one file across clients and events.
+ * -# \ref events-demux - Tells the events apart by their data.
+ * -# \ref events-batch - Reads queued events in batches.
+ * -# \ref events-empty - Reports no event on a wake without data.
+ * -# \ref events-remove - Frees the events.
+ * -# \ref events-vm - Counts the VM start and bind requests.
+ *
+ * \section events-register Shared File
+ *
+ * This test determines if events of several clients and parents notify one file, with one
+ * operating system event per client, and if the notification flags reach the event objects.
+ * The pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * for (client : 8) for (parent : 8) rm_event_hub_add(hub, client, parent, cmd, notify, flags),
+ * os_events == 8 && all on rm_event_hub_fd(hub) && rm_event_hub_size(hub) == 64 &&
+ * every event notify == notify | flags
+ * ```
+ *
+ * \section events-demux Demultiplexing
+ *
+ * This test determines if fired events are read in order and events of unknown objects are
+ * dropped. The pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * fire(a), fire(unknown), fire(c), fire(a), poll(fd), rm_event_hub_read(hub) == (a, c, a),
+ * !readable(fd)
+ * ```
+ *
+ * \section events-batch Batched Reads
+ *
+ * This test determines if a read stops at the size of its buffer and the next read continues
+ * with the queued events. The pseudo-code that is executed to determine if this test is a
+ * success is:
+ *
+ * ```{.c}
+ * fire() * 40, rm_event_hub_read(hub, 16) == 16, 16, 8
+ * ```
+ *
+ * \section events-empty Empty Wake
+ *
+ * This test determines if a wake without queued data reports no event and consumes the wake,
+ * so only the events whose data was read reach their owners. The pseudo-code that is executed
+ * to determine if this test is a success is:
+ *
+ * ```{.c}
+ * signal(fd), rm_event_hub_read(hub) == (), !readable(fd), fire(b), rm_event_hub_read(hub) == (b)
+ * ```
+ *
+ * \section events-remove Event Removal
+ *
+ * This test determines if removed events are freed and no longer reported, and if freeing the
+ * hub frees the remaining events. The pseudo-code that is executed to determine if this test
+ * is a success is:
+ *
+ * ```{.c}
+ * rm_event_hub_remove(hub, a), fire(a), fire(b), rm_event_hub_read(hub) == (b),
+ * rm_event_hub_free(hub), live == 0
+ * ```
+ *
+ * \section events-vm VM Events
+ *
+ * This test determines if the VM start and bind requests are counted from the shared file,
+ * if draining hands out every start request, and measures the events read per second. The
+ * pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * fire(start) * 2, fire(bind), read_vm_events(mgr) == 3 && starts == 2 && binds == 1,
+ * signal(fd), read_vm_events(mgr) == 0 && starts == 0 && binds == 0,
+ * fire(start) * 2, fire(bind), drain_vm_events(mgr, count) == (2, 1) && counted == 2
+ * ```
+ */
+
+/*! \brief Issues an ioctl on the simulated RM Core, where freeing an unknown event fails. */
+int sim_ioctl(int fd, unsigned long request, void* data)
+{
+    if (request == NV_FREE_RES && fd == SIM_FD) {
+        struct RmFreeRes* free_res = (struct RmFreeRes*) data;
+
+        if (sim_events.count(free_res->hObjectOld) == 0) {
+            free_res->status = SIM_ERROR;
+            return 0;
+        }
+    }
+
+    return sim_rm_ioctl(fd, request, data);
+}
+
+/*! \brief Checks if a file is readable without waiting. */
+static bool readable(int fd)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+
+    return poll(&pfd, 1, 0) == 1;
+}
+
+/*! \brief Creates a hub on the simulated RM Core. */
+static struct RmEventHub* sim_hub()
+{
+    return rm_event_hub_create_fd(SIM_FD, eventfd(0, EFD_NONBLOCK));
+}
+
+bool events_register()
+{
+    sim_reset();
+
+    struct RmEventHub* hub = sim_hub();
+    std::set<uint32_t> handles;
+
+    for (uint32_t client = 1; client <= 8; ++client)
+        for (uint32_t parent = 0; parent < 8; ++parent)
+            handles.insert(rm_event_hub_add(hub, client, client * 0x100 + parent, NV2080_SET_NOTIFICATION, parent, RM_EVENT_NONSTALL));
+
+    bool ret = hub != NULL && handles.size() == 64 && handles.count(0) == 0;
+
+    ret = ret && sim_os_events.size() == 1 && sim_os_events.count(rm_event_hub_fd(hub)) == 1;
+    ret = ret && sim_os_events[rm_event_hub_fd(hub)].size() == 8;
+    ret = ret && rm_event_hub_clients(hub) == 8 && rm_event_hub_size(hub) == 64;
+    ret = ret && sim_events.size() == 64 && sim_notifications == 64;
+
+    for (auto& event : sim_events)
+        ret = ret && event.second.notify == ((event.second.parent & 0xFF) | RM_EVENT_NONSTALL);
+
+    rm_event_hub_free(hub);
+
+    return ret && sim_events.empty();
+}
+
+bool events_demux()
+{
+    sim_reset();
+
+    struct RmEventHub* hub = sim_hub();
+    uint32_t a = rm_event_hub_add(hub, 1, 1, NV0000_SET_NOTIFICATION, 2, 0);
+    uint32_t b = rm_event_hub_add(hub, 1, 1, NV0000_SET_NOTIFICATION, 3, 0);
+    uint32_t c = rm_event_hub_add(hub, 1, 0x100, NV2080_SET_NOTIFICATION, 7, 0);
+    int fd = rm_event_hub_fd(hub);
+    struct RmEventData events[8];
+
+    sim_fire(a);
+    sim_fire(0xBAD, fd);
+    sim_fire(c);
+    sim_fire(a);
+
+    bool ret = a != 0 && b != 0 && c != 0 && readable(fd);
+    size_t count = rm_event_hub_read(hub, events, 8);
+
+    ret = ret && count == 3;
+    ret = ret && events[0].object == a && events[0].notify == 2 && events[0].info32 == 0x1234;
+    ret = ret && events[1].object == c && events[1].notify == 7;
+    ret = ret && events[2].object == a;
+    ret = ret && !readable(fd);
+
+    rm_event_hub_free(hub);
+
+    return ret;
+}
+
+bool events_batch()
+{
+    sim_reset();
+
+    struct RmEventHub* hub = sim_hub();
+    uint32_t a = rm_event_hub_add(hub, 1, 1, NV0000_SET_NOTIFICATION, 2, 0);
+    struct RmEventData events[16];
+
+    for (uint32_t i = 0; i < 40; ++i)
+        sim_fire(a);
+
+    bool ret = rm_event_hub_read(hub, events, 16) == 16;
+
+    ret = ret && rm_event_hub_read(hub, events, 16) == 16;
+    ret = ret && rm_event_hub_read(hub, events, 16) == 8;
+    ret = ret && !readable(rm_event_hub_fd(hub));
+
+    rm_event_hub_free(hub);
+
+    return ret;
+}
+
+bool events_empty()
+{
+    sim_reset();
+
+    struct RmEventHub* hub = sim_hub();
+    uint32_t b = rm_event_hub_add(hub, 1, 1, NV0000_SET_NOTIFICATION, 3, 0);
+    int fd = rm_event_hub_fd(hub);
+    struct RmEventData events[8];
+
+    rm_event_hub_add(hub, 1, 1, NV0000_SET_NOTIFICATION, 2, 0);
+    signal_fd(fd);
+
+    bool ret = rm_event_hub_read(hub, events, 8) == 0 && !readable(fd);
+
+    sim_fire(b);
+
+    ret = ret && rm_event_hub_read(hub, events, 8) == 1 && events[0].object == b && events[0].notify == 3;
+
+    rm_event_hub_free(hub);
+
+    return ret;
+}
+
+bool events_remove()
+{
+    sim_reset();
+
+    struct RmEventHub* hub = sim_hub();
+    uint32_t a = rm_event_hub_add(hub, 1, 1, NV0000_SET_NOTIFICATION, 2, 0);
+    uint32_t b = rm_event_hub_add(hub, 1, 1, NV0000_SET_NOTIFICATION, 3, 0);
+    uint32_t c = rm_event_hub_add(hub, 2, 2, NV0000_SET_NOTIFICATION, 2, 0);
+    int fd = rm_event_hub_fd(hub);
+    struct RmEventData events[8];
+
+    bool ret = rm_event_hub_remove(hub, a) && !rm_event_hub_remove(hub, a);
+
+    ret = ret && sim_events.size() == 2 && sim_events.count(a) == 0 && rm_event_hub_size(hub) == 2;
+
+    sim_fire(a, fd);
+    sim_fire(b);
+
+    ret = ret && rm_event_hub_read(hub, events, 8) == 1 && events[0].object == b;
+
+    rm_event_hub_free(hub);
+
+    return ret && c != 0 && sim_events.empty();
+}
+
+/*! \brief Counts the start requests handed out by drain_vm_events. */
+static void count_start(const struct VmStartRequest*, void* user)
+{
+    ++*(uint32_t*) user;
+}
+
+bool events_vm()
+{
+    const uint32_t NUM_EVENTS = 100000;
+
+    sim_reset();
+
+    struct VmMgr mgr = {};
+    struct VmEvents events;
+
+    mgr.events = sim_hub();
+    mgr.start_event = rm_event_hub_add(mgr.events, 1, 1, NV0000_SET_NOTIFICATION, 2, RM_EVENT_NONSTALL);
+    mgr.bind_event = rm_event_hub_add(mgr.events, 1, 1, NV0000_SET_NOTIFICATION, 3, RM_EVENT_NONSTALL);
+
+    /* Per GPU events share the file without adding wakeups to the VM events. */
+    for (uint32_t gpu = 0; gpu < 32; ++gpu)
+        rm_event_hub_add(mgr.events, 1, 0x100 + gpu, NV2080_SET_NOTIFICATION, 1, 0);
+
+    sim_fire(mgr.start_event);
+    sim_fire(mgr.bind_event);
+    sim_fire(mgr.start_event);
+
+    bool ret = read_vm_events(&mgr, &events) == 3 && events.starts == 2 && events.binds == 1;
+
+    /* A wake without queued data has no start or bind to report. */
+    signal_fd(rm_event_hub_fd(mgr.events));
+
+    ret = ret && read_vm_events(&mgr, &events) == 0 && events.starts == 0 && events.binds == 0;
+
+    /* Draining also reads the start request of every start event and hands it out. */
+    struct NvResource root = {};
+    struct NvMdev mdev = {};
+    uint32_t started = 0;
+
+    root.client = 1;
+    root.object = 1;
+    mdev.fd = SIM_FD;
+    mdev.res = &root;
+
+    sim_fire(mgr.start_event);
+    sim_fire(mgr.bind_event);
+    sim_fire(mgr.start_event);
+
+    events = drain_vm_events(&mgr, &mdev, count_start, &started);
+    ret = ret && events.starts == 2 && events.binds == 1 && started == 2;
+
+    for (uint32_t i = 0; i < NUM_EVENTS; ++i)
+        sim_fire(i % 2 == 0 ? mgr.start_event : mgr.bind_event);
+
+    auto start = std::chrono::steady_clock::now();
+    size_t read = read_vm_events(&mgr, &events);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+    cout << "\tevent reads: " << read << " ops in " << ms << " ms ("
+         << (ms > 0 ? read * 1000 / ms : read) << " ops/s) on "
+         << sim_os_events.size() << " fd for " << rm_event_hub_size(mgr.events) << " events\n";
+
+    ret = ret && read == NUM_EVENTS && events.starts == NUM_EVENTS / 2 && events.binds == NUM_EVENTS / 2;
+
+    free_nv_vm_events(&mgr);
+
+    return ret && mgr.events == NULL && sim_events.empty();
+}
+
+int main()
+{
+    const uint32_t NUM_TESTS = 6;
+
+    const std::string test_names[] = {
+        "Shared File",
+        "Demultiplexing",
+        "Batched Reads",
+        "Empty Wake",
+        "Event Removal",
+        "VM Events"
+    };
+    const std::string test_details[] = {
+        "The events did not share one file or a client bound it several times.",
+        "The events were not told apart, reordered or an unknown event was reported.",
+        "A read overflowed its buffer or lost the queued events.",
+        "A wake without data reported an event or stayed readable.",
+        "A removed event was reported or the events were not freed.",
+        "The VM start and bind requests were not counted."
+    };
+
+    bool (*tests[])(void) = {
+        events_register, events_demux, events_batch, events_empty, events_remove, events_vm
+    };
+
+    rm_set_ioctl(sim_ioctl);
+
+    uint32_t failures = 0;
+
+    for (uint32_t i = 0; i < NUM_TESTS; ++i) {
+        bool test_result = tests[i]() == 1;
+
+        if (test_result)
+            cout << GREEN_COLOR << test_names[i]
+                 << " succeeded" RESET_COLOR "\n";
+        else {
+            ++failures;
+            cout << RED_COLOR << test_names[i]
+                 << ": " << test_details[i]
+                 << RESET_COLOR "\n";
+        }
+    }
+
+    rm_set_ioctl(NULL);
+
+    if (failures == 0)
+        cout << GREEN_COLOR << "All tests succeeded" RESET_COLOR "\n";
+    else
+        cout << RED_COLOR << failures << "/"
+             << NUM_TESTS << " tests failed" RESET_COLOR "\n";
+}
@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <gpu/nvidia/resman/api.h>
+#include <gpu/nvidia/resman/ioctl.h>
+#include <gpu/nvidia/resman/objects.hpp>
+
+#include <utils/colors.h>
+
+#include "sim-rm.hpp"
+
+using std::cout;
+
+using namespace gvm::nvidia;
+
+/*! \page resman-objects-test RM Object Model Test
+ *
+ * \tableofcontents
+ *
+ * These tests check the ownership rules of the C++ object model on a simulated RM Core installed with rm_set_ioctl.
+ * The following tests are implemented:
+ *
+ * -# \ref objects-order - Frees a GPU hierarchy children first.
+ * -# \ref objects-move - Moves owners without freeing twice, including to another thread.
+ * -# \ref objects-failure - Releases the files of a failed creation.
+ *
+ * \section objects-order Object Release Order
+ *
+ * This test determines if the objects of a GPU are freed children first once they leave the scope. The pseudo-code
+ * that is executed to determine if this test is a success is:
+ *
+ * ```{.cpp}
+ * { client = RmClient::open(fd), device = RmDevice::create(client, dev_fd, 0, DEV),
+ *   device.alloc_subdevice(SDEV), device.subdevice().alloc_mdev_config(MDEV) }
+ * freed == {MDEV, SDEV, DEV, client} && live == 0
+ * ```
+ *
+ * \section objects-move Object Move
+ *
+ * This test determines if moved owners free their objects once, on the thread they were moved to. The pseudo-code
+ * that is executed to determine if this test is a success is:
+ *
+ * ```{.cpp}
+ * moved = std::move(device), std::thread([d = std::move(moved)] {}).join(), freed == {MDEV, SDEV, DEV}
+ * ```
+ *
+ * \section objects-failure Object Creation Failure
+ *
+ * This test determines if a failed creation converts to false and leaves nothing allocated. The pseudo-code that is
+ * executed to determine if this test is a success is:
+ *
+ * ```{.cpp}
+ * fail_class = NV0080_CLASS, !RmDevice::create(client, dev_fd, 0, DEV) && dev_fd closed && live == 1
+ * ```
+ */
+
+//! Class the simulated RM Core refuses to allocate.
+static uint32_t fail_class = 0xFFFFFFFF;
+
+//! Objects freed by the simulated RM Core, in order.
+static std::vector<uint32_t> freed;
+
+//! Lock protecting the freed objects.
+static std::mutex sim_lock;
+
+/*! \brief Issues an ioctl on the simulated RM Core, which refuses fail_class and records the freed objects. */
+int sim_ioctl(int fd, unsigned long request, void* data)
+{
+    std::lock_guard<std::mutex> guard(sim_lock);
+
+    if (request == NV_ALLOC_RES && ((struct RmAllocRes*) data)->hClass == fail_class) {
+        ((struct RmAllocRes*) data)->status = SIM_ERROR;
+        return 0;
+    }
+
+    if (request == NV_FREE_RES)
+        freed.push_back(((struct RmFreeRes*) data)->hObjectOld);
+
+    return sim_rm_ioctl(fd, request, data);
+}
+
+/*! \brief Opens a file standing in for a NVIDIA device file. */
+static Fd open_fd()
+{
+    return Fd(open("/dev/null", O_RDWR));
+}
+
+bool objects_order()
+{
+    const uint32_t DEV = 0xD0, SDEV = 0xD1, MDEV = 0xD2;
+    uint32_t client_handle = 0;
+
+    freed.clear();
+
+    {
+        RmClient client = RmClient::open(open_fd());
+        RmDevice device = RmDevice::create(client, open_fd(), 0, DEV);
+
+        if (!client || !device || !device.alloc_subdevice(SDEV) || !device.subdevice().alloc_mdev_config(MDEV))
+            return false;
+
+        client_handle = client.object().object();
+
+        if (device.subdevice().mdev_config().object().parent() != SDEV || device.object().client() != client_handle)
+            return false;
+    }
+
+    return freed == std::vector<uint32_t>{MDEV, SDEV, DEV, client_handle} && sim_live == 0;
+}
+
+bool objects_move()
+{
+    const uint32_t DEV = 0xE0, SDEV = 0xE1, MDEV = 0xE2;
+
+    static_assert(!std::is_copy_constructible<RmDevice>::value, "RmDevice must be move-only");
+    static_assert(std::is_nothrow_move_constructible<RmDevice>::value, "RmDevice must be cheap to move");
+
+    RmClient client = RmClient::open(open_fd());
+    RmDevice device = RmDevice::create(client, open_fd(), 0, DEV);
+
+    if (!device || !device.alloc_subdevice(SDEV) || !device.subdevice().alloc_mdev_config(MDEV))
+        return false;
+
+    int dev_fd = device.fd();
+    RmDevice moved = std::move(device);
+    RmDevice assigned;
+
+    assigned = std::move(moved);
+    freed.clear();
+
+    bool ret = !device && !moved && assigned && assigned.fd() == dev_fd && freed.empty();
+
+    std::thread([owner = std::move(assigned)]() {}).join();
+
+    ret = ret && freed == std::vector<uint32_t>{MDEV, SDEV, DEV} && fcntl(dev_fd, F_GETFD) == -1;
+
+    return ret && sim_live == 1;
+}
+
+bool objects_failure()
+{
+    RmClient client = RmClient::open(open_fd());
+    Fd dev = open_fd();
+    int dev_fd = dev.get();
+
+    fail_class = NV0080_CLASS;
+    RmDevice device = RmDevice::create(client, std::move(dev), 0, 0xF0);
+    fail_class = 0xFFFFFFFF;
+
+    return client && !device && device.fd() == -1 && fcntl(dev_fd, F_GETFD) == -1 && sim_live == 1;
+}
+
+int main()
+{
+    const uint32_t NUM_TESTS = 3;
+
+    const std::string test_names[] = {
+        "Object Release Order",
+        "Object Move",
+        "Object Creation Failure"
+    };
+    const std::string test_details[] = {
+        "The GPU objects were not freed children first.",
+        "A moved object was freed twice or not on the thread owning it.",
+        "The failed creation left an object or file behind."
+    };
+
+    bool (*tests[])(void) = {
+        objects_order, objects_move, objects_failure
+    };
+
+    uint32_t failures = 0;
+
+    sim_any_fd = true;
+    rm_set_ioctl(sim_ioctl);
+
+    for (uint32_t i = 0; i < NUM_TESTS; ++i) {
+        bool test_result = tests[i]() == 1;
+
+        if (test_result)
+            cout << GREEN_COLOR << test_names[i]
+                 << " succeeded" RESET_COLOR "\n";
+        else {
+            ++failures;
+            cout << RED_COLOR << test_names[i]
+                 << ": " << test_details[i]
+                 << RESET_COLOR "\n";
+        }
+    }
+
+    rm_set_ioctl(NULL);
+
+    if (failures == 0)
+        cout << GREEN_COLOR << "All tests succeeded" RESET_COLOR "\n";
+    else
+        cout << RED_COLOR << failures << "/"
+             << NUM_TESTS << " tests failed" RESET_COLOR "\n";
+}
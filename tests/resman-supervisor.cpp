@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <iostream>
+#include <atomic>
+#include <thread>
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gpu/nvidia/resman/api.h>
+#include <gpu/nvidia/resman/ioctl.h>
+#include <gpu/nvidia/resman/supervisor.h>
+
+#include <utils/colors.h>
+#include <utils/epoch.h>
+
+#include "sim-rm.hpp"
+
+using std::cout;
+
+/*! \page resman-supervisor-test RM Supervisor Test
+ *
+ * \tableofcontents
+ *
+ * These tests check the retry policy and the supervisor of RM calls on a simulated RM Core installed with
+ * rm_set_ioctl. The following tests are implemented:
+ *
+ * -# \ref retry-busy - Retries a control failing with NV_ERR_BUSY_RETRY.
+ * -# \ref retry-policy - Applies the retry policy of a single command.
+ * -# \ref supervisor-report - Reports a call past its deadline.
+ * -# \ref supervisor-escalate - Interrupts a call past its escalation time.
+ *
+ * \section retry-busy Retry Busy Control
+ *
+ * This test determines if a control is retried until it succeeds. The pseudo-code that is executed to determine if
+ * this test is a success is:
+ *
+ * ```{.c}
+ * busy_left = 2, rm_ctrl_res(fd, 1, 1, BUSY_CMD, &data, size) == &data && issued == 3
+ * ```
+ *
+ * \section retry-policy Retry Policy
+ *
+ * This test determines if the policy of a single command replaces the default one. The pseudo-code that is executed
+ * to determine if this test is a success is:
+ *
+ * ```{.c}
+ * rm_set_retry_policy(BUSY_CMD, {1, 0, 0}), busy_left = 1, rm_ctrl_res(...) == NULL && issued == 1,
+ * rm_set_retry_policy(BUSY_CMD, {8, 10, 100}), busy_left = 6, rm_ctrl_res(...) != NULL && issued == 7
+ * ```
+ *
+ * \section supervisor-report Supervisor Report
+ *
+ * This test determines if a call past its deadline is listed and reported. The pseudo-code that is executed to
+ * determine if this test is a success is:
+ *
+ * ```{.c}
+ * rm_supervisor_start({10, 0, 5}), thread: rm_ctrl_res(..., BLOCK_CMD, ...),
+ * rm_supervisor_in_flight(calls, 4) == 1 && calls[0].command == BLOCK_CMD && reported
+ * ```
+ *
+ * \section supervisor-escalate Supervisor Escalation
+ *
+ * This test determines if a call past its escalation time is interrupted and fails with ETIMEDOUT. The pseudo-code
+ * that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * rm_supervisor_start({10, 20, 5}), rm_ctrl_res(..., SLEEP_CMD, ...) == NULL && errno == ETIMEDOUT
+ * ```
+ */
+
+//! Control command failing with NV_ERR_BUSY_RETRY while busy_left is positive.
+static const uint32_t BUSY_CMD = 0xB054;
+
+//! Control command which blocks until it is released.
+static const uint32_t BLOCK_CMD = 0xB10C;
+
+//! Control command which sleeps until it is interrupted.
+static const uint32_t SLEEP_CMD = 0x5EE9;
+
+//! Number of busy replies left.
+static std::atomic<int> busy_left(0);
+
+//! Number of issued controls.
+static std::atomic<int> issued(0);
+
+//! If a blocked control may return.
+static std::atomic<bool> sim_release(false);
+
+/*! \brief Issues an ioctl on the simulated RM Core, whose controls can be busy, block or sleep. */
+int sim_ioctl(int fd, unsigned long request, void* data)
+{
+    if (fd != SIM_FD || request != NV_CONTROL_RES)
+        return sim_rm_ioctl(fd, request, data);
+
+    struct RmControlRes* ctrl_res = (struct RmControlRes*) data;
+
+    ++issued;
+    ctrl_res->status = 0;
+
+    if (ctrl_res->cmd == BUSY_CMD && busy_left-- > 0)
+        ctrl_res->status = NV_ERR_BUSY_RETRY;
+
+    if (ctrl_res->cmd == BLOCK_CMD)
+        while (!sim_release.load())
+            usleep(100);
+
+    if (ctrl_res->cmd == SLEEP_CMD) {
+        struct timespec sleep = {5, 0};
+
+        if (nanosleep(&sleep, NULL) == -1) {
+            errno = EINTR;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+bool retry_busy()
+{
+    uint32_t data = 0;
+
+    busy_left = 2;
+    issued = 0;
+
+    return rm_ctrl_res(SIM_FD, 1, 1, BUSY_CMD, &data, sizeof(data)) == &data && issued == 3;
+}
+
+bool retry_policy()
+{
+    struct RmRetryPolicy never = {1, 0, 0};
+    struct RmRetryPolicy often = {8, 10, 100};
+    uint32_t data = 0;
+
+    rm_set_retry_policy(BUSY_CMD, &never);
+    busy_left = 1;
+    issued = 0;
+
+    bool ret = rm_ctrl_res(SIM_FD, 1, 1, BUSY_CMD, &data, sizeof(data)) == NULL && issued == 1;
+
+    rm_set_retry_policy(BUSY_CMD, &often);
+    busy_left = 6;
+    issued = 0;
+
+    ret = ret && rm_ctrl_res(SIM_FD, 1, 1, BUSY_CMD, &data, sizeof(data)) == &data && issued == 7 &&
+          rm_get_retry_policy(BUSY_CMD).attempts == 8 && rm_get_retry_policy(BLOCK_CMD).attempts == 3;
+
+    rm_set_retry_policy(BUSY_CMD, NULL);
+
+    return ret && rm_get_retry_policy(BUSY_CMD).attempts == 3;
+}
+
+//! Number of reported stuck calls.
+static std::atomic<uint32_t> reports(0);
+
+//! Command of the last reported stuck call.
+static std::atomic<uint32_t> reported_command(0);
+
+void count_report(const struct RmInFlight* call, void* user)
+{
+    if (user == &reports) {
+        reported_command = call->command;
+        ++reports;
+    }
+}
+
+bool supervisor_report()
+{
+    struct RmSupervisorConfig config = {10, 0, 5, 0, count_report, &reports};
+    struct RmInFlight calls[4];
+    uint32_t data = 0;
+
+    reports = 0;
+    sim_release = false;
+
+    if (!rm_supervisor_start(&config))
+        return false;
+
+    std::thread caller([&data]() {
+        rm_ctrl_res(SIM_FD, 1, 1, BLOCK_CMD, &data, sizeof(data));
+    });
+
+    while (reports.load() == 0)
+        usleep(1000);
+
+    bool ret = rm_supervisor_in_flight(calls, 4) == 1 && calls[0].command == BLOCK_CMD &&
+               calls[0].elapsed_ms >= 10 && !calls[0].escalated && reported_command == BLOCK_CMD;
+
+    sim_release = true;
+    caller.join();
+    rm_supervisor_stop();
+
+    return ret && rm_supervisor_in_flight(calls, 4) == 0 && reports == 1;
+}
+
+bool supervisor_escalate()
+{
+    struct RmSupervisorConfig config = {10, 20, 5, 0, count_report, &reports};
+    uint32_t data = 0;
+
+    reports = 0;
+    issued = 0;
+
+    if (!rm_supervisor_start(&config))
+        return false;
+
+    void* res = rm_ctrl_res(SIM_FD, 1, 1, SLEEP_CMD, &data, sizeof(data));
+    int error = errno;
+
+    rm_supervisor_stop();
+
+    return res == NULL && error == ETIMEDOUT && issued == 1 && reports == 2;
+}
+
+int main()
+{
+    const uint32_t NUM_TESTS = 4;
+
+    const std::string test_names[] = {
+        "Retry Busy Control",
+        "Retry Policy",
+        "Supervisor Report",
+        "Supervisor Escalation"
+    };
+    const std::string test_details[] = {
+        "The busy control was not retried until it succeeded.",
+        "The retry policy of the command was not applied.",
+        "The blocked call was not listed or reported.",
+        "The sleeping call was not interrupted or was retried."
+    };
+
+    bool (*tests[])(void) = {
+        retry_busy, retry_policy, supervisor_report, supervisor_escalate
+    };
+
+    uint32_t failures = 0;
+
+    rm_set_ioctl(sim_ioctl);
+
+    for (uint32_t i = 0; i < NUM_TESTS; ++i) {
+        bool test_result = tests[i]() == 1;
+
+        if (test_result)
+            cout << GREEN_COLOR << test_names[i]
+                 << " succeeded" RESET_COLOR "\n";
+        else {
+            ++failures;
+            cout << RED_COLOR << test_names[i]
+                 << ": " << test_details[i]
+                 << RESET_COLOR "\n";
+        }
+    }
+
+    rm_set_ioctl(NULL);
+    epoch_barrier();
+
+    if (failures == 0)
+        cout << GREEN_COLOR << "All tests succeeded" RESET_COLOR "\n";
+    else
+        cout << RED_COLOR << failures << "/"
+             << NUM_TESTS << " tests failed" RESET_COLOR "\n";
+}
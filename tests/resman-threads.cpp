@@ -0,0 +1,383 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <gpu/nvidia/resman/api.h>
+#include <gpu/nvidia/resman/ioctl.h>
+
+#include <utils/colors.h>
+#include <utils/epoch.h>
+
+#include "sim-rm.hpp"
+
+using std::cout;
+
+/*! \page resman-threads-test RM API Thread Safety Test
+ *
+ * \tableofcontents
+ *
+ * These tests stress the RM API from several threads at once. The ioctls are routed to a simulated RM Core through
+ * rm_set_ioctl, so they run without a GPU and report the throughput of the resource tree. The following tests are
+ * implemented:
+ *
+ * -# \ref sim-alloc - Allocates a client and a child on the simulated RM Core.
+ * -# \ref concurrent-alloc - Allocates children under a single parent from several threads.
+ * -# \ref concurrent-traverse - Traverses trees while other threads replace and free them.
+ * -# \ref concurrent-unlink - Frees the last children of a parent while other threads append to it.
+ * -# \ref epoch-defer - Defers reclamation while a reader is inside a critical section.
+ *
+ * \section sim-alloc Simulated Allocation
+ *
+ * This test determines if the simulated RM Core is used by the API. The pseudo-code that is executed to determine if
+ * this test is a success is:
+ *
+ * ```{.c}
+ * client = rm_alloc_res(fd, NULL, 0, 0, NULL), child = rm_alloc_res(fd, client, 0, 1, NULL),
+ * rm_find_res(client, child->object) == child
+ * ```
+ *
+ * \section concurrent-alloc Concurrent Allocation
+ *
+ * This test determines if no child is lost when several threads append to the same parent. The pseudo-code that is
+ * executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * for each thread: for i in ALLOCS: rm_alloc_res(fd, client, 0, 1, NULL)
+ * children(client) == THREADS * ALLOCS && unique(children), rm_free_tree(fd, client), live objects == 0
+ * ```
+ *
+ * \section concurrent-traverse Concurrent Traversal
+ *
+ * This test determines if readers inside an epoch critical section can traverse a tree while writers unpublish and
+ * free it. Run with AddressSanitizer to catch use after free. The pseudo-code that is executed to determine if this
+ * test is a success is:
+ *
+ * ```{.c}
+ * readers: epoch_enter(), count(published), epoch_exit()
+ * writers: old = exchange(published, new_tree()), rm_free_tree(fd, old)
+ * every count == CHILDREN
+ * ```
+ *
+ * \section concurrent-unlink Concurrent Unlink
+ *
+ * This test determines if no child is lost when the last child of a parent is freed while other threads append to
+ * it. The pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * for each thread: for i in ALLOCS: rm_alloc_res(fd, client, 0, 1, NULL)
+ * main: while appending: rm_free_subtree(fd, client, client->last)
+ * children(client) == THREADS * ALLOCS - freed, rm_free_tree(fd, client), live objects == 0
+ * ```
+ *
+ * \section epoch-defer Epoch Deferral
+ *
+ * This test determines if retired memory outlives the critical sections that could reference it. The pseudo-code
+ * that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * reader: epoch_enter(), writer: epoch_retire(ptr, destructor), epoch_reclaim(), !destroyed,
+ * reader: epoch_exit(), writer: epoch_barrier(), destroyed
+ * ```
+ */
+
+/*! \brief Counts the direct children of a resource, must be called inside an epoch. */
+static size_t count_children(struct NvResource* res)
+{
+    size_t ret = 0;
+
+    for (struct NvResource* child = __atomic_load_n(&res->child, __ATOMIC_ACQUIRE); child != NULL;
+         child = __atomic_load_n(&child->next, __ATOMIC_ACQUIRE))
+        ++ret;
+
+    return ret;
+}
+
+/*! \brief Prints the throughput of a benchmark. */
+static void report(const char* name, uint64_t ops, std::chrono::steady_clock::time_point start)
+{
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    cout << "\t" << name << ": " << ops << " ops in " << secs * 1e3 << " ms ("
+         << (uint64_t) (ops / (secs > 0 ? secs : 1e-9)) << " ops/s)\n";
+}
+
+bool sim_alloc()
+{
+    struct NvResource* client = rm_alloc_res(SIM_FD, NULL, 0, 0, NULL);
+
+    if (client == NULL)
+        return false;
+
+    struct NvResource* child = rm_alloc_res(SIM_FD, client, 0, 1, NULL);
+
+    epoch_enter();
+    bool ret = child != NULL && child->client == client->object && rm_find_res(client, child->object) == child;
+    epoch_exit();
+
+    rm_free_tree(SIM_FD, client);
+    epoch_barrier();
+
+    return ret && sim_live == 0;
+}
+
+bool concurrent_alloc()
+{
+    const uint32_t THREADS = 8;
+    const uint32_t ALLOCS = 4096;
+
+    struct NvResource* client = rm_alloc_res(SIM_FD, NULL, 0, 0, NULL);
+    std::vector<std::thread> threads;
+
+    if (client == NULL)
+        return false;
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < THREADS; ++i)
+        threads.emplace_back([client, ALLOCS]() {
+            for (uint32_t j = 0; j < ALLOCS; ++j)
+                rm_alloc_res(SIM_FD, client, 0, 1, NULL);
+        });
+
+    for (auto& thread : threads)
+        thread.join();
+
+    report("rm_alloc_res", THREADS * ALLOCS, start);
+
+    std::vector<uint32_t> objects;
+
+    for (struct NvResource* child = client->child; child != NULL; child = child->next)
+        objects.push_back(child->object);
+
+    std::sort(objects.begin(), objects.end());
+
+    bool ret = objects.size() == THREADS * ALLOCS &&
+               std::adjacent_find(objects.begin(), objects.end()) == objects.end();
+
+    rm_free_tree(SIM_FD, client);
+    epoch_barrier();
+
+    return ret && sim_live == 0;
+}
+
+bool concurrent_traverse()
+{
+    const uint32_t READERS = 6;
+    const uint32_t WRITERS = 2;
+    const uint32_t REPLACES = 512;
+    const size_t CHILDREN = 16;
+
+    auto new_tree = [CHILDREN]() {
+        struct NvResource* client = rm_alloc_res(SIM_FD, NULL, 0, 0, NULL);
+
+        for (size_t i = 0; client != NULL && i < CHILDREN; ++i)
+            rm_alloc_res(SIM_FD, client, 0, 1, NULL);
+
+        return client;
+    };
+
+    struct NvResource* published = new_tree();
+    std::atomic<bool> done(false);
+    std::atomic<uint64_t> reads(0);
+    std::atomic<uint32_t> bad(0);
+    std::vector<std::thread> readers;
+    std::vector<std::thread> writers;
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < READERS; ++i)
+        readers.emplace_back([&]() {
+            uint64_t local = 0;
+
+            while (!done.load()) {
+                epoch_enter();
+                struct NvResource* root = __atomic_load_n(&published, __ATOMIC_ACQUIRE);
+                if (root == NULL || count_children(root) != CHILDREN)
+                    ++bad;
+                epoch_exit();
+                ++local;
+            }
+
+            reads += local;
+        });
+
+    for (uint32_t i = 0; i < WRITERS; ++i)
+        writers.emplace_back([&]() {
+            for (uint32_t j = 0; j < REPLACES; ++j) {
+                struct NvResource* old = __atomic_exchange_n(&published, new_tree(), __ATOMIC_ACQ_REL);
+
+                rm_free_tree(SIM_FD, old);
+            }
+        });
+
+    for (auto& writer : writers)
+        writer.join();
+
+    done = true;
+
+    for (auto& reader : readers)
+        reader.join();
+
+    report("tree traversals", reads, start);
+    report("tree replacements", WRITERS * REPLACES, start);
+
+    rm_free_tree(SIM_FD, published);
+    epoch_barrier();
+
+    return bad == 0 && sim_live == 0;
+}
+
+bool concurrent_unlink()
+{
+    const uint32_t THREADS = 4;
+    const uint32_t ALLOCS = 4096;
+
+    struct NvResource* client = rm_alloc_res(SIM_FD, NULL, 0, 0, NULL);
+    std::atomic<uint32_t> running(THREADS);
+    std::vector<std::thread> threads;
+    uint32_t freed = 0;
+
+    if (client == NULL)
+        return false;
+
+    for (uint32_t i = 0; i < THREADS; ++i)
+        threads.emplace_back([client, ALLOCS, &running]() {
+            for (uint32_t j = 0; j < ALLOCS; ++j)
+                rm_alloc_res(SIM_FD, client, 0, 1, NULL);
+
+            --running;
+        });
+
+    /* Only this thread frees, the last child stays valid until it is freed here. */
+    while (running.load() != 0) {
+        struct NvResource* last = __atomic_load_n(&client->last, __ATOMIC_ACQUIRE);
+
+        if (last != NULL && rm_free_subtree(SIM_FD, client, last))
+            ++freed;
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+
+    epoch_enter();
+    bool ret = count_children(client) == THREADS * ALLOCS - freed;
+    epoch_exit();
+
+    rm_free_tree(SIM_FD, client);
+    epoch_barrier();
+
+    return ret && sim_live == 0;
+}
+
+//! Number of times the deferral destructor ran.
+static std::atomic<uint32_t> destroyed(0);
+
+void count_destroy(void*)
+{
+    ++destroyed;
+}
+
+bool epoch_defer()
+{
+    static int object;
+    std::atomic<int> stage(0);
+
+    std::thread reader([&stage]() {
+        epoch_enter();
+        stage = 1;
+        while (stage.load() != 2)
+            std::this_thread::yield();
+        epoch_exit();
+        stage = 3;
+    });
+
+    while (stage.load() != 1)
+        std::this_thread::yield();
+
+    epoch_retire(&object, count_destroy);
+
+    for (int i = 0; i < 16; ++i)
+        epoch_reclaim();
+
+    bool ret = destroyed == 0;
+
+    stage = 2;
+    while (stage.load() != 3)
+        std::this_thread::yield();
+
+    epoch_barrier();
+    reader.join();
+
+    return ret && destroyed == 1;
+}
+
+int main()
+{
+    const uint32_t NUM_TESTS = 5;
+
+    const std::string test_names[] = {
+        "Simulated Allocation",
+        "Concurrent Allocation",
+        "Concurrent Traversal",
+        "Concurrent Unlink",
+        "Epoch Deferral"
+    };
+    const std::string test_details[] = {
+        "The simulated RM Core did not allocate the client and child.",
+        "Children were lost or duplicated by concurrent allocations.",
+        "A reader saw a partially freed tree.",
+        "Children appended next to a freed child were lost.",
+        "Retired memory was released while a reader could reference it."
+    };
+
+    bool (*tests[])(void) = {
+        sim_alloc, concurrent_alloc, concurrent_traverse, concurrent_unlink, epoch_defer
+    };
+
+    uint32_t failures = 0;
+
+    rm_set_ioctl(sim_rm_ioctl);
+
+    for (uint32_t i = 0; i < NUM_TESTS; ++i) {
+        bool test_result = tests[i]() == 1;
+
+        if (test_result)
+            cout << GREEN_COLOR << test_names[i]
+                 << " succeeded" RESET_COLOR "\n";
+        else {
+            ++failures;
+            cout << RED_COLOR << test_names[i]
+                 << ": " << test_details[i]
+                 << RESET_COLOR "\n";
+        }
+    }
+
+    rm_set_ioctl(NULL);
+
+    if (failures == 0)
+        cout << GREEN_COLOR << "All tests succeeded" RESET_COLOR "\n";
+    else
+        cout << RED_COLOR << failures << "/"
+             << NUM_TESTS << " tests failed" RESET_COLOR "\n";
+}
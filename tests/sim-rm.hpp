@@ -0,0 +1,326 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef TESTS_SIM_RM_HPP
+#define TESTS_SIM_RM_HPP
+
+#include <iostream>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include <string.h>
+#include <unistd.h>
+
+#include <gpu/nvidia/resman/api.h>
+#include <gpu/nvidia/resman/classes.h>
+#include <gpu/nvidia/resman/ioctl.h>
+
+/*! \file sim-rm.hpp
+ *
+ * Simulated RM Core shared by the tests running without a GPU. A test installs sim_rm_ioctl
+ * through rm_set_ioctl, or an ioctl of its own handling the requests it overrides and passing
+ * the others to sim_rm_ioctl. The simulation allocates handles and records the file of each
+ * client, probes and attaches the GPUs of sim_probed except those of sim_unattachable, binds
+ * the event objects to their files and queues the data of the events fired with sim_fire on
+ * them.
+ */
+
+//! File descriptor handed to the simulated RM Core.
+static const int SIM_FD = 0x5100;
+
+//! Status the simulated RM Core fails a call with.
+static const uint32_t SIM_ERROR = 0x1F;
+
+//! Class of the event objects.
+static const uint32_t SIM_EVENT_CLASS = 0x00000005;
+
+/*! \brief Event object of the simulated RM Core. */
+struct SimEvent {
+    uint32_t client;            //!< Client of the event.
+    uint32_t parent;            //!< Parent of the event.
+    uint32_t notify;            //!< Notification index.
+    int fd;                     //!< File notified.
+};
+
+//! If every file is accepted, instead of SIM_FD only.
+inline bool sim_any_fd = false;
+
+//! Last handle allocated by the simulated RM Core.
+inline std::atomic<uint32_t> sim_handle(0x1000);
+
+//! Number of objects allocated in the simulated RM Core.
+inline std::atomic<int64_t> sim_live(0);
+
+//! File each client of the simulated RM Core was allocated on.
+inline std::map<uint32_t, int> sim_clients;
+
+//! Lock protecting the clients, the GPUs and the events of the simulated RM Core.
+inline std::mutex sim_rm_lock;
+
+//! GPUs probed by the simulated RM Core.
+inline std::vector<uint32_t> sim_probed;
+
+//! Number of times the probed GPUs were read.
+inline uint32_t sim_probes = 0;
+
+//! GPUs attached in the simulated RM Core.
+inline std::set<uint32_t> sim_attached;
+
+//! GPUs the simulated RM Core fails to attach.
+inline std::set<uint32_t> sim_unattachable;
+
+//! If detaching several GPUs in one control fails.
+inline bool sim_detach_batch_fails = false;
+
+//! GPU ids of every attach control, in order.
+inline std::vector<std::vector<uint32_t>> sim_attach_calls;
+
+//! GPU ids of every detach control, in order.
+inline std::vector<std::vector<uint32_t>> sim_detach_calls;
+
+//! Event objects of the simulated RM Core.
+inline std::map<uint32_t, SimEvent> sim_events;
+
+//! Number of event objects, the free path only takes the lock while there are some.
+inline std::atomic<uint32_t> sim_event_objects(0);
+
+//! Clients bound to each file by NV_CREATE_OS_EVENT.
+inline std::map<int, std::set<uint32_t>> sim_os_events;
+
+//! Event data queued on each file.
+inline std::map<int, std::deque<struct RmEventData>> sim_queues;
+
+//! Number of notifications enabled.
+inline uint32_t sim_notifications = 0;
+
+/*! \brief Resets the clients, the GPUs and the events of the simulated RM Core between tests. */
+inline void sim_reset()
+{
+    std::lock_guard<std::mutex> guard(sim_rm_lock);
+
+    sim_clients.clear();
+    sim_probed.clear();
+    sim_probes = 0;
+    sim_attached.clear();
+    sim_unattachable.clear();
+    sim_detach_batch_fails = false;
+    sim_attach_calls.clear();
+    sim_detach_calls.clear();
+    sim_events.clear();
+    sim_event_objects = 0;
+    sim_os_events.clear();
+    sim_queues.clear();
+    sim_notifications = 0;
+}
+
+/*! \brief Consumes the counter of an eventfd. */
+inline void drain_fd(int fd)
+{
+    uint64_t value;
+
+    if (read(fd, &value, sizeof(value)) != sizeof(value))
+        value = 0;
+}
+
+/*! \brief Signals an eventfd. */
+inline void signal_fd(int fd)
+{
+    uint64_t value = 1;
+
+    if (write(fd, &value, sizeof(value)) != sizeof(value))
+        std::cout << "\tcannot signal the eventfd\n";
+}
+
+/*! \brief Fires an event of the simulated RM Core.
+ *
+ * \param handle - Event object, unknown objects are queued on fd.
+ * \param fd - File of unknown objects.
+ */
+inline void sim_fire(uint32_t handle, int fd = -1)
+{
+    std::unique_lock<std::mutex> guard(sim_rm_lock);
+    auto event = sim_events.find(handle);
+    struct RmEventData data = {};
+
+    if (event != sim_events.end()) {
+        fd = event->second.fd;
+        data.notify = event->second.notify;
+    }
+
+    data.object = handle;
+    data.info32 = 0x1234;
+
+    sim_queues[fd].push_back(data);
+    guard.unlock();
+
+    signal_fd(fd);
+}
+
+/*! \brief Handles a control of the simulated RM Core.
+ *
+ * \param ctrl - Control to handle.
+ */
+inline void sim_control(struct RmControlRes* ctrl)
+{
+    std::lock_guard<std::mutex> guard(sim_rm_lock);
+
+    ctrl->status = 0;
+
+    if (ctrl->cmd == NV0000_SET_NOTIFICATION || ctrl->cmd == NV2080_SET_NOTIFICATION) {
+        ++sim_notifications;
+    } else if (ctrl->cmd == NV0000_GET_PROBED_IDS) {
+        struct Nv0000CtrlGpuGetProbedIdsParams* probed = (struct Nv0000CtrlGpuGetProbedIdsParams*) ctrl->params;
+
+        memset(probed->gpu_ids, 0xFF, sizeof(probed->gpu_ids));
+        for (size_t i = 0; i < sim_probed.size(); ++i)
+            probed->gpu_ids[i] = sim_probed[i];
+        ++sim_probes;
+    } else if (ctrl->cmd == NV0000_GET_PCI_INFO) {
+        struct Nv0000CtrlGpuGetPciInfoParams* pci = (struct Nv0000CtrlGpuGetPciInfoParams*) ctrl->params;
+
+        pci->domain = 0;
+        pci->bus = pci->gpu_id >> 8;
+        pci->slot = 0;
+    } else if (ctrl->cmd == NV0000_ATTACH_IDS) {
+        struct Nv0000CtrlGpuAttachIdsParams* attach = (struct Nv0000CtrlGpuAttachIdsParams*) ctrl->params;
+        std::vector<uint32_t>& ids = sim_attach_calls.emplace_back();
+
+        for (uint32_t i = 0; i < 32 && attach->gpu_ids[i] != 0xFFFFFFFF; ++i)
+            ids.push_back(attach->gpu_ids[i]);
+
+        /* As the driver, the GPUs before the first failure stay attached. */
+        for (uint32_t gpu_id : ids) {
+            if (sim_unattachable.count(gpu_id) != 0) {
+                attach->failed_gpu_id = gpu_id;
+                ctrl->status = SIM_ERROR;
+                break;
+            }
+
+            sim_attached.insert(gpu_id);
+        }
+    } else if (ctrl->cmd == NV0000_DEATTACH_IDS) {
+        struct Nv0000CtrlGpuDeAttachIdsParams* detach = (struct Nv0000CtrlGpuDeAttachIdsParams*) ctrl->params;
+        std::vector<uint32_t>& ids = sim_detach_calls.emplace_back();
+
+        for (uint32_t i = 0; i < 32 && detach->gpu_ids[i] != 0xFFFFFFFF; ++i)
+            ids.push_back(detach->gpu_ids[i]);
+
+        if (sim_detach_batch_fails && ids.size() > 1) {
+            ctrl->status = SIM_ERROR;
+            return;
+        }
+
+        for (uint32_t gpu_id : ids)
+            sim_attached.erase(gpu_id);
+    }
+}
+
+/*! \brief Issues an ioctl on the simulated RM Core.
+ *
+ * \param fd - File descriptor, SIM_FD unless sim_any_fd is set.
+ * \param request - Ioctl request.
+ * \param data - Ioctl argument.
+ * \return -1 for a file the simulated RM Core does not know, 0 otherwise.
+ */
+inline int sim_rm_ioctl(int fd, unsigned long request, void* data)
+{
+    if (request == NV_CREATE_OS_EVENT) {
+        struct RmAllocOsEvent* event = (struct RmAllocOsEvent*) data;
+        std::lock_guard<std::mutex> guard(sim_rm_lock);
+
+        sim_os_events[event->fd].insert(event->client);
+        event->status = 0;
+    } else if (request == NV_GET_EVENT_DATA) {
+        struct RmGetEventData* get_data = (struct RmGetEventData*) data;
+        std::lock_guard<std::mutex> guard(sim_rm_lock);
+        std::deque<struct RmEventData>& queue = sim_queues[fd];
+
+        /* As the driver, the file stays readable while events are queued. */
+        if (queue.empty()) {
+            drain_fd(fd);
+            get_data->status = 1;
+            return 0;
+        }
+
+        *(struct RmEventData*) (uintptr_t) get_data->event = queue.front();
+        queue.pop_front();
+        get_data->more_events = !queue.empty();
+        get_data->status = 0;
+
+        if (queue.empty())
+            drain_fd(fd);
+    } else if (fd != SIM_FD && !sim_any_fd) {
+        return -1;
+    } else if (request == NV_ALLOC_RES) {
+        struct RmAllocRes* alloc_res = (struct RmAllocRes*) data;
+
+        alloc_res->status = 0;
+
+        if (alloc_res->hObjectNew == 0)
+            alloc_res->hObjectNew = ++sim_handle;
+
+        if (alloc_res->hRoot == 0 && alloc_res->hObjectParent == 0) {
+            std::lock_guard<std::mutex> guard(sim_rm_lock);
+
+            sim_clients[alloc_res->hObjectNew] = fd;
+        } else if (alloc_res->hClass == SIM_EVENT_CLASS) {
+            struct RmAllocEvent* event = (struct RmAllocEvent*) alloc_res->pAllocParams;
+            std::lock_guard<std::mutex> guard(sim_rm_lock);
+
+            /* An event needs the file to be bound to its client first. */
+            if (sim_os_events[(int) event->event_data].count(alloc_res->hRoot) == 0) {
+                alloc_res->status = SIM_ERROR;
+                return 0;
+            }
+
+            SimEvent sim_event = {alloc_res->hRoot, alloc_res->hObjectParent, event->notify, (int) event->event_data};
+
+            sim_event_objects += sim_events.insert_or_assign(alloc_res->hObjectNew, sim_event).second;
+        }
+
+        ++sim_live;
+    } else if (request == NV_FREE_RES) {
+        struct RmFreeRes* free_res = (struct RmFreeRes*) data;
+
+        if (free_res->hObjectOld == free_res->hRoot) {
+            std::lock_guard<std::mutex> guard(sim_rm_lock);
+
+            sim_clients.erase(free_res->hObjectOld);
+        }
+
+        /* The objects of the throughput tests are freed without the lock. */
+        if (sim_event_objects.load() != 0) {
+            std::lock_guard<std::mutex> guard(sim_rm_lock);
+
+            sim_event_objects -= sim_events.erase(free_res->hObjectOld);
+        }
+
+        free_res->status = 0;
+        --sim_live;
+    } else if (request == NV_CONTROL_RES) {
+        sim_control((struct RmControlRes*) data);
+    }
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#ifndef TESTS_SYSFS_FIXTURE_HPP
+#define TESTS_SYSFS_FIXTURE_HPP
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+#include <stdlib.h>
+
+#include <utils/sysfs.h>
+
+/*! \file sysfs-fixture.hpp
+ *
+ * Sysfs tree shared by the tests reading sysfs. The tree is created in a temporary directory
+ * installed with set_sysfs_root and removed with the fixture. A test derives from the fixture
+ * and writes the attributes it needs in its constructor.
+ */
+
+/*! \brief Sysfs tree created for a test. */
+class SysfsFixture {
+public:
+    /*! \brief Creates an empty tree and makes it the sysfs root.
+     *
+     * \param name - Name of the test, part of the name of the temporary directory.
+     */
+    SysfsFixture(const std::string& name)
+    {
+        std::string root = "/tmp/gvm-" + name + "-XXXXXX";
+
+        if (mkdtemp(root.data()) == NULL)
+            return;
+
+        /* The root is kept, not copied, by set_sysfs_root. */
+        this->root = root;
+        set_sysfs_root(this->root.c_str());
+    }
+
+    SysfsFixture(const SysfsFixture&) = delete;
+    SysfsFixture& operator=(const SysfsFixture&) = delete;
+
+    virtual ~SysfsFixture()
+    {
+        std::error_code error;
+
+        if (!this->root.empty())
+            std::filesystem::remove_all(this->root, error);
+
+        set_sysfs_root(NULL);
+    }
+
+    /*! \brief Checks if the tree was created. */
+    bool valid() const
+    {
+        return !this->root.empty();
+    }
+
+    /*! \brief Gets the path of a file of the tree. */
+    std::string path(const std::string& relative) const
+    {
+        return this->root + "/" + relative;
+    }
+
+    /*! \brief Writes a file of the tree, creating its directories. */
+    void write(const std::string& relative, const std::string& content)
+    {
+        std::filesystem::path path = this->path(relative);
+        std::error_code error;
+
+        std::filesystem::create_directories(path.parent_path(), error);
+        std::ofstream(path) << content;
+    }
+
+    /*! \brief Creates a link of the tree, creating its directories. */
+    void link(const std::string& relative, const std::string& target)
+    {
+        std::filesystem::path path = this->path(relative);
+        std::error_code error;
+
+        std::filesystem::create_directories(path.parent_path(), error);
+        std::filesystem::remove(path, error);
+        std::filesystem::create_symlink(target, path, error);
+    }
+
+protected:
+    std::string root;   //!< Root of the tree, empty if it could not be created.
+};
+
+#endif
@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <gvm/exits.h>
+#include <gvm/sessions.h>
+
+#include <utils/colors.h>
+#include <utils/epoch.h>
+#include <utils/uuid.h>
+
+using std::cout;
+
+/*! \page vm-exits-test VM Exits Test
+ *
+ * \tableofcontents
+ *
+ * These tests check that the sessions of VMs are released as soon as their QEMU process exits.
+ * Child processes stand in for QEMU. The following tests are implemented:
+ *
+ * -# \ref exit-release - Releases the session of an exited process.
+ * -# \ref exit-restart - Keeps the session of a mediated device started again.
+ *
+ * \section exit-release Exit Release
+ *
+ * This test determines if the session of a process is released once it exits, and only then,
+ * and if the ended session is handed to the caller. The pseudo-code that is executed to
+ * determine if this test is a success is:
+ *
+ * ```{.c}
+ * vm_watch_exit(mgr, s{child}), vm_add_session(mgr, s), handle_vm_exits(mgr) == 0,
+ * kill(child), poll(exit_fd), handle_vm_exits(mgr, record) == 1 && recorded == (s) &&
+ * closed(s.mdev_fd) && vm_gpu_sessions(view, gpu) == 0 &&
+ * vm_find_watched(view, s.pid_fd) == NULL
+ * ```
+ *
+ * \section exit-restart Exit Restart
+ *
+ * This test determines if the exit of a process leaves alone the session of another process
+ * using the same mediated device. The pseudo-code that is executed to determine if this test
+ * is a success is:
+ *
+ * ```{.c}
+ * vm_add_session(mgr, a{first}), vm_add_session(mgr, a{second}), kill(first),
+ * vm_end_session(mgr, a, first) == 0 && vm_find_session(view, a)->qemu_pid == second
+ * ```
+ */
+
+/*! \brief Spawns a process standing in for QEMU.
+ *
+ * \return PID of the process, -1 on failure.
+ */
+static pid_t spawn_qemu()
+{
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        pause();
+        _exit(0);
+    }
+
+    return pid;
+}
+
+/*! \brief Kills and reaps a process standing in for QEMU. */
+static void kill_qemu(pid_t pid)
+{
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+/*! \brief Creates the session of a process.
+ *
+ * \param index - Index used to derive the UUID.
+ * \param pid - QEMU process of the session.
+ * \param mdev_fd - Vgpu fd owned by the session.
+ * \return The session.
+ */
+static struct VmSession make_session(uint32_t index, pid_t pid, int mdev_fd)
+{
+    struct VmSession ret = {};
+
+    ret.mdev.time_low = index;
+    ret.qemu_pid = pid;
+    ret.gpu_id = 0x100;
+    ret.mdev_fd = mdev_fd;
+    ret.pid_fd = -1;
+
+    return ret;
+}
+
+/*! \brief Checks if a file descriptor is open. */
+static bool fd_open(int fd)
+{
+    return fcntl(fd, F_GETFD) != -1;
+}
+
+/*! \brief Records the sessions ended by handle_vm_exits. */
+static void record_exit(const struct VmSession* session, void* user)
+{
+    ((std::vector<struct VmSession>*) user)->push_back(*session);
+}
+
+bool exit_release()
+{
+    struct VmMgr mgr = {};
+    int fds[2];
+
+    if (vm_exits_open(&mgr) == -1 || pipe(fds) == -1) {
+        vm_exits_close(&mgr);
+        return false;
+    }
+
+    pid_t first = spawn_qemu();
+    pid_t second = spawn_qemu();
+    struct VmSession session = make_session(1, first, fds[0]);
+    struct VmSession other = make_session(2, second, fds[1]);
+
+    bool ret = first > 0 && second > 0 &&
+               vm_watch_exit(&mgr, &session) && vm_watch_exit(&mgr, &other) &&
+               vm_add_session(&mgr, &session) && vm_add_session(&mgr, &other);
+
+    ret = ret && handle_vm_exits(&mgr, NULL, NULL) == 0 && fd_open(fds[0]);
+
+    kill_qemu(first);
+
+    struct pollfd exit_poll = {.fd = mgr.exit_fd, .events = POLLIN, .revents = 0};
+
+    std::vector<struct VmSession> exited;
+
+    ret = ret && poll(&exit_poll, 1, 5000) == 1 && handle_vm_exits(&mgr, record_exit, &exited) == 1;
+    ret = ret && exited.size() == 1 && exited[0].qemu_pid == (uint32_t) first;
+    ret = ret && uuid_equal(&exited[0].mdev, &session.mdev) && exited[0].gpu_id == 0x100;
+    ret = ret && !fd_open(fds[0]) && !fd_open(session.pid_fd) && fd_open(fds[1]);
+
+    epoch_enter();
+
+    const struct VmSessionView* view = vm_sessions(&mgr);
+
+    ret = ret && vm_find_session(view, &session.mdev) == NULL && vm_find_session(view, &other.mdev) != NULL;
+    ret = ret && vm_gpu_sessions(view, 0x100) == 1;
+    ret = ret && vm_find_watched(view, session.pid_fd) == NULL && vm_find_watched(view, other.pid_fd) != NULL;
+    ret = ret && vm_find_watched(view, other.pid_fd)->qemu_pid == (uint32_t) second;
+
+    epoch_exit();
+
+    ret = ret && handle_vm_exits(&mgr, NULL, NULL) == 0;
+
+    kill_qemu(second);
+
+    vm_free_sessions(&mgr);
+    vm_exits_close(&mgr);
+
+    return ret && !fd_open(fds[1]);
+}
+
+bool exit_restart()
+{
+    struct VmMgr mgr = {};
+
+    if (vm_exits_open(&mgr) == -1)
+        return false;
+
+    pid_t first = spawn_qemu();
+    pid_t second = spawn_qemu();
+    struct VmSession before = make_session(1, first, -1);
+    struct VmSession after = make_session(1, second, -1);
+
+    bool ret = first > 0 && second > 0 &&
+               vm_watch_exit(&mgr, &before) && vm_add_session(&mgr, &before) &&
+               vm_watch_exit(&mgr, &after) && vm_add_session(&mgr, &after);
+
+    /* The replaced session released its pidfd, so the exit is not even reported. */
+    kill_qemu(first);
+
+    ret = ret && !fd_open(before.pid_fd) && handle_vm_exits(&mgr, NULL, NULL) == 0;
+    ret = ret && !vm_end_session(&mgr, &before.mdev, first);
+
+    epoch_enter();
+
+    const struct VmSession* found = vm_find_session(vm_sessions(&mgr), &after.mdev);
+
+    ret = ret && found != NULL && found->qemu_pid == (uint32_t) second;
+
+    epoch_exit();
+
+    kill_qemu(second);
+
+    ret = ret && vm_end_session(&mgr, &after.mdev, second);
+
+    vm_free_sessions(&mgr);
+    vm_exits_close(&mgr);
+
+    return ret;
+}
+
+int main()
+{
+    const uint32_t NUM_TESTS = 2;
+
+    const std::string test_names[] = {
+        "Exit Release",
+        "Exit Restart"
+    };
+    const std::string test_details[] = {
+        "The session of an exited process was kept or a running one was released.",
+        "The exit of a process released the session of another process."
+    };
+
+    bool (*tests[])(void) = {
+        exit_release, exit_restart
+    };
+
+    uint32_t failures = 0;
+
+    for (uint32_t i = 0; i < NUM_TESTS; ++i) {
+        bool test_result = tests[i]() == 1;
+
+        if (test_result)
+            cout << GREEN_COLOR << test_names[i]
+                 << " succeeded" RESET_COLOR "\n";
+        else {
+            ++failures;
+            cout << RED_COLOR << test_names[i]
+                 << ": " << test_details[i]
+                 << RESET_COLOR "\n";
+        }
+    }
+
+    epoch_barrier();
+
+    if (failures == 0)
+        cout << GREEN_COLOR << "All tests succeeded" RESET_COLOR "\n";
+    else
+        cout << RED_COLOR << failures << "/"
+             << NUM_TESTS << " tests failed" RESET_COLOR "\n";
+}
@@ -0,0 +1,412 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include <gvm/scheduler.h>
+
+#include <utils/colors.h>
+
+using std::cout;
+
+/*! \page vm-scheduler-test VM Scheduler Test
+ *
+ * \tableofcontents
+ *
+ * These tests check the scheduler ordering the VM start requests. Requests carry their index
+ * as data so the dispatch order can be checked. The following tests are implemented:
+ *
+ * -# \ref sched-rules - Classifies configuration strings.
+ * -# \ref sched-priority - Dispatches the classes in order.
+ * -# \ref sched-cap - Bounds the starts in flight per GPU.
+ * -# \ref sched-fair - Takes turns across the GPUs.
+ * -# \ref sched-stats - Reports the queue depths.
+ * -# \ref sched-concurrent - Dispatches from several threads.
+ *
+ * \section sched-rules Priority Rules
+ *
+ * This test determines if the first matching rule gives the class of a configuration and if
+ * malformed rules are rejected. The pseudo-code that is executed to determine if this test is
+ * a success is:
+ *
+ * ```{.c}
+ * vm_sched_parse_rule(s, "tier=gold=0"), vm_sched_parse_rule(s, "batch=3"),
+ * vm_sched_class(s, "a,tier=gold") == 0 && vm_sched_class(s, "other") == 2 &&
+ * !vm_sched_parse_rule(s, "tier=9")
+ * ```
+ *
+ * \section sched-priority Priority Order
+ *
+ * This test determines if requests of a lower class are dispatched first, in arrival order
+ * within a class. The pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * submit(class 2: 0), submit(class 0: 1), submit(class 3: 2), submit(class 0: 3),
+ * next() == 1, 3, 0, 2
+ * ```
+ *
+ * \section sched-cap Concurrency Cap
+ *
+ * This test determines if a GPU never runs more starts than its cap while other GPUs still
+ * run theirs. The pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * cap = 2, submit(gpu a) * 5, submit(gpu b), next() * 3 == (a, b, a) && !next(),
+ * done(a), next() == a
+ * ```
+ *
+ * \section sched-fair Fair Queuing
+ *
+ * This test determines if the GPUs take turns within a class, so a GPU with many requests does
+ * not delay the others. The pseudo-code that is executed to determine if this test is a success
+ * is:
+ *
+ * ```{.c}
+ * submit(gpu a) * 6, submit(gpu b) * 2, submit(gpu c) * 2, next() * 10 == a b c a b c a a a a
+ * ```
+ *
+ * \section sched-stats Queue Metrics
+ *
+ * This test determines if the queue depths and counters follow the requests. The pseudo-code
+ * that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * submit * 4, next(), stats.queued == 3 && stats.max_queued == 4 && stats.in_flight == 1 &&
+ * vm_sched_gpu_depth(s, a) == 2
+ * ```
+ *
+ * \section sched-concurrent Concurrent Dispatch
+ *
+ * This test determines if the cap holds while requests are submitted and dispatched from
+ * several threads. The pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * producer: submit(gpu i % 4) * 20000
+ * workers: next(), running[gpu]++ <= cap, running[gpu]--, done()
+ * completed == 20000 && max(running) <= cap
+ * ```
+ */
+
+/*! \brief Encodes a request index as request data. */
+static void* index_data(uintptr_t index)
+{
+    return (void*) (index + 1);
+}
+
+/*! \brief Decodes the request index of request data. */
+static uintptr_t data_index(void* data)
+{
+    return (uintptr_t) data - 1;
+}
+
+bool sched_rules()
+{
+    struct VmScheduler* sched = vm_sched_create(1, 2);
+
+    if (sched == NULL)
+        return false;
+
+    bool ret = vm_sched_parse_rule(sched, "tier=gold=0") && vm_sched_parse_rule(sched, "batch=3") &&
+               vm_sched_parse_rule(sched, "tier=silver=1");
+
+    ret = ret && !vm_sched_parse_rule(sched, "tier=9") && !vm_sched_parse_rule(sched, "=1") &&
+          !vm_sched_parse_rule(sched, "gold") && !vm_sched_parse_rule(sched, "gold=") &&
+          !vm_sched_parse_rule(sched, "gold=1x");
+
+    ret = ret && vm_sched_class(sched, "name=vm,tier=gold") == 0;
+    ret = ret && vm_sched_class(sched, "tier=silver") == 1;
+    ret = ret && vm_sched_class(sched, "batch,tier=gold") == 0;
+    ret = ret && vm_sched_class(sched, "batch") == 3;
+    ret = ret && vm_sched_class(sched, "") == 2;
+
+    vm_sched_free(sched, NULL);
+
+    return ret;
+}
+
+bool sched_priority()
+{
+    struct VmScheduler* sched = vm_sched_create(16, 2);
+
+    if (sched == NULL)
+        return false;
+
+    const uint8_t classes[] = {2, 0, 3, 0};
+    const uintptr_t expected[] = {1, 3, 0, 2};
+
+    bool ret = true;
+
+    for (uintptr_t i = 0; i < 4; ++i)
+        ret = ret && vm_sched_submit(sched, 0x100, classes[i], index_data(i));
+
+    for (uint32_t i = 0; i < 4 && ret; ++i) {
+        uint32_t gpu_id = 0;
+        void* data = NULL;
+
+        ret = vm_sched_next(sched, &gpu_id, &data) && gpu_id == 0x100 && data_index(data) == expected[i];
+    }
+
+    uint32_t gpu_id;
+    void* data;
+
+    ret = ret && !vm_sched_next(sched, &gpu_id, &data);
+
+    vm_sched_free(sched, NULL);
+
+    return ret;
+}
+
+bool sched_cap()
+{
+    struct VmScheduler* sched = vm_sched_create(2, 2);
+
+    if (sched == NULL)
+        return false;
+
+    bool ret = true;
+
+    for (uintptr_t i = 0; i < 5; ++i)
+        ret = ret && vm_sched_submit(sched, 0xA00, 2, index_data(i));
+
+    ret = ret && vm_sched_submit(sched, 0xB00, 2, index_data(5));
+
+    uint32_t gpus[3] = {};
+    void* data;
+
+    for (uint32_t i = 0; i < 3 && ret; ++i)
+        ret = vm_sched_next(sched, &gpus[i], &data);
+
+    ret = ret && gpus[0] == 0xA00 && gpus[1] == 0xB00 && gpus[2] == 0xA00;
+    ret = ret && !vm_sched_next(sched, &gpus[0], &data);
+
+    vm_sched_done(sched, 0xA00);
+
+    ret = ret && vm_sched_next(sched, &gpus[0], &data) && gpus[0] == 0xA00 && data_index(data) == 2;
+    ret = ret && !vm_sched_next(sched, &gpus[0], &data);
+
+    /* Done for a GPU without starts in flight is ignored. */
+    vm_sched_done(sched, 0xC00);
+
+    struct VmSchedStats stats;
+
+    vm_sched_stats(sched, &stats);
+
+    ret = ret && stats.in_flight == 3 && stats.queued == 2 && stats.completed == 1;
+
+    vm_sched_free(sched, NULL);
+
+    return ret;
+}
+
+bool sched_fair()
+{
+    struct VmScheduler* sched = vm_sched_create(16, 2);
+
+    if (sched == NULL)
+        return false;
+
+    bool ret = true;
+
+    for (uintptr_t i = 0; i < 6; ++i)
+        ret = ret && vm_sched_submit(sched, 0xA00, 1, index_data(i));
+    for (uintptr_t i = 0; i < 2; ++i)
+        ret = ret && vm_sched_submit(sched, 0xB00, 1, index_data(i));
+    for (uintptr_t i = 0; i < 2; ++i)
+        ret = ret && vm_sched_submit(sched, 0xC00, 1, index_data(i));
+
+    const uint32_t expected[] = {0xA00, 0xB00, 0xC00, 0xA00, 0xB00, 0xC00, 0xA00, 0xA00, 0xA00, 0xA00};
+
+    for (uint32_t i = 0; i < 10 && ret; ++i) {
+        uint32_t gpu_id;
+        void* data;
+
+        ret = vm_sched_next(sched, &gpu_id, &data) && gpu_id == expected[i];
+    }
+
+    vm_sched_free(sched, NULL);
+
+    return ret;
+}
+
+/*! \brief Counts the discarded requests. */
+static std::atomic<uint32_t> discarded(0);
+
+static void count_discard(void* data)
+{
+    (void) data;
+    ++discarded;
+}
+
+bool sched_stats()
+{
+    struct VmScheduler* sched = vm_sched_create(1, 2);
+
+    if (sched == NULL)
+        return false;
+
+    bool ret = vm_sched_submit(sched, 0xA00, 0, index_data(0)) &&
+               vm_sched_submit(sched, 0xA00, 2, index_data(1)) &&
+               vm_sched_submit(sched, 0xA00, 2, index_data(2)) &&
+               vm_sched_submit(sched, 0xB00, 3, index_data(3));
+
+    uint32_t gpu_id;
+    void* data;
+
+    ret = ret && vm_sched_next(sched, &gpu_id, &data) && data_index(data) == 0;
+
+    struct VmSchedStats stats;
+
+    vm_sched_stats(sched, &stats);
+
+    ret = ret && stats.queued == 3 && stats.max_queued == 4 && stats.in_flight == 1 &&
+          stats.submitted == 4 && stats.dispatched == 1 && stats.gpus == 2 &&
+          stats.queued_by_class[0] == 0 && stats.queued_by_class[2] == 2 &&
+          stats.queued_by_class[3] == 1 && stats.wait_ns_max >= stats.wait_ns_total;
+
+    ret = ret && vm_sched_gpu_depth(sched, 0xA00) == 2 && vm_sched_gpu_depth(sched, 0xB00) == 1;
+    ret = ret && vm_sched_gpu_depth(sched, 0xC00) == 0;
+
+    discarded = 0;
+    vm_sched_free(sched, count_discard);
+
+    return ret && discarded == 3;
+}
+
+bool sched_concurrent()
+{
+    const uint32_t NUM_REQUESTS = 20000;
+    const uint32_t NUM_WORKERS = 4;
+    const uint32_t NUM_GPUS = 4;
+    const uint32_t CAP = 2;
+
+    struct VmScheduler* sched = vm_sched_create(CAP, 2);
+
+    if (sched == NULL)
+        return false;
+
+    std::atomic<uint32_t> running[NUM_GPUS];
+    std::atomic<uint32_t> max_running(0);
+    std::atomic<uint32_t> completed(0);
+    std::vector<std::thread> threads;
+
+    for (uint32_t i = 0; i < NUM_GPUS; ++i)
+        running[i] = 0;
+
+    auto start = std::chrono::steady_clock::now();
+
+    threads.emplace_back([&]() {
+        for (uintptr_t i = 0; i < NUM_REQUESTS; ++i)
+            while (!vm_sched_submit(sched, i % NUM_GPUS, i % VM_SCHED_CLASSES, index_data(i)))
+                std::this_thread::yield();
+    });
+
+    for (uint32_t w = 0; w < NUM_WORKERS; ++w) {
+        threads.emplace_back([&]() {
+            while (completed < NUM_REQUESTS) {
+                uint32_t gpu_id;
+                void* data;
+
+                if (!vm_sched_next(sched, &gpu_id, &data)) {
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                uint32_t now = ++running[gpu_id];
+                uint32_t seen = max_running;
+
+                while (now > seen && !max_running.compare_exchange_weak(seen, now))
+                    ;
+
+                --running[gpu_id];
+                vm_sched_done(sched, gpu_id);
+                ++completed;
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+    struct VmSchedStats stats;
+
+    vm_sched_stats(sched, &stats);
+    vm_sched_free(sched, NULL);
+
+    cout << "\tconcurrent dispatch: " << NUM_REQUESTS << " ops in " << ms << " ms ("
+         << (ms > 0 ? NUM_REQUESTS * 1000 / ms : NUM_REQUESTS) << " ops/s)\n";
+
+    return completed == NUM_REQUESTS && max_running <= CAP && stats.completed == NUM_REQUESTS &&
+           stats.queued == 0 && stats.in_flight == 0;
+}
+
+int main()
+{
+    const uint32_t NUM_TESTS = 6;
+
+    const std::string test_names[] = {
+        "Priority Rules",
+        "Priority Order",
+        "Concurrency Cap",
+        "Fair Queuing",
+        "Queue Metrics",
+        "Concurrent Dispatch"
+    };
+    const std::string test_details[] = {
+        "A configuration was classified incorrectly or a malformed rule was accepted.",
+        "Requests were not dispatched by class and arrival order.",
+        "A GPU ran more starts than its cap or blocked another GPU.",
+        "A GPU with many requests delayed the requests of the other GPUs.",
+        "The queue depths or counters do not match the requests.",
+        "The cap was exceeded or requests were lost while dispatching from several threads."
+    };
+
+    bool (*tests[])(void) = {
+        sched_rules, sched_priority, sched_cap, sched_fair, sched_stats, sched_concurrent
+    };
+
+    uint32_t failures = 0;
+
+    for (uint32_t i = 0; i < NUM_TESTS; ++i) {
+        bool test_result = tests[i]() == 1;
+
+        if (test_result)
+            cout << GREEN_COLOR << test_names[i]
+                 << " succeeded" RESET_COLOR "\n";
+        else {
+            ++failures;
+            cout << RED_COLOR << test_names[i]
+                 << ": " << test_details[i]
+                 << RESET_COLOR "\n";
+        }
+    }
+
+    if (failures == 0)
+        cout << GREEN_COLOR << "All tests succeeded" RESET_COLOR "\n";
+    else
+        cout << RED_COLOR << failures << "/"
+             << NUM_TESTS << " tests failed" RESET_COLOR "\n";
+}
@@ -0,0 +1,345 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <iostream>
+#include <string>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <gvm/sessions.h>
+
+#include <utils/colors.h>
+#include <utils/epoch.h>
+#include <utils/sysfs.h>
+#include <utils/uuid.h>
+
+#include "sysfs-fixture.hpp"
+
+using std::cout;
+
+/*! \page vm-sessions-test VM Sessions Test
+ *
+ * \tableofcontents
+ *
+ * These tests check the table of the started VMs, keyed by the UUID of their mediated
+ * device, and the resources owned by its sessions. The following tests are implemented:
+ *
+ * -# \ref uuid-text - Parses and generates UUIDs.
+ * -# \ref session-lookup - Finds sessions and counts them per GPU.
+ * -# \ref session-release - Releases the vgpu fds of replaced and removed sessions.
+ * -# \ref qemu-uuid - Finds the UUID of a QEMU process.
+ * -# \ref mdev-type - Finds the mdev type of a mediated device.
+ *
+ * \section uuid-text UUID Text
+ *
+ * This test determines if UUIDs are parsed from their canonical form and if random UUIDs are
+ * version 4. The pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * uuid_parse("1ef6679d-e5ee-1aea-cafd-56470fbb851e", &uuid) && uuid.time_low == 0x1EF6679D &&
+ * !uuid_parse("1ef6679d-e5ee-1aea-cafd-56470fbb85", &uuid) && version(uuid_generate()) == 4
+ * ```
+ *
+ * \section session-lookup Session Lookup
+ *
+ * This test determines if every session of a large table is found by its UUID and if the
+ * sessions are counted per GPU. The pseudo-code that is executed to determine if this test is a
+ * success is:
+ *
+ * ```{.c}
+ * vm_add_session(mgr, s[i]) for 1000 sessions on 4 GPUs,
+ * vm_find_session(view, s[i].mdev) == s[i] && vm_gpu_sessions(view, gpu) == 250 &&
+ * vm_find_session(view, unknown) == NULL
+ * ```
+ *
+ * \section session-release Session Release
+ *
+ * This test determines if the vgpu fd of a session is closed when the session is replaced,
+ * removed or freed, and only then. The pseudo-code that is executed to determine if this test
+ * is a success is:
+ *
+ * ```{.c}
+ * vm_add_session(mgr, a{fd0}), vm_add_session(mgr, a{fd1}), closed(fd0) && open(fd1),
+ * vm_remove_session(mgr, a), closed(fd1), vm_add_session(mgr, b{fd2}), vm_free_sessions(mgr),
+ * closed(fd2)
+ * ```
+ *
+ * \section qemu-uuid QEMU UUID
+ *
+ * This test determines if the UUID a process was started with is read from its command line.
+ * The pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * pid = spawn("sh", "-c", "sleep 5", "sh", "-uuid", uuid), vm_qemu_uuid(pid, &found) &&
+ * found == uuid && !vm_qemu_uuid(getpid(), &found)
+ * ```
+ *
+ * \section mdev-type Mdev Type
+ *
+ * This test determines if the type of a mediated device is read from its mdev_type link in a
+ * sysfs fixture set with set_sysfs_root. The pseudo-code that is executed to determine if this
+ * test is a success is:
+ *
+ * ```{.c}
+ * link(devices/uuid/mdev_type -> types/nvidia-63), vm_mdev_type(uuid) == 63 &&
+ * link(-> types/i915-GVTg_V5_4) && !vm_mdev_type(uuid) && !vm_mdev_type(unknown)
+ * ```
+ */
+
+//! UUID used through the tests.
+static const char* TEST_UUID = "1ef6679d-e5ee-1aea-cafd-56470fbb851e";
+
+/*! \brief Creates a session without resources.
+ *
+ * \param index - Index used to derive the UUID.
+ * \param gpu_id - GPU of the session.
+ * \return The session.
+ */
+static struct VmSession make_session(uint32_t index, uint32_t gpu_id)
+{
+    struct VmSession ret = {};
+
+    ret.mdev.time_low = index;
+    ret.mdev.node[5] = index & 0xFF;
+    ret.qemu_pid = index + 1000;
+    ret.gpu_id = gpu_id;
+    ret.mdev_fd = -1;
+    ret.pid_fd = -1;
+
+    return ret;
+}
+
+/*! \brief Checks if a file descriptor is open. */
+static bool fd_open(int fd)
+{
+    return fcntl(fd, F_GETFD) != -1;
+}
+
+bool uuid_text()
+{
+    struct UUID uuid = {};
+    struct UUID random = {};
+
+    bool ret = uuid_parse(TEST_UUID, &uuid) && uuid.time_low == 0x1EF6679D &&
+               uuid.time_mid == 0xE5EE && uuid.time_hi_and_version == 0x1AEA &&
+               uuid.clock_seq_hi_and_reserved == 0xCA && uuid.clock_seq_low == 0xFD &&
+               uuid.node[0] == 0x56 && uuid.node[5] == 0x1E;
+
+    ret = ret && !uuid_parse("1ef6679d-e5ee-1aea-cafd-56470fbb85", &uuid);
+    ret = ret && !uuid_parse("1ef6679de5ee-1aea-cafd-56470fbb851e0", &uuid);
+    ret = ret && !uuid_parse("1ef6679d-e5ee-1aea-cafd-56470fbb851g", &uuid);
+    ret = ret && uuid.time_low == 0x1EF6679D;
+
+    ret = ret && uuid_generate(&random) && (random.time_hi_and_version >> 12) == 4 &&
+          (random.clock_seq_hi_and_reserved & 0xC0) == 0x80 && !uuid_equal(&random, &uuid);
+
+    return ret;
+}
+
+bool session_lookup()
+{
+    const uint32_t NUM_SESSIONS = 1000;
+
+    struct VmMgr mgr = {};
+    bool ret = true;
+
+    for (uint32_t i = 0; i < NUM_SESSIONS && ret; ++i) {
+        struct VmSession session = make_session(i, 0x100 * (i % 4 + 1));
+
+        ret = vm_add_session(&mgr, &session);
+    }
+
+    epoch_enter();
+
+    const struct VmSessionView* view = vm_sessions(&mgr);
+
+    ret = ret && view != NULL && view->size == NUM_SESSIONS && view->gpu_count == 4;
+
+    for (uint32_t i = 0; i < NUM_SESSIONS && ret; ++i) {
+        struct VmSession session = make_session(i, 0);
+        const struct VmSession* found = vm_find_session(view, &session.mdev);
+
+        ret = found != NULL && found->qemu_pid == i + 1000 && found->gpu_id == 0x100 * (i % 4 + 1);
+    }
+
+    struct VmSession unknown = make_session(NUM_SESSIONS, 0);
+
+    ret = ret && vm_find_session(view, &unknown.mdev) == NULL;
+    ret = ret && vm_gpu_sessions(view, 0x100) == 250 && vm_gpu_sessions(view, 0x400) == 250;
+    ret = ret && vm_gpu_sessions(view, 0x500) == 0 && vm_gpu_sessions(NULL, 0x100) == 0;
+
+    epoch_exit();
+
+    ret = ret && vm_remove_session(&mgr, &unknown.mdev) == 0;
+
+    struct VmSession first = make_session(0, 0);
+
+    ret = ret && vm_remove_session(&mgr, &first.mdev);
+
+    epoch_enter();
+    view = vm_sessions(&mgr);
+    ret = ret && vm_find_session(view, &first.mdev) == NULL && vm_gpu_sessions(view, 0x100) == 249;
+    epoch_exit();
+
+    vm_free_sessions(&mgr);
+
+    return ret;
+}
+
+bool session_release()
+{
+    int fds[2][2];
+
+    if (pipe(fds[0]) == -1)
+        return false;
+
+    if (pipe(fds[1]) == -1) {
+        close(fds[0][0]);
+        close(fds[0][1]);
+        return false;
+    }
+
+    struct VmMgr mgr = {};
+    struct VmSession first = make_session(1, 0x100);
+    struct VmSession replaced = make_session(1, 0x100);
+    struct VmSession second = make_session(2, 0x100);
+
+    first.mdev_fd = fds[0][0];
+    replaced.mdev_fd = fds[0][1];
+    second.mdev_fd = fds[1][0];
+
+    bool ret = vm_add_session(&mgr, &first) && vm_add_session(&mgr, &replaced);
+
+    ret = ret && !fd_open(fds[0][0]) && fd_open(fds[0][1]);
+
+    /* Adding the same session again keeps its fd. */
+    ret = ret && vm_add_session(&mgr, &replaced) && fd_open(fds[0][1]);
+    ret = ret && vm_remove_session(&mgr, &replaced.mdev) && !fd_open(fds[0][1]);
+    ret = ret && vm_add_session(&mgr, &second) && fd_open(fds[1][0]);
+
+    vm_free_sessions(&mgr);
+
+    ret = ret && !fd_open(fds[1][0]) && fd_open(fds[1][1]);
+
+    close(fds[1][1]);
+
+    return ret;
+}
+
+bool qemu_uuid()
+{
+    pid_t pid = fork();
+
+    if (pid == -1)
+        return false;
+
+    if (pid == 0) {
+        execl("/bin/sh", "sh", "-c", "sleep 5; true", "sh", "-uuid", TEST_UUID, (char*) NULL);
+        _exit(1);
+    }
+
+    struct UUID expected;
+    struct UUID found = {};
+    bool ret = false;
+
+    uuid_parse(TEST_UUID, &expected);
+
+    /* The command line changes from the one of the test once the child executed the shell. */
+    for (uint32_t i = 0; i < 2000 && !ret; ++i) {
+        ret = vm_qemu_uuid(pid, &found) && uuid_equal(&found, &expected);
+
+        if (!ret)
+            usleep(1000);
+    }
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+
+    return ret && !vm_qemu_uuid(getpid(), &found) && !vm_qemu_uuid(pid, &found);
+}
+
+bool mdev_type()
+{
+    SysfsFixture fixture("sessions");
+    std::string device = std::string("bus/mdev/devices/") + TEST_UUID;
+    std::string types = "../../../../devices/pci0000:00/0000:00:02.0/mdev_supported_types/";
+    struct UUID mdev;
+    struct UUID unknown = {};
+    uint32_t type = 0;
+
+    uuid_parse(TEST_UUID, &mdev);
+    fixture.link(device + "/mdev_type", types + "nvidia-63");
+
+    bool ret = fixture.valid() && vm_mdev_type(&mdev, &type) && type == 63 && !vm_mdev_type(&unknown, &type);
+
+    fixture.link(device + "/mdev_type", types + "i915-GVTg_V5_4");
+
+    return ret && !vm_mdev_type(&mdev, &type);
+}
+
+int main()
+{
+    const uint32_t NUM_TESTS = 5;
+
+    const std::string test_names[] = {
+        "UUID Text",
+        "Session Lookup",
+        "Session Release",
+        "QEMU UUID",
+        "Mdev Type"
+    };
+    const std::string test_details[] = {
+        "A UUID was parsed incorrectly, a malformed one was accepted or a random one is not version 4.",
+        "A session was not found by its UUID or the sessions of a GPU were miscounted.",
+        "The vgpu fd of a session was leaked or closed while the session was running.",
+        "The UUID a process was started with was not found.",
+        "The type of a mediated device was not read or a foreign type was accepted."
+    };
+
+    bool (*tests[])(void) = {
+        uuid_text, session_lookup, session_release, qemu_uuid, mdev_type
+    };
+
+    uint32_t failures = 0;
+
+    for (uint32_t i = 0; i < NUM_TESTS; ++i) {
+        bool test_result = tests[i]() == 1;
+
+        if (test_result)
+            cout << GREEN_COLOR << test_names[i]
+                 << " succeeded" RESET_COLOR "\n";
+        else {
+            ++failures;
+            cout << RED_COLOR << test_names[i]
+                 << ": " << test_details[i]
+                 << RESET_COLOR "\n";
+        }
+    }
+
+    epoch_barrier();
+
+    if (failures == 0)
+        cout << GREEN_COLOR << "All tests succeeded" RESET_COLOR "\n";
+    else
+        cout << RED_COLOR << failures << "/"
+             << NUM_TESTS << " tests failed" RESET_COLOR "\n";
+}
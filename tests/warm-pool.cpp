@@ -0,0 +1,559 @@
+/*
+ * Copyright (C) 2022 2666680 Ontario Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+#include <iostream>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <gvm/pool.h>
+
+#include <utils/colors.h>
+#include <utils/sysfs.h>
+#include <utils/uuid.h>
+
+#include "sysfs-fixture.hpp"
+
+using std::cout;
+
+namespace fs = std::filesystem;
+
+/*! \page warm-pool-test Warm Pool Test
+ *
+ * \tableofcontents
+ *
+ * These tests check the warm pool of vGPU instances. The mdev types of the GPUs are read from a
+ * sysfs fixture set with set_sysfs_root, whose create attributes keep every UUID written to
+ * them, and the vGPU devices are eventfds. The following tests are implemented:
+ *
+ * -# \ref pool-parse - Parses the pool targets.
+ * -# \ref pool-fill - Creates the instances of the targets.
+ * -# \ref pool-open - Opens the vGPU devices once their minor is known.
+ * -# \ref pool-claim - Hands the open devices to the starting VMs.
+ * -# \ref pool-take - Hands out ready instances to start VMs on.
+ * -# \ref pool-refill - Refills the pool in the background.
+ * -# \ref pool-free - Removes the instances no VM was started on.
+ *
+ * \section pool-parse Target Parsing
+ *
+ * This test determines if the targets are parsed from their TYPE@BDF=COUNT form. The
+ * pseudo-code that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * parse("nvidia-63@0000:01:00.0=4") && !parse("nvidia-63=4") && !parse("nvidia-63@0000:01:00.0=x")
+ * ```
+ *
+ * \section pool-fill Filling
+ *
+ * This test determines if the missing instances are created through the create attribute of
+ * their type, and if types without available instances are skipped. The pseudo-code that is
+ * executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * add(nvidia-63, 4), add(nvidia-64 without instances, 2), add(nvidia-65 without create, 1),
+ * fill() == 4 && create == 4 distinct UUIDs && failures == 1
+ * ```
+ *
+ * \section pool-open Late Devices
+ *
+ * This test determines if the vGPU devices appearing after their instance was created are
+ * opened by the next fill. The pseudo-code that is executed to determine if this test is a
+ * success is:
+ *
+ * ```{.c}
+ * opened == 0, write(vgpu_minor) for every instance, fill() == 0 && opened == 4
+ * ```
+ *
+ * \section pool-claim Claims
+ *
+ * This test determines if a VM started on a pooled instance gets its open device once, and
+ * if unknown instances and mismatched minors get none. The pseudo-code that is executed to
+ * determine if this test is a success is:
+ *
+ * ```{.c}
+ * claim(instance, minor) != -1 && claim(instance, minor) == -1 &&
+ * claim(other, wrong minor) == -1 && claim(unknown) == -1
+ * ```
+ *
+ * \section pool-take Take
+ *
+ * This test determines if ready instances are handed out once, open devices first, and if a
+ * handed out instance is claimed by its VM and kept when the pool is freed. The pseudo-code
+ * that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * take(nvidia-63, &a) && take(nvidia-63, &b) && a != b && !take(nvidia-64) && taken == 2,
+ * claim(a, a.minor) != -1 && taken == 1, free(), removed == ready instances && !removed(b)
+ * ```
+ *
+ * \section pool-refill Background Refill
+ *
+ * This test determines if the refill thread replaces the instances claimed. The pseudo-code
+ * that is executed to determine if this test is a success is:
+ *
+ * ```{.c}
+ * start(), claim() * 2, wait(ready == 4) < 2 s
+ * ```
+ *
+ * \section pool-free Teardown
+ *
+ * This test determines if freeing the pool removes the instances no VM was started on, keeps
+ * the claimed ones and closes every device. The pseudo-code that is executed to determine if
+ * this test is a success is:
+ *
+ * ```{.c}
+ * claim(), free(), removed == ready instances && open fds == before
+ * ```
+ */
+
+//! GPU of the fixture.
+static const char* SIM_BDF = "0000:01:00.0";
+
+//! Minor given to the next instance whose device appears.
+static uint32_t next_minor = 0;
+
+/*! \brief Opens a vGPU device, an eventfd standing in for /dev/nvidia-vgpu%d. */
+static int sim_open(uint16_t minor)
+{
+    (void) minor;
+
+    return eventfd(0, EFD_CLOEXEC);
+}
+
+/*! \brief Counts the open file descriptors of the process. */
+static size_t open_fds()
+{
+    size_t ret = 0;
+
+    for (auto& entry : fs::directory_iterator("/proc/self/fd")) {
+        (void) entry;
+        ++ret;
+    }
+
+    return ret;
+}
+
+/*! \brief Sysfs tree created for the tests.
+ *
+ * The GPU has the types nvidia-63 with 8 available instances, nvidia-64 with none and
+ * nvidia-65 without a create attribute.
+ */
+class PoolFixture : public SysfsFixture {
+public:
+    PoolFixture() : SysfsFixture("pool")
+    {
+        this->write(this->type_path("nvidia-63") + "/available_instances", "8\n");
+        this->write(this->type_path("nvidia-63") + "/create", "");
+        this->write(this->type_path("nvidia-64") + "/available_instances", "0\n");
+        this->write(this->type_path("nvidia-64") + "/create", "");
+        this->write(this->type_path("nvidia-65") + "/available_instances", "1\n");
+    }
+
+    /*! \brief Gets the UUIDs written to the create attribute of a type. */
+    std::vector<std::string> created(const char* type) const
+    {
+        std::ifstream in(this->path(this->type_path(type) + "/create"));
+        std::vector<std::string> ret;
+
+        /* The UUIDs are appended without separators, like the kernel takes them. */
+        for (std::string uuid; in.width(UUID_STR_LEN), in >> uuid;)
+            ret.push_back(uuid);
+
+        return ret;
+    }
+
+    /*! \brief Makes the vGPU devices of the created instances of a type appear. */
+    void expose(const char* type)
+    {
+        for (const std::string& uuid : this->created(type))
+            if (!fs::exists(this->path("bus/mdev/devices/" + uuid + "/nvidia/vgpu_minor")))
+                this->write("bus/mdev/devices/" + uuid + "/nvidia/vgpu_minor", std::to_string(next_minor++) + "\n");
+    }
+
+    /*! \brief Gets the vGPU minor of an instance, -1 if its device did not appear. */
+    int32_t minor(const std::string& uuid) const
+    {
+        std::ifstream in(this->path("bus/mdev/devices/" + uuid + "/nvidia/vgpu_minor"));
+        int32_t ret = -1;
+
+        in >> ret;
+
+        return ret;
+    }
+
+    /*! \brief Gets the value written to the remove attribute of an instance, empty if none. */
+    std::string removed(const std::string& uuid) const
+    {
+        std::ifstream in(this->path("bus/mdev/devices/" + uuid + "/remove"));
+        std::string ret;
+
+        in >> ret;
+
+        return ret;
+    }
+
+    /*! \brief Prepares the remove attributes of the created instances of a type. */
+    void removable(const char* type)
+    {
+        for (const std::string& uuid : this->created(type))
+            this->write("bus/mdev/devices/" + uuid + "/remove", "");
+    }
+
+private:
+    /*! \brief Gets the path of a type of the GPU, relative to the root. */
+    std::string type_path(const char* type) const
+    {
+        return std::string("bus/pci/devices/") + SIM_BDF + "/mdev_supported_types/" + type;
+    }
+};
+
+/*! \brief Creates a pool keeping 4 instances of nvidia-63 and asking for impossible ones. */
+static struct VgpuPool* create_pool()
+{
+    struct VgpuPool* ret = vgpu_pool_create(sim_open);
+
+    if (ret != NULL &&
+        (!vgpu_pool_add(ret, SIM_BDF, "nvidia-63", 4) || !vgpu_pool_add(ret, SIM_BDF, "nvidia-64", 2) ||
+         !vgpu_pool_add(ret, SIM_BDF, "nvidia-65", 1))) {
+        vgpu_pool_free(ret);
+        return NULL;
+    }
+
+    return ret;
+}
+
+bool pool_parse()
+{
+    struct VgpuPool* pool = vgpu_pool_create(sim_open);
+
+    if (pool == NULL)
+        return false;
+
+    bool ret = vgpu_pool_parse(pool, "nvidia-63@0000:01:00.0=4") &&
+               vgpu_pool_parse(pool, "nvidia-63@0000:01:00.0=0x2") &&
+               !vgpu_pool_parse(pool, "nvidia-63=4") &&
+               !vgpu_pool_parse(pool, "0000:01:00.0=4") &&
+               !vgpu_pool_parse(pool, "nvidia-63@0000:01:00.0") &&
+               !vgpu_pool_parse(pool, "nvidia-63@0000:01:00.0=x") &&
+               !vgpu_pool_parse(pool, "nvidia-63@=4") &&
+               !vgpu_pool_parse(pool, "@0000:01:00.0=4") &&
+               !vgpu_pool_parse(pool, "nvidia-63@0000:0000:01:00.0=4");
+
+    vgpu_pool_free(pool);
+
+    return ret;
+}
+
+bool pool_fill()
+{
+    PoolFixture fixture;
+    struct VgpuPool* pool = create_pool();
+    struct VgpuPoolStats stats;
+
+    if (!fixture.valid() || pool == NULL) {
+        vgpu_pool_free(pool);
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    uint32_t created = vgpu_pool_fill(pool);
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    cout << "\tInstance setup: " << created << " ops in " << us / 1000.0 << " ms ("
+         << (us > 0 ? created * 1000000 / us : created) << " ops/s)\n";
+
+    std::vector<std::string> uuids = fixture.created("nvidia-63");
+    std::set<std::string> distinct(uuids.begin(), uuids.end());
+    struct UUID uuid;
+    bool ret = created == 4 && uuids.size() == 4 && distinct.size() == 4;
+
+    for (const std::string& text : uuids)
+        ret = ret && uuid_parse(text.c_str(), &uuid);
+
+    vgpu_pool_stats(pool, &stats);
+    ret = ret && fixture.created("nvidia-64").empty() && stats.ready == 4 && stats.opened == 0 &&
+          stats.created == 4 && stats.failures == 1;
+
+    /* A full pool creates nothing more. */
+    ret = ret && vgpu_pool_fill(pool) == 0 && fixture.created("nvidia-63").size() == 4;
+
+    vgpu_pool_free(pool);
+
+    return ret;
+}
+
+bool pool_open()
+{
+    PoolFixture fixture;
+    struct VgpuPool* pool = create_pool();
+    struct VgpuPoolStats before;
+    struct VgpuPoolStats after;
+
+    if (!fixture.valid() || pool == NULL) {
+        vgpu_pool_free(pool);
+        return false;
+    }
+
+    vgpu_pool_fill(pool);
+    vgpu_pool_stats(pool, &before);
+
+    fixture.expose("nvidia-63");
+
+    uint32_t created = vgpu_pool_fill(pool);
+
+    vgpu_pool_stats(pool, &after);
+    vgpu_pool_free(pool);
+
+    return before.opened == 0 && created == 0 && after.ready == 4 && after.opened == 4;
+}
+
+bool pool_claim()
+{
+    PoolFixture fixture;
+    struct VgpuPool* pool = create_pool();
+    struct UUID first;
+    struct UUID second;
+    struct VgpuPoolStats stats;
+    struct UUID unknown;
+
+    if (!fixture.valid() || pool == NULL) {
+        vgpu_pool_free(pool);
+        return false;
+    }
+
+    vgpu_pool_fill(pool);
+    fixture.expose("nvidia-63");
+    vgpu_pool_fill(pool);
+
+    std::vector<std::string> uuids = fixture.created("nvidia-63");
+
+    if (uuids.size() != 4) {
+        vgpu_pool_free(pool);
+        return false;
+    }
+
+    int32_t minor = fixture.minor(uuids[0]);
+    bool ret = uuid_parse(uuids[0].c_str(), &first) && uuid_parse(uuids[1].c_str(), &second) && minor != -1;
+
+    auto start = std::chrono::steady_clock::now();
+    int fd = vgpu_pool_claim(pool, &first, minor);
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    cout << "\tWarm claim: 1 ops in " << ns / 1000000.0 << " ms\n";
+
+    ret = ret && fd != -1 && vgpu_pool_claim(pool, &first, minor) == -1;
+
+    /* A device opened for another minor is stale, the VM opens its own. */
+    ret = ret && vgpu_pool_claim(pool, &second, fixture.minor(uuids[1]) + 1) == -1 &&
+          uuid_generate(&unknown) && vgpu_pool_claim(pool, &unknown, 0) == -1 &&
+          vgpu_pool_claim(NULL, &first, minor) == -1;
+
+    vgpu_pool_stats(pool, &stats);
+    ret = ret && stats.ready == 2 && stats.opened == 2 && stats.claimed == 2 && stats.warm_starts == 1;
+
+    if (fd != -1)
+        close(fd);
+
+    vgpu_pool_free(pool);
+
+    return ret;
+}
+
+bool pool_take()
+{
+    PoolFixture fixture;
+    struct VgpuPool* pool = create_pool();
+    struct VgpuInstance first;
+    struct VgpuInstance second;
+    struct VgpuPoolStats stats;
+
+    if (!fixture.valid() || pool == NULL) {
+        vgpu_pool_free(pool);
+        return false;
+    }
+
+    vgpu_pool_fill(pool);
+    fixture.expose("nvidia-63");
+    fixture.removable("nvidia-63");
+    vgpu_pool_fill(pool);
+
+    bool ret = vgpu_pool_take(pool, SIM_BDF, "nvidia-63", &first) &&
+               vgpu_pool_take(pool, SIM_BDF, "nvidia-63", &second) &&
+               !vgpu_pool_take(pool, SIM_BDF, "nvidia-64", &second) &&
+               !uuid_equal(&first.uuid, &second.uuid) && first.minor != -1 &&
+               strcmp(first.bdf, SIM_BDF) == 0 && strcmp(first.type, "nvidia-63") == 0;
+
+    vgpu_pool_stats(pool, &stats);
+    ret = ret && stats.ready == 2 && stats.taken == 2;
+
+    /* The VM started on a handed out instance gets its device like on any pooled one. */
+    int fd = ret ? vgpu_pool_claim(pool, &first.uuid, first.minor) : -1;
+
+    vgpu_pool_stats(pool, &stats);
+    ret = ret && fd != -1 && stats.taken == 1 && stats.warm_starts == 1;
+
+    vgpu_pool_free(pool);
+
+    if (fd != -1)
+        close(fd);
+
+    char taken[UUID_STR_LEN + 1];
+    uint32_t removed = 0;
+
+    uuid_format(&second.uuid, taken);
+
+    for (const std::string& created : fixture.created("nvidia-63"))
+        removed += fixture.removed(created) == "1";
+
+    return ret && removed == 2 && fixture.removed(taken).empty();
+}
+
+bool pool_refill()
+{
+    PoolFixture fixture;
+    struct VgpuPool* pool = create_pool();
+    struct VgpuPoolStats stats = {};
+    struct UUID uuid;
+
+    if (!fixture.valid() || pool == NULL) {
+        vgpu_pool_free(pool);
+        return false;
+    }
+
+    vgpu_pool_fill(pool);
+
+    std::vector<std::string> uuids = fixture.created("nvidia-63");
+    bool ret = uuids.size() == 4 && vgpu_pool_start(pool);
+
+    /* Without a minor the devices are not open, the claims get none but still refill. */
+    for (uint32_t i = 0; ret && i < 2; ++i)
+        ret = uuid_parse(uuids[i].c_str(), &uuid) && vgpu_pool_claim(pool, &uuid, 0) == -1;
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+
+    while (ret && std::chrono::steady_clock::now() < deadline) {
+        vgpu_pool_stats(pool, &stats);
+        if (stats.ready == 4)
+            break;
+        usleep(1000);
+    }
+
+    vgpu_pool_free(pool);
+
+    return ret && stats.ready == 4 && stats.claimed == 2 && stats.created == 6 &&
+           fixture.created("nvidia-63").size() == 6;
+}
+
+bool pool_free()
+{
+    size_t before = open_fds();
+    bool ret;
+
+    {
+        PoolFixture fixture;
+        struct VgpuPool* pool = create_pool();
+        struct UUID uuid;
+        int fd = -1;
+
+        if (!fixture.valid() || pool == NULL) {
+            vgpu_pool_free(pool);
+            return false;
+        }
+
+        vgpu_pool_fill(pool);
+        fixture.expose("nvidia-63");
+        fixture.removable("nvidia-63");
+        vgpu_pool_fill(pool);
+
+        std::vector<std::string> uuids = fixture.created("nvidia-63");
+        std::string claimed = uuids.empty() ? "" : uuids.front();
+
+        ret = uuid_parse(claimed.c_str(), &uuid) && (fd = vgpu_pool_claim(pool, &uuid, fixture.minor(claimed))) != -1;
+
+        vgpu_pool_free(pool);
+
+        if (fd != -1)
+            close(fd);
+
+        uint32_t removed = 0;
+
+        for (const std::string& created : fixture.created("nvidia-63"))
+            removed += fixture.removed(created) == "1";
+
+        ret = ret && removed == 3 && fixture.removed(claimed).empty();
+    }
+
+    return ret && open_fds() == before;
+}
+
+int main()
+{
+    const uint32_t NUM_TESTS = 7;
+
+    const std::string test_names[] = {
+        "Target Parsing",
+        "Filling",
+        "Late Devices",
+        "Claims",
+        "Take",
+        "Background Refill",
+        "Teardown"
+    };
+    const std::string test_details[] = {
+        "A target was parsed wrong or a malformed one was accepted.",
+        "The instances were not created through sysfs, or unavailable types were created.",
+        "The device of an instance was not opened once its minor was known.",
+        "An open device was handed out twice, to the wrong VM or for the wrong minor.",
+        "An instance was handed out twice, not claimed by its VM or removed while handed out.",
+        "The refill thread did not replace the instances claimed.",
+        "An instance was not removed, a claimed one was, or a device was left open."
+    };
+
+    bool (*tests[])(void) = {
+        pool_parse, pool_fill, pool_open, pool_claim, pool_take, pool_refill, pool_free
+    };
+
+    uint32_t failures = 0;
+
+    for (uint32_t i = 0; i < NUM_TESTS; ++i) {
+        bool test_result = tests[i]() == 1;
+
+        if (test_result)
+            cout << GREEN_COLOR << test_names[i]
+                 << " succeeded" RESET_COLOR "\n";
+        else {
+            ++failures;
+            cout << RED_COLOR << test_names[i]
+                 << ": " << test_details[i]
+                 << RESET_COLOR "\n";
+        }
+    }
+
+    if (failures == 0)
+        cout << GREEN_COLOR << "All tests succeeded" RESET_COLOR "\n";
+    else
+        cout << RED_COLOR << failures << "/"
+             << NUM_TESTS << " tests failed" RESET_COLOR "\n";
+}